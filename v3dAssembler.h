@@ -87,6 +87,10 @@ typedef unsigned int v3d_uint32;
 typedef unsigned long v3d_uint64;
 typedef int v3d_int32;
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 //
 // Interface
 //
@@ -626,16 +630,62 @@ v3d_qpu_decode(const struct v3d_device_info *devinfo,
 size_t
 v3d_qpu_disasm(const struct v3d_device_info *devinfo, v3d_uint64 inst, char* outBuffer, size_t outBufferSize);
 
+// Raddr conflicts
+//
+// A V3D 4.x instruction has two raddrs shared by all four ALU inputs, and only raddr_b can hold a
+// small immediate. Normally an instruction which reads more than that is an error. Conflict
+// resolution instead rewrites it into two instructions which compute the same thing. Swapping or
+// reordering operands never helps: only the number of distinct register files and immediates
+// matters, not which input reads them.
+
+enum v3d_qpu_raddr_fix
+{
+	// The instruction fit as written
+	V3D_QPU_RADDR_FIX_NONE,
+	// The add and mul ops went into separate instructions
+	V3D_QPU_RADDR_FIX_SPLIT,
+	// One register file or small immediate is first copied into the scratch accumulator with
+	// "nop ; mov", and the instruction reads it from there
+	V3D_QPU_RADDR_FIX_MOVE,
+};
+
+// Zero initialize to allow no fixes. Every fix adds an instruction, which moves everything after
+// it, so don't use them inside branch or thrsw delay slots.
+struct v3d_qpu_raddr_fix_options
+{
+	// Only when neither op reads what the other writes (including flags), there are no signals, and
+	// at most one of them writes a magic waddr with side effects. Preferred over moves since it
+	// doesn't clobber anything.
+	v3d_bool allowSplit;
+	// Only when the device has accumulators. scratchAccumulator (0-5) is overwritten, so it must not
+	// hold anything live, and the instruction may not read it.
+	v3d_bool allowMove;
+	int scratchAccumulator;
+};
+
+// A short description of the fix, e.g. for reporting it to the user
+const char* v3d_qpu_raddr_fix_description(enum v3d_qpu_raddr_fix fix);
+
 // The assembler is written by Macoy Madson (not from Mesa)
 struct v3d_qpu_assemble_arguments
 {
 	// Inputs
 	struct v3d_device_info devinfo;
 	const char* assembly;
+	// Optional. One past the last character of assembly which may be read. When set, assembly
+	// does not need to be null terminated, e.g. it can point straight into a memory-mapped file.
+	// When NULL, assembly must be null terminated.
+	const char* assemblyEnd;
+	// Optional. When set, an instruction which needs too many raddrs is rewritten into two
+	// instructions (see enum v3d_qpu_raddr_fix) rather than being an error.
+	const struct v3d_qpu_raddr_fix_options* raddrFixOptions;
 
 	// Outputs
 	struct v3d_qpu_instr instruction;
 	v3d_bool isEmptyLine;
+	// When not V3D_QPU_RADDR_FIX_NONE, instruction must be followed by secondInstruction
+	enum v3d_qpu_raddr_fix raddrFix;
+	struct v3d_qpu_instr secondInstruction;
 
 	// So later errors can be routed directly to this instruction in the text. This is a byte
 	// offset, NOT a line or column number.
@@ -648,7 +698,8 @@ struct v3d_qpu_assemble_arguments
 };
 
 // Assembly is expected to point to the start of a line of assembly code. This function parses
-// until the end of the line or null terminator, whichever comes first. If a /**/ comment is
+// until the end of the line or the end of the input (assemblyEnd or the null terminator),
+// whichever comes first. Nothing past the end of the input is ever read. If a /**/ comment is
 // detected, this function will skip over the entire comment, which could include multiple newlines.
 // Therefore, do not expect this to only parse a single line and use that as a line count.
 // This function parses a single 64 bit instruction expected to be in the same format as the
@@ -663,6 +714,211 @@ struct v3d_qpu_assemble_arguments
 // Otherwise, returns the number of characters absorbed by this instruction.
 v3d_uint32 v3d_qpu_assemble(struct v3d_qpu_assemble_arguments* args);
 
+// Arena allocation
+//
+// Whole-program features need scratch memory, e.g. for line tables or error lists. They take a
+// v3d_arena, which hands out memory by bumping a pointer and frees everything at once. Reset the
+// arena between programs and the same memory is reused, so assembling many programs in a loop
+// never goes back to the system allocator.
+//
+// A fixed arena only ever uses the buffer it was given, e.g. for embedded targets. A block arena
+// asks callbacks for more blocks when it runs out, and keeps them across resets.
+
+// Returns at least size bytes, aligned to 16 bytes, or NULL on failure.
+typedef void* (*v3d_arena_alloc_func)(void* userData, size_t size);
+typedef void (*v3d_arena_free_func)(void* userData, void* memory);
+
+// Header at the start of each block in a block arena
+struct v3d_arena_block
+{
+	struct v3d_arena_block* next;
+	size_t size;
+};
+
+struct v3d_arena
+{
+	// The region allocations currently come from: the whole buffer of a fixed arena, or the
+	// current block of a block arena.
+	char* memory;
+	size_t capacity;
+	size_t used;
+
+	// Only used by block arenas
+	struct v3d_arena_block* firstBlock;
+	struct v3d_arena_block* currentBlock;
+	size_t blockSize;
+	v3d_arena_alloc_func allocBlock;
+	v3d_arena_free_func freeBlock;
+	void* userData;
+
+	// Statistics, e.g. for sizing a fixed arena. Counts every byte handed out since the last
+	// reset, including alignment padding.
+	size_t bytesUsed;
+	size_t peakBytesUsed;
+	int numBlocks;
+};
+
+// Remembers a position to go back to with v3d_arena_restore(), freeing only what was allocated
+// since, e.g. temporary memory for one pass.
+struct v3d_arena_marker
+{
+	struct v3d_arena_block* block;
+	size_t used;
+	size_t bytesUsed;
+};
+
+void v3d_arena_init_fixed(struct v3d_arena* arena, void* buffer, size_t size);
+// Blocks are blockSize bytes, or larger if a single allocation needs it.
+void v3d_arena_init_blocks(struct v3d_arena* arena, size_t blockSize,
+                           v3d_arena_alloc_func allocBlock, v3d_arena_free_func freeBlock,
+                           void* userData);
+// Returns NULL if the arena is out of memory. The memory is not cleared.
+void* v3d_arena_alloc(struct v3d_arena* arena, size_t size);
+void* v3d_arena_alloc_zeroed(struct v3d_arena* arena, size_t size);
+#define V3D_ARENA_ALLOC_ARRAY(arena, type, count) \
+	((type*)v3d_arena_alloc((arena), sizeof(type) * (size_t)(count)))
+struct v3d_arena_marker v3d_arena_mark(struct v3d_arena* arena);
+void v3d_arena_restore(struct v3d_arena* arena, struct v3d_arena_marker marker);
+// Frees every allocation, keeping all blocks for reuse.
+void v3d_arena_reset(struct v3d_arena* arena);
+// Gives every block back to freeBlock. The arena can still be used afterwards.
+void v3d_arena_release(struct v3d_arena* arena);
+
+// Incremental assembly
+//
+// Editors which re-assemble after every keystroke can keep a line cache alive between edits. Each
+// line's result is stored under a hash of the line's text and the device version, so only lines
+// which actually changed get parsed again. Lines which only moved (e.g. because a line was
+// inserted above them) are still cache hits. Passing just the dirty lines to
+// v3d_qpu_assemble_line_cached() makes the cost of an edit independent of the file size.
+// Lines longer than V3D_QPU_LINE_CACHE_MAX_LINE_LENGTH are assembled every time.
+
+#define V3D_QPU_LINE_CACHE_MAX_LINE_LENGTH 128
+
+// The result of assembling one line. Offsets are relative to the start of the line.
+struct v3d_qpu_assemble_line_result
+{
+	v3d_bool isEmptyLine;
+	v3d_uint64 packedInstruction;
+	int instructionStartsAtOffset;
+
+	// NULL if the line assembled (and packed) successfully.
+	const char* errorMessage;
+	int errorAtOffset;
+	const char** hintAvailable;
+	int numHints;
+};
+
+struct v3d_qpu_assemble_line_cache_entry
+{
+	// 0 marks an empty slot.
+	v3d_uint64 key;
+	int lineLength;
+	// Compared on every hit, so lines whose hashes collide don't share a result
+	char line[V3D_QPU_LINE_CACHE_MAX_LINE_LENGTH];
+	struct v3d_qpu_assemble_line_result result;
+};
+
+struct v3d_qpu_assemble_line_cache
+{
+	struct v3d_device_info devinfo;
+
+	// Storage is owned by the caller. numEntries must be a power of two. When the cache is full,
+	// old entries are evicted; the cache never allocates.
+	struct v3d_qpu_assemble_line_cache_entry* entries;
+	int numEntries;
+
+	// Statistics, e.g. for checking the cache is sized appropriately.
+	int numHits;
+	int numMisses;
+
+	// Holds the result for lines too long to cache
+	struct v3d_qpu_assemble_line_result uncachedResult;
+};
+
+void v3d_qpu_assemble_line_cache_init(struct v3d_qpu_assemble_line_cache* cache,
+                                      const struct v3d_device_info* devinfo,
+                                      struct v3d_qpu_assemble_line_cache_entry* entries,
+                                      int numEntries);
+// Same as v3d_qpu_assemble_line_cache_init(), with the entries allocated from arena. Returns FALSE
+// if the arena is out of memory.
+v3d_bool v3d_qpu_assemble_line_cache_init_arena(struct v3d_qpu_assemble_line_cache* cache,
+                                                const struct v3d_device_info* devinfo,
+                                                struct v3d_arena* arena, int numEntries);
+// Forget every cached line, e.g. after changing the device info.
+void v3d_qpu_assemble_line_cache_clear(struct v3d_qpu_assemble_line_cache* cache);
+
+// Returns the number of characters in the line starting at assembly, not including the
+// terminating newline. A /* */ comment which is still open at the end of a line extends the line
+// to wherever the comment closes, matching what v3d_qpu_assemble() will absorb. Reads at most
+// assemblyLength characters.
+int v3d_qpu_assemble_line_length(const char* assembly, int assemblyLength);
+
+// Assembles the line which starts at line and is lineLength characters long (use
+// v3d_qpu_assemble_line_length() to find it), or returns the cached result if the same text was
+// assembled before. Nothing past the end of the line is read.
+// The returned pointer is only valid until the next call which modifies the cache.
+const struct v3d_qpu_assemble_line_result*
+v3d_qpu_assemble_line_cached(struct v3d_qpu_assemble_line_cache* cache, const char* line,
+                             int lineLength);
+
+// Convenience for assembling a whole file through the cache. Writes one result per line
+// (including empty lines) and, if lineStartOffsetsOut is not NULL, the byte offset each line
+// starts at. Returns the number of lines in the file, which may be larger than maxLines; only the
+// first maxLines results are written.
+int v3d_qpu_assemble_text_cached(struct v3d_qpu_assemble_line_cache* cache, const char* assembly,
+                                 int assemblyLength,
+                                 struct v3d_qpu_assemble_line_result* resultsOut,
+                                 int* lineStartOffsetsOut, int maxLines);
+
+// Streaming assembly
+//
+// Assembles source which arrives in chunks, e.g. piped from a code generator, without ever holding
+// the whole file. Memory use is bounded by the caller-provided buffer, which only needs to fit the
+// longest line (a /* */ comment spanning several lines counts as part of the line it starts on).
+// This header does not depend on any I/O library, so input comes through a read callback. For a
+// file descriptor, the callback can be as simple as:
+//
+// static int read_fd(void* userData, char* buffer, int bufferSize)
+// {
+// 	return read(*(int*)userData, buffer, bufferSize);
+// }
+
+// Writes up to bufferSize bytes of source to buffer. Returns the number of bytes written, 0 at the
+// end of the input, or a negative value if reading failed.
+typedef int (*v3d_qpu_stream_read_func)(void* userData, char* buffer, int bufferSize);
+// Called with each instruction as soon as it is assembled. lineNumber starts at 1. Return FALSE to
+// stop assembling.
+typedef v3d_bool (*v3d_qpu_stream_emit_func)(void* userData, v3d_uint64 packedInstruction,
+                                             int lineNumber);
+
+struct v3d_qpu_assemble_stream_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	v3d_qpu_stream_read_func read;
+	v3d_qpu_stream_emit_func emit;
+	void* userData;
+	// Working memory owned by the caller.
+	char* buffer;
+	int bufferSize;
+
+	// Outputs
+	int numInstructions;
+	int numLines;
+
+	// Set if FALSE is returned. The offset is in bytes from the start of the stream.
+	const char* errorMessage;
+	int errorAtOffset;
+	int errorLine;
+	const char** hintAvailable;
+	int numHints;
+};
+
+// Reads and assembles until the end of the input. Returns FALSE on the first assembly, read, or
+// emit failure.
+v3d_bool v3d_qpu_assemble_stream(struct v3d_qpu_assemble_stream_arguments* args);
+
 // (todo documentation) It would be good to write explanations for all of these.
 enum v3d_qpu_validate_error
 {
@@ -711,5547 +967,13011 @@ struct v3d_qpu_validate_result
 v3d_bool v3d_qpu_validate(const struct v3d_device_info* devinfo, struct v3d_qpu_instr* instructions,
                           int numInstructions, struct v3d_qpu_validate_result* results);
 
+// Hazard fixing
 //
-// Implementation
+// Instead of only rejecting code, pads it so v3d_qpu_validate() accepts it, e.g. for hand-written
+// kernels. Hazards which resolve with time (R4 read too soon after SFU, LDUNIF after LDVARY, SFU
+// or LDVARY in THRSW delay slots, THRSW too close to another THRSW, and missing program-end THRSW
+// delay slots) get the fewest NOPs which satisfy the validator. Anything else is an error, as is
+// any fix which would change what runs in branch delay slots, or push an instruction which reads
+// accumulators out of THRSW delay slots, since accumulators don't survive the thread switch.
 //
+// This assumes code never relies on reading a register's old value while a write to it is still
+// in flight (e.g. r5 right after ldvary), since waiting longer makes the new value visible.
 
-#ifdef V3D_ASSEMBLER_IMPLEMENTATION
-
-#ifndef v3d_memcmp
-#error "Need to #define v3d_memcmp to e.g.: #define v3d_memcmp memcmp"
-#endif
+// One instruction which needed padding
+struct v3d_qpu_hazard_fix
+{
+	// Index in the input. numInstructions for the program-end THRSW delay slots.
+	int instructionIndex;
+	enum v3d_qpu_validate_error error;
+	int numNopsInserted;
+	// Independent later instructions moved in front of it instead of NOPs
+	int numInstructionsMoved;
+};
 
-#ifndef v3d_vsnprintf
-#error "Need to #define v3d_vsnprintf to e.g.: #define v3d_vsnprintf vsnprintf"
-#endif
+struct v3d_qpu_fix_hazards_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the fixed program. It can grow by up to three instructions per input instruction.
+	struct v3d_qpu_instr* instructionsOut;
+	int maxInstructions;
+	// Temporary memory for about 6 bytes per input instruction plus 4 per maxInstructions. Freed
+	// again before returning.
+	struct v3d_arena* arena;
+	// Fill gaps with later instructions which are independent of the ones they move past, rather
+	// than NOPs. Only ALU instructions without signals or side effects (e.g. TMU or SFU writes)
+	// move, never past branches, THRSW or branch targets. V3D 4.x only.
+	v3d_bool allowMoves;
+	// Optional. Receives where each fix was made, in program order.
+	struct v3d_qpu_hazard_fix* fixesOut;
+	int maxFixes;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length, e.g. to update line tables or labels. Padding inserted in front
+	// of an instruction counts as part of it, so jumps to it still cover the hazard.
+	int* newIndicesOut;
 
-#ifndef V3D_ARRAY_SIZE
-#define V3D_ARRAY_SIZE(array) (sizeof((array)) / sizeof((array)[0]))
-#endif
+	// Outputs
+	int numInstructionsOut;
+	// Each NOP is one cycle; moved instructions cost nothing
+	int cyclesAdded;
+	int numInstructionsMoved;
+	// Every fix, even those which didn't fit in fixesOut
+	int numFixes;
+
+	// Set if FALSE is returned
+	const char* errorMessage;
+	enum v3d_qpu_validate_error error;
+	// Index in the input
+	int errorInstructionIndex;
+};
 
-#ifndef V3D_STATIC_ASSERT
-#define V3D_STATIC_ASSERT(condition)
-#endif
+// Relative branches within the program are re-targeted to match. Returns FALSE if a hazard can't be
+// fixed or an output runs out of space.
+v3d_bool v3d_qpu_fix_hazards(struct v3d_qpu_fix_hazards_arguments* args);
 
-#ifndef v3d_assert
-#define v3d_assert(condition)
-#endif
+// Re-targets relative branches after instructions were inserted, removed or moved.
+// oldIndices gives the original index of each of the numInstructions instructions, or -1 for new
+// ones. newIndices gives the new index of each original instruction (numOldInstructions + 1
+// entries, the last being the new program length); removed instructions should map to whatever
+// now runs in their place. Targets outside the program keep their distance from its start or end.
+void v3d_qpu_remap_branches(struct v3d_qpu_instr* instructions, int numInstructions,
+                            const int* oldIndices, const int* newIndices, int numOldInstructions);
 
-#ifndef v3d_unreachable
-#define v3d_unreachable(message) v3d_assert(0)
-#endif
+// Dual-issue pairing
+//
+// Merges instructions which only use the add ALU with ones which only use the mul ALU, e.g. in
+// hand-written code which leaves one side as nop. A later instruction moves up into an earlier one
+// when it is independent of everything it moves past (registers, accumulators, flags, and writes
+// still in flight), the two together fit the raddr limits and encode, and the program still
+// validates around it. The moving instruction may not have signals or side effects, and nothing
+// moves past branches, THRSW or branch targets, or into delay slots. V3D 4.x only.
+
+struct v3d_qpu_pair_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the paired program, which is never longer than the input
+	struct v3d_qpu_instr* instructionsOut;
+	// Temporary memory for about 10 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. Both halves of a pair get the same index.
+	int* newIndicesOut;
 
-#ifndef TRUE
-#define TRUE 1
-#endif
+	// Outputs
+	int numInstructionsOut;
+	int numPairs;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
+};
 
-#ifndef FALSE
-#define FALSE 0
-#endif
+// The input must pass v3d_qpu_validate() (see v3d_qpu_fix_hazards()), and the output is checked
+// with it again. Relative branches within the program are re-targeted to match. A program which
+// pairing would leave under three instructions, too short to validate, is copied out unpaired.
+// Returns FALSE if either check fails or the arena is out of memory.
+v3d_bool v3d_qpu_pair_instructions(struct v3d_qpu_pair_arguments* args);
 
-#ifndef NULL
-#define NULL 0
-#endif
+// List scheduling
+//
+// Reorders instructions to hide latency: SFU results are read once their two cycle latency has
+// passed, TMU and other work is started early, and ldtmu is left as late as possible. Each run
+// of instructions between branch targets, branches and THRSW (which stay in place along with
+// their delay slots) becomes a dependency DAG, with edges for registers (rf and accumulators,
+// including r4 from SFU and ldtmu, r5 from ldunif and ldvary, and registers written by signals)
+// and flags. Instructions with signals or side effects, such as TMU, VPM, TLB and SFU accesses,
+// keep their order among themselves. The DAG is then scheduled by critical path.
+//
+// NOPs without signals are dropped, and NOPs are only inserted where a hazard leaves nothing else
+// to issue, so the program usually gets shorter. V3D 4.x only.
 
-// endOfCompareOut is set only when the symbol matches, and is the character right after the match
-// completes.
-static v3d_bool v3d_symbol_equals(const char* symbol, const char* compare,
-                                  const char** endOfCompareOut)
+struct v3d_qpu_schedule_arguments
 {
-	const char* candidateChar = compare;
-	for (const char* a = symbol; *a && *candidateChar && *a == *candidateChar; ++a)
-	{
-		++candidateChar;
-		// All possible delimiters for symbols
-		if (a[1] == 0 && (*candidateChar == 0 || *candidateChar == '\n' || *candidateChar == '\r' ||
-		                  *candidateChar == '\t' || *candidateChar == '.' ||
-		                  *candidateChar == ' ' || *candidateChar == ',' || *candidateChar == ';'))
-		{
-			if (endOfCompareOut)
-				*endOfCompareOut = candidateChar;
-			return TRUE;
-		}
-	}
-	return FALSE;
-}
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the scheduled program. numInstructions entries are enough unless reordering one run
+	// leaves a hazard in front of the next, which then needs padding.
+	struct v3d_qpu_instr* instructionsOut;
+	int maxInstructions;
+	// Temporary memory for about 12 bytes per instruction plus 4 KB. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. Dropped NOPs map to the start of their run.
+	int* newIndicesOut;
 
-// >>> qpu_instr.c
-const char *
-v3d_qpu_magic_waddr_name(const struct v3d_device_info *devinfo,
-                         enum v3d_qpu_waddr waddr)
-{
-	/* V3D 4.x UNIFA aliases TMU in V3D 3.x in the table below */
-	if (devinfo->ver < 40 && waddr == V3D_QPU_WADDR_TMU)
-		return "tmu";
+	// Outputs
+	int numInstructionsOut;
+	// Cycles spent waiting for results according to the latency model, before and after
+	int estimatedStallsBefore;
+	int estimatedStallsAfter;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
+};
 
-	/* V3D 7.x QUAD and REP aliases R5 and R5REPT in the table below
-	 */
-	if (devinfo->ver >= 71 && waddr == V3D_QPU_WADDR_QUAD)
-		return "quad";
+// The input must pass v3d_qpu_validate() (see v3d_qpu_fix_hazards()), and the output is checked
+// with it again. Relative branches within the program are re-targeted to match. Returns FALSE if
+// either check fails or an output or the arena runs out of space.
+v3d_bool v3d_qpu_schedule(struct v3d_qpu_schedule_arguments* args);
 
-	if (devinfo->ver >= 71 && waddr == V3D_QPU_WADDR_REP)
-		return "rep";
+// Delay slot filling
+//
+// Branches have three delay slots and THRSW two, which always run, and often hold nothing but
+// NOPs. This moves independent instructions from in front of the branch or THRSW into those NOPs,
+// saving a cycle each, e.g. up to 3 per iteration of a tight loop. Moved instructions may not have
+// signals or side effects, so no SFU writes or ldvary end up in THRSW delay slots, nor branches or
+// THRSW in branch delay slots. Nothing moves past a branch target, out of other delay slots, or
+// into the delay slots of the final THRSW. V3D 4.x only.
+
+struct v3d_qpu_fill_delay_slots_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the filled program, which is never longer than the input
+	struct v3d_qpu_instr* instructionsOut;
+	// Temporary memory for about 24 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. A filled NOP maps to the instruction which replaced it.
+	int* newIndicesOut;
 
-	static const char *waddr_magic[] = {
-		[V3D_QPU_WADDR_R0] = "r0",
-		[V3D_QPU_WADDR_R1] = "r1",
-		[V3D_QPU_WADDR_R2] = "r2",
-		[V3D_QPU_WADDR_R3] = "r3",
-		[V3D_QPU_WADDR_R4] = "r4",
-		[V3D_QPU_WADDR_R5] = "r5",
-		[V3D_QPU_WADDR_NOP] = "-",
-		[V3D_QPU_WADDR_TLB] = "tlb",
-		[V3D_QPU_WADDR_TLBU] = "tlbu",
-		[V3D_QPU_WADDR_UNIFA] = "unifa",
-		[V3D_QPU_WADDR_TMUL] = "tmul",
-		[V3D_QPU_WADDR_TMUD] = "tmud",
-		[V3D_QPU_WADDR_TMUA] = "tmua",
-		[V3D_QPU_WADDR_TMUAU] = "tmuau",
-		[V3D_QPU_WADDR_VPM] = "vpm",
-		[V3D_QPU_WADDR_VPMU] = "vpmu",
-		[V3D_QPU_WADDR_SYNC] = "sync",
-		[V3D_QPU_WADDR_SYNCU] = "syncu",
-		[V3D_QPU_WADDR_SYNCB] = "syncb",
-		[V3D_QPU_WADDR_RECIP] = "recip",
-		[V3D_QPU_WADDR_RSQRT] = "rsqrt",
-		[V3D_QPU_WADDR_EXP] = "exp",
-		[V3D_QPU_WADDR_LOG] = "log",
-		[V3D_QPU_WADDR_SIN] = "sin",
-		[V3D_QPU_WADDR_RSQRT2] = "rsqrt2",
-		[V3D_QPU_WADDR_TMUC] = "tmuc",
-		[V3D_QPU_WADDR_TMUS] = "tmus",
-		[V3D_QPU_WADDR_TMUT] = "tmut",
-		[V3D_QPU_WADDR_TMUR] = "tmur",
-		[V3D_QPU_WADDR_TMUI] = "tmui",
-		[V3D_QPU_WADDR_TMUB] = "tmub",
-		[V3D_QPU_WADDR_TMUDREF] = "tmudref",
-		[V3D_QPU_WADDR_TMUOFF] = "tmuoff",
-		[V3D_QPU_WADDR_TMUSCM] = "tmuscm",
-		[V3D_QPU_WADDR_TMUSF] = "tmusf",
-		[V3D_QPU_WADDR_TMUSLOD] = "tmuslod",
-		[V3D_QPU_WADDR_TMUHS] = "tmuhs",
-		[V3D_QPU_WADDR_TMUHSCM] = "tmuscm",
-		[V3D_QPU_WADDR_TMUHSF] = "tmuhsf",
-		[V3D_QPU_WADDR_TMUHSLOD] = "tmuhslod",
-		[V3D_QPU_WADDR_R5REP] = "r5rep",
-	};
+	// Outputs
+	int numInstructionsOut;
+	// Delay slot NOPs which were replaced, i.e. cycles saved each time the code runs once
+	int numSlotsFilled;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
+};
 
-	return waddr_magic[waddr];
-}
+// The input must pass v3d_qpu_validate() (see v3d_qpu_fix_hazards()), and every fill is checked
+// with it again. Relative branches within the program are re-targeted to match. Returns FALSE if
+// the input doesn't validate or the arena is out of memory.
+v3d_bool v3d_qpu_fill_delay_slots(struct v3d_qpu_fill_delay_slots_arguments* args);
 
-// MUST align exactly with waddr_values
-// (kept separate to make names easy to prompt in assembler errors)
-static const char* waddr_names[] = {
-	"r0",
-	"r1",
-	"r2",
-	"r3",
-	"r4",
-	"r5",
-	"-",
-	"tlb",
-	"tlbu",
-	"unifa",
-	"tmul",
-	"tmud",
-	"tmua",
-	"tmuau",
-	"vpm",
-	"vpmu",
-	"sync",
-	"syncu",
-	"syncb",
-	"recip",
-	"rsqrt",
-	"exp",
-	"log",
-	"sin",
-	"rsqrt2",
-	"tmuc",
-	"tmus",
-	"tmut",
-	"tmur",
-	"tmui",
-	"tmub",
-	"tmudref",
-	"tmuoff",
-	"tmuscm",
-	"tmusf",
-	"tmuslod",
-	"tmuhs",
-	"tmuscm",
-	"tmuhsf",
-	"tmuhslod",
-	"r5rep",
-	/* V3D 4.x UNIFA aliases TMU in V3D 3.x */
-	// devinfo->ver < 40
-	"tmu",
-	/* V3D 7.x QUAD and REP aliases R5 and R5REPT */
-	// devinfo->ver >= 71
-	"quad",
-	// devinfo->ver >= 71
-	"rep",
+// Cycle estimation
+//
+// Estimates how many cycles a program takes to run through once in order, e.g. to compare two
+// variants of a shader without hardware. Each instruction takes a cycle plus any time it waits:
+// reading r4 before an SFU result is there or a register before ldvary has written it, ldtmu and
+// tmuwt waiting for TMU lookups, vpmwt waiting for VPM writes, and time away from the QPU after a
+// thread switch (once its delay slots have run). Branch delay slots are ordinary instructions here
+// and loops count as one iteration. V3D 4.x only.
+
+enum v3d_qpu_stall_reason
+{
+	V3D_QPU_STALL_NONE,
+	V3D_QPU_STALL_SFU,
+	V3D_QPU_STALL_LDVARY,
+	V3D_QPU_STALL_TMU,
+	V3D_QPU_STALL_VPM,
+	V3D_QPU_STALL_THRSW,
+	V3D_QPU_STALL_REASON_COUNT
 };
 
-// MUST align exactly with waddr_names
-static const enum v3d_qpu_waddr waddr_values[] = {
-	V3D_QPU_WADDR_R0,
-	V3D_QPU_WADDR_R1,
-	V3D_QPU_WADDR_R2,
-	V3D_QPU_WADDR_R3,
-	V3D_QPU_WADDR_R4,
-	V3D_QPU_WADDR_R5,
-	V3D_QPU_WADDR_NOP,
-	V3D_QPU_WADDR_TLB,
-	V3D_QPU_WADDR_TLBU,
-	V3D_QPU_WADDR_UNIFA,
-	V3D_QPU_WADDR_TMUL,
-	V3D_QPU_WADDR_TMUD,
-	V3D_QPU_WADDR_TMUA,
-	V3D_QPU_WADDR_TMUAU,
-	V3D_QPU_WADDR_VPM,
-	V3D_QPU_WADDR_VPMU,
-	V3D_QPU_WADDR_SYNC,
-	V3D_QPU_WADDR_SYNCU,
-	V3D_QPU_WADDR_SYNCB,
-	V3D_QPU_WADDR_RECIP,
-	V3D_QPU_WADDR_RSQRT,
-	V3D_QPU_WADDR_EXP,
-	V3D_QPU_WADDR_LOG,
-	V3D_QPU_WADDR_SIN,
-	V3D_QPU_WADDR_RSQRT2,
-	V3D_QPU_WADDR_TMUC,
-	V3D_QPU_WADDR_TMUS,
-	V3D_QPU_WADDR_TMUT,
-	V3D_QPU_WADDR_TMUR,
-	V3D_QPU_WADDR_TMUI,
-	V3D_QPU_WADDR_TMUB,
-	V3D_QPU_WADDR_TMUDREF,
-	V3D_QPU_WADDR_TMUOFF,
-	V3D_QPU_WADDR_TMUSCM,
-	V3D_QPU_WADDR_TMUSF,
-	V3D_QPU_WADDR_TMUSLOD,
-	V3D_QPU_WADDR_TMUHS,
-	V3D_QPU_WADDR_TMUHSCM,
-	V3D_QPU_WADDR_TMUHSF,
-	V3D_QPU_WADDR_TMUHSLOD,
-	V3D_QPU_WADDR_R5REP,
-	V3D_QPU_WADDR_TMU,
-	V3D_QPU_WADDR_QUAD,
-	V3D_QPU_WADDR_REP,
+const char* v3d_qpu_stall_reason_name(enum v3d_qpu_stall_reason reason);
+
+struct v3d_qpu_instruction_timing
+{
+	// Cycle the instruction issues in, counting from 0
+	int cycle;
+	int stallCycles;
+	// What the instruction waited on longest
+	enum v3d_qpu_stall_reason stallReason;
 };
 
-v3d_bool v32_qpu_magic_waddr_from_name(const char* name,
-									   enum v3d_qpu_waddr* waddrOut,
-									   const char** endOfNameOut)
+struct v3d_qpu_estimate_cycles_arguments
 {
-	for (int index = 0; index < V3D_ARRAY_SIZE(waddr_names); ++index)
-	{
-		if (v3d_symbol_equals(waddr_names[index], name, endOfNameOut))
-		{
-			*waddrOut = waddr_values[index];
-			return TRUE;
-		}
-	}
-	return FALSE;
-}
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Latencies which depend on more than the shader. 0 picks the default.
+	// Cycles from starting a TMU lookup until its result can be read. Defaults to 20, about a
+	// cache hit.
+	int tmuLatency;
+	// Cycles from a VPM write until vpmwt can return. Defaults to 4.
+	int vpmLatency;
+	// Cycles other threads run for after a thread switch, while TMU and VPM work carries on.
+	// Defaults to 8.
+	int thrswCycles;
+	// Optional. numInstructions entries receiving when each instruction issues and why it waited.
+	struct v3d_qpu_instruction_timing* timingsOut;
 
-static const char *add_op_names[] = {
-	[V3D_QPU_A_FADD] = "fadd",
-	[V3D_QPU_A_FADDNF] = "faddnf",
-	[V3D_QPU_A_VFPACK] = "vfpack",
-	[V3D_QPU_A_ADD] = "add",
-	[V3D_QPU_A_SUB] = "sub",
-	[V3D_QPU_A_FSUB] = "fsub",
-	[V3D_QPU_A_MIN] = "min",
-	[V3D_QPU_A_MAX] = "max",
-	[V3D_QPU_A_UMIN] = "umin",
-	[V3D_QPU_A_UMAX] = "umax",
-	[V3D_QPU_A_SHL] = "shl",
-	[V3D_QPU_A_SHR] = "shr",
-	[V3D_QPU_A_ASR] = "asr",
-	[V3D_QPU_A_ROR] = "ror",
-	[V3D_QPU_A_FMIN] = "fmin",
-	[V3D_QPU_A_FMAX] = "fmax",
-	[V3D_QPU_A_VFMIN] = "vfmin",
-	[V3D_QPU_A_AND] = "and",
-	[V3D_QPU_A_OR] = "or",
-	[V3D_QPU_A_XOR] = "xor",
-	[V3D_QPU_A_VADD] = "vadd",
-	[V3D_QPU_A_VSUB] = "vsub",
-	[V3D_QPU_A_NOT] = "not",
-	[V3D_QPU_A_NEG] = "neg",
-	[V3D_QPU_A_FLAPUSH] = "flapush",
-	[V3D_QPU_A_FLBPUSH] = "flbpush",
-	[V3D_QPU_A_FLPOP] = "flpop",
-	[V3D_QPU_A_RECIP] = "recip",
-	[V3D_QPU_A_SETMSF] = "setmsf",
-	[V3D_QPU_A_SETREVF] = "setrevf",
-	[V3D_QPU_A_NOP] = "nop",
-	[V3D_QPU_A_TIDX] = "tidx",
-	[V3D_QPU_A_EIDX] = "eidx",
-	[V3D_QPU_A_LR] = "lr",
-	[V3D_QPU_A_VFLA] = "vfla",
-	[V3D_QPU_A_VFLNA] = "vflna",
-	[V3D_QPU_A_VFLB] = "vflb",
-	[V3D_QPU_A_VFLNB] = "vflnb",
-	[V3D_QPU_A_FXCD] = "fxcd",
-	[V3D_QPU_A_XCD] = "xcd",
-	[V3D_QPU_A_FYCD] = "fycd",
-	[V3D_QPU_A_YCD] = "ycd",
-	[V3D_QPU_A_MSF] = "msf",
-	[V3D_QPU_A_REVF] = "revf",
-	[V3D_QPU_A_VDWWT] = "vdwwt",
-	[V3D_QPU_A_IID] = "iid",
-	[V3D_QPU_A_SAMPID] = "sampid",
-	[V3D_QPU_A_BARRIERID] = "barrierid",
-	[V3D_QPU_A_TMUWT] = "tmuwt",
-	[V3D_QPU_A_VPMSETUP] = "vpmsetup",
-	[V3D_QPU_A_VPMWT] = "vpmwt",
-	[V3D_QPU_A_FLAFIRST] = "flafirst",
-	[V3D_QPU_A_FLNAFIRST] = "flnafirst",
-	[V3D_QPU_A_LDVPMV_IN] = "ldvpmv_in",
-	[V3D_QPU_A_LDVPMV_OUT] = "ldvpmv_out",
-	[V3D_QPU_A_LDVPMD_IN] = "ldvpmd_in",
-	[V3D_QPU_A_LDVPMD_OUT] = "ldvpmd_out",
-	[V3D_QPU_A_LDVPMP] = "ldvpmp",
-	[V3D_QPU_A_RSQRT] = "rsqrt",
-	[V3D_QPU_A_EXP] = "exp",
-	[V3D_QPU_A_LOG] = "log",
-	[V3D_QPU_A_SIN] = "sin",
-	[V3D_QPU_A_RSQRT2] = "rsqrt2",
-	[V3D_QPU_A_LDVPMG_IN] = "ldvpmg_in",
-	[V3D_QPU_A_LDVPMG_OUT] = "ldvpmg_out",
-	[V3D_QPU_A_FCMP] = "fcmp",
-	[V3D_QPU_A_VFMAX] = "vfmax",
-	[V3D_QPU_A_FROUND] = "fround",
-	[V3D_QPU_A_FTOIN] = "ftoin",
-	[V3D_QPU_A_FTRUNC] = "ftrunc",
-	[V3D_QPU_A_FTOIZ] = "ftoiz",
-	[V3D_QPU_A_FFLOOR] = "ffloor",
-	[V3D_QPU_A_FTOUZ] = "ftouz",
-	[V3D_QPU_A_FCEIL] = "fceil",
-	[V3D_QPU_A_FTOC] = "ftoc",
-	[V3D_QPU_A_FDX] = "fdx",
-	[V3D_QPU_A_FDY] = "fdy",
-	[V3D_QPU_A_STVPMV] = "stvpmv",
-	[V3D_QPU_A_STVPMD] = "stvpmd",
-	[V3D_QPU_A_STVPMP] = "stvpmp",
-	[V3D_QPU_A_ITOF] = "itof",
-	[V3D_QPU_A_CLZ] = "clz",
-	[V3D_QPU_A_UTOF] = "utof",
-	[V3D_QPU_A_MOV] = "mov",
-	[V3D_QPU_A_FMOV] = "fmov",
-	[V3D_QPU_A_VPACK] = "vpack",
-	[V3D_QPU_A_V8PACK] = "v8pack",
-	[V3D_QPU_A_V10PACK] = "v10pack",
-	[V3D_QPU_A_V11FPACK] = "v11fpack",
+	// Outputs
+	// Including stalls
+	int cycles;
+	int stallCycles;
+	int stallCyclesByReason[V3D_QPU_STALL_REASON_COUNT];
+	// Set if FALSE is returned
+	const char* errorMessage;
 };
 
-const char *
-v3d_qpu_add_op_name(enum v3d_qpu_add_op op)
-{
-	if (op >= V3D_ARRAY_SIZE(add_op_names))
-		return NULL;
+v3d_bool v3d_qpu_estimate_cycles(struct v3d_qpu_estimate_cycles_arguments* args);
 
-	return add_op_names[op];
-}
+// Instruction mix
+//
+// Counts how a program uses the QPU in a single pass, e.g. to track generated code per commit and
+// catch regressions. v3d_qpu_format_instruction_mix() writes the counts out as text or JSON.
 
-static const char* mul_op_names[] = {
-    [V3D_QPU_M_ADD] = "add",
-    [V3D_QPU_M_SUB] = "sub",
-    [V3D_QPU_M_UMUL24] = "umul24",
-    [V3D_QPU_M_VFMUL] = "vfmul",
-    [V3D_QPU_M_SMUL24] = "smul24",
-    [V3D_QPU_M_MULTOP] = "multop",
-    [V3D_QPU_M_FMOV] = "fmov",
-    [V3D_QPU_M_MOV] = "mov",
-    [V3D_QPU_M_NOP] = "nop",
-    [V3D_QPU_M_FMUL] = "fmul",
-    [V3D_QPU_M_FTOUNORM16] = "ftounorm16",
-    [V3D_QPU_M_FTOSNORM16] = "ftosnorm16",
-    [V3D_QPU_M_VFTOUNORM8] = "vftounorm8",
-    [V3D_QPU_M_VFTOSNORM8] = "vftosnorm8",
-    [V3D_QPU_M_VFTOUNORM10LO] = "vftounorm10lo",
-    [V3D_QPU_M_VFTOUNORM10HI] = "vftounorm10hi",
+struct v3d_qpu_instruction_mix
+{
+	int numInstructions;
+	int numAluInstructions;
+	int numBranches;
+	// Instructions whose add or mul op isn't a nop
+	int numAddOps;
+	int numMulOps;
+	// Instructions which only take a cycle: no ops and no signals
+	int numNops;
+	int numSfuOps;
+	int numTmuWrites;
+	int numLdtmu;
+	int numVpmOps;
+	int numTlbOps;
+	// Reads from the uniform stream: ldunif, ldunifrf, magic writes which load a uniform (e.g.
+	// tmuau) and branches with ub
+	int numUniformLoads;
+	// ldunifa and ldunifarf, which read from the unifa address rather than the stream
+	int numUnifaLoads;
+	int numLdvary;
+	int numThrsw;
+	// Instructions with a small immediate in place of an raddr
+	int numSmallImmediates;
 };
 
-const char* v3d_qpu_mul_op_name(enum v3d_qpu_mul_op op)
+void v3d_qpu_count_instruction_mix(const struct v3d_device_info* devinfo,
+                                   const struct v3d_qpu_instr* instructions, int numInstructions,
+                                   struct v3d_qpu_instruction_mix* mixOut);
+
+enum v3d_qpu_report_format
 {
-	if (op >= V3D_ARRAY_SIZE(mul_op_names))
-		return NULL;
+	V3D_QPU_REPORT_FORMAT_TEXT,
+	V3D_QPU_REPORT_FORMAT_JSON
+};
 
-	return mul_op_names[op];
-}
+// Add and mul slot utilization are included as the share of instructions using each ALU.
+// Returns the length of the whole report like snprintf(), even if outBuffer is too small.
+size_t v3d_qpu_format_instruction_mix(const struct v3d_qpu_instruction_mix* mix,
+                                      enum v3d_qpu_report_format format, char* outBuffer,
+                                      size_t outBufferSize);
 
-// Also update cond_pf_uf_names if changing
-static const char* cond_names[] = {
-	[V3D_QPU_COND_NONE] = "",
-	[V3D_QPU_COND_IFA] = ".ifa",
-	[V3D_QPU_COND_IFB] = ".ifb",
-	[V3D_QPU_COND_IFNA] = ".ifna",
-	[V3D_QPU_COND_IFNB] = ".ifnb",
+// Occupancy
+//
+// Each QPU runs 1, 2 or 4 threads, which split the 64-entry physical register file between them:
+// a thread can only address rf0-rf15 in 4-thread mode and rf0-rf31 in 2-thread mode. More threads
+// hide more TMU latency, since the others run while one waits after a thrsw, so a shader which
+// needs more registers than that costs occupancy. Finds the most threads a program fits, both as
+// its registers are numbered and if they were renumbered to pack live values together (e.g. by
+// v3d_qpu_allocate_registers()), and checks its thread switches the way the validator does.
+// V3D 4.x only.
+
+struct v3d_qpu_analyze_occupancy_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Temporary memory for 16 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+
+	// Outputs
+	// Most rf holding a value which is read later, at any one instruction. Registers read before
+	// anything writes them, e.g. the payload the hardware loads, are live from the start.
+	int maxLiveRegisterFile;
+	// The first instruction where maxLiveRegisterFile are live
+	int maxLiveInstructionIndex;
+	// One past the highest rf the program reads or writes
+	int numRegisterFile;
+	// The first instruction using the highest rf, or -1 if no rf is used
+	int highestRegisterFileInstructionIndex;
+	// Thread switches, not counting the second THRSW of the pair marking the last one
+	int numThreadSwitches;
+	// Whether the last thread switch is marked by two THRSW in a row. The hardware only runs a
+	// program with more than one thread if it is.
+	v3d_bool lastThreadSwitchFound;
+	// 1, 2 or 4 for numRegisterFile
+	int maxThreads;
+	// 1, 2 or 4 for maxLiveRegisterFile
+	int maxThreadsIfRenumbered;
+
+	// Set if FALSE is returned
+	const char* errorMessage;
+	int errorInstructionIndex;
 };
 
-const char *
-v3d_qpu_cond_name(enum v3d_qpu_cond cond)
+// Returns FALSE if the program doesn't validate, e.g. its thread switches are too close together,
+// or the arena runs out of memory.
+v3d_bool v3d_qpu_analyze_occupancy(struct v3d_qpu_analyze_occupancy_arguments* args);
+
+// Peephole optimization
+//
+// Small local rewrites over decoded instructions, e.g. to tidy up generated code:
+//
+// - A mov or fmov whose result the next instruction overwrites without reading is dropped.
+// - A mov is folded into the next instruction when that is the only reader of its result and the
+//   raddrs allow, e.g. "nop ; mov rf1, rf2" then "fadd rf3, rf1, rf4" reads rf2 directly. Chains
+//   of movs collapse one step at a time.
+// - fmul by 2.0 becomes fadd of the value to itself when the add ALU is free, which is exact and
+//   frees the mul ALU. The QPU has no op for adding to the exponent, and doing it with integer
+//   ops isn't exact for zero, denormals, infinity or NaN, so other powers of two are left alone.
+// - umul24 and smul24 by 1, 2, 4 or 8 become shl on a free add ALU, if allowMul24ToShift is set.
+// - Flag pushes and updates which nothing reads are dropped.
+//
+// Instructions left with nothing to do are removed, unless they are delay slots. Every rewrite is
+// checked with v3d_qpu_validate() and kept only if the program still passes. V3D 4.x only.
+
+struct v3d_qpu_peephole_arguments
 {
-	if (cond >= V3D_ARRAY_SIZE(cond_names))
-		return NULL;
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the optimized program, which is never longer than the input
+	struct v3d_qpu_instr* instructionsOut;
+	// umul24 and smul24 only multiply the low 24 bits of their operands, so shl only gives the
+	// same result when the value fits in 24 bits (sign extended, for smul24). Set this when the
+	// code only uses them on such values, which is what they are for.
+	v3d_bool allowMul24ToShift;
+	// Temporary memory for about 120 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. A removed instruction maps to the one after it.
+	int* newIndicesOut;
 
-	return cond_names[cond];
-}
+	// Outputs
+	int numInstructionsOut;
+	int numMovsRemoved;
+	int numMovsFolded;
+	int numMultipliesReplaced;
+	int numFlagWritesRemoved;
+	int numInstructionsRemoved;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
+};
 
-const char *
-v3d_qpu_branch_cond_name(enum v3d_qpu_branch_cond cond)
+// The input must pass v3d_qpu_validate(). Relative branches within the program are re-targeted to
+// match. Returns FALSE if the input doesn't validate or the arena is out of memory.
+v3d_bool v3d_qpu_peephole(struct v3d_qpu_peephole_arguments* args);
+
+// Dead code elimination
+//
+// Removes work whose result is never used, e.g. left behind by generated code or other passes.
+// Liveness of the register file, accumulators and flags is worked out over the whole program,
+// following relative branches. An add or mul op whose destination nothing reads afterwards
+// becomes a nop, or only keeps its flag push if that is read, and flag pushes and updates
+// nothing reads are dropped. This repeats until nothing changes, since a removed op's inputs may
+// be dead too. Ops with side effects, e.g. magic writes to the TMU or TLB, and signals, which use
+// up uniforms or varyings, are kept. Instructions left empty are then removed, unless they are
+// delay slots or the program no longer passes v3d_qpu_validate() without them. V3D 4.x only.
+
+struct v3d_qpu_eliminate_dead_code_arguments
 {
-	switch (cond) {
-	case V3D_QPU_BRANCH_COND_ALWAYS:
-		return "";
-	case V3D_QPU_BRANCH_COND_A0:
-		return ".a0";
-	case V3D_QPU_BRANCH_COND_NA0:
-		return ".na0";
-	case V3D_QPU_BRANCH_COND_ALLA:
-		return ".alla";
-	case V3D_QPU_BRANCH_COND_ANYNA:
-		return ".anyna";
-	case V3D_QPU_BRANCH_COND_ANYA:
-		return ".anya";
-	case V3D_QPU_BRANCH_COND_ALLNA:
-		return ".allna";
-	default:
-		v3d_unreachable("bad branch cond value");
-	}
-	return "";
-}
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the program, which is never longer than the input
+	struct v3d_qpu_instr* instructionsOut;
+	// Temporary memory for about 120 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. A removed instruction maps to the one after it.
+	int* newIndicesOut;
 
-const char *
-v3d_qpu_msfign_name(enum v3d_qpu_msfign msfign)
+	// Outputs
+	int numInstructionsOut;
+	int numOpsRemoved;
+	// Ops whose destination became the NOP waddr, as only their flag push was read
+	int numWritesRemoved;
+	int numFlagWritesRemoved;
+	int numInstructionsRemoved;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
+};
+
+// The input must pass v3d_qpu_validate(). Relative branches within the program are re-targeted to
+// match. Returns FALSE if the input doesn't validate or the arena is out of memory.
+v3d_bool v3d_qpu_eliminate_dead_code(struct v3d_qpu_eliminate_dead_code_arguments* args);
+
+// NOP compaction
+//
+// Removes instructions which are nothing but NOPs, e.g. left behind by other passes, wherever the
+// program still passes v3d_qpu_validate() without them. NOPs which give an SFU result, ldvary or a
+// THRSW the time it needs stay, as do branch and THRSW delay slots, which always run. Since the
+// validator only follows program order, NOPs at a relative branch target or just after one also
+// stay, as the path coming from the branch may need them.
+
+struct v3d_qpu_compact_nops_arguments
 {
-	switch (msfign) {
-	case V3D_QPU_MSFIGN_NONE:
-		return "";
-	case V3D_QPU_MSFIGN_P:
-		return "p";
-	case V3D_QPU_MSFIGN_Q:
-		return "q";
-	default:
-		v3d_unreachable("bad branch cond value");
-	}
-	return "";
-}
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the compacted program, which is never longer than the input
+	struct v3d_qpu_instr* instructionsOut;
+	// Temporary memory for about 10 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. A removed NOP maps to the instruction after it.
+	int* newIndicesOut;
+	// Optional. Instruction indices, e.g. of labels or line tables, rewritten in place the same way.
+	// Entries outside 0 to numInstructions are left alone.
+	int* labels;
+	int numLabels;
 
-// Also update cond_pf_uf_names if changing
-const char* pf_names[] = {
-	[V3D_QPU_PF_NONE] =  "",
-	[V3D_QPU_PF_PUSHZ] =  ".pushz",
-	[V3D_QPU_PF_PUSHN] =  ".pushn",
-	[V3D_QPU_PF_PUSHC] =  ".pushc",
+	// Outputs
+	int numInstructionsOut;
+	int numNopsRemoved;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
 };
 
-const char *
-v3d_qpu_pf_name(enum v3d_qpu_pf pf)
-{
-	if (pf >= V3D_ARRAY_SIZE(pf_names))
-		return NULL;
+// The input must pass v3d_qpu_validate(). Relative branches within the program are re-targeted to
+// match. Returns FALSE if the input doesn't validate or the arena is out of memory.
+v3d_bool v3d_qpu_compact_nops(struct v3d_qpu_compact_nops_arguments* args);
 
-	return pf_names[pf];
-}
+// Accumulator promotion
+//
+// On V3D 4.x, reading an accumulator doesn't use one of an instruction's two raddrs, while reading
+// the register file does. This moves short-lived values, written by an add or mul op and read by
+// the next few instructions, from the register file into an accumulator which is free for that
+// time, so e.g. v3d_qpu_pair_instructions() finds more instructions whose reads fit together. Only
+// r0-r3 are used, since SFU and TMU results, ldunif and ldvary write r4 and r5, and r3 only where
+// nothing (e.g. ldvpm) writes it implicitly. Values don't cross branches, branch targets or thread
+// switches, which accumulators don't survive. V3D 4.x only.
+
+struct v3d_qpu_promote_accumulators_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the program, which has the same length as the input
+	struct v3d_qpu_instr* instructionsOut;
+	// Longest a value may live, in instructions from its write to its last read, to be promoted. 0
+	// for no limit, though a long-lived value keeps an accumulator from shorter ones.
+	int maxLifetime;
+	// Temporary memory for about 110 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
 
-// Also update cond_pf_uf_names if changing
-const char* uf_names[] = {
-	[V3D_QPU_UF_NONE] = "",
-	[V3D_QPU_UF_ANDZ] = ".andz",
-	[V3D_QPU_UF_ANDNZ] = ".andnz",
-	[V3D_QPU_UF_NORZ] = ".norz",
-	[V3D_QPU_UF_NORNZ] = ".nornz",
-	[V3D_QPU_UF_ANDN] = ".andn",
-	[V3D_QPU_UF_ANDNN] = ".andnn",
-	[V3D_QPU_UF_NORN] = ".norn",
-	[V3D_QPU_UF_NORNN] = ".nornn",
-	[V3D_QPU_UF_ANDC] = ".andc",
-	[V3D_QPU_UF_ANDNC] = ".andnc",
-	[V3D_QPU_UF_NORC] = ".norc",
-	[V3D_QPU_UF_NORNC] = ".nornc",
+	// Outputs
+	int numValuesPromoted;
+	// Register file reads which became accumulator reads
+	int numReadsPromoted;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
 };
 
-const char *
-v3d_qpu_uf_name(enum v3d_qpu_uf uf)
-{
-	if (uf >= V3D_ARRAY_SIZE(uf_names))
-		return NULL;
+// The input must pass v3d_qpu_validate(), and each promotion is checked with it again. Returns
+// FALSE if the input doesn't validate or the arena is out of memory.
+v3d_bool v3d_qpu_promote_accumulators(struct v3d_qpu_promote_accumulators_arguments* args);
 
-	return uf_names[uf];
-}
+// If-conversion
+//
+// Removes forward branches over short blocks which may as well run on the path that skipped them,
+// saving the branch and the NOPs in its delay slots. A branch over the block on b.allna (no lane
+// has flag A) or b.alla (every lane has) can go when each write in the block is already
+// predicated on .ifa or .ifna respectively, so it writes nothing in any lane when the branch
+// would have been taken, or goes to a register nothing reads after the block. Predicating
+// unconditional writes instead would change the lanes the branch ran the block for, since it
+// decides for all lanes at once. Both branches of an if/else diamond convert this way, the else
+// branch first. The block and the delay slots may not write flags, have signals or side effects,
+// or contain other branches. Other conditions, and branches which are branch targets themselves or
+// move the uniform stream, are left alone. V3D 4.x only.
+
+struct v3d_qpu_if_convert_arguments
+{
+	// Inputs
+	struct v3d_device_info devinfo;
+	const struct v3d_qpu_instr* instructions;
+	int numInstructions;
+	// Receives the program, which is never longer than the input
+	struct v3d_qpu_instr* instructionsOut;
+	// How many cycles the path which skipped a block may get slower by, i.e. how much longer the
+	// block may be than the branch and its delay slot NOPs. 0 converts only where neither path
+	// gets slower.
+	int maxExtraCycles;
+	// Temporary memory for about 30 bytes per instruction. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. numInstructions + 1 entries, receiving the new index of each input instruction and
+	// then the new program length. A removed instruction maps to the one after it.
+	int* newIndicesOut;
 
-// Only used for listing all the options
-const char* cond_pf_uf_names[] = {
-    // cond_names
-    ".ifa",
-    ".ifb",
-    ".ifna",
-    ".ifnb",
-    // pf_names
-    ".pushz",
-    ".pushn",
-    ".pushc",
-    // uf_names
-    ".andz",
-    ".andnz",
-    ".norz",
-    ".nornz",
-    ".andn",
-    ".andnn",
-    ".norn",
-    ".nornn",
-    ".andc",
-    ".andnc",
-    ".norc",
-    ".nornc",
+	// Outputs
+	int numInstructionsOut;
+	int numBranchesRemoved;
+	// Including the branches
+	int numInstructionsRemoved;
+	// Set if FALSE is returned. The index is in the input.
+	const char* errorMessage;
+	int errorInstructionIndex;
 };
 
-// Looks through nameList for an exact match to name. Name doesn't need to be null terminated or
-// anything because this will automatically check for symbol dividers. If dotOptional, nothing
-// specified will be considered a valid entry and its index will be 0. The nameList should therefore
-// have its first index be an empty string with NONE associated value.
-// Returns whether the value is in the list (TRUE if unspecified and dotOptional).
-v3d_bool v3d_qpu_value_from_name_list(const char* name, const char** nameList, int nameListLength,
-                                      v3d_bool dotOptional, v3d_uint32* matchingIndexOut,
-                                      const char** endOfNameOut)
+// The input must pass v3d_qpu_validate(), and each removal is checked with it again. Relative
+// branches within the program are re-targeted to match. Returns FALSE if the input doesn't
+// validate or the arena is out of memory.
+v3d_bool v3d_qpu_if_convert(struct v3d_qpu_if_convert_arguments* args);
+
+// Fused assembly
+//
+// Assembles, packs and validates a whole program in a single pass. Each instruction is validated
+// as soon as it is parsed, so only packed words are written out and no array of unpacked
+// v3d_qpu_instr needs to be kept around. Equivalent to running v3d_qpu_assemble(),
+// v3d_qpu_instr_pack() and v3d_qpu_validate() over the program one after another.
+struct v3d_qpu_assemble_program_arguments
 {
-	if (dotOptional && name[0] != '.')
-	{
-		*matchingIndexOut = 0;
-		if (endOfNameOut)
-			*endOfNameOut = name;
-		return TRUE;
-	}
+	// Inputs
+	struct v3d_device_info devinfo;
+	const char* assembly;
+	int assemblyLength;
+	// Owned by the caller. Receives one packed word per instruction.
+	v3d_uint64* instructionsOut;
+	int maxInstructions;
+	// Optional, maxInstructions entries each. Receive where each instruction starts, in bytes from
+	// the start of assembly and as a line number starting at 1.
+	int* instructionOffsetsOut;
+	int* instructionLinesOut;
 
-	// Skip over empty string for dot-optional lists
-	for (int index = dotOptional ? 1 : 0; index < nameListLength; ++index)
-	{
-		if (v3d_symbol_equals(nameList[index], name, endOfNameOut))
-		{
-			*matchingIndexOut = index;
-			return TRUE;
-		}
-	}
-	return FALSE;
-}
+	// Outputs
+	int numInstructions;
 
-static const char* pack_names[] = {
-    [V3D_QPU_PACK_NONE] = "",
-    [V3D_QPU_PACK_L] = ".l",
-    [V3D_QPU_PACK_H] = ".h",
+	// Set if FALSE is returned. The offset is in bytes from the start of assembly and the line
+	// starts at 1. Validation errors point at the start of the offending instruction, and also
+	// fill validateResult.
+	const char* errorMessage;
+	int errorAtOffset;
+	int errorLine;
+	const char** hintAvailable;
+	int numHints;
+	struct v3d_qpu_validate_result validateResult;
 };
 
-const char*	v3d_qpu_pack_name(enum v3d_qpu_output_pack pack)
-{
-	if (pack >= V3D_ARRAY_SIZE(pack_names))
-		return NULL;
+// Returns FALSE on the first assembly, encoding or validation error, or if the program has more
+// than maxInstructions instructions.
+v3d_bool v3d_qpu_assemble_program(struct v3d_qpu_assemble_program_arguments* args);
 
-	return pack_names[pack];
-}
+// Whole-file diagnostics
+//
+// Assembles a whole file and reports every bad line instead of stopping at the first one. Each
+// line is assembled on its own, so an error only costs the rest of its line and assembly picks
+// back up on the next one.
 
-static const char* unpack_names[] = {
-    [V3D_QPU_UNPACK_NONE] = "",
-    [V3D_QPU_UNPACK_L] = ".l",
-    [V3D_QPU_UNPACK_H] = ".h",
-    [V3D_QPU_UNPACK_ABS] = ".abs",
-    [V3D_QPU_UNPACK_REPLICATE_32F_16] = ".ff",
-    [V3D_QPU_UNPACK_REPLICATE_L_16] = ".ll",
-    [V3D_QPU_UNPACK_REPLICATE_H_16] = ".hh",
-    [V3D_QPU_UNPACK_SWAP_16] = ".swp",
+struct v3d_qpu_diagnostic
+{
+	const char* errorMessage;
+	// In bytes from the start of the assembly
+	int errorAtOffset;
+	// Starting at 1
+	int line;
+	const char** hintAvailable;
+	int numHints;
+	// Set for validation errors, otherwise V3D_QPU_VALIDATE_ERROR_NONE
+	enum v3d_qpu_validate_error validateError;
+	// Only set for notes, where errorMessage describes the fix
+	enum v3d_qpu_raddr_fix raddrFix;
+
+	struct v3d_qpu_diagnostic* next;
 };
 
-const char*	v3d_qpu_unpack_name(enum v3d_qpu_input_unpack unpack)
+struct v3d_qpu_assemble_file_arguments
 {
-	if (unpack >= V3D_ARRAY_SIZE(unpack_names))
-		return NULL;
+	// Inputs
+	struct v3d_device_info devinfo;
+	const char* assembly;
+	int assemblyLength;
+	// Optional. Receives one packed word per instruction which assembled. Leave NULL to only
+	// check the file.
+	v3d_uint64* instructionsOut;
+	int maxInstructions;
+	// Diagnostics are allocated from here
+	struct v3d_arena* arena;
+	// Stop after this many diagnostics. 0 for no limit.
+	int maxDiagnostics;
+	// Also run v3d_qpu_validate() over the program. Validation stops at its first error, and only
+	// runs while every line so far assembled, because the instruction sequence is incomplete
+	// otherwise.
+	v3d_bool validate;
+	// Optional. Passed on to v3d_qpu_assemble(). Each fix is reported in notes.
+	const struct v3d_qpu_raddr_fix_options* raddrFixOptions;
 
-	return unpack_names[unpack];
-}
+	// Outputs
+	int numInstructions;
+	// In the order they appear in the file
+	struct v3d_qpu_diagnostic* diagnostics;
+	int numDiagnostics;
+	// Set if the arena ran out of memory or maxDiagnostics was reached, so diagnostics is
+	// incomplete.
+	v3d_bool diagnosticsTruncated;
+	// Lines which assembled into more than one instruction because of raddrFixOptions, in the
+	// order they appear in the file. These are not errors and don't count towards maxDiagnostics,
+	// but are dropped if the arena runs out of memory.
+	struct v3d_qpu_diagnostic* notes;
+	int numNotes;
+};
 
-#define D   1 // Destination
-#define A   2 // Argument A
-#define B   4 // Argument B
-static const v3d_uint8 add_op_args[] = {
-	[V3D_QPU_A_FADD] = D | A | B,
-	[V3D_QPU_A_FADDNF] = D | A | B,
-	[V3D_QPU_A_VFPACK] = D | A | B,
-	[V3D_QPU_A_ADD] = D | A | B,
-	[V3D_QPU_A_VFPACK] = D | A | B,
-	[V3D_QPU_A_SUB] = D | A | B,
-	[V3D_QPU_A_VFPACK] = D | A | B,
-	[V3D_QPU_A_FSUB] = D | A | B,
-	[V3D_QPU_A_MIN] = D | A | B,
-	[V3D_QPU_A_MAX] = D | A | B,
-	[V3D_QPU_A_UMIN] = D | A | B,
-	[V3D_QPU_A_UMAX] = D | A | B,
-	[V3D_QPU_A_SHL] = D | A | B,
-	[V3D_QPU_A_SHR] = D | A | B,
-	[V3D_QPU_A_ASR] = D | A | B,
-	[V3D_QPU_A_ROR] = D | A | B,
-	[V3D_QPU_A_FMIN] = D | A | B,
-	[V3D_QPU_A_FMAX] = D | A | B,
-	[V3D_QPU_A_VFMIN] = D | A | B,
+// Returns TRUE if the file assembled (and validated, if requested) without any errors.
+v3d_bool v3d_qpu_assemble_file(struct v3d_qpu_assemble_file_arguments* args);
 
-	[V3D_QPU_A_AND] = D | A | B,
-	[V3D_QPU_A_OR] = D | A | B,
-	[V3D_QPU_A_XOR] = D | A | B,
+// Preprocessor
+//
+// Expands directives into plain assembly for the assembler functions above. Directives start with
+// '.' at the beginning of a line:
+//
+// .set NAME, value     Replace NAME with value in the lines which follow
+// .include "path"      Insert the file loaded by the include callback
+// .macro name a, b     Define a macro. \a and \b in the body are replaced by the arguments
+// ...
+// .endm
+//
+// A macro is used like an instruction: "name arg1, arg2". Arguments are split on ',' and trimmed.
+//
+// The preprocessor is meant to outlive many calls to v3d_qpu_preprocess(), e.g. one per shader
+// variant. Included files are loaded and split into lines once, and each macro expansion is kept
+// per unique argument list, so shared code is only processed the first time it is used. Symbols
+// and macros also stay defined between calls.
+
+// Loads the file at path (not null terminated). The text only needs to stay valid until this
+// returns; it is copied. Return FALSE if the file could not be loaded.
+typedef v3d_bool (*v3d_qpu_include_func)(void* userData, const char* path, int pathLength,
+                                         const char** textOut, int* textLengthOut);
+
+// Defined in the implementation
+struct v3d_qpu_pp_macro;
+struct v3d_qpu_pp_symbol;
+struct v3d_qpu_pp_include;
+
+struct v3d_qpu_preprocessor
+{
+	// Macros, symbols, included files and expansions are all allocated from here, so it should
+	// only be reset along with the preprocessor (see v3d_qpu_preprocessor_init()).
+	struct v3d_arena* arena;
+	// Optional. Without it, .include is an error.
+	v3d_qpu_include_func loadInclude;
+	void* userData;
+
+	struct v3d_qpu_pp_macro* macros;
+	struct v3d_qpu_pp_symbol* symbols;
+	struct v3d_qpu_pp_include* includes;
+
+	// Statistics
+	int numIncludeLoads;
+	int numIncludeHits;
+	int numExpansionHits;
+	int numExpansionMisses;
+};
 
-	[V3D_QPU_A_VADD] = D | A | B,
-	[V3D_QPU_A_VSUB] = D | A | B,
-	[V3D_QPU_A_NOT] = D | A,
-	[V3D_QPU_A_NEG] = D | A,
-	[V3D_QPU_A_FLAPUSH] = D | A,
-	[V3D_QPU_A_FLBPUSH] = D | A,
-	[V3D_QPU_A_FLPOP] = D | A,
-	[V3D_QPU_A_RECIP] = D | A,
-	[V3D_QPU_A_SETMSF] = D | A,
-	[V3D_QPU_A_SETREVF] = D | A,
-	[V3D_QPU_A_NOP] = 0,
-	[V3D_QPU_A_TIDX] = D,
-	[V3D_QPU_A_EIDX] = D,
-	[V3D_QPU_A_LR] = D,
-	[V3D_QPU_A_VFLA] = D,
-	[V3D_QPU_A_VFLNA] = D,
-	[V3D_QPU_A_VFLB] = D,
-	[V3D_QPU_A_VFLNB] = D,
+// Where an output line came from. Lines expanded from a macro point at the line which used it.
+struct v3d_qpu_preprocess_line_origin
+{
+	// NULL for the source passed to v3d_qpu_preprocess(), otherwise the include's path
+	const char* path;
+	int pathLength;
+	// Starting at 1
+	int line;
+};
 
-	[V3D_QPU_A_FXCD] = D,
-	[V3D_QPU_A_XCD] = D,
-	[V3D_QPU_A_FYCD] = D,
-	[V3D_QPU_A_YCD] = D,
+struct v3d_qpu_preprocess_arguments
+{
+	// Inputs
+	const char* source;
+	int sourceLength;
+	// Owned by the caller. Receives the expanded assembly, one instruction per line.
+	char* output;
+	int outputCapacity;
+	// Optional. Receives the origin of each output line.
+	struct v3d_qpu_preprocess_line_origin* originsOut;
+	int maxOrigins;
 
-	[V3D_QPU_A_MSF] = D,
-	[V3D_QPU_A_REVF] = D,
-	[V3D_QPU_A_VDWWT] = D,
-	[V3D_QPU_A_IID] = D,
-	[V3D_QPU_A_SAMPID] = D,
-	[V3D_QPU_A_BARRIERID] = D,
-	[V3D_QPU_A_TMUWT] = D,
-	[V3D_QPU_A_VPMWT] = D,
-	[V3D_QPU_A_FLAFIRST] = D,
-	[V3D_QPU_A_FLNAFIRST] = D,
+	// Outputs
+	int outputLength;
+	int numLines;
 
-	[V3D_QPU_A_VPMSETUP] = D | A,
+	// Set if FALSE is returned
+	const char* errorMessage;
+	struct v3d_qpu_preprocess_line_origin errorOrigin;
+};
 
-	[V3D_QPU_A_LDVPMV_IN] = D | A,
-	[V3D_QPU_A_LDVPMV_OUT] = D | A,
-	[V3D_QPU_A_LDVPMD_IN] = D | A,
-	[V3D_QPU_A_LDVPMD_OUT] = D | A,
-	[V3D_QPU_A_LDVPMP] = D | A,
-	[V3D_QPU_A_RSQRT] = D | A,
-	[V3D_QPU_A_EXP] = D | A,
-	[V3D_QPU_A_LOG] = D | A,
-	[V3D_QPU_A_SIN] = D | A,
-	[V3D_QPU_A_RSQRT2] = D | A,
-	[V3D_QPU_A_LDVPMG_IN] = D | A | B,
-	[V3D_QPU_A_LDVPMG_OUT] = D | A | B,
+void v3d_qpu_preprocessor_init(struct v3d_qpu_preprocessor* preprocessor, struct v3d_arena* arena,
+                               v3d_qpu_include_func loadInclude, void* userData);
+// Same as ".set name, value" in the source, e.g. to choose a shader variant. Returns FALSE if the
+// arena is out of memory.
+v3d_bool v3d_qpu_preprocessor_set(struct v3d_qpu_preprocessor* preprocessor, const char* name,
+                                  int nameLength, const char* value, int valueLength);
+v3d_bool v3d_qpu_preprocess(struct v3d_qpu_preprocessor* preprocessor,
+                            struct v3d_qpu_preprocess_arguments* args);
 
-	/* FIXME: MOVABSNEG */
+// Instruction builder
+//
+// Emits instructions straight from code, e.g. when specializing shaders at runtime, without
+// printing assembly text only to parse it back. Operands go through the same raddr and small
+// immediate allocation as v3d_qpu_assemble(), so the same instructions are accepted. Emitting
+// never allocates unless the code buffer is full and a grow callback was provided.
 
-	[V3D_QPU_A_FCMP] = D | A | B,
-	[V3D_QPU_A_VFMAX] = D | A | B,
+enum v3d_qpu_operand_kind
+{
+	// Unused source or destination, e.g. for ops with fewer sources or no destination
+	V3D_QPU_OPERAND_NONE,
+	// rf0 through rf63
+	V3D_QPU_OPERAND_REGISTER_FILE,
+	// r0 through r5
+	V3D_QPU_OPERAND_ACCUMULATOR,
+	// Index into the small immediate table (see v3d_qpu_small_imm_pack()). Sources only.
+	V3D_QPU_OPERAND_SMALL_IMMEDIATE,
+	// A magic waddr, e.g. V3D_QPU_WADDR_TMUA. Destinations only.
+	V3D_QPU_OPERAND_MAGIC,
+};
 
-	[V3D_QPU_A_FROUND] = D | A,
-	[V3D_QPU_A_FTOIN] = D | A,
-	[V3D_QPU_A_FTRUNC] = D | A,
-	[V3D_QPU_A_FTOIZ] = D | A,
-	[V3D_QPU_A_FFLOOR] = D | A,
-	[V3D_QPU_A_FTOUZ] = D | A,
-	[V3D_QPU_A_FCEIL] = D | A,
-	[V3D_QPU_A_FTOC] = D | A,
+struct v3d_qpu_operand
+{
+	enum v3d_qpu_operand_kind kind;
+	int index;
+	// Only used for sources
+	enum v3d_qpu_input_unpack unpack;
+	// Only used for destinations
+	enum v3d_qpu_output_pack pack;
+};
 
-	[V3D_QPU_A_FDX] = D | A,
-	[V3D_QPU_A_FDY] = D | A,
+struct v3d_qpu_operand v3d_qpu_operand_none(void);
+struct v3d_qpu_operand v3d_qpu_operand_rf(int registerFile);
+struct v3d_qpu_operand v3d_qpu_operand_acc(int accumulator);
+struct v3d_qpu_operand v3d_qpu_operand_magic(enum v3d_qpu_waddr waddr);
+struct v3d_qpu_operand v3d_qpu_operand_small_imm(v3d_uint32 packedSmallImmediate);
+// Finds the small immediate encoding value, e.g. 0x3f800000 for 1.0f. Returns FALSE if value is
+// not one of the small immediates, in which case it needs to come from e.g. a uniform instead.
+v3d_bool v3d_qpu_operand_small_imm_value(const struct v3d_device_info* devinfo, v3d_uint32 value,
+                                         struct v3d_qpu_operand* operandOut);
+struct v3d_qpu_operand v3d_qpu_operand_unpack(struct v3d_qpu_operand operand,
+                                              enum v3d_qpu_input_unpack unpack);
+struct v3d_qpu_operand v3d_qpu_operand_pack(struct v3d_qpu_operand operand,
+                                            enum v3d_qpu_output_pack pack);
+
+// Everything about an ALU instruction besides its ops and operands. Zero initialize for none.
+struct v3d_qpu_emit_modifiers
+{
+	struct v3d_qpu_flags flags;
+	struct v3d_qpu_sig sig;
+	v3d_uint8 sig_addr;
+	v3d_bool sig_magic;
+};
 
-	[V3D_QPU_A_STVPMV] = A | B,
-	[V3D_QPU_A_STVPMD] = A | B,
-	[V3D_QPU_A_STVPMP] = A | B,
+// Called when the code buffer is full. Should point *code at a buffer of at least
+// minCapacity instructions which starts with the *capacity instructions already emitted, update
+// *capacity, and return TRUE. Return FALSE to fail the emit instead.
+typedef v3d_bool (*v3d_qpu_builder_grow_func)(void* userData, v3d_uint64** code, int* capacity,
+                                              int minCapacity);
 
-	[V3D_QPU_A_ITOF] = D | A,
-	[V3D_QPU_A_CLZ] = D | A,
-	[V3D_QPU_A_UTOF] = D | A,
+struct v3d_qpu_builder
+{
+	struct v3d_device_info devinfo;
+	v3d_uint64* code;
+	int capacity;
+	int numInstructions;
+	// Optional. When NULL, code is fixed size and emitting past capacity fails.
+	v3d_qpu_builder_grow_func grow;
+	void* userData;
+
+	// Set by the first emit which fails. Once set, further emits are ignored, so a whole sequence
+	// can be emitted and the error checked once at the end.
+	const char* errorMessage;
+	int errorInstructionIndex;
+};
 
-	[V3D_QPU_A_MOV] = D | A,
-	[V3D_QPU_A_FMOV] = D | A,
-	[V3D_QPU_A_VPACK] = D | A | B,
-	[V3D_QPU_A_V8PACK] = D | A | B,
-	[V3D_QPU_A_V10PACK] = D | A | B,
-	[V3D_QPU_A_V11FPACK] = D | A | B,
+void v3d_qpu_builder_init(struct v3d_qpu_builder* builder, const struct v3d_device_info* devinfo,
+                          v3d_uint64* code, int capacity, v3d_qpu_builder_grow_func grow,
+                          void* userData);
+// Emits into code allocated from arena, growing it as needed. Returns FALSE if the arena is out of
+// memory for the initial capacity.
+v3d_bool v3d_qpu_builder_init_arena(struct v3d_qpu_builder* builder,
+                                    const struct v3d_device_info* devinfo, struct v3d_arena* arena,
+                                    int initialCapacity);
+
+// Fills instrOut without packing it, e.g. to inspect or modify it first. Modifiers may be NULL.
+// Returns FALSE and sets errorMessageOut if the operands don't fit the ops or the raddr limits.
+v3d_bool v3d_qpu_build_alu(const struct v3d_device_info* devinfo, enum v3d_qpu_add_op addOp,
+                           struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                           struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                           struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                           struct v3d_qpu_operand mulB,
+                           const struct v3d_qpu_emit_modifiers* modifiers,
+                           struct v3d_qpu_instr* instrOut, const char** errorMessageOut);
+
+// All emit functions return FALSE if the instruction could not be built, encoded, or stored.
+v3d_bool v3d_qpu_emit_instr(struct v3d_qpu_builder* builder, const struct v3d_qpu_instr* instr);
+v3d_bool v3d_qpu_emit_alu(struct v3d_qpu_builder* builder, enum v3d_qpu_add_op addOp,
+                          struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                          struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                          struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                          struct v3d_qpu_operand mulB,
+                          const struct v3d_qpu_emit_modifiers* modifiers);
+// Like v3d_qpu_build_alu(), but fixes raddr conflicts as allowed by options (see enum
+// v3d_qpu_raddr_fix). Fills numInstrsOut (1 or 2) instructions of instrsOut, in program order.
+v3d_bool v3d_qpu_build_alu_fixed(const struct v3d_device_info* devinfo, enum v3d_qpu_add_op addOp,
+                                 struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                                 struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                                 struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                                 struct v3d_qpu_operand mulB,
+                                 const struct v3d_qpu_emit_modifiers* modifiers,
+                                 const struct v3d_qpu_raddr_fix_options* options,
+                                 struct v3d_qpu_instr instrsOut[2], int* numInstrsOut,
+                                 enum v3d_qpu_raddr_fix* fixOut, const char** errorMessageOut);
+// fixOut may be NULL
+v3d_bool v3d_qpu_emit_alu_fixed(struct v3d_qpu_builder* builder, enum v3d_qpu_add_op addOp,
+                                struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                                struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                                struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                                struct v3d_qpu_operand mulB,
+                                const struct v3d_qpu_emit_modifiers* modifiers,
+                                const struct v3d_qpu_raddr_fix_options* options,
+                                enum v3d_qpu_raddr_fix* fixOut);
+// "nop ; nop" plus optional modifiers, e.g. for thrsw.
+v3d_bool v3d_qpu_emit_nop(struct v3d_qpu_builder* builder,
+                          const struct v3d_qpu_emit_modifiers* modifiers);
+// Emits a relative branch to the instruction at index targetInstruction, which may not have been
+// emitted yet. Remember branches have three delay slots.
+v3d_bool v3d_qpu_emit_branch(struct v3d_qpu_builder* builder, enum v3d_qpu_branch_cond cond,
+                             int targetInstruction);
+// Re-targets an already emitted relative branch, e.g. once a forward target is known.
+v3d_bool v3d_qpu_builder_set_branch_target(struct v3d_qpu_builder* builder,
+                                           int branchInstruction, int targetInstruction);
+
+// Constant expressions
+//
+// Source operands which aren't registers may be constant expressions, e.g. "(1 << 3)" or
+// "(0.5 * 4)", folded while assembling. The result must still be one of the small immediates.
+// Register files can be written as e.g. "rf(BASE + 2)", which is mostly useful along with .set.
+//
+// Integers are decimal or 0x hex. Numbers with a '.', an exponent or an 'f' suffix are floats,
+// e.g. 1.5, 2f, or 1e-3. Operators are, from lowest to highest precedence, | ^ & << >> + - * / %
+// and then unary - ~. Integers are promoted to float when mixed with floats, and bitwise operators
+// only take integers.
+
+struct v3d_qpu_constant
+{
+	// The 32 bit pattern, i.e. IEEE 754 single precision for floats
+	v3d_uint32 bits;
+	v3d_bool isFloat;
 };
 
-static const v3d_uint8 mul_op_args[] = {
-	[V3D_QPU_M_ADD] = D | A | B,
-	[V3D_QPU_M_SUB] = D | A | B,
-	[V3D_QPU_M_UMUL24] = D | A | B,
-	[V3D_QPU_M_VFMUL] = D | A | B,
-	[V3D_QPU_M_SMUL24] = D | A | B,
-	[V3D_QPU_M_MULTOP] = D | A | B,
-	[V3D_QPU_M_FMOV] = D | A,
-	[V3D_QPU_M_NOP] = 0,
-	[V3D_QPU_M_MOV] = D | A,
-	[V3D_QPU_M_FMUL] = D | A | B,
-	[V3D_QPU_M_FTOUNORM16] = D | A,
-	[V3D_QPU_M_FTOSNORM16] = D | A,
-	[V3D_QPU_M_VFTOUNORM8] = D | A,
-	[V3D_QPU_M_VFTOSNORM8] = D | A,
-	[V3D_QPU_M_VFTOUNORM10LO] = D | A,
-	[V3D_QPU_M_VFTOUNORM10HI] = D | A,
+// Evaluates the expression at expression, stopping at the first character which can't continue
+// it, e.g. ',' or ';'. Returns FALSE and sets errorMessageOut if the expression is invalid.
+v3d_bool v3d_qpu_eval_constant(const char* expression, const char* end,
+                               struct v3d_qpu_constant* constantOut,
+                               const char** endOfExpressionOut, const char** errorMessageOut);
+
+// How to get a constant into a register, from cheapest to most expensive
+enum v3d_qpu_constant_source
+{
+	// Used directly as an operand
+	V3D_QPU_CONSTANT_SMALL_IMMEDIATE,
+	// One add or mul op on a small immediate, e.g. "itof rf0, 3" for 3.0f. Only one small
+	// immediate fits in an instruction, so a binary op uses it as both operands.
+	V3D_QPU_CONSTANT_ALU_OP,
+	// Loaded from the uniform stream with ldunif, costing a uniform slot
+	V3D_QPU_CONSTANT_UNIFORM,
 };
 
-v3d_bool
-v3d_qpu_add_op_has_dst(enum v3d_qpu_add_op op)
+struct v3d_qpu_constant_plan
 {
-	v3d_assert(op < V3D_ARRAY_SIZE(add_op_args));
+	enum v3d_qpu_constant_source source;
+	// The packed small immediate for V3D_QPU_CONSTANT_SMALL_IMMEDIATE and V3D_QPU_CONSTANT_ALU_OP
+	v3d_uint32 packedSmallImmediate;
+	// For V3D_QPU_CONSTANT_ALU_OP. addOp is V3D_QPU_A_NOP if the op is mulOp.
+	enum v3d_qpu_add_op addOp;
+	enum v3d_qpu_mul_op mulOp;
+};
 
-	return add_op_args[op] & D;
-}
+// Finds the cheapest way to produce bits, e.g. so generated code can avoid spending uniform slots.
+void v3d_qpu_plan_constant(const struct v3d_device_info* devinfo, v3d_uint32 bits,
+                           struct v3d_qpu_constant_plan* planOut);
 
-v3d_bool
-v3d_qpu_mul_op_has_dst(enum v3d_qpu_mul_op op)
+// Register allocation
+//
+// Maps virtual registers, written as '%' followed by letters, digits and '_' (e.g. %tmp0), onto
+// the register file and accumulators, so assembly can be written without picking registers by
+// hand. Runs on text, between v3d_qpu_preprocess() and the assembler, and writes the same text
+// back out with each virtual register replaced.
+//
+// Each virtual register lives from its first write to its last read (the text assembler has no
+// branches, so programs are straight-line). Registers are handed out by linear scan, preferring
+// r0-r3 (when has_accumulators) and then the lowest free rf, which keeps the number of rf used
+// down: fewer registers allow more threads per QPU, which hide TMU latency better. Accumulators
+// aren't used for values which live across a thread switch, since they aren't kept, and nothing
+// is put in a register the program names explicitly. Each instruction keeps to two rf reads, or
+// one alongside a small immediate, so the result assembles without raddr conflicts.
+
+struct v3d_qpu_register_assignment
 {
-	v3d_assert(op < V3D_ARRAY_SIZE(mul_op_args));
-
-	return mul_op_args[op] & D;
-}
+	// Without the '%', pointing into the source
+	const char* name;
+	int nameLength;
+	// Register file or accumulator operand
+	struct v3d_qpu_operand reg;
+};
 
-int
-v3d_qpu_add_op_num_src(enum v3d_qpu_add_op op)
+struct v3d_qpu_allocate_registers_arguments
 {
-	v3d_assert(op < V3D_ARRAY_SIZE(add_op_args));
+	// Inputs
+	struct v3d_device_info devinfo;
+	const char* source;
+	int sourceLength;
+	// Owned by the caller. Receives the assembly with physical registers, with the same lines.
+	char* output;
+	int outputCapacity;
+	// Bit n set keeps rfn out of allocation, e.g. registers the hardware loads before the shader
+	// starts. Registers named in the source are always kept out.
+	v3d_uint32 reservedRegisterFile;
+	// Temporary memory for the source length plus 16 bytes per line and about 100 bytes per
+	// virtual register use. Freed again before returning.
+	struct v3d_arena* arena;
+	// Optional. Receives where each virtual register went, in the order they first appear.
+	struct v3d_qpu_register_assignment* assignmentsOut;
+	int maxAssignments;
 
-	v3d_uint8 args = add_op_args[op];
-	if (args & B)
-		return 2;
-	else if (args & A)
-		return 1;
-	else
-		return 0;
-}
+	// Outputs
+	int outputLength;
+	int numVirtualRegisters;
+	// One past the highest rf the program uses, whether named or allocated. This is what limits
+	// the number of threads.
+	int numRegisterFile;
+	// Accumulators given to virtual registers
+	int numAccumulators;
+
+	// Set if FALSE is returned
+	const char* errorMessage;
+	// Starting at 1
+	int errorLine;
+	// Byte offset into source
+	int errorAtOffset;
+};
 
-int
-v3d_qpu_mul_op_num_src(enum v3d_qpu_mul_op op)
-{
-	v3d_assert(op < V3D_ARRAY_SIZE(mul_op_args));
+// Returns FALSE if a line doesn't assemble, a virtual register is read before it is written, the
+// registers run out, or the output or the arena run out of space.
+v3d_bool v3d_qpu_allocate_registers(struct v3d_qpu_allocate_registers_arguments* args);
 
-	v3d_uint8 args = mul_op_args[op];
-	if (args & B)
-		return 2;
-	else if (args & A)
-		return 1;
-	else
-		return 0;
-}
 
-enum v3d_qpu_cond
-v3d_qpu_cond_invert(enum v3d_qpu_cond cond)
-{
-	switch (cond) {
-	case V3D_QPU_COND_IFA:
-		return V3D_QPU_COND_IFNA;
-	case V3D_QPU_COND_IFNA:
-		return V3D_QPU_COND_IFA;
-	case V3D_QPU_COND_IFB:
-		return V3D_QPU_COND_IFNB;
-	case V3D_QPU_COND_IFNB:
-		return V3D_QPU_COND_IFB;
-	default:
-		v3d_unreachable("Non-invertible cond");
-	}
-	return V3D_QPU_COND_IFNA;
+#ifdef __cplusplus
 }
+#endif
 
-v3d_bool
-v3d_qpu_magic_waddr_is_sfu(enum v3d_qpu_waddr waddr)
-{
-	switch (waddr) {
-	case V3D_QPU_WADDR_RECIP:
-	case V3D_QPU_WADDR_RSQRT:
-	case V3D_QPU_WADDR_EXP:
-	case V3D_QPU_WADDR_LOG:
-	case V3D_QPU_WADDR_SIN:
-	case V3D_QPU_WADDR_RSQRT2:
-		return TRUE;
-	default:
-		return FALSE;
-	}
-}
+//
+// Implementation
+//
 
-v3d_bool
-v3d_qpu_magic_waddr_is_tmu(const struct v3d_device_info *devinfo,
-                           enum v3d_qpu_waddr waddr)
-{
-	if (devinfo->ver >= 40) {
-		return ((waddr >= V3D_QPU_WADDR_TMUD &&
-				 waddr <= V3D_QPU_WADDR_TMUAU) ||
-				(waddr >= V3D_QPU_WADDR_TMUC &&
-				 waddr <= V3D_QPU_WADDR_TMUHSLOD));
-	} else {
-		return ((waddr >= V3D_QPU_WADDR_TMU &&
-				 waddr <= V3D_QPU_WADDR_TMUAU) ||
-				(waddr >= V3D_QPU_WADDR_TMUC &&
-				 waddr <= V3D_QPU_WADDR_TMUHSLOD));
-	}
-}
+#ifdef V3D_ASSEMBLER_IMPLEMENTATION
 
-v3d_bool
-v3d_qpu_waits_on_tmu(const struct v3d_qpu_instr *inst)
-{
-	return (inst->sig.ldtmu ||
-			(inst->type == V3D_QPU_INSTR_TYPE_ALU &&
-			 inst->alu.add.op == V3D_QPU_A_TMUWT));
-}
+#ifndef v3d_memcmp
+#error "Need to #define v3d_memcmp to e.g.: #define v3d_memcmp memcmp"
+#endif
 
-v3d_bool
-v3d_qpu_magic_waddr_is_tlb(enum v3d_qpu_waddr waddr)
-{
-	return (waddr == V3D_QPU_WADDR_TLB ||
-			waddr == V3D_QPU_WADDR_TLBU);
-}
+#ifndef v3d_vsnprintf
+#error "Need to #define v3d_vsnprintf to e.g.: #define v3d_vsnprintf vsnprintf"
+#endif
 
-v3d_bool
-v3d_qpu_magic_waddr_is_vpm(enum v3d_qpu_waddr waddr)
-{
-	return (waddr == V3D_QPU_WADDR_VPM ||
-			waddr == V3D_QPU_WADDR_VPMU);
-}
+#ifndef V3D_ARRAY_SIZE
+#define V3D_ARRAY_SIZE(array) (sizeof((array)) / sizeof((array)[0]))
+#endif
 
-v3d_bool
-v3d_qpu_magic_waddr_is_tsy(enum v3d_qpu_waddr waddr)
-{
-	return (waddr == V3D_QPU_WADDR_SYNC ||
-			waddr == V3D_QPU_WADDR_SYNCB ||
-			waddr == V3D_QPU_WADDR_SYNCU);
-}
+#ifndef V3D_STATIC_ASSERT
+#define V3D_STATIC_ASSERT(condition)
+#endif
 
-v3d_bool
-v3d_qpu_magic_waddr_loads_unif(enum v3d_qpu_waddr waddr)
-{
-	switch (waddr) {
-	case V3D_QPU_WADDR_VPMU:
-	case V3D_QPU_WADDR_TLBU:
-	case V3D_QPU_WADDR_TMUAU:
-	case V3D_QPU_WADDR_SYNCU:
-		return TRUE;
-	default:
-		return FALSE;
-	}
-}
+#ifndef v3d_assert
+#define v3d_assert(condition)
+#endif
 
-static v3d_bool
-v3d_qpu_add_op_reads_vpm(enum  v3d_qpu_add_op op)
+#ifndef v3d_unreachable
+#define v3d_unreachable(message) v3d_assert(0)
+#endif
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#ifndef NULL
+#define NULL 0
+#endif
+
+// All of the parsing functions take the text to parse as a (start, end) span, where end points one
+// past the last character which may be read. This allows assembling straight out of e.g. a
+// memory-mapped file without copying it to add a null terminator. An end of NULL means the text is
+// null terminated instead.
+// Returns the character at text[offset], or 0 if that is at or past the end of the span.
+static char v3d_peek(const char* text, const char* end, int offset)
 {
-	switch (op) {
-	case V3D_QPU_A_VPMSETUP:
-	case V3D_QPU_A_LDVPMV_IN:
-	case V3D_QPU_A_LDVPMV_OUT:
-	case V3D_QPU_A_LDVPMD_IN:
-	case V3D_QPU_A_LDVPMD_OUT:
-	case V3D_QPU_A_LDVPMP:
-	case V3D_QPU_A_LDVPMG_IN:
-	case V3D_QPU_A_LDVPMG_OUT:
-		return TRUE;
-	default:
-		return FALSE;
-	}
+	if (end && text + offset >= end)
+		return 0;
+	return text[offset];
 }
 
-static v3d_bool
-v3d_qpu_add_op_writes_vpm(enum  v3d_qpu_add_op op)
+// endOfCompareOut is set only when the symbol matches, and is the character right after the match
+// completes.
+static v3d_bool v3d_symbol_equals(const char* symbol, const char* compare, const char* end,
+                                  const char** endOfCompareOut)
 {
-	switch (op) {
-	case V3D_QPU_A_VPMSETUP:
-	case V3D_QPU_A_STVPMV:
-	case V3D_QPU_A_STVPMD:
-	case V3D_QPU_A_STVPMP:
-		return TRUE;
-	default:
-		return FALSE;
+	const char* candidateChar = compare;
+	for (const char* a = symbol; *a && v3d_peek(candidateChar, end, 0) && *a == *candidateChar; ++a)
+	{
+		++candidateChar;
+		// All possible delimiters for symbols
+		char delimiter = v3d_peek(candidateChar, end, 0);
+		if (a[1] == 0 && (delimiter == 0 || delimiter == '\n' || delimiter == '\r' ||
+		                  delimiter == '\t' || delimiter == '.' || delimiter == ' ' ||
+		                  delimiter == ',' || delimiter == ';'))
+		{
+			if (endOfCompareOut)
+				*endOfCompareOut = candidateChar;
+			return TRUE;
+		}
 	}
+	return FALSE;
 }
 
-v3d_bool
-v3d_qpu_reads_tlb(const struct v3d_qpu_instr *inst)
-{
-	return inst->sig.ldtlb || inst->sig.ldtlbu;
-}
-
-v3d_bool
-v3d_qpu_writes_tlb(const struct v3d_qpu_instr *inst)
+// >>> qpu_instr.c
+const char *
+v3d_qpu_magic_waddr_name(const struct v3d_device_info *devinfo,
+                         enum v3d_qpu_waddr waddr)
 {
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (inst->alu.add.op != V3D_QPU_A_NOP &&
-			inst->alu.add.magic_write &&
-			v3d_qpu_magic_waddr_is_tlb(inst->alu.add.waddr)) {
-			return TRUE;
-		}
+	/* V3D 4.x UNIFA aliases TMU in V3D 3.x in the table below */
+	if (devinfo->ver < 40 && waddr == V3D_QPU_WADDR_TMU)
+		return "tmu";
 
-		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			inst->alu.mul.magic_write &&
-			v3d_qpu_magic_waddr_is_tlb(inst->alu.mul.waddr)) {
-			return TRUE;
-		}
-	}
+	/* V3D 7.x QUAD and REP aliases R5 and R5REPT in the table below
+	 */
+	if (devinfo->ver >= 71 && waddr == V3D_QPU_WADDR_QUAD)
+		return "quad";
 
-	return FALSE;
-}
+	if (devinfo->ver >= 71 && waddr == V3D_QPU_WADDR_REP)
+		return "rep";
 
-v3d_bool
-v3d_qpu_uses_tlb(const struct v3d_qpu_instr *inst)
-{
-	return  v3d_qpu_writes_tlb(inst) || v3d_qpu_reads_tlb(inst);
-}
+	static const char *waddr_magic[] = {
+		[V3D_QPU_WADDR_R0] = "r0",
+		[V3D_QPU_WADDR_R1] = "r1",
+		[V3D_QPU_WADDR_R2] = "r2",
+		[V3D_QPU_WADDR_R3] = "r3",
+		[V3D_QPU_WADDR_R4] = "r4",
+		[V3D_QPU_WADDR_R5] = "r5",
+		[V3D_QPU_WADDR_NOP] = "-",
+		[V3D_QPU_WADDR_TLB] = "tlb",
+		[V3D_QPU_WADDR_TLBU] = "tlbu",
+		[V3D_QPU_WADDR_UNIFA] = "unifa",
+		[V3D_QPU_WADDR_TMUL] = "tmul",
+		[V3D_QPU_WADDR_TMUD] = "tmud",
+		[V3D_QPU_WADDR_TMUA] = "tmua",
+		[V3D_QPU_WADDR_TMUAU] = "tmuau",
+		[V3D_QPU_WADDR_VPM] = "vpm",
+		[V3D_QPU_WADDR_VPMU] = "vpmu",
+		[V3D_QPU_WADDR_SYNC] = "sync",
+		[V3D_QPU_WADDR_SYNCU] = "syncu",
+		[V3D_QPU_WADDR_SYNCB] = "syncb",
+		[V3D_QPU_WADDR_RECIP] = "recip",
+		[V3D_QPU_WADDR_RSQRT] = "rsqrt",
+		[V3D_QPU_WADDR_EXP] = "exp",
+		[V3D_QPU_WADDR_LOG] = "log",
+		[V3D_QPU_WADDR_SIN] = "sin",
+		[V3D_QPU_WADDR_RSQRT2] = "rsqrt2",
+		[V3D_QPU_WADDR_TMUC] = "tmuc",
+		[V3D_QPU_WADDR_TMUS] = "tmus",
+		[V3D_QPU_WADDR_TMUT] = "tmut",
+		[V3D_QPU_WADDR_TMUR] = "tmur",
+		[V3D_QPU_WADDR_TMUI] = "tmui",
+		[V3D_QPU_WADDR_TMUB] = "tmub",
+		[V3D_QPU_WADDR_TMUDREF] = "tmudref",
+		[V3D_QPU_WADDR_TMUOFF] = "tmuoff",
+		[V3D_QPU_WADDR_TMUSCM] = "tmuscm",
+		[V3D_QPU_WADDR_TMUSF] = "tmusf",
+		[V3D_QPU_WADDR_TMUSLOD] = "tmuslod",
+		[V3D_QPU_WADDR_TMUHS] = "tmuhs",
+		[V3D_QPU_WADDR_TMUHSCM] = "tmuhscm",
+		[V3D_QPU_WADDR_TMUHSF] = "tmuhsf",
+		[V3D_QPU_WADDR_TMUHSLOD] = "tmuhslod",
+		[V3D_QPU_WADDR_R5REP] = "r5rep",
+	};
 
-v3d_bool
-v3d_qpu_uses_sfu(const struct v3d_qpu_instr *inst)
-{
-	return v3d_qpu_instr_is_sfu(inst) || v3d_qpu_instr_is_legacy_sfu(inst);
+	return waddr_magic[waddr];
 }
 
-/* Checks whether the instruction implements a SFU operation by the writing
- * to specific magic register addresses instead of using SFU ALU opcodes.
- */
-v3d_bool
-v3d_qpu_instr_is_legacy_sfu(const struct v3d_qpu_instr *inst)
-{
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (inst->alu.add.op != V3D_QPU_A_NOP &&
-			inst->alu.add.magic_write &&
-			v3d_qpu_magic_waddr_is_sfu(inst->alu.add.waddr)) {
-			return TRUE;
-		}
-
-		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			inst->alu.mul.magic_write &&
-			v3d_qpu_magic_waddr_is_sfu(inst->alu.mul.waddr)) {
-			return TRUE;
-		}
-	}
+// MUST align exactly with waddr_values
+// (kept separate to make names easy to prompt in assembler errors)
+static const char* waddr_names[] = {
+	"r0",
+	"r1",
+	"r2",
+	"r3",
+	"r4",
+	"r5",
+	"-",
+	"tlb",
+	"tlbu",
+	"unifa",
+	"tmul",
+	"tmud",
+	"tmua",
+	"tmuau",
+	"vpm",
+	"vpmu",
+	"sync",
+	"syncu",
+	"syncb",
+	"recip",
+	"rsqrt",
+	"exp",
+	"log",
+	"sin",
+	"rsqrt2",
+	"tmuc",
+	"tmus",
+	"tmut",
+	"tmur",
+	"tmui",
+	"tmub",
+	"tmudref",
+	"tmuoff",
+	"tmuscm",
+	"tmusf",
+	"tmuslod",
+	"tmuhs",
+	"tmuhscm",
+	"tmuhsf",
+	"tmuhslod",
+	"r5rep",
+	/* V3D 4.x UNIFA aliases TMU in V3D 3.x */
+	// devinfo->ver < 40
+	"tmu",
+	/* V3D 7.x QUAD and REP aliases R5 and R5REPT */
+	// devinfo->ver >= 71
+	"quad",
+	// devinfo->ver >= 71
+	"rep",
+};
 
-	return FALSE;
-}
+// MUST align exactly with waddr_names
+static const enum v3d_qpu_waddr waddr_values[] = {
+	V3D_QPU_WADDR_R0,
+	V3D_QPU_WADDR_R1,
+	V3D_QPU_WADDR_R2,
+	V3D_QPU_WADDR_R3,
+	V3D_QPU_WADDR_R4,
+	V3D_QPU_WADDR_R5,
+	V3D_QPU_WADDR_NOP,
+	V3D_QPU_WADDR_TLB,
+	V3D_QPU_WADDR_TLBU,
+	V3D_QPU_WADDR_UNIFA,
+	V3D_QPU_WADDR_TMUL,
+	V3D_QPU_WADDR_TMUD,
+	V3D_QPU_WADDR_TMUA,
+	V3D_QPU_WADDR_TMUAU,
+	V3D_QPU_WADDR_VPM,
+	V3D_QPU_WADDR_VPMU,
+	V3D_QPU_WADDR_SYNC,
+	V3D_QPU_WADDR_SYNCU,
+	V3D_QPU_WADDR_SYNCB,
+	V3D_QPU_WADDR_RECIP,
+	V3D_QPU_WADDR_RSQRT,
+	V3D_QPU_WADDR_EXP,
+	V3D_QPU_WADDR_LOG,
+	V3D_QPU_WADDR_SIN,
+	V3D_QPU_WADDR_RSQRT2,
+	V3D_QPU_WADDR_TMUC,
+	V3D_QPU_WADDR_TMUS,
+	V3D_QPU_WADDR_TMUT,
+	V3D_QPU_WADDR_TMUR,
+	V3D_QPU_WADDR_TMUI,
+	V3D_QPU_WADDR_TMUB,
+	V3D_QPU_WADDR_TMUDREF,
+	V3D_QPU_WADDR_TMUOFF,
+	V3D_QPU_WADDR_TMUSCM,
+	V3D_QPU_WADDR_TMUSF,
+	V3D_QPU_WADDR_TMUSLOD,
+	V3D_QPU_WADDR_TMUHS,
+	V3D_QPU_WADDR_TMUHSCM,
+	V3D_QPU_WADDR_TMUHSF,
+	V3D_QPU_WADDR_TMUHSLOD,
+	V3D_QPU_WADDR_R5REP,
+	V3D_QPU_WADDR_TMU,
+	V3D_QPU_WADDR_QUAD,
+	V3D_QPU_WADDR_REP,
+};
 
-v3d_bool
-v3d_qpu_instr_is_sfu(const struct v3d_qpu_instr *inst)
+v3d_bool v32_qpu_magic_waddr_from_name(const char* name, const char* end,
+									   enum v3d_qpu_waddr* waddrOut,
+									   const char** endOfNameOut)
 {
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		switch (inst->alu.add.op) {
-		case V3D_QPU_A_RECIP:
-		case V3D_QPU_A_RSQRT:
-		case V3D_QPU_A_EXP:
-		case V3D_QPU_A_LOG:
-		case V3D_QPU_A_SIN:
-		case V3D_QPU_A_RSQRT2:
+	for (int index = 0; index < V3D_ARRAY_SIZE(waddr_names); ++index)
+	{
+		if (v3d_symbol_equals(waddr_names[index], name, end, endOfNameOut))
+		{
+			*waddrOut = waddr_values[index];
 			return TRUE;
-		default:
-			return FALSE;
 		}
 	}
 	return FALSE;
 }
 
-v3d_bool
-v3d_qpu_writes_tmu(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_instr *inst)
-{
-	return (inst->type == V3D_QPU_INSTR_TYPE_ALU &&
-			((inst->alu.add.op != V3D_QPU_A_NOP &&
-			  inst->alu.add.magic_write &&
-			  v3d_qpu_magic_waddr_is_tmu(devinfo, inst->alu.add.waddr)) ||
-			 (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			  inst->alu.mul.magic_write &&
-			  v3d_qpu_magic_waddr_is_tmu(devinfo, inst->alu.mul.waddr))));
-}
-
-v3d_bool
-v3d_qpu_writes_tmu_not_tmuc(const struct v3d_device_info *devinfo,
-                            const struct v3d_qpu_instr *inst)
-{
-	return v3d_qpu_writes_tmu(devinfo, inst) &&
-		(!inst->alu.add.magic_write ||
-		 inst->alu.add.waddr != V3D_QPU_WADDR_TMUC) &&
-		(!inst->alu.mul.magic_write ||
-		 inst->alu.mul.waddr != V3D_QPU_WADDR_TMUC);
-}
-
-v3d_bool
-v3d_qpu_reads_vpm(const struct v3d_qpu_instr *inst)
-{
-	if (inst->sig.ldvpm)
-		return TRUE;
-
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (v3d_qpu_add_op_reads_vpm(inst->alu.add.op))
-			return TRUE;
-	}
-
-	return FALSE;
-}
+static const char *add_op_names[] = {
+	[V3D_QPU_A_FADD] = "fadd",
+	[V3D_QPU_A_FADDNF] = "faddnf",
+	[V3D_QPU_A_VFPACK] = "vfpack",
+	[V3D_QPU_A_ADD] = "add",
+	[V3D_QPU_A_SUB] = "sub",
+	[V3D_QPU_A_FSUB] = "fsub",
+	[V3D_QPU_A_MIN] = "min",
+	[V3D_QPU_A_MAX] = "max",
+	[V3D_QPU_A_UMIN] = "umin",
+	[V3D_QPU_A_UMAX] = "umax",
+	[V3D_QPU_A_SHL] = "shl",
+	[V3D_QPU_A_SHR] = "shr",
+	[V3D_QPU_A_ASR] = "asr",
+	[V3D_QPU_A_ROR] = "ror",
+	[V3D_QPU_A_FMIN] = "fmin",
+	[V3D_QPU_A_FMAX] = "fmax",
+	[V3D_QPU_A_VFMIN] = "vfmin",
+	[V3D_QPU_A_AND] = "and",
+	[V3D_QPU_A_OR] = "or",
+	[V3D_QPU_A_XOR] = "xor",
+	[V3D_QPU_A_VADD] = "vadd",
+	[V3D_QPU_A_VSUB] = "vsub",
+	[V3D_QPU_A_NOT] = "not",
+	[V3D_QPU_A_NEG] = "neg",
+	[V3D_QPU_A_FLAPUSH] = "flapush",
+	[V3D_QPU_A_FLBPUSH] = "flbpush",
+	[V3D_QPU_A_FLPOP] = "flpop",
+	[V3D_QPU_A_RECIP] = "recip",
+	[V3D_QPU_A_SETMSF] = "setmsf",
+	[V3D_QPU_A_SETREVF] = "setrevf",
+	[V3D_QPU_A_NOP] = "nop",
+	[V3D_QPU_A_TIDX] = "tidx",
+	[V3D_QPU_A_EIDX] = "eidx",
+	[V3D_QPU_A_LR] = "lr",
+	[V3D_QPU_A_VFLA] = "vfla",
+	[V3D_QPU_A_VFLNA] = "vflna",
+	[V3D_QPU_A_VFLB] = "vflb",
+	[V3D_QPU_A_VFLNB] = "vflnb",
+	[V3D_QPU_A_FXCD] = "fxcd",
+	[V3D_QPU_A_XCD] = "xcd",
+	[V3D_QPU_A_FYCD] = "fycd",
+	[V3D_QPU_A_YCD] = "ycd",
+	[V3D_QPU_A_MSF] = "msf",
+	[V3D_QPU_A_REVF] = "revf",
+	[V3D_QPU_A_VDWWT] = "vdwwt",
+	[V3D_QPU_A_IID] = "iid",
+	[V3D_QPU_A_SAMPID] = "sampid",
+	[V3D_QPU_A_BARRIERID] = "barrierid",
+	[V3D_QPU_A_TMUWT] = "tmuwt",
+	[V3D_QPU_A_VPMSETUP] = "vpmsetup",
+	[V3D_QPU_A_VPMWT] = "vpmwt",
+	[V3D_QPU_A_FLAFIRST] = "flafirst",
+	[V3D_QPU_A_FLNAFIRST] = "flnafirst",
+	[V3D_QPU_A_LDVPMV_IN] = "ldvpmv_in",
+	[V3D_QPU_A_LDVPMV_OUT] = "ldvpmv_out",
+	[V3D_QPU_A_LDVPMD_IN] = "ldvpmd_in",
+	[V3D_QPU_A_LDVPMD_OUT] = "ldvpmd_out",
+	[V3D_QPU_A_LDVPMP] = "ldvpmp",
+	[V3D_QPU_A_RSQRT] = "rsqrt",
+	[V3D_QPU_A_EXP] = "exp",
+	[V3D_QPU_A_LOG] = "log",
+	[V3D_QPU_A_SIN] = "sin",
+	[V3D_QPU_A_RSQRT2] = "rsqrt2",
+	[V3D_QPU_A_LDVPMG_IN] = "ldvpmg_in",
+	[V3D_QPU_A_LDVPMG_OUT] = "ldvpmg_out",
+	[V3D_QPU_A_FCMP] = "fcmp",
+	[V3D_QPU_A_VFMAX] = "vfmax",
+	[V3D_QPU_A_FROUND] = "fround",
+	[V3D_QPU_A_FTOIN] = "ftoin",
+	[V3D_QPU_A_FTRUNC] = "ftrunc",
+	[V3D_QPU_A_FTOIZ] = "ftoiz",
+	[V3D_QPU_A_FFLOOR] = "ffloor",
+	[V3D_QPU_A_FTOUZ] = "ftouz",
+	[V3D_QPU_A_FCEIL] = "fceil",
+	[V3D_QPU_A_FTOC] = "ftoc",
+	[V3D_QPU_A_FDX] = "fdx",
+	[V3D_QPU_A_FDY] = "fdy",
+	[V3D_QPU_A_STVPMV] = "stvpmv",
+	[V3D_QPU_A_STVPMD] = "stvpmd",
+	[V3D_QPU_A_STVPMP] = "stvpmp",
+	[V3D_QPU_A_ITOF] = "itof",
+	[V3D_QPU_A_CLZ] = "clz",
+	[V3D_QPU_A_UTOF] = "utof",
+	[V3D_QPU_A_MOV] = "mov",
+	[V3D_QPU_A_FMOV] = "fmov",
+	[V3D_QPU_A_VPACK] = "vpack",
+	[V3D_QPU_A_V8PACK] = "v8pack",
+	[V3D_QPU_A_V10PACK] = "v10pack",
+	[V3D_QPU_A_V11FPACK] = "v11fpack",
+};
 
-v3d_bool
-v3d_qpu_writes_vpm(const struct v3d_qpu_instr *inst)
+const char *
+v3d_qpu_add_op_name(enum v3d_qpu_add_op op)
 {
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (v3d_qpu_add_op_writes_vpm(inst->alu.add.op))
-			return TRUE;
-
-		if (inst->alu.add.op != V3D_QPU_A_NOP &&
-			inst->alu.add.magic_write &&
-			v3d_qpu_magic_waddr_is_vpm(inst->alu.add.waddr)) {
-			return TRUE;
-		}
-
-		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			inst->alu.mul.magic_write &&
-			v3d_qpu_magic_waddr_is_vpm(inst->alu.mul.waddr)) {
-			return TRUE;
-		}
-	}
+	if (op >= V3D_ARRAY_SIZE(add_op_names))
+		return NULL;
 
-	return FALSE;
+	return add_op_names[op];
 }
 
-v3d_bool
-v3d_qpu_writes_unifa(const struct v3d_device_info *devinfo,
-                     const struct v3d_qpu_instr *inst)
+static const char* mul_op_names[] = {
+    [V3D_QPU_M_ADD] = "add",
+    [V3D_QPU_M_SUB] = "sub",
+    [V3D_QPU_M_UMUL24] = "umul24",
+    [V3D_QPU_M_VFMUL] = "vfmul",
+    [V3D_QPU_M_SMUL24] = "smul24",
+    [V3D_QPU_M_MULTOP] = "multop",
+    [V3D_QPU_M_FMOV] = "fmov",
+    [V3D_QPU_M_MOV] = "mov",
+    [V3D_QPU_M_NOP] = "nop",
+    [V3D_QPU_M_FMUL] = "fmul",
+    [V3D_QPU_M_FTOUNORM16] = "ftounorm16",
+    [V3D_QPU_M_FTOSNORM16] = "ftosnorm16",
+    [V3D_QPU_M_VFTOUNORM8] = "vftounorm8",
+    [V3D_QPU_M_VFTOSNORM8] = "vftosnorm8",
+    [V3D_QPU_M_VFTOUNORM10LO] = "vftounorm10lo",
+    [V3D_QPU_M_VFTOUNORM10HI] = "vftounorm10hi",
+};
+
+const char* v3d_qpu_mul_op_name(enum v3d_qpu_mul_op op)
 {
-	if (devinfo->ver < 40)
-		return FALSE;
+	if (op >= V3D_ARRAY_SIZE(mul_op_names))
+		return NULL;
 
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (inst->alu.add.op != V3D_QPU_A_NOP &&
-			inst->alu.add.magic_write &&
-			inst->alu.add.waddr == V3D_QPU_WADDR_UNIFA) {
-			return TRUE;
-		}
+	return mul_op_names[op];
+}
 
-		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			inst->alu.mul.magic_write &&
-			inst->alu.mul.waddr == V3D_QPU_WADDR_UNIFA) {
-			return TRUE;
-		}
+// Also update cond_pf_uf_names if changing
+static const char* cond_names[] = {
+	[V3D_QPU_COND_NONE] = "",
+	[V3D_QPU_COND_IFA] = ".ifa",
+	[V3D_QPU_COND_IFB] = ".ifb",
+	[V3D_QPU_COND_IFNA] = ".ifna",
+	[V3D_QPU_COND_IFNB] = ".ifnb",
+};
 
-		if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) &&
-			inst->sig_magic &&
-			inst->sig_addr == V3D_QPU_WADDR_UNIFA) {
-			return TRUE;
-		}
-	}
+const char *
+v3d_qpu_cond_name(enum v3d_qpu_cond cond)
+{
+	if (cond >= V3D_ARRAY_SIZE(cond_names))
+		return NULL;
 
-	return FALSE;
+	return cond_names[cond];
 }
 
-v3d_bool
-v3d_qpu_waits_vpm(const struct v3d_qpu_instr *inst)
+const char *
+v3d_qpu_branch_cond_name(enum v3d_qpu_branch_cond cond)
 {
-	return inst->type == V3D_QPU_INSTR_TYPE_ALU &&
-		inst->alu.add.op == V3D_QPU_A_VPMWT;
+	switch (cond) {
+	case V3D_QPU_BRANCH_COND_ALWAYS:
+		return "";
+	case V3D_QPU_BRANCH_COND_A0:
+		return ".a0";
+	case V3D_QPU_BRANCH_COND_NA0:
+		return ".na0";
+	case V3D_QPU_BRANCH_COND_ALLA:
+		return ".alla";
+	case V3D_QPU_BRANCH_COND_ANYNA:
+		return ".anyna";
+	case V3D_QPU_BRANCH_COND_ANYA:
+		return ".anya";
+	case V3D_QPU_BRANCH_COND_ALLNA:
+		return ".allna";
+	default:
+		v3d_unreachable("bad branch cond value");
+	}
+	return "";
 }
 
-v3d_bool
-v3d_qpu_reads_or_writes_vpm(const struct v3d_qpu_instr *inst)
+const char *
+v3d_qpu_msfign_name(enum v3d_qpu_msfign msfign)
 {
-	return v3d_qpu_reads_vpm(inst) || v3d_qpu_writes_vpm(inst);
+	switch (msfign) {
+	case V3D_QPU_MSFIGN_NONE:
+		return "";
+	case V3D_QPU_MSFIGN_P:
+		return "p";
+	case V3D_QPU_MSFIGN_Q:
+		return "q";
+	default:
+		v3d_unreachable("bad branch cond value");
+	}
+	return "";
 }
 
-v3d_bool
-v3d_qpu_uses_vpm(const struct v3d_qpu_instr *inst)
-{
-	return v3d_qpu_reads_vpm(inst) ||
-		v3d_qpu_writes_vpm(inst) ||
-		v3d_qpu_waits_vpm(inst);
-}
+// Also update cond_pf_uf_names if changing
+const char* pf_names[] = {
+	[V3D_QPU_PF_NONE] =  "",
+	[V3D_QPU_PF_PUSHZ] =  ".pushz",
+	[V3D_QPU_PF_PUSHN] =  ".pushn",
+	[V3D_QPU_PF_PUSHC] =  ".pushc",
+};
 
-static v3d_bool
-qpu_writes_magic_waddr_explicitly(const struct v3d_device_info *devinfo,
-                                  const struct v3d_qpu_instr *inst,
-                                  v3d_uint32 waddr)
+const char *
+v3d_qpu_pf_name(enum v3d_qpu_pf pf)
 {
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (inst->alu.add.op != V3D_QPU_A_NOP &&
-			inst->alu.add.magic_write && inst->alu.add.waddr == waddr)
-			return TRUE;
-
-		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			inst->alu.mul.magic_write && inst->alu.mul.waddr == waddr)
-			return TRUE;
-	}
-
-	if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) &&
-		inst->sig_magic && inst->sig_addr == waddr) {
-		return TRUE;
-	}
+	if (pf >= V3D_ARRAY_SIZE(pf_names))
+		return NULL;
 
-	return FALSE;
+	return pf_names[pf];
 }
 
-v3d_bool
-v3d_qpu_writes_r3(const struct v3d_device_info *devinfo,
-                  const struct v3d_qpu_instr *inst)
-{
-	if(!devinfo->has_accumulators)
-		return FALSE;
+// Also update cond_pf_uf_names if changing
+const char* uf_names[] = {
+	[V3D_QPU_UF_NONE] = "",
+	[V3D_QPU_UF_ANDZ] = ".andz",
+	[V3D_QPU_UF_ANDNZ] = ".andnz",
+	[V3D_QPU_UF_NORZ] = ".norz",
+	[V3D_QPU_UF_NORNZ] = ".nornz",
+	[V3D_QPU_UF_ANDN] = ".andn",
+	[V3D_QPU_UF_ANDNN] = ".andnn",
+	[V3D_QPU_UF_NORN] = ".norn",
+	[V3D_QPU_UF_NORNN] = ".nornn",
+	[V3D_QPU_UF_ANDC] = ".andc",
+	[V3D_QPU_UF_ANDNC] = ".andnc",
+	[V3D_QPU_UF_NORC] = ".norc",
+	[V3D_QPU_UF_NORNC] = ".nornc",
+};
 
-	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R3))
-		return TRUE;
+const char *
+v3d_qpu_uf_name(enum v3d_qpu_uf uf)
+{
+	if (uf >= V3D_ARRAY_SIZE(uf_names))
+		return NULL;
 
-	return (devinfo->ver < 41 && inst->sig.ldvary) || inst->sig.ldvpm;
+	return uf_names[uf];
 }
 
-v3d_bool
-v3d_qpu_writes_r4(const struct v3d_device_info *devinfo,
-                  const struct v3d_qpu_instr *inst)
-{
-	if (!devinfo->has_accumulators)
-		return FALSE;
-
-	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (inst->alu.add.op != V3D_QPU_A_NOP &&
-			inst->alu.add.magic_write &&
-			(inst->alu.add.waddr == V3D_QPU_WADDR_R4 ||
-			 v3d_qpu_magic_waddr_is_sfu(inst->alu.add.waddr))) {
-			return TRUE;
-		}
+// Only used for listing all the options
+const char* cond_pf_uf_names[] = {
+    // cond_names
+    ".ifa",
+    ".ifb",
+    ".ifna",
+    ".ifnb",
+    // pf_names
+    ".pushz",
+    ".pushn",
+    ".pushc",
+    // uf_names
+    ".andz",
+    ".andnz",
+    ".norz",
+    ".nornz",
+    ".andn",
+    ".andnn",
+    ".norn",
+    ".nornn",
+    ".andc",
+    ".andnc",
+    ".norc",
+    ".nornc",
+};
 
-		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
-			inst->alu.mul.magic_write &&
-			(inst->alu.mul.waddr == V3D_QPU_WADDR_R4 ||
-			 v3d_qpu_magic_waddr_is_sfu(inst->alu.mul.waddr))) {
-			return TRUE;
-		}
+// Looks through nameList for an exact match to name. Name doesn't need to be null terminated or
+// anything because this will automatically check for symbol dividers. If dotOptional, nothing
+// specified will be considered a valid entry and its index will be 0. The nameList should therefore
+// have its first index be an empty string with NONE associated value.
+// Returns whether the value is in the list (TRUE if unspecified and dotOptional).
+v3d_bool v3d_qpu_value_from_name_list(const char* name, const char* end, const char** nameList,
+                                      int nameListLength, v3d_bool dotOptional,
+                                      v3d_uint32* matchingIndexOut, const char** endOfNameOut)
+{
+	if (dotOptional && v3d_peek(name, end, 0) != '.')
+	{
+		*matchingIndexOut = 0;
+		if (endOfNameOut)
+			*endOfNameOut = name;
+		return TRUE;
 	}
 
-	if (v3d_qpu_sig_writes_address(devinfo, &inst->sig)) {
-		if (inst->sig_magic && inst->sig_addr == V3D_QPU_WADDR_R4)
+	// Skip over empty string for dot-optional lists
+	for (int index = dotOptional ? 1 : 0; index < nameListLength; ++index)
+	{
+		if (v3d_symbol_equals(nameList[index], name, end, endOfNameOut))
+		{
+			*matchingIndexOut = index;
 			return TRUE;
-	} else if (inst->sig.ldtmu) {
-		return TRUE;
+		}
 	}
-
 	return FALSE;
 }
 
-v3d_bool
-v3d_qpu_writes_r5(const struct v3d_device_info *devinfo,
-                  const struct v3d_qpu_instr *inst)
-{
-	if (!devinfo->has_accumulators)
-		return FALSE;
-
-	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R5))
-		return TRUE;
-
-	return inst->sig.ldvary || inst->sig.ldunif || inst->sig.ldunifa;
-}
+static const char* pack_names[] = {
+    [V3D_QPU_PACK_NONE] = "",
+    [V3D_QPU_PACK_L] = ".l",
+    [V3D_QPU_PACK_H] = ".h",
+};
 
-v3d_bool
-v3d_qpu_writes_accum(const struct v3d_device_info *devinfo,
-                     const struct v3d_qpu_instr *inst)
+const char*	v3d_qpu_pack_name(enum v3d_qpu_output_pack pack)
 {
-	if (!devinfo->has_accumulators)
-		return FALSE;
-
-	if (v3d_qpu_writes_r5(devinfo, inst))
-		return TRUE;
-	if (v3d_qpu_writes_r4(devinfo, inst))
-		return TRUE;
-	if (v3d_qpu_writes_r3(devinfo, inst))
-		return TRUE;
-	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R2))
-		return TRUE;
-	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R1))
-		return TRUE;
-	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R0))
-		return TRUE;
+	if (pack >= V3D_ARRAY_SIZE(pack_names))
+		return NULL;
 
-	return FALSE;
+	return pack_names[pack];
 }
 
-v3d_bool
-v3d_qpu_writes_rf0_implicitly(const struct v3d_device_info *devinfo,
-                              const struct v3d_qpu_instr *inst)
-{
-	if (devinfo->ver >= 71 &&
-		(inst->sig.ldvary || inst->sig.ldunif || inst->sig.ldunifa)) {
-		return TRUE;
-	}
-
-	return FALSE;
-}
+static const char* unpack_names[] = {
+    [V3D_QPU_UNPACK_NONE] = "",
+    [V3D_QPU_UNPACK_L] = ".l",
+    [V3D_QPU_UNPACK_H] = ".h",
+    [V3D_QPU_UNPACK_ABS] = ".abs",
+    [V3D_QPU_UNPACK_REPLICATE_32F_16] = ".ff",
+    [V3D_QPU_UNPACK_REPLICATE_L_16] = ".ll",
+    [V3D_QPU_UNPACK_REPLICATE_H_16] = ".hh",
+    [V3D_QPU_UNPACK_SWAP_16] = ".swp",
+};
 
-v3d_bool
-v3d_qpu_uses_mux(const struct v3d_qpu_instr *inst, enum v3d_qpu_mux mux)
+const char*	v3d_qpu_unpack_name(enum v3d_qpu_input_unpack unpack)
 {
-	int add_nsrc = v3d_qpu_add_op_num_src(inst->alu.add.op);
-	int mul_nsrc = v3d_qpu_mul_op_num_src(inst->alu.mul.op);
+	if (unpack >= V3D_ARRAY_SIZE(unpack_names))
+		return NULL;
 
-	return ((add_nsrc > 0 && inst->alu.add.a.mux == mux) ||
-			(add_nsrc > 1 && inst->alu.add.b.mux == mux) ||
-			(mul_nsrc > 0 && inst->alu.mul.a.mux == mux) ||
-			(mul_nsrc > 1 && inst->alu.mul.b.mux == mux));
+	return unpack_names[unpack];
 }
 
-v3d_bool
-v3d71_qpu_reads_raddr(const struct v3d_qpu_instr *inst, v3d_uint8 raddr)
-{
-	int add_nsrc = v3d_qpu_add_op_num_src(inst->alu.add.op);
-	int mul_nsrc = v3d_qpu_mul_op_num_src(inst->alu.mul.op);
+#define D   1 // Destination
+#define A   2 // Argument A
+#define B   4 // Argument B
+static const v3d_uint8 add_op_args[] = {
+	[V3D_QPU_A_FADD] = D | A | B,
+	[V3D_QPU_A_FADDNF] = D | A | B,
+	[V3D_QPU_A_VFPACK] = D | A | B,
+	[V3D_QPU_A_ADD] = D | A | B,
+	[V3D_QPU_A_VFPACK] = D | A | B,
+	[V3D_QPU_A_SUB] = D | A | B,
+	[V3D_QPU_A_VFPACK] = D | A | B,
+	[V3D_QPU_A_FSUB] = D | A | B,
+	[V3D_QPU_A_MIN] = D | A | B,
+	[V3D_QPU_A_MAX] = D | A | B,
+	[V3D_QPU_A_UMIN] = D | A | B,
+	[V3D_QPU_A_UMAX] = D | A | B,
+	[V3D_QPU_A_SHL] = D | A | B,
+	[V3D_QPU_A_SHR] = D | A | B,
+	[V3D_QPU_A_ASR] = D | A | B,
+	[V3D_QPU_A_ROR] = D | A | B,
+	[V3D_QPU_A_FMIN] = D | A | B,
+	[V3D_QPU_A_FMAX] = D | A | B,
+	[V3D_QPU_A_VFMIN] = D | A | B,
 
-	return (add_nsrc > 0 && !inst->sig.small_imm_a && inst->alu.add.a.raddr == raddr) ||
-		(add_nsrc > 1 && !inst->sig.small_imm_b && inst->alu.add.b.raddr == raddr) ||
-		(mul_nsrc > 0 && !inst->sig.small_imm_c && inst->alu.mul.a.raddr == raddr) ||
-		(mul_nsrc > 1 && !inst->sig.small_imm_d && inst->alu.mul.b.raddr == raddr);
-}
+	[V3D_QPU_A_AND] = D | A | B,
+	[V3D_QPU_A_OR] = D | A | B,
+	[V3D_QPU_A_XOR] = D | A | B,
 
-v3d_bool
-v3d71_qpu_writes_waddr_explicitly(const struct v3d_device_info *devinfo,
-                                  const struct v3d_qpu_instr *inst,
-                                  v3d_uint8 waddr)
-{
-	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
-		return FALSE;
+	[V3D_QPU_A_VADD] = D | A | B,
+	[V3D_QPU_A_VSUB] = D | A | B,
+	[V3D_QPU_A_NOT] = D | A,
+	[V3D_QPU_A_NEG] = D | A,
+	[V3D_QPU_A_FLAPUSH] = D | A,
+	[V3D_QPU_A_FLBPUSH] = D | A,
+	[V3D_QPU_A_FLPOP] = D | A,
+	[V3D_QPU_A_RECIP] = D | A,
+	[V3D_QPU_A_SETMSF] = D | A,
+	[V3D_QPU_A_SETREVF] = D | A,
+	[V3D_QPU_A_NOP] = 0,
+	[V3D_QPU_A_TIDX] = D,
+	[V3D_QPU_A_EIDX] = D,
+	[V3D_QPU_A_LR] = D,
+	[V3D_QPU_A_VFLA] = D,
+	[V3D_QPU_A_VFLNA] = D,
+	[V3D_QPU_A_VFLB] = D,
+	[V3D_QPU_A_VFLNB] = D,
 
-	if (v3d_qpu_add_op_has_dst(inst->alu.add.op) &&
-		!inst->alu.add.magic_write &&
-		inst->alu.add.waddr == waddr) {
-		return TRUE;
-	}
+	[V3D_QPU_A_FXCD] = D,
+	[V3D_QPU_A_XCD] = D,
+	[V3D_QPU_A_FYCD] = D,
+	[V3D_QPU_A_YCD] = D,
 
-	if (v3d_qpu_mul_op_has_dst(inst->alu.mul.op) &&
-		!inst->alu.mul.magic_write &&
-		inst->alu.mul.waddr == waddr) {
-		return TRUE;
-	}
+	[V3D_QPU_A_MSF] = D,
+	[V3D_QPU_A_REVF] = D,
+	[V3D_QPU_A_VDWWT] = D,
+	[V3D_QPU_A_IID] = D,
+	[V3D_QPU_A_SAMPID] = D,
+	[V3D_QPU_A_BARRIERID] = D,
+	[V3D_QPU_A_TMUWT] = D,
+	[V3D_QPU_A_VPMWT] = D,
+	[V3D_QPU_A_FLAFIRST] = D,
+	[V3D_QPU_A_FLNAFIRST] = D,
 
-	if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) &&
-		!inst->sig_magic && inst->sig_addr == waddr) {
-		return TRUE;
-	}
+	[V3D_QPU_A_VPMSETUP] = D | A,
 
-	return FALSE;
-}
+	[V3D_QPU_A_LDVPMV_IN] = D | A,
+	[V3D_QPU_A_LDVPMV_OUT] = D | A,
+	[V3D_QPU_A_LDVPMD_IN] = D | A,
+	[V3D_QPU_A_LDVPMD_OUT] = D | A,
+	[V3D_QPU_A_LDVPMP] = D | A,
+	[V3D_QPU_A_RSQRT] = D | A,
+	[V3D_QPU_A_EXP] = D | A,
+	[V3D_QPU_A_LOG] = D | A,
+	[V3D_QPU_A_SIN] = D | A,
+	[V3D_QPU_A_RSQRT2] = D | A,
+	[V3D_QPU_A_LDVPMG_IN] = D | A | B,
+	[V3D_QPU_A_LDVPMG_OUT] = D | A | B,
+
+	/* FIXME: MOVABSNEG */
+
+	[V3D_QPU_A_FCMP] = D | A | B,
+	[V3D_QPU_A_VFMAX] = D | A | B,
+
+	[V3D_QPU_A_FROUND] = D | A,
+	[V3D_QPU_A_FTOIN] = D | A,
+	[V3D_QPU_A_FTRUNC] = D | A,
+	[V3D_QPU_A_FTOIZ] = D | A,
+	[V3D_QPU_A_FFLOOR] = D | A,
+	[V3D_QPU_A_FTOUZ] = D | A,
+	[V3D_QPU_A_FCEIL] = D | A,
+	[V3D_QPU_A_FTOC] = D | A,
+
+	[V3D_QPU_A_FDX] = D | A,
+	[V3D_QPU_A_FDY] = D | A,
+
+	[V3D_QPU_A_STVPMV] = A | B,
+	[V3D_QPU_A_STVPMD] = A | B,
+	[V3D_QPU_A_STVPMP] = A | B,
+
+	[V3D_QPU_A_ITOF] = D | A,
+	[V3D_QPU_A_CLZ] = D | A,
+	[V3D_QPU_A_UTOF] = D | A,
+
+	[V3D_QPU_A_MOV] = D | A,
+	[V3D_QPU_A_FMOV] = D | A,
+	[V3D_QPU_A_VPACK] = D | A | B,
+	[V3D_QPU_A_V8PACK] = D | A | B,
+	[V3D_QPU_A_V10PACK] = D | A | B,
+	[V3D_QPU_A_V11FPACK] = D | A | B,
+};
+
+static const v3d_uint8 mul_op_args[] = {
+	[V3D_QPU_M_ADD] = D | A | B,
+	[V3D_QPU_M_SUB] = D | A | B,
+	[V3D_QPU_M_UMUL24] = D | A | B,
+	[V3D_QPU_M_VFMUL] = D | A | B,
+	[V3D_QPU_M_SMUL24] = D | A | B,
+	[V3D_QPU_M_MULTOP] = D | A | B,
+	[V3D_QPU_M_FMOV] = D | A,
+	[V3D_QPU_M_NOP] = 0,
+	[V3D_QPU_M_MOV] = D | A,
+	[V3D_QPU_M_FMUL] = D | A | B,
+	[V3D_QPU_M_FTOUNORM16] = D | A,
+	[V3D_QPU_M_FTOSNORM16] = D | A,
+	[V3D_QPU_M_VFTOUNORM8] = D | A,
+	[V3D_QPU_M_VFTOSNORM8] = D | A,
+	[V3D_QPU_M_VFTOUNORM10LO] = D | A,
+	[V3D_QPU_M_VFTOUNORM10HI] = D | A,
+};
 
 v3d_bool
-v3d_qpu_sig_writes_address(const struct v3d_device_info *devinfo,
-                           const struct v3d_qpu_sig *sig)
+v3d_qpu_add_op_has_dst(enum v3d_qpu_add_op op)
 {
-	if (devinfo->ver < 41)
-		return FALSE;
+	v3d_assert(op < V3D_ARRAY_SIZE(add_op_args));
 
-	return (sig->ldunifrf ||
-			sig->ldunifarf ||
-			sig->ldvary ||
-			sig->ldtmu ||
-			sig->ldtlb ||
-			sig->ldtlbu);
+	return add_op_args[op] & D;
 }
 
 v3d_bool
-v3d_qpu_reads_flags(const struct v3d_qpu_instr *inst)
+v3d_qpu_mul_op_has_dst(enum v3d_qpu_mul_op op)
 {
-	if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH) {
-		return inst->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS;
-	} else if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (inst->flags.ac != V3D_QPU_COND_NONE ||
-			inst->flags.mc != V3D_QPU_COND_NONE ||
-			inst->flags.auf != V3D_QPU_UF_NONE ||
-			inst->flags.muf != V3D_QPU_UF_NONE)
-			return TRUE;
-
-		switch (inst->alu.add.op) {
-		case V3D_QPU_A_VFLA:
-		case V3D_QPU_A_VFLNA:
-		case V3D_QPU_A_VFLB:
-		case V3D_QPU_A_VFLNB:
-		case V3D_QPU_A_FLAPUSH:
-		case V3D_QPU_A_FLBPUSH:
-		case V3D_QPU_A_FLAFIRST:
-		case V3D_QPU_A_FLNAFIRST:
-			return TRUE;
-		default:
-			break;
-		}
-	}
+	v3d_assert(op < V3D_ARRAY_SIZE(mul_op_args));
 
-	return FALSE;
+	return mul_op_args[op] & D;
 }
 
-v3d_bool
-v3d_qpu_writes_flags(const struct v3d_qpu_instr *inst)
+int
+v3d_qpu_add_op_num_src(enum v3d_qpu_add_op op)
 {
-	if (inst->flags.apf != V3D_QPU_PF_NONE ||
-		inst->flags.mpf != V3D_QPU_PF_NONE ||
-		inst->flags.auf != V3D_QPU_UF_NONE ||
-		inst->flags.muf != V3D_QPU_UF_NONE) {
-		return TRUE;
-	}
+	v3d_assert(op < V3D_ARRAY_SIZE(add_op_args));
 
-	return FALSE;
+	v3d_uint8 args = add_op_args[op];
+	if (args & B)
+		return 2;
+	else if (args & A)
+		return 1;
+	else
+		return 0;
 }
 
-v3d_bool
-v3d_qpu_unpacks_f32(const struct v3d_qpu_instr *inst)
+int
+v3d_qpu_mul_op_num_src(enum v3d_qpu_mul_op op)
 {
-	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
-		return FALSE;
+	v3d_assert(op < V3D_ARRAY_SIZE(mul_op_args));
 
-	switch (inst->alu.add.op) {
-	case V3D_QPU_A_FADD:
-	case V3D_QPU_A_FADDNF:
-	case V3D_QPU_A_FSUB:
-	case V3D_QPU_A_FMIN:
-	case V3D_QPU_A_FMAX:
-	case V3D_QPU_A_FCMP:
-	case V3D_QPU_A_FROUND:
-	case V3D_QPU_A_FTRUNC:
-	case V3D_QPU_A_FFLOOR:
-	case V3D_QPU_A_FCEIL:
-	case V3D_QPU_A_FDX:
-	case V3D_QPU_A_FDY:
-	case V3D_QPU_A_FTOIN:
-	case V3D_QPU_A_FTOIZ:
-	case V3D_QPU_A_FTOUZ:
-	case V3D_QPU_A_FTOC:
-	case V3D_QPU_A_VFPACK:
-		return TRUE;
-		break;
-	default:
-		break;
-	}
+	v3d_uint8 args = mul_op_args[op];
+	if (args & B)
+		return 2;
+	else if (args & A)
+		return 1;
+	else
+		return 0;
+}
 
-	switch (inst->alu.mul.op) {
-	case V3D_QPU_M_FMOV:
-	case V3D_QPU_M_FMUL:
-		return TRUE;
-		break;
+enum v3d_qpu_cond
+v3d_qpu_cond_invert(enum v3d_qpu_cond cond)
+{
+	switch (cond) {
+	case V3D_QPU_COND_IFA:
+		return V3D_QPU_COND_IFNA;
+	case V3D_QPU_COND_IFNA:
+		return V3D_QPU_COND_IFA;
+	case V3D_QPU_COND_IFB:
+		return V3D_QPU_COND_IFNB;
+	case V3D_QPU_COND_IFNB:
+		return V3D_QPU_COND_IFB;
 	default:
-		break;
+		v3d_unreachable("Non-invertible cond");
 	}
-
-	return FALSE;
+	return V3D_QPU_COND_IFNA;
 }
+
 v3d_bool
-v3d_qpu_unpacks_f16(const struct v3d_qpu_instr *inst)
+v3d_qpu_magic_waddr_is_sfu(enum v3d_qpu_waddr waddr)
 {
-	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
-		return FALSE;
-
-	switch (inst->alu.add.op) {
-	case V3D_QPU_A_VFMIN:
-	case V3D_QPU_A_VFMAX:
+	switch (waddr) {
+	case V3D_QPU_WADDR_RECIP:
+	case V3D_QPU_WADDR_RSQRT:
+	case V3D_QPU_WADDR_EXP:
+	case V3D_QPU_WADDR_LOG:
+	case V3D_QPU_WADDR_SIN:
+	case V3D_QPU_WADDR_RSQRT2:
 		return TRUE;
-		break;
 	default:
-		break;
+		return FALSE;
 	}
+}
 
-	switch (inst->alu.mul.op) {
-	case V3D_QPU_M_VFMUL:
-		return TRUE;
-		break;
-	default:
-		break;
+v3d_bool
+v3d_qpu_magic_waddr_is_tmu(const struct v3d_device_info *devinfo,
+                           enum v3d_qpu_waddr waddr)
+{
+	if (devinfo->ver >= 40) {
+		return ((waddr >= V3D_QPU_WADDR_TMUD &&
+				 waddr <= V3D_QPU_WADDR_TMUAU) ||
+				(waddr >= V3D_QPU_WADDR_TMUC &&
+				 waddr <= V3D_QPU_WADDR_TMUHSLOD));
+	} else {
+		return ((waddr >= V3D_QPU_WADDR_TMU &&
+				 waddr <= V3D_QPU_WADDR_TMUAU) ||
+				(waddr >= V3D_QPU_WADDR_TMUC &&
+				 waddr <= V3D_QPU_WADDR_TMUHSLOD));
 	}
-
-	return FALSE;
 }
 
 v3d_bool
-v3d_qpu_is_nop(struct v3d_qpu_instr *inst)
+v3d_qpu_waits_on_tmu(const struct v3d_qpu_instr *inst)
 {
-	static const struct v3d_qpu_sig nosig = { 0 };
-
-	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
-		return FALSE;
-	if (inst->alu.add.op != V3D_QPU_A_NOP)
-		return FALSE;
-	if (inst->alu.mul.op != V3D_QPU_M_NOP)
-		return FALSE;
-	if (v3d_memcmp(&inst->sig, &nosig, sizeof(nosig)))
-		return FALSE;
-	return TRUE;
+	return (inst->sig.ldtmu ||
+			(inst->type == V3D_QPU_INSTR_TYPE_ALU &&
+			 inst->alu.add.op == V3D_QPU_A_TMUWT));
 }
 
-// >>> qpu_pack.c
+v3d_bool
+v3d_qpu_magic_waddr_is_tlb(enum v3d_qpu_waddr waddr)
+{
+	return (waddr == V3D_QPU_WADDR_TLB ||
+			waddr == V3D_QPU_WADDR_TLBU);
+}
 
-#ifndef QPU_MASK
-#define QPU_MASK(high, low)										\
-	((((v3d_uint64)1ULL << ((high) - (low) + 1)) - 1) << (low))
-/* Using the GNU statement expression extension */
-#define QPU_SET_FIELD(value, field)										\
-	({																	\
-		v3d_uint64 fieldval = (v3d_uint64)(value) << field ## _SHIFT;	\
-		v3d_assert((fieldval & ~ field ## _MASK) == 0);					\
-		fieldval & field ## _MASK;										\
-	})
+v3d_bool
+v3d_qpu_magic_waddr_is_vpm(enum v3d_qpu_waddr waddr)
+{
+	return (waddr == V3D_QPU_WADDR_VPM ||
+			waddr == V3D_QPU_WADDR_VPMU);
+}
 
-#define QPU_GET_FIELD(word, field) ((v3d_uint32)(((word)  & field ## _MASK) >> field ## _SHIFT))
+v3d_bool
+v3d_qpu_magic_waddr_is_tsy(enum v3d_qpu_waddr waddr)
+{
+	return (waddr == V3D_QPU_WADDR_SYNC ||
+			waddr == V3D_QPU_WADDR_SYNCB ||
+			waddr == V3D_QPU_WADDR_SYNCU);
+}
 
-#define QPU_UPDATE_FIELD(inst, value, field)						\
-	(((inst) & ~(field ## _MASK)) | QPU_SET_FIELD(value, field))
-#endif /* QPU_MASK */
+v3d_bool
+v3d_qpu_magic_waddr_loads_unif(enum v3d_qpu_waddr waddr)
+{
+	switch (waddr) {
+	case V3D_QPU_WADDR_VPMU:
+	case V3D_QPU_WADDR_TLBU:
+	case V3D_QPU_WADDR_TMUAU:
+	case V3D_QPU_WADDR_SYNCU:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
 
-#define V3D_QPU_OP_MUL_SHIFT                58
-#define V3D_QPU_OP_MUL_MASK                 QPU_MASK(63, 58)
+static v3d_bool
+v3d_qpu_add_op_reads_vpm(enum  v3d_qpu_add_op op)
+{
+	switch (op) {
+	case V3D_QPU_A_VPMSETUP:
+	case V3D_QPU_A_LDVPMV_IN:
+	case V3D_QPU_A_LDVPMV_OUT:
+	case V3D_QPU_A_LDVPMD_IN:
+	case V3D_QPU_A_LDVPMD_OUT:
+	case V3D_QPU_A_LDVPMP:
+	case V3D_QPU_A_LDVPMG_IN:
+	case V3D_QPU_A_LDVPMG_OUT:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
 
-#define V3D_QPU_SIG_SHIFT                   53
-#define V3D_QPU_SIG_MASK                    QPU_MASK(57, 53)
+static v3d_bool
+v3d_qpu_add_op_writes_vpm(enum  v3d_qpu_add_op op)
+{
+	switch (op) {
+	case V3D_QPU_A_VPMSETUP:
+	case V3D_QPU_A_STVPMV:
+	case V3D_QPU_A_STVPMD:
+	case V3D_QPU_A_STVPMP:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
 
-#define V3D_QPU_COND_SHIFT                  46
-#define V3D_QPU_COND_MASK                   QPU_MASK(52, 46)
-#define V3D_QPU_COND_SIG_MAGIC_ADDR         (1 << 6)
+v3d_bool
+v3d_qpu_reads_tlb(const struct v3d_qpu_instr *inst)
+{
+	return inst->sig.ldtlb || inst->sig.ldtlbu;
+}
 
-#define V3D_QPU_MM                          QPU_MASK(45, 45)
-#define V3D_QPU_MA                          QPU_MASK(44, 44)
+v3d_bool
+v3d_qpu_writes_tlb(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (inst->alu.add.op != V3D_QPU_A_NOP &&
+			inst->alu.add.magic_write &&
+			v3d_qpu_magic_waddr_is_tlb(inst->alu.add.waddr)) {
+			return TRUE;
+		}
 
-#define V3D_QPU_WADDR_M_SHIFT               38
-#define V3D_QPU_WADDR_M_MASK                QPU_MASK(43, 38)
+		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			inst->alu.mul.magic_write &&
+			v3d_qpu_magic_waddr_is_tlb(inst->alu.mul.waddr)) {
+			return TRUE;
+		}
+	}
 
-#define V3D_QPU_BRANCH_ADDR_LOW_SHIFT       35
-#define V3D_QPU_BRANCH_ADDR_LOW_MASK        QPU_MASK(55, 35)
+	return FALSE;
+}
 
-#define V3D_QPU_WADDR_A_SHIFT               32
-#define V3D_QPU_WADDR_A_MASK                QPU_MASK(37, 32)
+v3d_bool
+v3d_qpu_uses_tlb(const struct v3d_qpu_instr *inst)
+{
+	return  v3d_qpu_writes_tlb(inst) || v3d_qpu_reads_tlb(inst);
+}
 
-#define V3D_QPU_BRANCH_COND_SHIFT           32
-#define V3D_QPU_BRANCH_COND_MASK            QPU_MASK(34, 32)
+v3d_bool
+v3d_qpu_uses_sfu(const struct v3d_qpu_instr *inst)
+{
+	return v3d_qpu_instr_is_sfu(inst) || v3d_qpu_instr_is_legacy_sfu(inst);
+}
 
-#define V3D_QPU_BRANCH_ADDR_HIGH_SHIFT      24
-#define V3D_QPU_BRANCH_ADDR_HIGH_MASK       QPU_MASK(31, 24)
+/* Checks whether the instruction implements a SFU operation by the writing
+ * to specific magic register addresses instead of using SFU ALU opcodes.
+ */
+v3d_bool
+v3d_qpu_instr_is_legacy_sfu(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (inst->alu.add.op != V3D_QPU_A_NOP &&
+			inst->alu.add.magic_write &&
+			v3d_qpu_magic_waddr_is_sfu(inst->alu.add.waddr)) {
+			return TRUE;
+		}
 
-#define V3D_QPU_OP_ADD_SHIFT                24
-#define V3D_QPU_OP_ADD_MASK                 QPU_MASK(31, 24)
+		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			inst->alu.mul.magic_write &&
+			v3d_qpu_magic_waddr_is_sfu(inst->alu.mul.waddr)) {
+			return TRUE;
+		}
+	}
 
-#define V3D_QPU_MUL_B_SHIFT                 21
-#define V3D_QPU_MUL_B_MASK                  QPU_MASK(23, 21)
+	return FALSE;
+}
 
-#define V3D_QPU_BRANCH_MSFIGN_SHIFT         21
-#define V3D_QPU_BRANCH_MSFIGN_MASK          QPU_MASK(22, 21)
+v3d_bool
+v3d_qpu_instr_is_sfu(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		switch (inst->alu.add.op) {
+		case V3D_QPU_A_RECIP:
+		case V3D_QPU_A_RSQRT:
+		case V3D_QPU_A_EXP:
+		case V3D_QPU_A_LOG:
+		case V3D_QPU_A_SIN:
+		case V3D_QPU_A_RSQRT2:
+			return TRUE;
+		default:
+			return FALSE;
+		}
+	}
+	return FALSE;
+}
 
-#define V3D_QPU_MUL_A_SHIFT                 18
-#define V3D_QPU_MUL_A_MASK                  QPU_MASK(20, 18)
+v3d_bool
+v3d_qpu_writes_tmu(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_instr *inst)
+{
+	return (inst->type == V3D_QPU_INSTR_TYPE_ALU &&
+			((inst->alu.add.op != V3D_QPU_A_NOP &&
+			  inst->alu.add.magic_write &&
+			  v3d_qpu_magic_waddr_is_tmu(devinfo, inst->alu.add.waddr)) ||
+			 (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			  inst->alu.mul.magic_write &&
+			  v3d_qpu_magic_waddr_is_tmu(devinfo, inst->alu.mul.waddr))));
+}
 
-#define V3D_QPU_RADDR_C_SHIFT               18
-#define V3D_QPU_RADDR_C_MASK                QPU_MASK(23, 18)
+v3d_bool
+v3d_qpu_writes_tmu_not_tmuc(const struct v3d_device_info *devinfo,
+                            const struct v3d_qpu_instr *inst)
+{
+	return v3d_qpu_writes_tmu(devinfo, inst) &&
+		(!inst->alu.add.magic_write ||
+		 inst->alu.add.waddr != V3D_QPU_WADDR_TMUC) &&
+		(!inst->alu.mul.magic_write ||
+		 inst->alu.mul.waddr != V3D_QPU_WADDR_TMUC);
+}
 
-#define V3D_QPU_ADD_B_SHIFT                 15
-#define V3D_QPU_ADD_B_MASK                  QPU_MASK(17, 15)
+v3d_bool
+v3d_qpu_reads_vpm(const struct v3d_qpu_instr *inst)
+{
+	if (inst->sig.ldvpm)
+		return TRUE;
 
-#define V3D_QPU_BRANCH_BDU_SHIFT            15
-#define V3D_QPU_BRANCH_BDU_MASK             QPU_MASK(17, 15)
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (v3d_qpu_add_op_reads_vpm(inst->alu.add.op))
+			return TRUE;
+	}
 
-#define V3D_QPU_BRANCH_UB                   QPU_MASK(14, 14)
+	return FALSE;
+}
 
-#define V3D_QPU_ADD_A_SHIFT                 12
-#define V3D_QPU_ADD_A_MASK                  QPU_MASK(14, 12)
+v3d_bool
+v3d_qpu_writes_vpm(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (v3d_qpu_add_op_writes_vpm(inst->alu.add.op))
+			return TRUE;
 
-#define V3D_QPU_BRANCH_BDI_SHIFT            12
-#define V3D_QPU_BRANCH_BDI_MASK             QPU_MASK(13, 12)
+		if (inst->alu.add.op != V3D_QPU_A_NOP &&
+			inst->alu.add.magic_write &&
+			v3d_qpu_magic_waddr_is_vpm(inst->alu.add.waddr)) {
+			return TRUE;
+		}
 
-#define V3D_QPU_RADDR_D_SHIFT               12
-#define V3D_QPU_RADDR_D_MASK                QPU_MASK(17, 12)
+		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			inst->alu.mul.magic_write &&
+			v3d_qpu_magic_waddr_is_vpm(inst->alu.mul.waddr)) {
+			return TRUE;
+		}
+	}
 
-#define V3D_QPU_RADDR_A_SHIFT               6
-#define V3D_QPU_RADDR_A_MASK                QPU_MASK(11, 6)
+	return FALSE;
+}
 
-#define V3D_QPU_RADDR_B_SHIFT               0
-#define V3D_QPU_RADDR_B_MASK                QPU_MASK(5, 0)
+v3d_bool
+v3d_qpu_writes_unifa(const struct v3d_device_info *devinfo,
+                     const struct v3d_qpu_instr *inst)
+{
+	if (devinfo->ver < 40)
+		return FALSE;
 
-#define THRSW .thrsw = TRUE
-#define LDUNIF .ldunif = TRUE
-#define LDUNIFRF .ldunifrf = TRUE
-#define LDUNIFA .ldunifa = TRUE
-#define LDUNIFARF .ldunifarf = TRUE
-#define LDTMU .ldtmu = TRUE
-#define LDVARY .ldvary = TRUE
-#define LDVPM .ldvpm = TRUE
-#define LDTLB .ldtlb = TRUE
-#define LDTLBU .ldtlbu = TRUE
-#define UCB .ucb = TRUE
-#define ROT .rotate = TRUE
-#define WRTMUC .wrtmuc = TRUE
-#define SMIMM_A .small_imm_a = TRUE
-#define SMIMM_B .small_imm_b = TRUE
-#define SMIMM_C .small_imm_c = TRUE
-#define SMIMM_D .small_imm_d = TRUE
-
-static const struct v3d_qpu_sig v33_sig_map[] = {
-	/*      MISC   R3       R4      R5 */
-	[0]  = {                               },
-	[1]  = { THRSW,                        },
-	[2]  = {                        LDUNIF },
-	[3]  = { THRSW,                 LDUNIF },
-	[4]  = {                LDTMU,         },
-	[5]  = { THRSW,         LDTMU,         },
-	[6]  = {                LDTMU,  LDUNIF },
-	[7]  = { THRSW,         LDTMU,  LDUNIF },
-	[8]  = {        LDVARY,                },
-	[9]  = { THRSW, LDVARY,                },
-	[10] = {        LDVARY,         LDUNIF },
-	[11] = { THRSW, LDVARY,         LDUNIF },
-	[12] = {        LDVARY, LDTMU,         },
-	[13] = { THRSW, LDVARY, LDTMU,         },
-	[14] = { SMIMM_B, LDVARY,              },
-	[15] = { SMIMM_B,                      },
-	[16] = {        LDTLB,                 },
-	[17] = {        LDTLBU,                },
-	/* 18-21 reserved */
-	[22] = { UCB,                          },
-	[23] = { ROT,                          },
-	[24] = {        LDVPM,                 },
-	[25] = { THRSW, LDVPM,                 },
-	[26] = {        LDVPM,          LDUNIF },
-	[27] = { THRSW, LDVPM,          LDUNIF },
-	[28] = {        LDVPM, LDTMU,          },
-	[29] = { THRSW, LDVPM, LDTMU,          },
-	[30] = { SMIMM_B, LDVPM,               },
-	[31] = { SMIMM_B,                      },
-};
-
-static const struct v3d_qpu_sig v40_sig_map[] = {
-	/*      MISC    R3      R4      R5 */
-	[0]  = {                               },
-	[1]  = { THRSW,                        },
-	[2]  = {                        LDUNIF },
-	[3]  = { THRSW,                 LDUNIF },
-	[4]  = {                LDTMU,         },
-	[5]  = { THRSW,         LDTMU,         },
-	[6]  = {                LDTMU,  LDUNIF },
-	[7]  = { THRSW,         LDTMU,  LDUNIF },
-	[8]  = {        LDVARY,                },
-	[9]  = { THRSW, LDVARY,                },
-	[10] = {        LDVARY,         LDUNIF },
-	[11] = { THRSW, LDVARY,         LDUNIF },
-	/* 12-13 reserved */
-	[14] = { SMIMM_B, LDVARY,              },
-	[15] = { SMIMM_B,                      },
-	[16] = {        LDTLB,                 },
-	[17] = {        LDTLBU,                },
-	[18] = {                        WRTMUC },
-	[19] = { THRSW,                 WRTMUC },
-	[20] = {        LDVARY,         WRTMUC },
-	[21] = { THRSW, LDVARY,         WRTMUC },
-	[22] = { UCB,                          },
-	[23] = { ROT,                          },
-	/* 24-30 reserved */
-	[31] = { SMIMM_B,       LDTMU,         },
-};
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (inst->alu.add.op != V3D_QPU_A_NOP &&
+			inst->alu.add.magic_write &&
+			inst->alu.add.waddr == V3D_QPU_WADDR_UNIFA) {
+			return TRUE;
+		}
 
-static const struct v3d_qpu_sig v41_sig_map[] = {
-	/*      MISC       phys    R5 */
-	[0]  = {                          },
-	[1]  = { THRSW,                   },
-	[2]  = {                   LDUNIF },
-	[3]  = { THRSW,            LDUNIF },
-	[4]  = {           LDTMU,         },
-	[5]  = { THRSW,    LDTMU,         },
-	[6]  = {           LDTMU,  LDUNIF },
-	[7]  = { THRSW,    LDTMU,  LDUNIF },
-	[8]  = {           LDVARY,        },
-	[9]  = { THRSW,    LDVARY,        },
-	[10] = {           LDVARY, LDUNIF },
-	[11] = { THRSW,    LDVARY, LDUNIF },
-	[12] = { LDUNIFRF                 },
-	[13] = { THRSW,    LDUNIFRF       },
-	[14] = { SMIMM_B,    LDVARY       },
-	[15] = { SMIMM_B,                 },
-	[16] = {           LDTLB,         },
-	[17] = {           LDTLBU,        },
-	[18] = {                          WRTMUC },
-	[19] = { THRSW,                   WRTMUC },
-	[20] = {           LDVARY,        WRTMUC },
-	[21] = { THRSW,    LDVARY,        WRTMUC },
-	[22] = { UCB,                     },
-	[23] = { ROT,                     },
-	[24] = {                   LDUNIFA},
-	[25] = { LDUNIFARF                },
-	/* 26-30 reserved */
-	[31] = { SMIMM_B,          LDTMU, },
-};
+		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			inst->alu.mul.magic_write &&
+			inst->alu.mul.waddr == V3D_QPU_WADDR_UNIFA) {
+			return TRUE;
+		}
 
+		if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) &&
+			inst->sig_magic &&
+			inst->sig_addr == V3D_QPU_WADDR_UNIFA) {
+			return TRUE;
+		}
+	}
 
-static const struct v3d_qpu_sig v71_sig_map[] = {
-	/*      MISC       phys    RF0 */
-	[0]  = {                          },
-	[1]  = { THRSW,                   },
-	[2]  = {                   LDUNIF },
-	[3]  = { THRSW,            LDUNIF },
-	[4]  = {           LDTMU,         },
-	[5]  = { THRSW,    LDTMU,         },
-	[6]  = {           LDTMU,  LDUNIF },
-	[7]  = { THRSW,    LDTMU,  LDUNIF },
-	[8]  = {           LDVARY,        },
-	[9]  = { THRSW,    LDVARY,        },
-	[10] = {           LDVARY, LDUNIF },
-	[11] = { THRSW,    LDVARY, LDUNIF },
-	[12] = { LDUNIFRF                 },
-	[13] = { THRSW,    LDUNIFRF       },
-	[14] = { SMIMM_A,                 },
-	[15] = { SMIMM_B,                 },
-	[16] = {           LDTLB,         },
-	[17] = {           LDTLBU,        },
-	[18] = {                          WRTMUC },
-	[19] = { THRSW,                   WRTMUC },
-	[20] = {           LDVARY,        WRTMUC },
-	[21] = { THRSW,    LDVARY,        WRTMUC },
-	[22] = { UCB,                     },
-	/* 23 reserved */
-	[24] = {                   LDUNIFA},
-	[25] = { LDUNIFARF                },
-	/* 26-29 reserved */
-	[30] = { SMIMM_C,                 },
-	[31] = { SMIMM_D,                 },
-};
+	return FALSE;
+}
 
 v3d_bool
-v3d_qpu_sig_unpack(const struct v3d_device_info *devinfo,
-                   v3d_uint32 packed_sig,
-                   struct v3d_qpu_sig *sig)
+v3d_qpu_waits_vpm(const struct v3d_qpu_instr *inst)
 {
-	if (packed_sig >= V3D_ARRAY_SIZE(v33_sig_map))
-		return FALSE;
-
-	if (devinfo->ver >= 71)
-		*sig = v71_sig_map[packed_sig];
-	else if (devinfo->ver >= 41)
-		*sig = v41_sig_map[packed_sig];
-	else if (devinfo->ver == 40)
-		*sig = v40_sig_map[packed_sig];
-	else
-		*sig = v33_sig_map[packed_sig];
+	return inst->type == V3D_QPU_INSTR_TYPE_ALU &&
+		inst->alu.add.op == V3D_QPU_A_VPMWT;
+}
 
-	/* Signals with zeroed unpacked contents after element 0 are reserved. */
-	return (packed_sig == 0 ||
-			memcmp(sig, &v33_sig_map[0], sizeof(*sig)) != 0);
+v3d_bool
+v3d_qpu_reads_or_writes_vpm(const struct v3d_qpu_instr *inst)
+{
+	return v3d_qpu_reads_vpm(inst) || v3d_qpu_writes_vpm(inst);
 }
 
 v3d_bool
-v3d_qpu_sig_pack(const struct v3d_device_info *devinfo,
-                 const struct v3d_qpu_sig *sig,
-                 v3d_uint32 *packed_sig)
+v3d_qpu_uses_vpm(const struct v3d_qpu_instr *inst)
 {
-	static const struct v3d_qpu_sig *map;
+	return v3d_qpu_reads_vpm(inst) ||
+		v3d_qpu_writes_vpm(inst) ||
+		v3d_qpu_waits_vpm(inst);
+}
 
-	if (devinfo->ver >= 71)
-		map = v71_sig_map;
-	else if (devinfo->ver >= 41)
-		map = v41_sig_map;
-	else if (devinfo->ver == 40)
-		map = v40_sig_map;
-	else
-		map = v33_sig_map;
+static v3d_bool
+qpu_writes_magic_waddr_explicitly(const struct v3d_device_info *devinfo,
+                                  const struct v3d_qpu_instr *inst,
+                                  v3d_uint32 waddr)
+{
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (inst->alu.add.op != V3D_QPU_A_NOP &&
+			inst->alu.add.magic_write && inst->alu.add.waddr == waddr)
+			return TRUE;
 
-	for (int i = 0; i < V3D_ARRAY_SIZE(v33_sig_map); i++) {
-		if (memcmp(&map[i], sig, sizeof(*sig)) == 0) {
-			*packed_sig = i;
+		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			inst->alu.mul.magic_write && inst->alu.mul.waddr == waddr)
 			return TRUE;
-		}
+	}
+
+	if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) &&
+		inst->sig_magic && inst->sig_addr == waddr) {
+		return TRUE;
 	}
 
 	return FALSE;
 }
 
-static const v3d_uint32 small_immediates[] = {
-	0, 1, 2, 3,
-	4, 5, 6, 7,
-	8, 9, 10, 11,
-	12, 13, 14, 15,
-	-16, -15, -14, -13,
-	-12, -11, -10, -9,
-	-8, -7, -6, -5,
-	-4, -3, -2, -1,
-	0x3b800000, /* 2.0^-8 */
-	0x3c000000, /* 2.0^-7 */
-	0x3c800000, /* 2.0^-6 */
-	0x3d000000, /* 2.0^-5 */
-	0x3d800000, /* 2.0^-4 */
-	0x3e000000, /* 2.0^-3 */
-	0x3e800000, /* 2.0^-2 */
-	0x3f000000, /* 2.0^-1 */
-	0x3f800000, /* 2.0^0 */
-	0x40000000, /* 2.0^1 */
-	0x40800000, /* 2.0^2 */
-	0x41000000, /* 2.0^3 */
-	0x41800000, /* 2.0^4 */
-	0x42000000, /* 2.0^5 */
-	0x42800000, /* 2.0^6 */
-	0x43000000, /* 2.0^7 */
-};
-
 v3d_bool
-v3d_qpu_small_imm_unpack(const struct v3d_device_info *devinfo,
-                         v3d_uint32 packed_small_immediate,
-                         v3d_uint32 *small_immediate)
+v3d_qpu_writes_r3(const struct v3d_device_info *devinfo,
+                  const struct v3d_qpu_instr *inst)
 {
-	if (packed_small_immediate >= V3D_ARRAY_SIZE(small_immediates))
+	if(!devinfo->has_accumulators)
 		return FALSE;
 
-	*small_immediate = small_immediates[packed_small_immediate];
-	return TRUE;
+	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R3))
+		return TRUE;
+
+	return (devinfo->ver < 41 && inst->sig.ldvary) || inst->sig.ldvpm;
 }
 
 v3d_bool
-v3d_qpu_small_imm_pack(const struct v3d_device_info *devinfo,
-                       v3d_uint32 value,
-                       v3d_uint32 *packed_small_immediate)
+v3d_qpu_writes_r4(const struct v3d_device_info *devinfo,
+                  const struct v3d_qpu_instr *inst)
 {
-	V3D_STATIC_ASSERT(V3D_V3D_ARRAY_SIZE(small_immediates) == 48);
-
-	for (int i = 0; i < V3D_ARRAY_SIZE(small_immediates); i++) {
-		if (small_immediates[i] == value) {
-			*packed_small_immediate = i;
+	if (!devinfo->has_accumulators)
+		return FALSE;
+
+	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (inst->alu.add.op != V3D_QPU_A_NOP &&
+			inst->alu.add.magic_write &&
+			(inst->alu.add.waddr == V3D_QPU_WADDR_R4 ||
+			 v3d_qpu_magic_waddr_is_sfu(inst->alu.add.waddr))) {
+			return TRUE;
+		}
+
+		if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+			inst->alu.mul.magic_write &&
+			(inst->alu.mul.waddr == V3D_QPU_WADDR_R4 ||
+			 v3d_qpu_magic_waddr_is_sfu(inst->alu.mul.waddr))) {
 			return TRUE;
 		}
 	}
 
+	if (v3d_qpu_sig_writes_address(devinfo, &inst->sig)) {
+		if (inst->sig_magic && inst->sig_addr == V3D_QPU_WADDR_R4)
+			return TRUE;
+	} else if (inst->sig.ldtmu) {
+		return TRUE;
+	}
+
 	return FALSE;
 }
 
-// See small_immediates[]. This array has everything to prompt the user what they can possibly provide.
-// small_immediates_packed_values[] should be used to get the proper packed immediate.
-static const char* small_immediates_names[] =
+v3d_bool
+v3d_qpu_writes_r5(const struct v3d_device_info *devinfo,
+                  const struct v3d_qpu_instr *inst)
 {
-	"0", "1", "2", "3",
-	"4", "5", "6", "7",
-	"8", "9", "10", "11",
-	"12", "13", "14", "15",
-	"-16", "-15", "-14", "-13",
-	"-12", "-11", "-10", "-9",
-	"-8", "-7", "-6", "-5",
-	"-4", "-3", "-2", "-1",
-	// Extension by Macoy for referring to attributes past 15 in e.g. ldvpm. These CANNOT be used for math.
-	// TODO: Verify this is okay
-	"16", "17", "18", "19",
-	"20", "21", "22", "23",
-	"24", "25", "26", "27",
-	"28", "29", "30", "31",
-	// Extension by Macoy for writing these by humans
-	"2f^-8", "2f^-7", "2f^-6", "2f^-5",
-	"2f^-4", "2f^-3", "2f^-2", "2f^-1",
-	"2f^0", "2f^1", "2f^2", "2f^3",
-	"2f^4", "2f^5", "2f^6", "2f^7",
-	// Floating point exponents
-	"0x3b800000", /* 2.0^-8 */
-	"0x3c000000", /* 2.0^-7 */
-	"0x3c800000", /* 2.0^-6 */
-	"0x3d000000", /* 2.0^-5 */
-	"0x3d800000", /* 2.0^-4 */
-	"0x3e000000", /* 2.0^-3 */
-	"0x3e800000", /* 2.0^-2 */
-	"0x3f000000", /* 2.0^-1 */
-	"0x3f800000", /* 2.0^0 */
-	"0x40000000", /* 2.0^1 */
-	"0x40800000", /* 2.0^2 */
-	"0x41000000", /* 2.0^3 */
-	"0x41800000", /* 2.0^4 */
-	"0x42000000", /* 2.0^5 */
-	"0x42800000", /* 2.0^6 */
-	"0x43000000", /* 2.0^7 */
-};
+	if (!devinfo->has_accumulators)
+		return FALSE;
 
-// Must correspond exactly with small_immediates_names[]
-static v3d_uint32 small_immediates_packed_indices[] =
-{
-	0, 1, 2, 3,
-	4, 5, 6, 7,
-	8, 9, 10, 11,
-	12, 13, 14, 15,
-	16, 17, 18, 19,
-	20, 21, 22, 23,
-	24, 25, 26, 27,
-	28, 29, 30, 31,
-	// Extension (positive to 31)
-	16, 17, 18, 19,
-	20, 21, 22, 23,
-	24, 25, 26, 27,
-	28, 29, 30, 31,
-	// Extension (2.0^x)
-	32, 33, 34, 35,
-	36, 37, 38, 39,
-	40, 41, 42, 43,
-	44, 45, 46, 47,
-	// Floating point exponents (hex)
-	32,
-	33,
-	34,
-	35,
-	36,
-	37,
-	38,
-	39,
-	40,
-	41,
-	42,
-	43,
-	44,
-	45,
-	46,
-	47,
-};
+	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R5))
+		return TRUE;
 
-// This accepts the following:
-// 0 through 15
-// -15 through -1
-// 16 through 31 (Extension; invalid for math)
-// 0x3b800000... (see small_immediates_names for valid hex constants)
-// 2^-8 through 2^7 (Extension)
-v3d_bool v3d_qpu_small_imm_from_name(const char* name, v3d_uint32* packed_small_immediate,
-                                     const char** endOfNameOut)
-{
-	for (int index = 0; index < V3D_ARRAY_SIZE(small_immediates_names); ++index)
-	{
-		if (v3d_symbol_equals(small_immediates_names[index], name, endOfNameOut))
-		{
-			*packed_small_immediate = small_immediates_packed_indices[index];
-			return TRUE;
-		}
-	}
-	return FALSE;
+	return inst->sig.ldvary || inst->sig.ldunif || inst->sig.ldunifa;
 }
 
 v3d_bool
-v3d_qpu_flags_unpack(const struct v3d_device_info *devinfo,
-                     v3d_uint32 packed_cond,
-                     struct v3d_qpu_flags *cond)
+v3d_qpu_writes_accum(const struct v3d_device_info *devinfo,
+                     const struct v3d_qpu_instr *inst)
 {
-	static const enum v3d_qpu_cond cond_map[4] = {
-		[0] = V3D_QPU_COND_IFA,
-		[1] = V3D_QPU_COND_IFB,
-		[2] = V3D_QPU_COND_IFNA,
-		[3] = V3D_QPU_COND_IFNB,
-	};
+	if (!devinfo->has_accumulators)
+		return FALSE;
 
-	cond->ac = V3D_QPU_COND_NONE;
-	cond->mc = V3D_QPU_COND_NONE;
-	cond->apf = V3D_QPU_PF_NONE;
-	cond->mpf = V3D_QPU_PF_NONE;
-	cond->auf = V3D_QPU_UF_NONE;
-	cond->muf = V3D_QPU_UF_NONE;
+	if (v3d_qpu_writes_r5(devinfo, inst))
+		return TRUE;
+	if (v3d_qpu_writes_r4(devinfo, inst))
+		return TRUE;
+	if (v3d_qpu_writes_r3(devinfo, inst))
+		return TRUE;
+	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R2))
+		return TRUE;
+	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R1))
+		return TRUE;
+	if (qpu_writes_magic_waddr_explicitly(devinfo, inst, V3D_QPU_WADDR_R0))
+		return TRUE;
 
-	if (packed_cond == 0) {
+	return FALSE;
+}
+
+v3d_bool
+v3d_qpu_writes_rf0_implicitly(const struct v3d_device_info *devinfo,
+                              const struct v3d_qpu_instr *inst)
+{
+	if (devinfo->ver >= 71 &&
+		(inst->sig.ldvary || inst->sig.ldunif || inst->sig.ldunifa)) {
 		return TRUE;
-	} else if (packed_cond >> 2 == 0) {
-		cond->apf = packed_cond & 0x3;
-	} else if (packed_cond >> 4 == 0) {
-		cond->auf = (packed_cond & 0xf) - 4 + V3D_QPU_UF_ANDZ;
-	} else if (packed_cond == 0x10) {
-		return FALSE;
-	} else if (packed_cond >> 2 == 0x4) {
-		cond->mpf = packed_cond & 0x3;
-	} else if (packed_cond >> 4 == 0x1) {
-		cond->muf = (packed_cond & 0xf) - 4 + V3D_QPU_UF_ANDZ;
-	} else if (packed_cond >> 4 == 0x2) {
-		cond->ac = ((packed_cond >> 2) & 0x3) + V3D_QPU_COND_IFA;
-		cond->mpf = packed_cond & 0x3;
-	} else if (packed_cond >> 4 == 0x3) {
-		cond->mc = ((packed_cond >> 2) & 0x3) + V3D_QPU_COND_IFA;
-		cond->apf = packed_cond & 0x3;
-	} else if (packed_cond >> 6) {
-		cond->mc = cond_map[(packed_cond >> 4) & 0x3];
-		if (((packed_cond >> 2) & 0x3) == 0) {
-			cond->ac = cond_map[packed_cond & 0x3];
-		} else {
-			cond->auf = (packed_cond & 0xf) - 4 + V3D_QPU_UF_ANDZ;
-		}
 	}
 
-	return TRUE;
+	return FALSE;
 }
 
 v3d_bool
-v3d_qpu_flags_pack(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_flags *cond,
-                   v3d_uint32 *packed_cond)
+v3d_qpu_uses_mux(const struct v3d_qpu_instr *inst, enum v3d_qpu_mux mux)
 {
-#define AC (1 << 0)
-#define MC (1 << 1)
-#define APF (1 << 2)
-#define MPF (1 << 3)
-#define AUF (1 << 4)
-#define MUF (1 << 5)
-	static const struct {
-		v3d_uint8 flags_present;
-		v3d_uint8 bits;
-	} flags_table[] = {
-		{ 0,        0 },
-		{ APF,      0 },
-		{ AUF,      0 },
-		{ MPF,      (1 << 4) },
-		{ MUF,      (1 << 4) },
-		{ AC,       (1 << 5) },
-		{ AC | MPF, (1 << 5) },
-		{ MC,       (1 << 5) | (1 << 4) },
-		{ MC | APF, (1 << 5) | (1 << 4) },
-		{ MC | AC,  (1 << 6) },
-		{ MC | AUF, (1 << 6) },
-	};
+	int add_nsrc = v3d_qpu_add_op_num_src(inst->alu.add.op);
+	int mul_nsrc = v3d_qpu_mul_op_num_src(inst->alu.mul.op);
 
-	v3d_uint8 flags_present = 0;
-	if (cond->ac != V3D_QPU_COND_NONE)
-		flags_present |= AC;
-	if (cond->mc != V3D_QPU_COND_NONE)
-		flags_present |= MC;
-	if (cond->apf != V3D_QPU_PF_NONE)
-		flags_present |= APF;
-	if (cond->mpf != V3D_QPU_PF_NONE)
-		flags_present |= MPF;
-	if (cond->auf != V3D_QPU_UF_NONE)
-		flags_present |= AUF;
-	if (cond->muf != V3D_QPU_UF_NONE)
-		flags_present |= MUF;
+	return ((add_nsrc > 0 && inst->alu.add.a.mux == mux) ||
+			(add_nsrc > 1 && inst->alu.add.b.mux == mux) ||
+			(mul_nsrc > 0 && inst->alu.mul.a.mux == mux) ||
+			(mul_nsrc > 1 && inst->alu.mul.b.mux == mux));
+}
 
-	for (int i = 0; i < V3D_ARRAY_SIZE(flags_table); i++) {
-		if (flags_table[i].flags_present != flags_present)
-			continue;
+v3d_bool
+v3d71_qpu_reads_raddr(const struct v3d_qpu_instr *inst, v3d_uint8 raddr)
+{
+	int add_nsrc = v3d_qpu_add_op_num_src(inst->alu.add.op);
+	int mul_nsrc = v3d_qpu_mul_op_num_src(inst->alu.mul.op);
 
-		*packed_cond = flags_table[i].bits;
+	return (add_nsrc > 0 && !inst->sig.small_imm_a && inst->alu.add.a.raddr == raddr) ||
+		(add_nsrc > 1 && !inst->sig.small_imm_b && inst->alu.add.b.raddr == raddr) ||
+		(mul_nsrc > 0 && !inst->sig.small_imm_c && inst->alu.mul.a.raddr == raddr) ||
+		(mul_nsrc > 1 && !inst->sig.small_imm_d && inst->alu.mul.b.raddr == raddr);
+}
 
-		*packed_cond |= cond->apf;
-		*packed_cond |= cond->mpf;
-
-		if (flags_present & AUF)
-			*packed_cond |= cond->auf - V3D_QPU_UF_ANDZ + 4;
-		if (flags_present & MUF)
-			*packed_cond |= cond->muf - V3D_QPU_UF_ANDZ + 4;
+v3d_bool
+v3d71_qpu_writes_waddr_explicitly(const struct v3d_device_info *devinfo,
+                                  const struct v3d_qpu_instr *inst,
+                                  v3d_uint8 waddr)
+{
+	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
+		return FALSE;
 
-		if (flags_present & AC) {
-			if (*packed_cond & (1 << 6))
-				*packed_cond |= cond->ac - V3D_QPU_COND_IFA;
-			else
-				*packed_cond |= (cond->ac -
-								 V3D_QPU_COND_IFA) << 2;
-		}
+	if (v3d_qpu_add_op_has_dst(inst->alu.add.op) &&
+		!inst->alu.add.magic_write &&
+		inst->alu.add.waddr == waddr) {
+		return TRUE;
+	}
 
-		if (flags_present & MC) {
-			if (*packed_cond & (1 << 6))
-				*packed_cond |= (cond->mc -
-								 V3D_QPU_COND_IFA) << 4;
-			else
-				*packed_cond |= (cond->mc -
-								 V3D_QPU_COND_IFA) << 2;
-		}
+	if (v3d_qpu_mul_op_has_dst(inst->alu.mul.op) &&
+		!inst->alu.mul.magic_write &&
+		inst->alu.mul.waddr == waddr) {
+		return TRUE;
+	}
 
+	if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) &&
+		!inst->sig_magic && inst->sig_addr == waddr) {
 		return TRUE;
 	}
 
 	return FALSE;
 }
 
-/* Make a mapping of the table of opcodes in the spec.  The opcode is
- * determined by a combination of the opcode field, and in the case of 0 or
- * 1-arg opcodes, the mux (version <= 42) or raddr (version >= 71) field as
- * well.
- */
-/** Set a single bit */
-#define BITFIELD64_BIT(b)      (1ull << (b))
-/** Set all bits up to excluding bit b */
-#define BITFIELD64_MASK(b)									\
-	((b) == 64 ? (~0ull) : BITFIELD64_BIT((b) & 63) - 1)
-/** Set count bits starting from bit b  */
-#define BITFIELD64_RANGE(b, count)							\
-	(BITFIELD64_MASK((b) + (count)) & ~BITFIELD64_MASK(b))
-#define OP_MASK(val) BITFIELD64_BIT(val)
-#define OP_RANGE(bot, top) BITFIELD64_RANGE(bot, top - bot + 1)
-#define ANYMUX OP_RANGE(0, 7)
-#define ANYOPMASK OP_RANGE(0, 63)
-
-struct opcode_desc {
-	v3d_uint8 opcode_first;
-	v3d_uint8 opcode_last;
+v3d_bool
+v3d_qpu_sig_writes_address(const struct v3d_device_info *devinfo,
+                           const struct v3d_qpu_sig *sig)
+{
+	if (devinfo->ver < 41)
+		return FALSE;
 
-	union {
-		struct {
-			v3d_uint8 b_mask;
-			v3d_uint8 a_mask;
-		} mux;
-		v3d_uint64 raddr_mask;
-	};
+	return (sig->ldunifrf ||
+			sig->ldunifarf ||
+			sig->ldvary ||
+			sig->ldtmu ||
+			sig->ldtlb ||
+			sig->ldtlbu);
+}
 
-	v3d_uint8 op;
+v3d_bool
+v3d_qpu_reads_flags(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH) {
+		return inst->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS;
+	} else if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (inst->flags.ac != V3D_QPU_COND_NONE ||
+			inst->flags.mc != V3D_QPU_COND_NONE ||
+			inst->flags.auf != V3D_QPU_UF_NONE ||
+			inst->flags.muf != V3D_QPU_UF_NONE)
+			return TRUE;
 
-	/* first_ver == 0 if it's the same across all V3D versions.
-	 * first_ver == X, last_ver == 0 if it's the same for all V3D versions
-	 *   starting from X
-	 * first_ver == X, last_ver == Y if it's the same for all V3D versions
-	 *   on the range X through Y
-	 */
-	v3d_uint8 first_ver;
-	v3d_uint8 last_ver;
-};
+		switch (inst->alu.add.op) {
+		case V3D_QPU_A_VFLA:
+		case V3D_QPU_A_VFLNA:
+		case V3D_QPU_A_VFLB:
+		case V3D_QPU_A_VFLNB:
+		case V3D_QPU_A_FLAPUSH:
+		case V3D_QPU_A_FLBPUSH:
+		case V3D_QPU_A_FLAFIRST:
+		case V3D_QPU_A_FLNAFIRST:
+			return TRUE;
+		default:
+			break;
+		}
+	}
 
-static const struct opcode_desc add_ops_v33[] = {
-	/* FADD is FADDNF depending on the order of the mux_a/mux_b. */
-	{ 0,   47,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FADD },
-	{ 0,   47,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FADDNF },
-	{ 53,  55,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFPACK },
-	{ 56,  56,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_ADD },
-	{ 57,  59,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFPACK },
-	{ 60,  60,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_SUB },
-	{ 61,  63,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFPACK },
-	{ 64,  111, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FSUB },
-	{ 120, 120, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_MIN },
-	{ 121, 121, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_MAX },
-	{ 122, 122, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_UMIN },
-	{ 123, 123, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_UMAX },
-	{ 124, 124, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_SHL },
-	{ 125, 125, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_SHR },
-	{ 126, 126, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_ASR },
-	{ 127, 127, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_ROR },
-	/* FMIN is instead FMAX depending on the order of the mux_a/mux_b. */
-	{ 128, 175, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FMIN },
-	{ 128, 175, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FMAX },
-	{ 176, 180, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFMIN },
+	return FALSE;
+}
 
-	{ 181, 181, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_AND },
-	{ 182, 182, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_OR },
-	{ 183, 183, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_XOR },
+v3d_bool
+v3d_qpu_writes_flags(const struct v3d_qpu_instr *inst)
+{
+	if (inst->flags.apf != V3D_QPU_PF_NONE ||
+		inst->flags.mpf != V3D_QPU_PF_NONE ||
+		inst->flags.auf != V3D_QPU_UF_NONE ||
+		inst->flags.muf != V3D_QPU_UF_NONE) {
+		return TRUE;
+	}
 
-	{ 184, 184, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VADD },
-	{ 185, 185, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VSUB },
-	{ 186, 186, .mux.b_mask = OP_MASK(0), .mux.a_mask = ANYMUX, V3D_QPU_A_NOT },
-	{ 186, 186, .mux.b_mask = OP_MASK(1), .mux.a_mask = ANYMUX, V3D_QPU_A_NEG },
-	{ 186, 186, .mux.b_mask = OP_MASK(2), .mux.a_mask = ANYMUX, V3D_QPU_A_FLAPUSH },
-	{ 186, 186, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_FLBPUSH },
-	{ 186, 186, .mux.b_mask = OP_MASK(4), .mux.a_mask = ANYMUX, V3D_QPU_A_FLPOP },
-	{ 186, 186, .mux.b_mask = OP_MASK(5), .mux.a_mask = ANYMUX, V3D_QPU_A_RECIP },
-	{ 186, 186, .mux.b_mask = OP_MASK(6), .mux.a_mask = ANYMUX, V3D_QPU_A_SETMSF },
-	{ 186, 186, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_SETREVF },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(0), V3D_QPU_A_NOP, 0 },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(1), V3D_QPU_A_TIDX },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(2), V3D_QPU_A_EIDX },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(3), V3D_QPU_A_LR },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(4), V3D_QPU_A_VFLA },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(5), V3D_QPU_A_VFLNA },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(6), V3D_QPU_A_VFLB },
-	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(7), V3D_QPU_A_VFLNB },
+	return FALSE;
+}
 
-	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_RANGE(0, 2), V3D_QPU_A_FXCD },
-	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_MASK(3), V3D_QPU_A_XCD },
-	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_RANGE(4, 6), V3D_QPU_A_FYCD },
-	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_MASK(7), V3D_QPU_A_YCD },
+v3d_bool
+v3d_qpu_unpacks_f32(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
+		return FALSE;
 
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(0), V3D_QPU_A_MSF },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(1), V3D_QPU_A_REVF },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(2), V3D_QPU_A_VDWWT, 33 },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(2), V3D_QPU_A_IID, 40 },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(3), V3D_QPU_A_SAMPID, 40 },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(4), V3D_QPU_A_BARRIERID, 40 },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(5), V3D_QPU_A_TMUWT },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(6), V3D_QPU_A_VPMWT },
-	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(7), V3D_QPU_A_FLAFIRST, 41 },
-	{ 187, 187, .mux.b_mask = OP_MASK(3), .mux.a_mask = OP_MASK(0), V3D_QPU_A_FLNAFIRST, 41 },
-	{ 187, 187, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_VPMSETUP, 33 },
+	switch (inst->alu.add.op) {
+	case V3D_QPU_A_FADD:
+	case V3D_QPU_A_FADDNF:
+	case V3D_QPU_A_FSUB:
+	case V3D_QPU_A_FMIN:
+	case V3D_QPU_A_FMAX:
+	case V3D_QPU_A_FCMP:
+	case V3D_QPU_A_FROUND:
+	case V3D_QPU_A_FTRUNC:
+	case V3D_QPU_A_FFLOOR:
+	case V3D_QPU_A_FCEIL:
+	case V3D_QPU_A_FDX:
+	case V3D_QPU_A_FDY:
+	case V3D_QPU_A_FTOIN:
+	case V3D_QPU_A_FTOIZ:
+	case V3D_QPU_A_FTOUZ:
+	case V3D_QPU_A_FTOC:
+	case V3D_QPU_A_VFPACK:
+		return TRUE;
+		break;
+	default:
+		break;
+	}
 
-	{ 188, 188, .mux.b_mask = OP_MASK(0), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMV_IN, 40 },
-	{ 188, 188, .mux.b_mask = OP_MASK(0), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMV_OUT, 40 },
-	{ 188, 188, .mux.b_mask = OP_MASK(1), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMD_IN, 40 },
-	{ 188, 188, .mux.b_mask = OP_MASK(1), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMD_OUT, 40 },
-	{ 188, 188, .mux.b_mask = OP_MASK(2), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMP, 40 },
-	{ 188, 188, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_RSQRT, 41 },
-	{ 188, 188, .mux.b_mask = OP_MASK(4), .mux.a_mask = ANYMUX, V3D_QPU_A_EXP, 41 },
-	{ 188, 188, .mux.b_mask = OP_MASK(5), .mux.a_mask = ANYMUX, V3D_QPU_A_LOG, 41 },
-	{ 188, 188, .mux.b_mask = OP_MASK(6), .mux.a_mask = ANYMUX, V3D_QPU_A_SIN, 41 },
-	{ 188, 188, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_RSQRT2, 41 },
-	{ 189, 189, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMG_IN, 40 },
-	{ 189, 189, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMG_OUT, 40 },
+	switch (inst->alu.mul.op) {
+	case V3D_QPU_M_FMOV:
+	case V3D_QPU_M_FMUL:
+		return TRUE;
+		break;
+	default:
+		break;
+	}
 
-	/* FIXME: MORE COMPLICATED */
-	/* { 190, 191, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFMOVABSNEGNAB }, */
+	return FALSE;
+}
+v3d_bool
+v3d_qpu_unpacks_f16(const struct v3d_qpu_instr *inst)
+{
+	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
+		return FALSE;
 
-	{ 192, 239, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FCMP },
-	{ 240, 244, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFMAX },
+	switch (inst->alu.add.op) {
+	case V3D_QPU_A_VFMIN:
+	case V3D_QPU_A_VFMAX:
+		return TRUE;
+		break;
+	default:
+		break;
+	}
 
-	{ 245, 245, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_FROUND },
-	{ 245, 245, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOIN },
-	{ 245, 245, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_FTRUNC },
-	{ 245, 245, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOIZ },
-	{ 246, 246, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_FFLOOR },
-	{ 246, 246, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOUZ },
-	{ 246, 246, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_FCEIL },
-	{ 246, 246, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOC },
+	switch (inst->alu.mul.op) {
+	case V3D_QPU_M_VFMUL:
+		return TRUE;
+		break;
+	default:
+		break;
+	}
 
-	{ 247, 247, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_FDX },
-	{ 247, 247, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_FDY },
+	return FALSE;
+}
 
-	/* The stvpms are distinguished by the waddr field. */
-	{ 248, 248, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_STVPMV },
-	{ 248, 248, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_STVPMD },
-	{ 248, 248, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_STVPMP },
+v3d_bool
+v3d_qpu_is_nop(struct v3d_qpu_instr *inst)
+{
+	static const struct v3d_qpu_sig nosig = { 0 };
 
-	{ 252, 252, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_ITOF },
-	{ 252, 252, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_CLZ },
-	{ 252, 252, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_UTOF },
-};
+	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
+		return FALSE;
+	if (inst->alu.add.op != V3D_QPU_A_NOP)
+		return FALSE;
+	if (inst->alu.mul.op != V3D_QPU_M_NOP)
+		return FALSE;
+	if (v3d_memcmp(&inst->sig, &nosig, sizeof(nosig)))
+		return FALSE;
+	return TRUE;
+}
 
-static const struct opcode_desc mul_ops_v33[] = {
-	{ 1, 1, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_ADD },
-	{ 2, 2, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_SUB },
-	{ 3, 3, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_UMUL24 },
-	{ 4, 8, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_VFMUL },
-	{ 9, 9, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_SMUL24 },
-	{ 10, 10, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_MULTOP },
-	{ 14, 14, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_FMOV, 33, 42 },
-	{ 15, 15, .mux.b_mask = OP_RANGE(0, 3), ANYMUX, V3D_QPU_M_FMOV, 33, 42},
-	{ 15, 15, .mux.b_mask = OP_MASK(4), .mux.a_mask = OP_MASK(0), V3D_QPU_M_NOP, 33, 42 },
-	{ 15, 15, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_M_MOV, 33, 42 },
+// >>> qpu_pack.c
 
-	{ 16, 63, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_FMUL },
-};
+#ifndef QPU_MASK
+#define QPU_MASK(high, low)										\
+	((((v3d_uint64)1ULL << ((high) - (low) + 1)) - 1) << (low))
+/* Using the GNU statement expression extension */
+#define QPU_SET_FIELD(value, field)										\
+	({																	\
+		v3d_uint64 fieldval = (v3d_uint64)(value) << field ## _SHIFT;	\
+		v3d_assert((fieldval & ~ field ## _MASK) == 0);					\
+		fieldval & field ## _MASK;										\
+	})
 
-/* Note that it would have been possible to define all the add/mul opcodes in
- * just one table, using the first_ver/last_ver. But taking into account that
- * for v71 there were a lot of changes, it was more tidy this way. Also right
- * now we are doing a linear search on those tables, so this maintains the
- * tables smaller.
- *
- * Just in case we merge the tables, we define the first_ver as 71 for those
- * opcodes that changed on v71
- */
-static const struct opcode_desc add_ops_v71[] = {
-	/* FADD is FADDNF depending on the order of the raddr_a/raddr_b. */
-	{ 0,   47,  .raddr_mask = ANYOPMASK, V3D_QPU_A_FADD },
-	{ 0,   47,  .raddr_mask = ANYOPMASK, V3D_QPU_A_FADDNF },
-	{ 53,  55,  .raddr_mask = ANYOPMASK, V3D_QPU_A_VFPACK },
-	{ 56,  56,  .raddr_mask = ANYOPMASK, V3D_QPU_A_ADD },
-	{ 57,  59,  .raddr_mask = ANYOPMASK, V3D_QPU_A_VFPACK },
-	{ 60,  60,  .raddr_mask = ANYOPMASK, V3D_QPU_A_SUB },
-	{ 61,  63,  .raddr_mask = ANYOPMASK, V3D_QPU_A_VFPACK },
-	{ 64,  111, .raddr_mask = ANYOPMASK, V3D_QPU_A_FSUB },
-	{ 120, 120, .raddr_mask = ANYOPMASK, V3D_QPU_A_MIN },
-	{ 121, 121, .raddr_mask = ANYOPMASK, V3D_QPU_A_MAX },
-	{ 122, 122, .raddr_mask = ANYOPMASK, V3D_QPU_A_UMIN },
-	{ 123, 123, .raddr_mask = ANYOPMASK, V3D_QPU_A_UMAX },
-	{ 124, 124, .raddr_mask = ANYOPMASK, V3D_QPU_A_SHL },
-	{ 125, 125, .raddr_mask = ANYOPMASK, V3D_QPU_A_SHR },
-	{ 126, 126, .raddr_mask = ANYOPMASK, V3D_QPU_A_ASR },
-	{ 127, 127, .raddr_mask = ANYOPMASK, V3D_QPU_A_ROR },
-	/* FMIN is instead FMAX depending on the raddr_a/b order. */
-	{ 128, 175, .raddr_mask = ANYOPMASK, V3D_QPU_A_FMIN },
-	{ 128, 175, .raddr_mask = ANYOPMASK, V3D_QPU_A_FMAX },
-	{ 176, 180, .raddr_mask = ANYOPMASK, V3D_QPU_A_VFMIN },
+#define QPU_GET_FIELD(word, field) ((v3d_uint32)(((word)  & field ## _MASK) >> field ## _SHIFT))
 
-	{ 181, 181, .raddr_mask = ANYOPMASK, V3D_QPU_A_AND },
-	{ 182, 182, .raddr_mask = ANYOPMASK, V3D_QPU_A_OR },
-	{ 183, 183, .raddr_mask = ANYOPMASK, V3D_QPU_A_XOR },
-	{ 184, 184, .raddr_mask = ANYOPMASK, V3D_QPU_A_VADD },
-	{ 185, 185, .raddr_mask = ANYOPMASK, V3D_QPU_A_VSUB },
+#define QPU_UPDATE_FIELD(inst, value, field)						\
+	(((inst) & ~(field ## _MASK)) | QPU_SET_FIELD(value, field))
+#endif /* QPU_MASK */
 
-	{ 186, 186, .raddr_mask = OP_MASK(0), V3D_QPU_A_NOT },
-	{ 186, 186, .raddr_mask = OP_MASK(1), V3D_QPU_A_NEG },
-	{ 186, 186, .raddr_mask = OP_MASK(2), V3D_QPU_A_FLAPUSH },
-	{ 186, 186, .raddr_mask = OP_MASK(3), V3D_QPU_A_FLBPUSH },
-	{ 186, 186, .raddr_mask = OP_MASK(4), V3D_QPU_A_FLPOP },
-	{ 186, 186, .raddr_mask = OP_MASK(5), V3D_QPU_A_CLZ },
-	{ 186, 186, .raddr_mask = OP_MASK(6), V3D_QPU_A_SETMSF },
-	{ 186, 186, .raddr_mask = OP_MASK(7), V3D_QPU_A_SETREVF },
+#define V3D_QPU_OP_MUL_SHIFT                58
+#define V3D_QPU_OP_MUL_MASK                 QPU_MASK(63, 58)
 
-	{ 187, 187, .raddr_mask = OP_MASK(0), V3D_QPU_A_NOP, 0 },
-	{ 187, 187, .raddr_mask = OP_MASK(1), V3D_QPU_A_TIDX },
-	{ 187, 187, .raddr_mask = OP_MASK(2), V3D_QPU_A_EIDX },
-	{ 187, 187, .raddr_mask = OP_MASK(3), V3D_QPU_A_LR },
-	{ 187, 187, .raddr_mask = OP_MASK(4), V3D_QPU_A_VFLA },
-	{ 187, 187, .raddr_mask = OP_MASK(5), V3D_QPU_A_VFLNA },
-	{ 187, 187, .raddr_mask = OP_MASK(6), V3D_QPU_A_VFLB },
-	{ 187, 187, .raddr_mask = OP_MASK(7), V3D_QPU_A_VFLNB },
-	{ 187, 187, .raddr_mask = OP_MASK(8), V3D_QPU_A_XCD },
-	{ 187, 187, .raddr_mask = OP_MASK(9), V3D_QPU_A_YCD },
-	{ 187, 187, .raddr_mask = OP_MASK(10), V3D_QPU_A_MSF },
-	{ 187, 187, .raddr_mask = OP_MASK(11), V3D_QPU_A_REVF },
-	{ 187, 187, .raddr_mask = OP_MASK(12), V3D_QPU_A_IID },
-	{ 187, 187, .raddr_mask = OP_MASK(13), V3D_QPU_A_SAMPID },
-	{ 187, 187, .raddr_mask = OP_MASK(14), V3D_QPU_A_BARRIERID },
-	{ 187, 187, .raddr_mask = OP_MASK(15), V3D_QPU_A_TMUWT },
-	{ 187, 187, .raddr_mask = OP_MASK(16), V3D_QPU_A_VPMWT },
-	{ 187, 187, .raddr_mask = OP_MASK(17), V3D_QPU_A_FLAFIRST },
-	{ 187, 187, .raddr_mask = OP_MASK(18), V3D_QPU_A_FLNAFIRST },
+#define V3D_QPU_SIG_SHIFT                   53
+#define V3D_QPU_SIG_MASK                    QPU_MASK(57, 53)
 
-	{ 187, 187, .raddr_mask = OP_RANGE(32, 34), V3D_QPU_A_FXCD },
-	{ 187, 187, .raddr_mask = OP_RANGE(36, 38), V3D_QPU_A_FYCD },
+#define V3D_QPU_COND_SHIFT                  46
+#define V3D_QPU_COND_MASK                   QPU_MASK(52, 46)
+#define V3D_QPU_COND_SIG_MAGIC_ADDR         (1 << 6)
 
-	{ 188, 188, .raddr_mask = OP_MASK(0), V3D_QPU_A_LDVPMV_IN, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(1), V3D_QPU_A_LDVPMD_IN, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(2), V3D_QPU_A_LDVPMP, 71 },
+#define V3D_QPU_MM                          QPU_MASK(45, 45)
+#define V3D_QPU_MA                          QPU_MASK(44, 44)
 
-	{ 188, 188, .raddr_mask = OP_MASK(32), V3D_QPU_A_RECIP, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(33), V3D_QPU_A_RSQRT, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(34), V3D_QPU_A_EXP, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(35), V3D_QPU_A_LOG, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(36), V3D_QPU_A_SIN, 71 },
-	{ 188, 188, .raddr_mask = OP_MASK(37), V3D_QPU_A_RSQRT2, 71 },
+#define V3D_QPU_WADDR_M_SHIFT               38
+#define V3D_QPU_WADDR_M_MASK                QPU_MASK(43, 38)
 
-	{ 189, 189, .raddr_mask = ANYOPMASK, V3D_QPU_A_LDVPMG_IN, 71 },
+#define V3D_QPU_BRANCH_ADDR_LOW_SHIFT       35
+#define V3D_QPU_BRANCH_ADDR_LOW_MASK        QPU_MASK(55, 35)
 
-	/* The stvpms are distinguished by the waddr field. */
-	{ 190, 190, .raddr_mask = ANYOPMASK, V3D_QPU_A_STVPMV, 71},
-	{ 190, 190, .raddr_mask = ANYOPMASK, V3D_QPU_A_STVPMD, 71},
-	{ 190, 190, .raddr_mask = ANYOPMASK, V3D_QPU_A_STVPMP, 71},
+#define V3D_QPU_WADDR_A_SHIFT               32
+#define V3D_QPU_WADDR_A_MASK                QPU_MASK(37, 32)
 
-	{ 192, 207, .raddr_mask = ANYOPMASK, V3D_QPU_A_FCMP, 71 },
+#define V3D_QPU_BRANCH_COND_SHIFT           32
+#define V3D_QPU_BRANCH_COND_MASK            QPU_MASK(34, 32)
 
-	{ 245, 245, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_A_FROUND, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_A_FROUND, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_A_FROUND, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_A_FROUND, 71 },
+#define V3D_QPU_BRANCH_ADDR_HIGH_SHIFT      24
+#define V3D_QPU_BRANCH_ADDR_HIGH_MASK       QPU_MASK(31, 24)
 
-	{ 245, 245, .raddr_mask = OP_MASK(3),  V3D_QPU_A_FTOIN, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(7),  V3D_QPU_A_FTOIN, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(11), V3D_QPU_A_FTOIN, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(15), V3D_QPU_A_FTOIN, 71 },
+#define V3D_QPU_OP_ADD_SHIFT                24
+#define V3D_QPU_OP_ADD_MASK                 QPU_MASK(31, 24)
 
-	{ 245, 245, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_A_FTRUNC, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_A_FTRUNC, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(24, 26), V3D_QPU_A_FTRUNC, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(28, 30), V3D_QPU_A_FTRUNC, 71 },
+#define V3D_QPU_MUL_B_SHIFT                 21
+#define V3D_QPU_MUL_B_MASK                  QPU_MASK(23, 21)
 
-	{ 245, 245, .raddr_mask = OP_MASK(19), V3D_QPU_A_FTOIZ, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(23), V3D_QPU_A_FTOIZ, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(27), V3D_QPU_A_FTOIZ, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(31), V3D_QPU_A_FTOIZ, 71 },
+#define V3D_QPU_BRANCH_MSFIGN_SHIFT         21
+#define V3D_QPU_BRANCH_MSFIGN_MASK          QPU_MASK(22, 21)
 
-	{ 245, 245, .raddr_mask = OP_RANGE(32, 34), V3D_QPU_A_FFLOOR, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(36, 38), V3D_QPU_A_FFLOOR, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(40, 42), V3D_QPU_A_FFLOOR, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(44, 46), V3D_QPU_A_FFLOOR, 71 },
+#define V3D_QPU_MUL_A_SHIFT                 18
+#define V3D_QPU_MUL_A_MASK                  QPU_MASK(20, 18)
 
-	{ 245, 245, .raddr_mask = OP_MASK(35), V3D_QPU_A_FTOUZ, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(39), V3D_QPU_A_FTOUZ, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(43), V3D_QPU_A_FTOUZ, 71 },
-	{ 245, 245, .raddr_mask = OP_MASK(47), V3D_QPU_A_FTOUZ, 71 },
+#define V3D_QPU_RADDR_C_SHIFT               18
+#define V3D_QPU_RADDR_C_MASK                QPU_MASK(23, 18)
 
-	{ 245, 245, .raddr_mask = OP_RANGE(48, 50), V3D_QPU_A_FCEIL, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(52, 54), V3D_QPU_A_FCEIL, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(56, 58), V3D_QPU_A_FCEIL, 71 },
-	{ 245, 245, .raddr_mask = OP_RANGE(60, 62), V3D_QPU_A_FCEIL, 71 },
+#define V3D_QPU_ADD_B_SHIFT                 15
+#define V3D_QPU_ADD_B_MASK                  QPU_MASK(17, 15)
 
-	{ 245, 245, .raddr_mask = OP_MASK(51), V3D_QPU_A_FTOC },
-	{ 245, 245, .raddr_mask = OP_MASK(55), V3D_QPU_A_FTOC },
-	{ 245, 245, .raddr_mask = OP_MASK(59), V3D_QPU_A_FTOC },
-	{ 245, 245, .raddr_mask = OP_MASK(63), V3D_QPU_A_FTOC },
+#define V3D_QPU_BRANCH_BDU_SHIFT            15
+#define V3D_QPU_BRANCH_BDU_MASK             QPU_MASK(17, 15)
 
-	{ 246, 246, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_A_FDX, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_A_FDX, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_A_FDX, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_A_FDX, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_A_FDY, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_A_FDY, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(24, 26), V3D_QPU_A_FDY, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(28, 30), V3D_QPU_A_FDY, 71 },
+#define V3D_QPU_BRANCH_UB                   QPU_MASK(14, 14)
 
-	{ 246, 246, .raddr_mask = OP_RANGE(32, 34), V3D_QPU_A_ITOF, 71 },
-	{ 246, 246, .raddr_mask = OP_RANGE(36, 38), V3D_QPU_A_UTOF, 71 },
+#define V3D_QPU_ADD_A_SHIFT                 12
+#define V3D_QPU_ADD_A_MASK                  QPU_MASK(14, 12)
 
-	{ 247, 247, .raddr_mask = ANYOPMASK, V3D_QPU_A_VPACK, 71 },
-	{ 248, 248, .raddr_mask = ANYOPMASK, V3D_QPU_A_V8PACK, 71 },
+#define V3D_QPU_BRANCH_BDI_SHIFT            12
+#define V3D_QPU_BRANCH_BDI_MASK             QPU_MASK(13, 12)
 
-	{ 249, 249, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_A_FMOV, 71 },
-	{ 249, 249, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_A_FMOV, 71 },
-	{ 249, 249, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_A_FMOV, 71 },
-	{ 249, 249, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_A_FMOV, 71 },
-	{ 249, 249, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_A_FMOV, 71 },
-	{ 249, 249, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_A_FMOV, 71 },
-	{ 249, 249, .raddr_mask = OP_RANGE(24, 26), V3D_QPU_A_FMOV, 71 },
+#define V3D_QPU_RADDR_D_SHIFT               12
+#define V3D_QPU_RADDR_D_MASK                QPU_MASK(17, 12)
 
-	{ 249, 249, .raddr_mask = OP_MASK(3),  V3D_QPU_A_MOV, 71 },
-	{ 249, 249, .raddr_mask = OP_MASK(7),  V3D_QPU_A_MOV, 71 },
-	{ 249, 249, .raddr_mask = OP_MASK(11), V3D_QPU_A_MOV, 71 },
-	{ 249, 249, .raddr_mask = OP_MASK(15), V3D_QPU_A_MOV, 71 },
-	{ 249, 249, .raddr_mask = OP_MASK(19), V3D_QPU_A_MOV, 71 },
+#define V3D_QPU_RADDR_A_SHIFT               6
+#define V3D_QPU_RADDR_A_MASK                QPU_MASK(11, 6)
 
-	{ 250, 250, .raddr_mask = ANYOPMASK, V3D_QPU_A_V10PACK, 71 },
-	{ 251, 251, .raddr_mask = ANYOPMASK, V3D_QPU_A_V11FPACK, 71 },
-};
+#define V3D_QPU_RADDR_B_SHIFT               0
+#define V3D_QPU_RADDR_B_MASK                QPU_MASK(5, 0)
 
-static const struct opcode_desc mul_ops_v71[] = {
-	/* For V3D 7.1, second mask field would be ignored */
-	{ 1, 1, .raddr_mask = ANYOPMASK, V3D_QPU_M_ADD, 71 },
-	{ 2, 2, .raddr_mask = ANYOPMASK, V3D_QPU_M_SUB, 71 },
-	{ 3, 3, .raddr_mask = ANYOPMASK, V3D_QPU_M_UMUL24, 71 },
-	{ 3, 3, .raddr_mask = ANYOPMASK, V3D_QPU_M_UMUL24, 71 },
-	{ 4, 8, .raddr_mask = ANYOPMASK, V3D_QPU_M_VFMUL, 71 },
-	{ 9, 9, .raddr_mask = ANYOPMASK, V3D_QPU_M_SMUL24, 71 },
-	{ 10, 10, .raddr_mask = ANYOPMASK, V3D_QPU_M_MULTOP, 71 },
+#define THRSW .thrsw = TRUE
+#define LDUNIF .ldunif = TRUE
+#define LDUNIFRF .ldunifrf = TRUE
+#define LDUNIFA .ldunifa = TRUE
+#define LDUNIFARF .ldunifarf = TRUE
+#define LDTMU .ldtmu = TRUE
+#define LDVARY .ldvary = TRUE
+#define LDVPM .ldvpm = TRUE
+#define LDTLB .ldtlb = TRUE
+#define LDTLBU .ldtlbu = TRUE
+#define UCB .ucb = TRUE
+#define ROT .rotate = TRUE
+#define WRTMUC .wrtmuc = TRUE
+#define SMIMM_A .small_imm_a = TRUE
+#define SMIMM_B .small_imm_b = TRUE
+#define SMIMM_C .small_imm_c = TRUE
+#define SMIMM_D .small_imm_d = TRUE
 
-	{ 14, 14, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_M_FMOV, 71 },
-	{ 14, 14, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_M_FMOV, 71 },
-	{ 14, 14, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_M_FMOV, 71 },
-	{ 14, 14, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_M_FMOV, 71 },
-	{ 14, 14, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_M_FMOV, 71 },
-	{ 14, 14, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_M_FMOV, 71 },
+static const struct v3d_qpu_sig v33_sig_map[] = {
+	/*      MISC   R3       R4      R5 */
+	[0]  = {                               },
+	[1]  = { THRSW,                        },
+	[2]  = {                        LDUNIF },
+	[3]  = { THRSW,                 LDUNIF },
+	[4]  = {                LDTMU,         },
+	[5]  = { THRSW,         LDTMU,         },
+	[6]  = {                LDTMU,  LDUNIF },
+	[7]  = { THRSW,         LDTMU,  LDUNIF },
+	[8]  = {        LDVARY,                },
+	[9]  = { THRSW, LDVARY,                },
+	[10] = {        LDVARY,         LDUNIF },
+	[11] = { THRSW, LDVARY,         LDUNIF },
+	[12] = {        LDVARY, LDTMU,         },
+	[13] = { THRSW, LDVARY, LDTMU,         },
+	[14] = { SMIMM_B, LDVARY,              },
+	[15] = { SMIMM_B,                      },
+	[16] = {        LDTLB,                 },
+	[17] = {        LDTLBU,                },
+	/* 18-21 reserved */
+	[22] = { UCB,                          },
+	[23] = { ROT,                          },
+	[24] = {        LDVPM,                 },
+	[25] = { THRSW, LDVPM,                 },
+	[26] = {        LDVPM,          LDUNIF },
+	[27] = { THRSW, LDVPM,          LDUNIF },
+	[28] = {        LDVPM, LDTMU,          },
+	[29] = { THRSW, LDVPM, LDTMU,          },
+	[30] = { SMIMM_B, LDVPM,               },
+	[31] = { SMIMM_B,                      },
+};
 
-	{ 14, 14, .raddr_mask = OP_MASK(3),  V3D_QPU_M_MOV, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(7),  V3D_QPU_M_MOV, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(11), V3D_QPU_M_MOV, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(15), V3D_QPU_M_MOV, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(19), V3D_QPU_M_MOV, 71 },
+static const struct v3d_qpu_sig v40_sig_map[] = {
+	/*      MISC    R3      R4      R5 */
+	[0]  = {                               },
+	[1]  = { THRSW,                        },
+	[2]  = {                        LDUNIF },
+	[3]  = { THRSW,                 LDUNIF },
+	[4]  = {                LDTMU,         },
+	[5]  = { THRSW,         LDTMU,         },
+	[6]  = {                LDTMU,  LDUNIF },
+	[7]  = { THRSW,         LDTMU,  LDUNIF },
+	[8]  = {        LDVARY,                },
+	[9]  = { THRSW, LDVARY,                },
+	[10] = {        LDVARY,         LDUNIF },
+	[11] = { THRSW, LDVARY,         LDUNIF },
+	/* 12-13 reserved */
+	[14] = { SMIMM_B, LDVARY,              },
+	[15] = { SMIMM_B,                      },
+	[16] = {        LDTLB,                 },
+	[17] = {        LDTLBU,                },
+	[18] = {                        WRTMUC },
+	[19] = { THRSW,                 WRTMUC },
+	[20] = {        LDVARY,         WRTMUC },
+	[21] = { THRSW, LDVARY,         WRTMUC },
+	[22] = { UCB,                          },
+	[23] = { ROT,                          },
+	/* 24-30 reserved */
+	[31] = { SMIMM_B,       LDTMU,         },
+};
 
-	{ 14, 14, .raddr_mask = OP_MASK(32), V3D_QPU_M_FTOUNORM16, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(33), V3D_QPU_M_FTOSNORM16, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(34), V3D_QPU_M_VFTOUNORM8, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(35), V3D_QPU_M_VFTOSNORM8, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(48), V3D_QPU_M_VFTOUNORM10LO, 71 },
-	{ 14, 14, .raddr_mask = OP_MASK(49), V3D_QPU_M_VFTOUNORM10HI, 71 },
+static const struct v3d_qpu_sig v41_sig_map[] = {
+	/*      MISC       phys    R5 */
+	[0]  = {                          },
+	[1]  = { THRSW,                   },
+	[2]  = {                   LDUNIF },
+	[3]  = { THRSW,            LDUNIF },
+	[4]  = {           LDTMU,         },
+	[5]  = { THRSW,    LDTMU,         },
+	[6]  = {           LDTMU,  LDUNIF },
+	[7]  = { THRSW,    LDTMU,  LDUNIF },
+	[8]  = {           LDVARY,        },
+	[9]  = { THRSW,    LDVARY,        },
+	[10] = {           LDVARY, LDUNIF },
+	[11] = { THRSW,    LDVARY, LDUNIF },
+	[12] = { LDUNIFRF                 },
+	[13] = { THRSW,    LDUNIFRF       },
+	[14] = { SMIMM_B,    LDVARY       },
+	[15] = { SMIMM_B,                 },
+	[16] = {           LDTLB,         },
+	[17] = {           LDTLBU,        },
+	[18] = {                          WRTMUC },
+	[19] = { THRSW,                   WRTMUC },
+	[20] = {           LDVARY,        WRTMUC },
+	[21] = { THRSW,    LDVARY,        WRTMUC },
+	[22] = { UCB,                     },
+	[23] = { ROT,                     },
+	[24] = {                   LDUNIFA},
+	[25] = { LDUNIFARF                },
+	/* 26-30 reserved */
+	[31] = { SMIMM_B,          LDTMU, },
+};
 
-	{ 14, 14, .raddr_mask = OP_MASK(63), V3D_QPU_M_NOP, 71 },
 
-	{ 16, 63, .raddr_mask = ANYOPMASK, V3D_QPU_M_FMUL },
+static const struct v3d_qpu_sig v71_sig_map[] = {
+	/*      MISC       phys    RF0 */
+	[0]  = {                          },
+	[1]  = { THRSW,                   },
+	[2]  = {                   LDUNIF },
+	[3]  = { THRSW,            LDUNIF },
+	[4]  = {           LDTMU,         },
+	[5]  = { THRSW,    LDTMU,         },
+	[6]  = {           LDTMU,  LDUNIF },
+	[7]  = { THRSW,    LDTMU,  LDUNIF },
+	[8]  = {           LDVARY,        },
+	[9]  = { THRSW,    LDVARY,        },
+	[10] = {           LDVARY, LDUNIF },
+	[11] = { THRSW,    LDVARY, LDUNIF },
+	[12] = { LDUNIFRF                 },
+	[13] = { THRSW,    LDUNIFRF       },
+	[14] = { SMIMM_A,                 },
+	[15] = { SMIMM_B,                 },
+	[16] = {           LDTLB,         },
+	[17] = {           LDTLBU,        },
+	[18] = {                          WRTMUC },
+	[19] = { THRSW,                   WRTMUC },
+	[20] = {           LDVARY,        WRTMUC },
+	[21] = { THRSW,    LDVARY,        WRTMUC },
+	[22] = { UCB,                     },
+	/* 23 reserved */
+	[24] = {                   LDUNIFA},
+	[25] = { LDUNIFARF                },
+	/* 26-29 reserved */
+	[30] = { SMIMM_C,                 },
+	[31] = { SMIMM_D,                 },
 };
 
-/* Returns TRUE if op_desc should be filtered out based on devinfo->ver
- * against op_desc->first_ver and op_desc->last_ver. Check notes about
- * first_ver/last_ver on struct opcode_desc comments.
- */
-static v3d_bool
-opcode_invalid_in_version(const struct v3d_device_info *devinfo,
-                          const v3d_uint8 first_ver,
-                          const v3d_uint8 last_ver)
+v3d_bool
+v3d_qpu_sig_unpack(const struct v3d_device_info *devinfo,
+                   v3d_uint32 packed_sig,
+                   struct v3d_qpu_sig *sig)
 {
-	return (first_ver != 0 && devinfo->ver < first_ver) ||
-		(last_ver != 0  && devinfo->ver > last_ver);
-}
+	if (packed_sig >= V3D_ARRAY_SIZE(v33_sig_map))
+		return FALSE;
 
-/* Note that we pass as parameters mux_a, mux_b and raddr, even if depending
- * on the devinfo->ver some would be ignored. We do this way just to avoid
- * having two really similar lookup_opcode methods
- */
-static const struct opcode_desc *
-lookup_opcode_from_packed(const struct v3d_device_info *devinfo,
-                          const struct opcode_desc *opcodes,
-                          size_t num_opcodes, v3d_uint32 opcode,
-                          v3d_uint32 mux_a, v3d_uint32 mux_b,
-                          v3d_uint32 raddr)
-{
-	for (int i = 0; i < num_opcodes; i++) {
-		const struct opcode_desc *op_desc = &opcodes[i];
+	if (devinfo->ver >= 71)
+		*sig = v71_sig_map[packed_sig];
+	else if (devinfo->ver >= 41)
+		*sig = v41_sig_map[packed_sig];
+	else if (devinfo->ver == 40)
+		*sig = v40_sig_map[packed_sig];
+	else
+		*sig = v33_sig_map[packed_sig];
 
-		if (opcode < op_desc->opcode_first ||
-			opcode > op_desc->opcode_last)
-			continue;
+	/* Signals with zeroed unpacked contents after element 0 are reserved. */
+	return (packed_sig == 0 ||
+			memcmp(sig, &v33_sig_map[0], sizeof(*sig)) != 0);
+}
 
-		if (opcode_invalid_in_version(devinfo, op_desc->first_ver, op_desc->last_ver))
-			continue;
+v3d_bool
+v3d_qpu_sig_pack(const struct v3d_device_info *devinfo,
+                 const struct v3d_qpu_sig *sig,
+                 v3d_uint32 *packed_sig)
+{
+	static const struct v3d_qpu_sig *map;
 
-		if (devinfo->ver < 71) {
-			if (!(op_desc->mux.b_mask & (1 << mux_b)))
-				continue;
+	if (devinfo->ver >= 71)
+		map = v71_sig_map;
+	else if (devinfo->ver >= 41)
+		map = v41_sig_map;
+	else if (devinfo->ver == 40)
+		map = v40_sig_map;
+	else
+		map = v33_sig_map;
 
-			if (!(op_desc->mux.a_mask & (1 << mux_a)))
-				continue;
-		} else {
-			if (!(op_desc->raddr_mask & ((v3d_uint64) 1 << raddr)))
-				continue;
+	for (int i = 0; i < V3D_ARRAY_SIZE(v33_sig_map); i++) {
+		if (memcmp(&map[i], sig, sizeof(*sig)) == 0) {
+			*packed_sig = i;
+			return TRUE;
 		}
-
-		return op_desc;
 	}
 
-	return NULL;
+	return FALSE;
 }
 
-static v3d_bool
-v3d_qpu_float32_unpack_unpack(v3d_uint32 packed,
-                              enum v3d_qpu_input_unpack *unpacked)
-{
-	switch (packed) {
-	case 0:
-		*unpacked = V3D_QPU_UNPACK_ABS;
-		return TRUE;
-	case 1:
-		*unpacked = V3D_QPU_UNPACK_NONE;
-		return TRUE;
-	case 2:
-		*unpacked = V3D_QPU_UNPACK_L;
-		return TRUE;
-	case 3:
-		*unpacked = V3D_QPU_UNPACK_H;
-		return TRUE;
-	default:
-		return FALSE;
+static const v3d_uint32 small_immediates[] = {
+	0, 1, 2, 3,
+	4, 5, 6, 7,
+	8, 9, 10, 11,
+	12, 13, 14, 15,
+	-16, -15, -14, -13,
+	-12, -11, -10, -9,
+	-8, -7, -6, -5,
+	-4, -3, -2, -1,
+	0x3b800000, /* 2.0^-8 */
+	0x3c000000, /* 2.0^-7 */
+	0x3c800000, /* 2.0^-6 */
+	0x3d000000, /* 2.0^-5 */
+	0x3d800000, /* 2.0^-4 */
+	0x3e000000, /* 2.0^-3 */
+	0x3e800000, /* 2.0^-2 */
+	0x3f000000, /* 2.0^-1 */
+	0x3f800000, /* 2.0^0 */
+	0x40000000, /* 2.0^1 */
+	0x40800000, /* 2.0^2 */
+	0x41000000, /* 2.0^3 */
+	0x41800000, /* 2.0^4 */
+	0x42000000, /* 2.0^5 */
+	0x42800000, /* 2.0^6 */
+	0x43000000, /* 2.0^7 */
+};
+
+v3d_bool
+v3d_qpu_small_imm_unpack(const struct v3d_device_info *devinfo,
+                         v3d_uint32 packed_small_immediate,
+                         v3d_uint32 *small_immediate)
+{
+	if (packed_small_immediate >= V3D_ARRAY_SIZE(small_immediates))
+		return FALSE;
+
+	*small_immediate = small_immediates[packed_small_immediate];
+	return TRUE;
+}
+
+v3d_bool
+v3d_qpu_small_imm_pack(const struct v3d_device_info *devinfo,
+                       v3d_uint32 value,
+                       v3d_uint32 *packed_small_immediate)
+{
+	V3D_STATIC_ASSERT(V3D_V3D_ARRAY_SIZE(small_immediates) == 48);
+
+	for (int i = 0; i < V3D_ARRAY_SIZE(small_immediates); i++) {
+		if (small_immediates[i] == value) {
+			*packed_small_immediate = i;
+			return TRUE;
+		}
 	}
+
+	return FALSE;
 }
 
-static v3d_bool
-v3d_qpu_float32_unpack_pack(enum v3d_qpu_input_unpack unpacked,
-                            v3d_uint32 *packed)
+// See small_immediates[]. This array has everything to prompt the user what they can possibly provide.
+// small_immediates_packed_values[] should be used to get the proper packed immediate.
+static const char* small_immediates_names[] =
 {
-	switch (unpacked) {
-	case V3D_QPU_UNPACK_ABS:
-		*packed = 0;
-		return TRUE;
-	case V3D_QPU_UNPACK_NONE:
-		*packed = 1;
-		return TRUE;
-	case V3D_QPU_UNPACK_L:
-		*packed = 2;
-		return TRUE;
-	case V3D_QPU_UNPACK_H:
-		*packed = 3;
-		return TRUE;
-	default:
-		return FALSE;
+	"0", "1", "2", "3",
+	"4", "5", "6", "7",
+	"8", "9", "10", "11",
+	"12", "13", "14", "15",
+	"-16", "-15", "-14", "-13",
+	"-12", "-11", "-10", "-9",
+	"-8", "-7", "-6", "-5",
+	"-4", "-3", "-2", "-1",
+	// Extension by Macoy for referring to attributes past 15 in e.g. ldvpm. These CANNOT be used for math.
+	// TODO: Verify this is okay
+	"16", "17", "18", "19",
+	"20", "21", "22", "23",
+	"24", "25", "26", "27",
+	"28", "29", "30", "31",
+	// Extension by Macoy for writing these by humans
+	"2f^-8", "2f^-7", "2f^-6", "2f^-5",
+	"2f^-4", "2f^-3", "2f^-2", "2f^-1",
+	"2f^0", "2f^1", "2f^2", "2f^3",
+	"2f^4", "2f^5", "2f^6", "2f^7",
+	// Floating point exponents
+	"0x3b800000", /* 2.0^-8 */
+	"0x3c000000", /* 2.0^-7 */
+	"0x3c800000", /* 2.0^-6 */
+	"0x3d000000", /* 2.0^-5 */
+	"0x3d800000", /* 2.0^-4 */
+	"0x3e000000", /* 2.0^-3 */
+	"0x3e800000", /* 2.0^-2 */
+	"0x3f000000", /* 2.0^-1 */
+	"0x3f800000", /* 2.0^0 */
+	"0x40000000", /* 2.0^1 */
+	"0x40800000", /* 2.0^2 */
+	"0x41000000", /* 2.0^3 */
+	"0x41800000", /* 2.0^4 */
+	"0x42000000", /* 2.0^5 */
+	"0x42800000", /* 2.0^6 */
+	"0x43000000", /* 2.0^7 */
+};
+
+// Must correspond exactly with small_immediates_names[]
+static v3d_uint32 small_immediates_packed_indices[] =
+{
+	0, 1, 2, 3,
+	4, 5, 6, 7,
+	8, 9, 10, 11,
+	12, 13, 14, 15,
+	16, 17, 18, 19,
+	20, 21, 22, 23,
+	24, 25, 26, 27,
+	28, 29, 30, 31,
+	// Extension (positive to 31)
+	16, 17, 18, 19,
+	20, 21, 22, 23,
+	24, 25, 26, 27,
+	28, 29, 30, 31,
+	// Extension (2.0^x)
+	32, 33, 34, 35,
+	36, 37, 38, 39,
+	40, 41, 42, 43,
+	44, 45, 46, 47,
+	// Floating point exponents (hex)
+	32,
+	33,
+	34,
+	35,
+	36,
+	37,
+	38,
+	39,
+	40,
+	41,
+	42,
+	43,
+	44,
+	45,
+	46,
+	47,
+};
+
+// This accepts the following:
+// 0 through 15
+// -15 through -1
+// 16 through 31 (Extension; invalid for math)
+// 0x3b800000... (see small_immediates_names for valid hex constants)
+// 2^-8 through 2^7 (Extension)
+v3d_bool v3d_qpu_small_imm_from_name(const char* name, const char* end,
+                                     v3d_uint32* packed_small_immediate,
+                                     const char** endOfNameOut)
+{
+	for (int index = 0; index < V3D_ARRAY_SIZE(small_immediates_names); ++index)
+	{
+		if (v3d_symbol_equals(small_immediates_names[index], name, end, endOfNameOut))
+		{
+			*packed_small_immediate = small_immediates_packed_indices[index];
+			return TRUE;
+		}
 	}
+	return FALSE;
 }
 
-static v3d_bool
-v3d_qpu_int32_unpack_unpack(v3d_uint32 packed,
-                            enum v3d_qpu_input_unpack *unpacked)
+v3d_bool
+v3d_qpu_flags_unpack(const struct v3d_device_info *devinfo,
+                     v3d_uint32 packed_cond,
+                     struct v3d_qpu_flags *cond)
 {
-	switch (packed) {
-	case 0:
-		*unpacked = V3D_QPU_UNPACK_NONE;
-		return TRUE;
-	case 1:
-		*unpacked = V3D_QPU_UNPACK_UL;
-		return TRUE;
-	case 2:
-		*unpacked = V3D_QPU_UNPACK_UH;
-		return TRUE;
-	case 3:
-		*unpacked = V3D_QPU_UNPACK_IL;
-		return TRUE;
-	case 4:
-		*unpacked = V3D_QPU_UNPACK_IH;
+	static const enum v3d_qpu_cond cond_map[4] = {
+		[0] = V3D_QPU_COND_IFA,
+		[1] = V3D_QPU_COND_IFB,
+		[2] = V3D_QPU_COND_IFNA,
+		[3] = V3D_QPU_COND_IFNB,
+	};
+
+	cond->ac = V3D_QPU_COND_NONE;
+	cond->mc = V3D_QPU_COND_NONE;
+	cond->apf = V3D_QPU_PF_NONE;
+	cond->mpf = V3D_QPU_PF_NONE;
+	cond->auf = V3D_QPU_UF_NONE;
+	cond->muf = V3D_QPU_UF_NONE;
+
+	if (packed_cond == 0) {
 		return TRUE;
-	default:
+	} else if (packed_cond >> 2 == 0) {
+		cond->apf = packed_cond & 0x3;
+	} else if (packed_cond >> 4 == 0) {
+		cond->auf = (packed_cond & 0xf) - 4 + V3D_QPU_UF_ANDZ;
+	} else if (packed_cond == 0x10) {
 		return FALSE;
+	} else if (packed_cond >> 2 == 0x4) {
+		cond->mpf = packed_cond & 0x3;
+	} else if (packed_cond >> 4 == 0x1) {
+		cond->muf = (packed_cond & 0xf) - 4 + V3D_QPU_UF_ANDZ;
+	} else if (packed_cond >> 4 == 0x2) {
+		cond->ac = ((packed_cond >> 2) & 0x3) + V3D_QPU_COND_IFA;
+		cond->mpf = packed_cond & 0x3;
+	} else if (packed_cond >> 4 == 0x3) {
+		cond->mc = ((packed_cond >> 2) & 0x3) + V3D_QPU_COND_IFA;
+		cond->apf = packed_cond & 0x3;
+	} else if (packed_cond >> 6) {
+		cond->mc = cond_map[(packed_cond >> 4) & 0x3];
+		if (((packed_cond >> 2) & 0x3) == 0) {
+			cond->ac = cond_map[packed_cond & 0x3];
+		} else {
+			cond->auf = (packed_cond & 0xf) - 4 + V3D_QPU_UF_ANDZ;
+		}
+	}
+
+	return TRUE;
+}
+
+v3d_bool
+v3d_qpu_flags_pack(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_flags *cond,
+                   v3d_uint32 *packed_cond)
+{
+#define AC (1 << 0)
+#define MC (1 << 1)
+#define APF (1 << 2)
+#define MPF (1 << 3)
+#define AUF (1 << 4)
+#define MUF (1 << 5)
+	static const struct {
+		v3d_uint8 flags_present;
+		v3d_uint8 bits;
+	} flags_table[] = {
+		{ 0,        0 },
+		{ APF,      0 },
+		{ AUF,      0 },
+		{ MPF,      (1 << 4) },
+		{ MUF,      (1 << 4) },
+		{ AC,       (1 << 5) },
+		{ AC | MPF, (1 << 5) },
+		{ MC,       (1 << 5) | (1 << 4) },
+		{ MC | APF, (1 << 5) | (1 << 4) },
+		{ MC | AC,  (1 << 6) },
+		{ MC | AUF, (1 << 6) },
+	};
+
+	v3d_uint8 flags_present = 0;
+	if (cond->ac != V3D_QPU_COND_NONE)
+		flags_present |= AC;
+	if (cond->mc != V3D_QPU_COND_NONE)
+		flags_present |= MC;
+	if (cond->apf != V3D_QPU_PF_NONE)
+		flags_present |= APF;
+	if (cond->mpf != V3D_QPU_PF_NONE)
+		flags_present |= MPF;
+	if (cond->auf != V3D_QPU_UF_NONE)
+		flags_present |= AUF;
+	if (cond->muf != V3D_QPU_UF_NONE)
+		flags_present |= MUF;
+
+	for (int i = 0; i < V3D_ARRAY_SIZE(flags_table); i++) {
+		if (flags_table[i].flags_present != flags_present)
+			continue;
+
+		*packed_cond = flags_table[i].bits;
+
+		*packed_cond |= cond->apf;
+		*packed_cond |= cond->mpf;
+
+		if (flags_present & AUF)
+			*packed_cond |= cond->auf - V3D_QPU_UF_ANDZ + 4;
+		if (flags_present & MUF)
+			*packed_cond |= cond->muf - V3D_QPU_UF_ANDZ + 4;
+
+		if (flags_present & AC) {
+			if (*packed_cond & (1 << 6))
+				*packed_cond |= cond->ac - V3D_QPU_COND_IFA;
+			else
+				*packed_cond |= (cond->ac -
+								 V3D_QPU_COND_IFA) << 2;
+		}
+
+		if (flags_present & MC) {
+			if (*packed_cond & (1 << 6))
+				*packed_cond |= (cond->mc -
+								 V3D_QPU_COND_IFA) << 4;
+			else
+				*packed_cond |= (cond->mc -
+								 V3D_QPU_COND_IFA) << 2;
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Make a mapping of the table of opcodes in the spec.  The opcode is
+ * determined by a combination of the opcode field, and in the case of 0 or
+ * 1-arg opcodes, the mux (version <= 42) or raddr (version >= 71) field as
+ * well.
+ */
+/** Set a single bit */
+#define BITFIELD64_BIT(b)      (1ull << (b))
+/** Set all bits up to excluding bit b */
+#define BITFIELD64_MASK(b)									\
+	((b) == 64 ? (~0ull) : BITFIELD64_BIT((b) & 63) - 1)
+/** Set count bits starting from bit b  */
+#define BITFIELD64_RANGE(b, count)							\
+	(BITFIELD64_MASK((b) + (count)) & ~BITFIELD64_MASK(b))
+#define OP_MASK(val) BITFIELD64_BIT(val)
+#define OP_RANGE(bot, top) BITFIELD64_RANGE(bot, top - bot + 1)
+#define ANYMUX OP_RANGE(0, 7)
+#define ANYOPMASK OP_RANGE(0, 63)
+
+struct opcode_desc {
+	v3d_uint8 opcode_first;
+	v3d_uint8 opcode_last;
+
+	union {
+		struct {
+			v3d_uint8 b_mask;
+			v3d_uint8 a_mask;
+		} mux;
+		v3d_uint64 raddr_mask;
+	};
+
+	v3d_uint8 op;
+
+	/* first_ver == 0 if it's the same across all V3D versions.
+	 * first_ver == X, last_ver == 0 if it's the same for all V3D versions
+	 *   starting from X
+	 * first_ver == X, last_ver == Y if it's the same for all V3D versions
+	 *   on the range X through Y
+	 */
+	v3d_uint8 first_ver;
+	v3d_uint8 last_ver;
+};
+
+static const struct opcode_desc add_ops_v33[] = {
+	/* FADD is FADDNF depending on the order of the mux_a/mux_b. */
+	{ 0,   47,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FADD },
+	{ 0,   47,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FADDNF },
+	{ 53,  55,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFPACK },
+	{ 56,  56,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_ADD },
+	{ 57,  59,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFPACK },
+	{ 60,  60,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_SUB },
+	{ 61,  63,  .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFPACK },
+	{ 64,  111, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FSUB },
+	{ 120, 120, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_MIN },
+	{ 121, 121, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_MAX },
+	{ 122, 122, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_UMIN },
+	{ 123, 123, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_UMAX },
+	{ 124, 124, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_SHL },
+	{ 125, 125, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_SHR },
+	{ 126, 126, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_ASR },
+	{ 127, 127, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_ROR },
+	/* FMIN is instead FMAX depending on the order of the mux_a/mux_b. */
+	{ 128, 175, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FMIN },
+	{ 128, 175, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FMAX },
+	{ 176, 180, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFMIN },
+
+	{ 181, 181, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_AND },
+	{ 182, 182, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_OR },
+	{ 183, 183, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_XOR },
+
+	{ 184, 184, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VADD },
+	{ 185, 185, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VSUB },
+	{ 186, 186, .mux.b_mask = OP_MASK(0), .mux.a_mask = ANYMUX, V3D_QPU_A_NOT },
+	{ 186, 186, .mux.b_mask = OP_MASK(1), .mux.a_mask = ANYMUX, V3D_QPU_A_NEG },
+	{ 186, 186, .mux.b_mask = OP_MASK(2), .mux.a_mask = ANYMUX, V3D_QPU_A_FLAPUSH },
+	{ 186, 186, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_FLBPUSH },
+	{ 186, 186, .mux.b_mask = OP_MASK(4), .mux.a_mask = ANYMUX, V3D_QPU_A_FLPOP },
+	{ 186, 186, .mux.b_mask = OP_MASK(5), .mux.a_mask = ANYMUX, V3D_QPU_A_RECIP },
+	{ 186, 186, .mux.b_mask = OP_MASK(6), .mux.a_mask = ANYMUX, V3D_QPU_A_SETMSF },
+	{ 186, 186, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_SETREVF },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(0), V3D_QPU_A_NOP, 0 },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(1), V3D_QPU_A_TIDX },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(2), V3D_QPU_A_EIDX },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(3), V3D_QPU_A_LR },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(4), V3D_QPU_A_VFLA },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(5), V3D_QPU_A_VFLNA },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(6), V3D_QPU_A_VFLB },
+	{ 187, 187, .mux.b_mask = OP_MASK(0), .mux.a_mask = OP_MASK(7), V3D_QPU_A_VFLNB },
+
+	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_RANGE(0, 2), V3D_QPU_A_FXCD },
+	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_MASK(3), V3D_QPU_A_XCD },
+	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_RANGE(4, 6), V3D_QPU_A_FYCD },
+	{ 187, 187, .mux.b_mask = OP_MASK(1), .mux.a_mask = OP_MASK(7), V3D_QPU_A_YCD },
+
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(0), V3D_QPU_A_MSF },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(1), V3D_QPU_A_REVF },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(2), V3D_QPU_A_VDWWT, 33 },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(2), V3D_QPU_A_IID, 40 },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(3), V3D_QPU_A_SAMPID, 40 },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(4), V3D_QPU_A_BARRIERID, 40 },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(5), V3D_QPU_A_TMUWT },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(6), V3D_QPU_A_VPMWT },
+	{ 187, 187, .mux.b_mask = OP_MASK(2), .mux.a_mask = OP_MASK(7), V3D_QPU_A_FLAFIRST, 41 },
+	{ 187, 187, .mux.b_mask = OP_MASK(3), .mux.a_mask = OP_MASK(0), V3D_QPU_A_FLNAFIRST, 41 },
+	{ 187, 187, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_VPMSETUP, 33 },
+
+	{ 188, 188, .mux.b_mask = OP_MASK(0), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMV_IN, 40 },
+	{ 188, 188, .mux.b_mask = OP_MASK(0), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMV_OUT, 40 },
+	{ 188, 188, .mux.b_mask = OP_MASK(1), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMD_IN, 40 },
+	{ 188, 188, .mux.b_mask = OP_MASK(1), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMD_OUT, 40 },
+	{ 188, 188, .mux.b_mask = OP_MASK(2), .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMP, 40 },
+	{ 188, 188, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_RSQRT, 41 },
+	{ 188, 188, .mux.b_mask = OP_MASK(4), .mux.a_mask = ANYMUX, V3D_QPU_A_EXP, 41 },
+	{ 188, 188, .mux.b_mask = OP_MASK(5), .mux.a_mask = ANYMUX, V3D_QPU_A_LOG, 41 },
+	{ 188, 188, .mux.b_mask = OP_MASK(6), .mux.a_mask = ANYMUX, V3D_QPU_A_SIN, 41 },
+	{ 188, 188, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_RSQRT2, 41 },
+	{ 189, 189, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMG_IN, 40 },
+	{ 189, 189, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_LDVPMG_OUT, 40 },
+
+	/* FIXME: MORE COMPLICATED */
+	/* { 190, 191, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFMOVABSNEGNAB }, */
+
+	{ 192, 239, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_FCMP },
+	{ 240, 244, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_VFMAX },
+
+	{ 245, 245, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_FROUND },
+	{ 245, 245, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOIN },
+	{ 245, 245, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_FTRUNC },
+	{ 245, 245, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOIZ },
+	{ 246, 246, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_FFLOOR },
+	{ 246, 246, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOUZ },
+	{ 246, 246, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_FCEIL },
+	{ 246, 246, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_A_FTOC },
+
+	{ 247, 247, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_FDX },
+	{ 247, 247, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_FDY },
+
+	/* The stvpms are distinguished by the waddr field. */
+	{ 248, 248, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_STVPMV },
+	{ 248, 248, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_STVPMD },
+	{ 248, 248, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_A_STVPMP },
+
+	{ 252, 252, .mux.b_mask = OP_RANGE(0, 2), .mux.a_mask = ANYMUX, V3D_QPU_A_ITOF },
+	{ 252, 252, .mux.b_mask = OP_MASK(3), .mux.a_mask = ANYMUX, V3D_QPU_A_CLZ },
+	{ 252, 252, .mux.b_mask = OP_RANGE(4, 6), .mux.a_mask = ANYMUX, V3D_QPU_A_UTOF },
+};
+
+static const struct opcode_desc mul_ops_v33[] = {
+	{ 1, 1, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_ADD },
+	{ 2, 2, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_SUB },
+	{ 3, 3, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_UMUL24 },
+	{ 4, 8, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_VFMUL },
+	{ 9, 9, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_SMUL24 },
+	{ 10, 10, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_MULTOP },
+	{ 14, 14, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_FMOV, 33, 42 },
+	{ 15, 15, .mux.b_mask = OP_RANGE(0, 3), ANYMUX, V3D_QPU_M_FMOV, 33, 42},
+	{ 15, 15, .mux.b_mask = OP_MASK(4), .mux.a_mask = OP_MASK(0), V3D_QPU_M_NOP, 33, 42 },
+	{ 15, 15, .mux.b_mask = OP_MASK(7), .mux.a_mask = ANYMUX, V3D_QPU_M_MOV, 33, 42 },
+
+	{ 16, 63, .mux.b_mask = ANYMUX, .mux.a_mask = ANYMUX, V3D_QPU_M_FMUL },
+};
+
+/* Note that it would have been possible to define all the add/mul opcodes in
+ * just one table, using the first_ver/last_ver. But taking into account that
+ * for v71 there were a lot of changes, it was more tidy this way. Also right
+ * now we are doing a linear search on those tables, so this maintains the
+ * tables smaller.
+ *
+ * Just in case we merge the tables, we define the first_ver as 71 for those
+ * opcodes that changed on v71
+ */
+static const struct opcode_desc add_ops_v71[] = {
+	/* FADD is FADDNF depending on the order of the raddr_a/raddr_b. */
+	{ 0,   47,  .raddr_mask = ANYOPMASK, V3D_QPU_A_FADD },
+	{ 0,   47,  .raddr_mask = ANYOPMASK, V3D_QPU_A_FADDNF },
+	{ 53,  55,  .raddr_mask = ANYOPMASK, V3D_QPU_A_VFPACK },
+	{ 56,  56,  .raddr_mask = ANYOPMASK, V3D_QPU_A_ADD },
+	{ 57,  59,  .raddr_mask = ANYOPMASK, V3D_QPU_A_VFPACK },
+	{ 60,  60,  .raddr_mask = ANYOPMASK, V3D_QPU_A_SUB },
+	{ 61,  63,  .raddr_mask = ANYOPMASK, V3D_QPU_A_VFPACK },
+	{ 64,  111, .raddr_mask = ANYOPMASK, V3D_QPU_A_FSUB },
+	{ 120, 120, .raddr_mask = ANYOPMASK, V3D_QPU_A_MIN },
+	{ 121, 121, .raddr_mask = ANYOPMASK, V3D_QPU_A_MAX },
+	{ 122, 122, .raddr_mask = ANYOPMASK, V3D_QPU_A_UMIN },
+	{ 123, 123, .raddr_mask = ANYOPMASK, V3D_QPU_A_UMAX },
+	{ 124, 124, .raddr_mask = ANYOPMASK, V3D_QPU_A_SHL },
+	{ 125, 125, .raddr_mask = ANYOPMASK, V3D_QPU_A_SHR },
+	{ 126, 126, .raddr_mask = ANYOPMASK, V3D_QPU_A_ASR },
+	{ 127, 127, .raddr_mask = ANYOPMASK, V3D_QPU_A_ROR },
+	/* FMIN is instead FMAX depending on the raddr_a/b order. */
+	{ 128, 175, .raddr_mask = ANYOPMASK, V3D_QPU_A_FMIN },
+	{ 128, 175, .raddr_mask = ANYOPMASK, V3D_QPU_A_FMAX },
+	{ 176, 180, .raddr_mask = ANYOPMASK, V3D_QPU_A_VFMIN },
+
+	{ 181, 181, .raddr_mask = ANYOPMASK, V3D_QPU_A_AND },
+	{ 182, 182, .raddr_mask = ANYOPMASK, V3D_QPU_A_OR },
+	{ 183, 183, .raddr_mask = ANYOPMASK, V3D_QPU_A_XOR },
+	{ 184, 184, .raddr_mask = ANYOPMASK, V3D_QPU_A_VADD },
+	{ 185, 185, .raddr_mask = ANYOPMASK, V3D_QPU_A_VSUB },
+
+	{ 186, 186, .raddr_mask = OP_MASK(0), V3D_QPU_A_NOT },
+	{ 186, 186, .raddr_mask = OP_MASK(1), V3D_QPU_A_NEG },
+	{ 186, 186, .raddr_mask = OP_MASK(2), V3D_QPU_A_FLAPUSH },
+	{ 186, 186, .raddr_mask = OP_MASK(3), V3D_QPU_A_FLBPUSH },
+	{ 186, 186, .raddr_mask = OP_MASK(4), V3D_QPU_A_FLPOP },
+	{ 186, 186, .raddr_mask = OP_MASK(5), V3D_QPU_A_CLZ },
+	{ 186, 186, .raddr_mask = OP_MASK(6), V3D_QPU_A_SETMSF },
+	{ 186, 186, .raddr_mask = OP_MASK(7), V3D_QPU_A_SETREVF },
+
+	{ 187, 187, .raddr_mask = OP_MASK(0), V3D_QPU_A_NOP, 0 },
+	{ 187, 187, .raddr_mask = OP_MASK(1), V3D_QPU_A_TIDX },
+	{ 187, 187, .raddr_mask = OP_MASK(2), V3D_QPU_A_EIDX },
+	{ 187, 187, .raddr_mask = OP_MASK(3), V3D_QPU_A_LR },
+	{ 187, 187, .raddr_mask = OP_MASK(4), V3D_QPU_A_VFLA },
+	{ 187, 187, .raddr_mask = OP_MASK(5), V3D_QPU_A_VFLNA },
+	{ 187, 187, .raddr_mask = OP_MASK(6), V3D_QPU_A_VFLB },
+	{ 187, 187, .raddr_mask = OP_MASK(7), V3D_QPU_A_VFLNB },
+	{ 187, 187, .raddr_mask = OP_MASK(8), V3D_QPU_A_XCD },
+	{ 187, 187, .raddr_mask = OP_MASK(9), V3D_QPU_A_YCD },
+	{ 187, 187, .raddr_mask = OP_MASK(10), V3D_QPU_A_MSF },
+	{ 187, 187, .raddr_mask = OP_MASK(11), V3D_QPU_A_REVF },
+	{ 187, 187, .raddr_mask = OP_MASK(12), V3D_QPU_A_IID },
+	{ 187, 187, .raddr_mask = OP_MASK(13), V3D_QPU_A_SAMPID },
+	{ 187, 187, .raddr_mask = OP_MASK(14), V3D_QPU_A_BARRIERID },
+	{ 187, 187, .raddr_mask = OP_MASK(15), V3D_QPU_A_TMUWT },
+	{ 187, 187, .raddr_mask = OP_MASK(16), V3D_QPU_A_VPMWT },
+	{ 187, 187, .raddr_mask = OP_MASK(17), V3D_QPU_A_FLAFIRST },
+	{ 187, 187, .raddr_mask = OP_MASK(18), V3D_QPU_A_FLNAFIRST },
+
+	{ 187, 187, .raddr_mask = OP_RANGE(32, 34), V3D_QPU_A_FXCD },
+	{ 187, 187, .raddr_mask = OP_RANGE(36, 38), V3D_QPU_A_FYCD },
+
+	{ 188, 188, .raddr_mask = OP_MASK(0), V3D_QPU_A_LDVPMV_IN, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(1), V3D_QPU_A_LDVPMD_IN, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(2), V3D_QPU_A_LDVPMP, 71 },
+
+	{ 188, 188, .raddr_mask = OP_MASK(32), V3D_QPU_A_RECIP, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(33), V3D_QPU_A_RSQRT, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(34), V3D_QPU_A_EXP, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(35), V3D_QPU_A_LOG, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(36), V3D_QPU_A_SIN, 71 },
+	{ 188, 188, .raddr_mask = OP_MASK(37), V3D_QPU_A_RSQRT2, 71 },
+
+	{ 189, 189, .raddr_mask = ANYOPMASK, V3D_QPU_A_LDVPMG_IN, 71 },
+
+	/* The stvpms are distinguished by the waddr field. */
+	{ 190, 190, .raddr_mask = ANYOPMASK, V3D_QPU_A_STVPMV, 71},
+	{ 190, 190, .raddr_mask = ANYOPMASK, V3D_QPU_A_STVPMD, 71},
+	{ 190, 190, .raddr_mask = ANYOPMASK, V3D_QPU_A_STVPMP, 71},
+
+	{ 192, 207, .raddr_mask = ANYOPMASK, V3D_QPU_A_FCMP, 71 },
+
+	{ 245, 245, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_A_FROUND, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_A_FROUND, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_A_FROUND, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_A_FROUND, 71 },
+
+	{ 245, 245, .raddr_mask = OP_MASK(3),  V3D_QPU_A_FTOIN, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(7),  V3D_QPU_A_FTOIN, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(11), V3D_QPU_A_FTOIN, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(15), V3D_QPU_A_FTOIN, 71 },
+
+	{ 245, 245, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_A_FTRUNC, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_A_FTRUNC, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(24, 26), V3D_QPU_A_FTRUNC, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(28, 30), V3D_QPU_A_FTRUNC, 71 },
+
+	{ 245, 245, .raddr_mask = OP_MASK(19), V3D_QPU_A_FTOIZ, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(23), V3D_QPU_A_FTOIZ, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(27), V3D_QPU_A_FTOIZ, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(31), V3D_QPU_A_FTOIZ, 71 },
+
+	{ 245, 245, .raddr_mask = OP_RANGE(32, 34), V3D_QPU_A_FFLOOR, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(36, 38), V3D_QPU_A_FFLOOR, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(40, 42), V3D_QPU_A_FFLOOR, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(44, 46), V3D_QPU_A_FFLOOR, 71 },
+
+	{ 245, 245, .raddr_mask = OP_MASK(35), V3D_QPU_A_FTOUZ, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(39), V3D_QPU_A_FTOUZ, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(43), V3D_QPU_A_FTOUZ, 71 },
+	{ 245, 245, .raddr_mask = OP_MASK(47), V3D_QPU_A_FTOUZ, 71 },
+
+	{ 245, 245, .raddr_mask = OP_RANGE(48, 50), V3D_QPU_A_FCEIL, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(52, 54), V3D_QPU_A_FCEIL, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(56, 58), V3D_QPU_A_FCEIL, 71 },
+	{ 245, 245, .raddr_mask = OP_RANGE(60, 62), V3D_QPU_A_FCEIL, 71 },
+
+	{ 245, 245, .raddr_mask = OP_MASK(51), V3D_QPU_A_FTOC },
+	{ 245, 245, .raddr_mask = OP_MASK(55), V3D_QPU_A_FTOC },
+	{ 245, 245, .raddr_mask = OP_MASK(59), V3D_QPU_A_FTOC },
+	{ 245, 245, .raddr_mask = OP_MASK(63), V3D_QPU_A_FTOC },
+
+	{ 246, 246, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_A_FDX, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_A_FDX, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_A_FDX, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_A_FDX, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_A_FDY, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_A_FDY, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(24, 26), V3D_QPU_A_FDY, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(28, 30), V3D_QPU_A_FDY, 71 },
+
+	{ 246, 246, .raddr_mask = OP_RANGE(32, 34), V3D_QPU_A_ITOF, 71 },
+	{ 246, 246, .raddr_mask = OP_RANGE(36, 38), V3D_QPU_A_UTOF, 71 },
+
+	{ 247, 247, .raddr_mask = ANYOPMASK, V3D_QPU_A_VPACK, 71 },
+	{ 248, 248, .raddr_mask = ANYOPMASK, V3D_QPU_A_V8PACK, 71 },
+
+	{ 249, 249, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_A_FMOV, 71 },
+	{ 249, 249, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_A_FMOV, 71 },
+	{ 249, 249, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_A_FMOV, 71 },
+	{ 249, 249, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_A_FMOV, 71 },
+	{ 249, 249, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_A_FMOV, 71 },
+	{ 249, 249, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_A_FMOV, 71 },
+	{ 249, 249, .raddr_mask = OP_RANGE(24, 26), V3D_QPU_A_FMOV, 71 },
+
+	{ 249, 249, .raddr_mask = OP_MASK(3),  V3D_QPU_A_MOV, 71 },
+	{ 249, 249, .raddr_mask = OP_MASK(7),  V3D_QPU_A_MOV, 71 },
+	{ 249, 249, .raddr_mask = OP_MASK(11), V3D_QPU_A_MOV, 71 },
+	{ 249, 249, .raddr_mask = OP_MASK(15), V3D_QPU_A_MOV, 71 },
+	{ 249, 249, .raddr_mask = OP_MASK(19), V3D_QPU_A_MOV, 71 },
+
+	{ 250, 250, .raddr_mask = ANYOPMASK, V3D_QPU_A_V10PACK, 71 },
+	{ 251, 251, .raddr_mask = ANYOPMASK, V3D_QPU_A_V11FPACK, 71 },
+};
+
+static const struct opcode_desc mul_ops_v71[] = {
+	/* For V3D 7.1, second mask field would be ignored */
+	{ 1, 1, .raddr_mask = ANYOPMASK, V3D_QPU_M_ADD, 71 },
+	{ 2, 2, .raddr_mask = ANYOPMASK, V3D_QPU_M_SUB, 71 },
+	{ 3, 3, .raddr_mask = ANYOPMASK, V3D_QPU_M_UMUL24, 71 },
+	{ 3, 3, .raddr_mask = ANYOPMASK, V3D_QPU_M_UMUL24, 71 },
+	{ 4, 8, .raddr_mask = ANYOPMASK, V3D_QPU_M_VFMUL, 71 },
+	{ 9, 9, .raddr_mask = ANYOPMASK, V3D_QPU_M_SMUL24, 71 },
+	{ 10, 10, .raddr_mask = ANYOPMASK, V3D_QPU_M_MULTOP, 71 },
+
+	{ 14, 14, .raddr_mask = OP_RANGE(0, 2),   V3D_QPU_M_FMOV, 71 },
+	{ 14, 14, .raddr_mask = OP_RANGE(4, 6),   V3D_QPU_M_FMOV, 71 },
+	{ 14, 14, .raddr_mask = OP_RANGE(8, 10),  V3D_QPU_M_FMOV, 71 },
+	{ 14, 14, .raddr_mask = OP_RANGE(12, 14), V3D_QPU_M_FMOV, 71 },
+	{ 14, 14, .raddr_mask = OP_RANGE(16, 18), V3D_QPU_M_FMOV, 71 },
+	{ 14, 14, .raddr_mask = OP_RANGE(20, 22), V3D_QPU_M_FMOV, 71 },
+
+	{ 14, 14, .raddr_mask = OP_MASK(3),  V3D_QPU_M_MOV, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(7),  V3D_QPU_M_MOV, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(11), V3D_QPU_M_MOV, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(15), V3D_QPU_M_MOV, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(19), V3D_QPU_M_MOV, 71 },
+
+	{ 14, 14, .raddr_mask = OP_MASK(32), V3D_QPU_M_FTOUNORM16, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(33), V3D_QPU_M_FTOSNORM16, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(34), V3D_QPU_M_VFTOUNORM8, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(35), V3D_QPU_M_VFTOSNORM8, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(48), V3D_QPU_M_VFTOUNORM10LO, 71 },
+	{ 14, 14, .raddr_mask = OP_MASK(49), V3D_QPU_M_VFTOUNORM10HI, 71 },
+
+	{ 14, 14, .raddr_mask = OP_MASK(63), V3D_QPU_M_NOP, 71 },
+
+	{ 16, 63, .raddr_mask = ANYOPMASK, V3D_QPU_M_FMUL },
+};
+
+/* Returns TRUE if op_desc should be filtered out based on devinfo->ver
+ * against op_desc->first_ver and op_desc->last_ver. Check notes about
+ * first_ver/last_ver on struct opcode_desc comments.
+ */
+static v3d_bool
+opcode_invalid_in_version(const struct v3d_device_info *devinfo,
+                          const v3d_uint8 first_ver,
+                          const v3d_uint8 last_ver)
+{
+	return (first_ver != 0 && devinfo->ver < first_ver) ||
+		(last_ver != 0  && devinfo->ver > last_ver);
+}
+
+/* Note that we pass as parameters mux_a, mux_b and raddr, even if depending
+ * on the devinfo->ver some would be ignored. We do this way just to avoid
+ * having two really similar lookup_opcode methods
+ */
+static const struct opcode_desc *
+lookup_opcode_from_packed(const struct v3d_device_info *devinfo,
+                          const struct opcode_desc *opcodes,
+                          size_t num_opcodes, v3d_uint32 opcode,
+                          v3d_uint32 mux_a, v3d_uint32 mux_b,
+                          v3d_uint32 raddr)
+{
+	for (int i = 0; i < num_opcodes; i++) {
+		const struct opcode_desc *op_desc = &opcodes[i];
+
+		if (opcode < op_desc->opcode_first ||
+			opcode > op_desc->opcode_last)
+			continue;
+
+		if (opcode_invalid_in_version(devinfo, op_desc->first_ver, op_desc->last_ver))
+			continue;
+
+		if (devinfo->ver < 71) {
+			if (!(op_desc->mux.b_mask & (1 << mux_b)))
+				continue;
+
+			if (!(op_desc->mux.a_mask & (1 << mux_a)))
+				continue;
+		} else {
+			if (!(op_desc->raddr_mask & ((v3d_uint64) 1 << raddr)))
+				continue;
+		}
+
+		return op_desc;
+	}
+
+	return NULL;
+}
+
+static v3d_bool
+v3d_qpu_float32_unpack_unpack(v3d_uint32 packed,
+                              enum v3d_qpu_input_unpack *unpacked)
+{
+	switch (packed) {
+	case 0:
+		*unpacked = V3D_QPU_UNPACK_ABS;
+		return TRUE;
+	case 1:
+		*unpacked = V3D_QPU_UNPACK_NONE;
+		return TRUE;
+	case 2:
+		*unpacked = V3D_QPU_UNPACK_L;
+		return TRUE;
+	case 3:
+		*unpacked = V3D_QPU_UNPACK_H;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d_qpu_float32_unpack_pack(enum v3d_qpu_input_unpack unpacked,
+                            v3d_uint32 *packed)
+{
+	switch (unpacked) {
+	case V3D_QPU_UNPACK_ABS:
+		*packed = 0;
+		return TRUE;
+	case V3D_QPU_UNPACK_NONE:
+		*packed = 1;
+		return TRUE;
+	case V3D_QPU_UNPACK_L:
+		*packed = 2;
+		return TRUE;
+	case V3D_QPU_UNPACK_H:
+		*packed = 3;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d_qpu_int32_unpack_unpack(v3d_uint32 packed,
+                            enum v3d_qpu_input_unpack *unpacked)
+{
+	switch (packed) {
+	case 0:
+		*unpacked = V3D_QPU_UNPACK_NONE;
+		return TRUE;
+	case 1:
+		*unpacked = V3D_QPU_UNPACK_UL;
+		return TRUE;
+	case 2:
+		*unpacked = V3D_QPU_UNPACK_UH;
+		return TRUE;
+	case 3:
+		*unpacked = V3D_QPU_UNPACK_IL;
+		return TRUE;
+	case 4:
+		*unpacked = V3D_QPU_UNPACK_IH;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d_qpu_int32_unpack_pack(enum v3d_qpu_input_unpack unpacked,
+                          v3d_uint32 *packed)
+{
+	switch (unpacked) {
+	case V3D_QPU_UNPACK_NONE:
+		*packed = 0;
+		return TRUE;
+	case V3D_QPU_UNPACK_UL:
+		*packed = 1;
+		return TRUE;
+	case V3D_QPU_UNPACK_UH:
+		*packed = 2;
+		return TRUE;
+	case V3D_QPU_UNPACK_IL:
+		*packed = 3;
+		return TRUE;
+	case V3D_QPU_UNPACK_IH:
+		*packed = 4;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d_qpu_float16_unpack_unpack(v3d_uint32 packed,
+                              enum v3d_qpu_input_unpack *unpacked)
+{
+	switch (packed) {
+	case 0:
+		*unpacked = V3D_QPU_UNPACK_NONE;
+		return TRUE;
+	case 1:
+		*unpacked = V3D_QPU_UNPACK_REPLICATE_32F_16;
+		return TRUE;
+	case 2:
+		*unpacked = V3D_QPU_UNPACK_REPLICATE_L_16;
+		return TRUE;
+	case 3:
+		*unpacked = V3D_QPU_UNPACK_REPLICATE_H_16;
+		return TRUE;
+	case 4:
+		*unpacked = V3D_QPU_UNPACK_SWAP_16;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d_qpu_float16_unpack_pack(enum v3d_qpu_input_unpack unpacked,
+                            v3d_uint32 *packed)
+{
+	switch (unpacked) {
+	case V3D_QPU_UNPACK_NONE:
+		*packed = 0;
+		return TRUE;
+	case V3D_QPU_UNPACK_REPLICATE_32F_16:
+		*packed = 1;
+		return TRUE;
+	case V3D_QPU_UNPACK_REPLICATE_L_16:
+		*packed = 2;
+		return TRUE;
+	case V3D_QPU_UNPACK_REPLICATE_H_16:
+		*packed = 3;
+		return TRUE;
+	case V3D_QPU_UNPACK_SWAP_16:
+		*packed = 4;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d_qpu_float32_pack_pack(enum v3d_qpu_output_pack pack,
+                          v3d_uint32 *packed)
+{
+	switch (pack) {
+	case V3D_QPU_PACK_NONE:
+		*packed = 0;
+		return TRUE;
+	case V3D_QPU_PACK_L:
+		*packed = 1;
+		return TRUE;
+	case V3D_QPU_PACK_H:
+		*packed = 2;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static v3d_bool
+v3d33_qpu_add_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
+                     struct v3d_qpu_instr *instr)
+{
+	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_ADD);
+	v3d_uint32 mux_a = QPU_GET_FIELD(packed_inst, V3D_QPU_ADD_A);
+	v3d_uint32 mux_b = QPU_GET_FIELD(packed_inst, V3D_QPU_ADD_B);
+	v3d_uint32 waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+
+	v3d_uint32 map_op = op;
+	/* Some big clusters of opcodes are replicated with unpack
+	 * flags
+	 */
+	if (map_op >= 249 && map_op <= 251)
+		map_op = (map_op - 249 + 245);
+	if (map_op >= 253 && map_op <= 255)
+		map_op = (map_op - 253 + 245);
+
+	const struct opcode_desc *desc =
+		lookup_opcode_from_packed(devinfo, add_ops_v33,
+								  V3D_ARRAY_SIZE(add_ops_v33),
+								  map_op, mux_a, mux_b, 0);
+
+	if (!desc)
+		return FALSE;
+
+	instr->alu.add.op = desc->op;
+
+	/* FADD/FADDNF and FMIN/FMAX are determined by the orders of the
+	 * operands.
+	 */
+	if (((op >> 2) & 3) * 8 + mux_a > (op & 3) * 8 + mux_b) {
+		if (instr->alu.add.op == V3D_QPU_A_FMIN)
+			instr->alu.add.op = V3D_QPU_A_FMAX;
+		if (instr->alu.add.op == V3D_QPU_A_FADD)
+			instr->alu.add.op = V3D_QPU_A_FADDNF;
+	}
+
+	/* Some QPU ops require a bit more than just basic opcode and mux a/b
+	 * comparisons to distinguish them.
+	 */
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_STVPMV:
+	case V3D_QPU_A_STVPMD:
+	case V3D_QPU_A_STVPMP:
+		switch (waddr) {
+		case 0:
+			instr->alu.add.op = V3D_QPU_A_STVPMV;
+			break;
+		case 1:
+			instr->alu.add.op = V3D_QPU_A_STVPMD;
+			break;
+		case 2:
+			instr->alu.add.op = V3D_QPU_A_STVPMP;
+			break;
+		default:
+			return FALSE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_FADD:
+	case V3D_QPU_A_FADDNF:
+	case V3D_QPU_A_FSUB:
+	case V3D_QPU_A_FMIN:
+	case V3D_QPU_A_FMAX:
+	case V3D_QPU_A_FCMP:
+	case V3D_QPU_A_VFPACK:
+		if (instr->alu.add.op != V3D_QPU_A_VFPACK)
+			instr->alu.add.output_pack = (op >> 4) & 0x3;
+		else
+			instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
+										   &instr->alu.add.b.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_FFLOOR:
+	case V3D_QPU_A_FROUND:
+	case V3D_QPU_A_FTRUNC:
+	case V3D_QPU_A_FCEIL:
+	case V3D_QPU_A_FDX:
+	case V3D_QPU_A_FDY:
+		instr->alu.add.output_pack = mux_b & 0x3;
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_FTOIN:
+	case V3D_QPU_A_FTOIZ:
+	case V3D_QPU_A_FTOUZ:
+	case V3D_QPU_A_FTOC:
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_VFMIN:
+	case V3D_QPU_A_VFMAX:
+		if (!v3d_qpu_float16_unpack_unpack(op & 0x7,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
+		break;
+
+	default:
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+		instr->alu.add.a.unpack = V3D_QPU_UNPACK_NONE;
+		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
+		break;
+	}
+
+	instr->alu.add.a.mux = mux_a;
+	instr->alu.add.b.mux = mux_b;
+	instr->alu.add.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+
+	instr->alu.add.magic_write = FALSE;
+	if (packed_inst & V3D_QPU_MA) {
+		switch (instr->alu.add.op) {
+		case V3D_QPU_A_LDVPMV_IN:
+			instr->alu.add.op = V3D_QPU_A_LDVPMV_OUT;
+			break;
+		case V3D_QPU_A_LDVPMD_IN:
+			instr->alu.add.op = V3D_QPU_A_LDVPMD_OUT;
+			break;
+		case V3D_QPU_A_LDVPMG_IN:
+			instr->alu.add.op = V3D_QPU_A_LDVPMG_OUT;
+			break;
+		default:
+			instr->alu.add.magic_write = TRUE;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d71_qpu_add_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
+                     struct v3d_qpu_instr *instr)
+{
+	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_ADD);
+	v3d_uint32 raddr_a = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_A);
+	v3d_uint32 raddr_b = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_B);
+	v3d_uint32 waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+	v3d_uint32 map_op = op;
+
+	const struct opcode_desc *desc =
+		lookup_opcode_from_packed(devinfo,
+								  add_ops_v71,
+								  V3D_ARRAY_SIZE(add_ops_v71),
+								  map_op, 0, 0,
+								  raddr_b);
+	if (!desc)
+		return FALSE;
+
+	instr->alu.add.op = desc->op;
+
+	/* FADD/FADDNF and FMIN/FMAX are determined by the order of the
+	 * operands.
+	 */
+	if (instr->sig.small_imm_a * 256 + ((op >> 2) & 3) * 64 + raddr_a >
+		instr->sig.small_imm_b * 256 + (op & 3) * 64 + raddr_b) {
+		if (instr->alu.add.op == V3D_QPU_A_FMIN)
+			instr->alu.add.op = V3D_QPU_A_FMAX;
+		if (instr->alu.add.op == V3D_QPU_A_FADD)
+			instr->alu.add.op = V3D_QPU_A_FADDNF;
+	}
+
+	/* Some QPU ops require a bit more than just basic opcode and mux a/b
+	 * comparisons to distinguish them.
+	 */
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_STVPMV:
+	case V3D_QPU_A_STVPMD:
+	case V3D_QPU_A_STVPMP:
+		switch (waddr) {
+		case 0:
+			instr->alu.add.op = V3D_QPU_A_STVPMV;
+			break;
+		case 1:
+			instr->alu.add.op = V3D_QPU_A_STVPMD;
+			break;
+		case 2:
+			instr->alu.add.op = V3D_QPU_A_STVPMP;
+			break;
+		default:
+			return FALSE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_FADD:
+	case V3D_QPU_A_FADDNF:
+	case V3D_QPU_A_FSUB:
+	case V3D_QPU_A_FMIN:
+	case V3D_QPU_A_FMAX:
+	case V3D_QPU_A_FCMP:
+	case V3D_QPU_A_VFPACK:
+		if (instr->alu.add.op != V3D_QPU_A_VFPACK &&
+			instr->alu.add.op != V3D_QPU_A_FCMP) {
+			instr->alu.add.output_pack = (op >> 4) & 0x3;
+		} else {
+			instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+		}
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
+										   &instr->alu.add.b.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_FFLOOR:
+	case V3D_QPU_A_FROUND:
+	case V3D_QPU_A_FTRUNC:
+	case V3D_QPU_A_FCEIL:
+	case V3D_QPU_A_FDX:
+	case V3D_QPU_A_FDY:
+		instr->alu.add.output_pack = raddr_b & 0x3;
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_FTOIN:
+	case V3D_QPU_A_FTOIZ:
+	case V3D_QPU_A_FTOUZ:
+	case V3D_QPU_A_FTOC:
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_float32_unpack_unpack((raddr_b >> 2) & 0x3,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_VFMIN:
+	case V3D_QPU_A_VFMAX:
+		v3d_unreachable("pending v71 update");
+		if (!v3d_qpu_float16_unpack_unpack(op & 0x7,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
+		break;
+
+	case V3D_QPU_A_MOV:
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_int32_unpack_unpack((raddr_b >> 2) & 0x7,
+										 &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	case V3D_QPU_A_FMOV:
+		instr->alu.add.output_pack = raddr_b & 0x3;
+
+		/* Mul alu FMOV has one additional variant */
+		v3d_int32 unpack = (raddr_b >> 2) & 0x7;
+		if (unpack == 7)
+			return FALSE;
+
+		if (!v3d_qpu_float32_unpack_unpack(unpack,
+										   &instr->alu.add.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	default:
+		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+		instr->alu.add.a.unpack = V3D_QPU_UNPACK_NONE;
+		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
+		break;
+	}
+
+	instr->alu.add.a.raddr = raddr_a;
+	instr->alu.add.b.raddr = raddr_b;
+	instr->alu.add.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+
+	instr->alu.add.magic_write = FALSE;
+	if (packed_inst & V3D_QPU_MA) {
+		switch (instr->alu.add.op) {
+		case V3D_QPU_A_LDVPMV_IN:
+			instr->alu.add.op = V3D_QPU_A_LDVPMV_OUT;
+			break;
+		case V3D_QPU_A_LDVPMD_IN:
+			instr->alu.add.op = V3D_QPU_A_LDVPMD_OUT;
+			break;
+		case V3D_QPU_A_LDVPMG_IN:
+			instr->alu.add.op = V3D_QPU_A_LDVPMG_OUT;
+			break;
+		default:
+			instr->alu.add.magic_write = TRUE;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d_qpu_add_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
+                   struct v3d_qpu_instr *instr)
+{
+	if (devinfo->ver < 71)
+		return v3d33_qpu_add_unpack(devinfo, packed_inst, instr);
+	else
+		return v3d71_qpu_add_unpack(devinfo, packed_inst, instr);
+}
+
+static v3d_bool
+v3d33_qpu_mul_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
+                     struct v3d_qpu_instr *instr)
+{
+	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_MUL);
+	v3d_uint32 mux_a = QPU_GET_FIELD(packed_inst, V3D_QPU_MUL_A);
+	v3d_uint32 mux_b = QPU_GET_FIELD(packed_inst, V3D_QPU_MUL_B);
+
+	{
+		const struct opcode_desc *desc =
+			lookup_opcode_from_packed(devinfo,
+									  mul_ops_v33,
+									  V3D_ARRAY_SIZE(mul_ops_v33),
+									  op, mux_a, mux_b, 0);
+		if (!desc)
+			return FALSE;
+
+		instr->alu.mul.op = desc->op;
+	}
+
+	switch (instr->alu.mul.op) {
+	case V3D_QPU_M_FMUL:
+		instr->alu.mul.output_pack = ((op >> 4) & 0x3) - 1;
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
+										   &instr->alu.mul.b.unpack)) {
+			return FALSE;
+		}
+
+		break;
+
+	case V3D_QPU_M_FMOV:
+		instr->alu.mul.output_pack = (((op & 1) << 1) +
+									  ((mux_b >> 2) & 1));
+
+		if (!v3d_qpu_float32_unpack_unpack(mux_b & 0x3,
+										   &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+
+		break;
+
+	case V3D_QPU_M_VFMUL:
+		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_float16_unpack_unpack(((op & 0x7) - 4) & 7,
+										   &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+
+		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
+
+		break;
+
+	default:
+		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+		instr->alu.mul.a.unpack = V3D_QPU_UNPACK_NONE;
+		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
+		break;
+	}
+
+	instr->alu.mul.a.mux = mux_a;
+	instr->alu.mul.b.mux = mux_b;
+	instr->alu.mul.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_M);
+	instr->alu.mul.magic_write = (packed_inst & V3D_QPU_MM) ? TRUE : FALSE;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d71_qpu_mul_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
+                     struct v3d_qpu_instr *instr)
+{
+	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_MUL);
+	v3d_uint32 raddr_c = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_C);
+	v3d_uint32 raddr_d = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_D);
+
+	{
+		const struct opcode_desc *desc =
+			lookup_opcode_from_packed(devinfo,
+									  mul_ops_v71,
+									  V3D_ARRAY_SIZE(mul_ops_v71),
+									  op, 0, 0,
+									  raddr_d);
+		if (!desc)
+			return FALSE;
+
+		instr->alu.mul.op = desc->op;
+	}
+
+	switch (instr->alu.mul.op) {
+	case V3D_QPU_M_FMUL:
+		instr->alu.mul.output_pack = ((op >> 4) & 0x3) - 1;
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
+										   &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
+										   &instr->alu.mul.b.unpack)) {
+			return FALSE;
+		}
+
+		break;
+
+	case V3D_QPU_M_FMOV:
+		instr->alu.mul.output_pack = raddr_d & 0x3;
+
+		if (!v3d_qpu_float32_unpack_unpack((raddr_d >> 2) & 0x7,
+										   &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+
+		break;
+
+	case V3D_QPU_M_VFMUL:
+		v3d_unreachable("pending v71 update");
+		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_float16_unpack_unpack(((op & 0x7) - 4) & 7,
+										   &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+
+		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
+
+		break;
+
+	case V3D_QPU_M_MOV:
+		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+
+		if (!v3d_qpu_int32_unpack_unpack((raddr_d >> 2) & 0x7,
+										 &instr->alu.mul.a.unpack)) {
+			return FALSE;
+		}
+		break;
+
+	default:
+		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+		instr->alu.mul.a.unpack = V3D_QPU_UNPACK_NONE;
+		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
+		break;
+	}
+
+	instr->alu.mul.a.raddr = raddr_c;
+	instr->alu.mul.b.raddr = raddr_d;
+	instr->alu.mul.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_M);
+	instr->alu.mul.magic_write = (packed_inst & V3D_QPU_MM) ? TRUE : FALSE;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d_qpu_mul_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
+                   struct v3d_qpu_instr *instr)
+{
+	if (devinfo->ver < 71)
+		return v3d33_qpu_mul_unpack(devinfo, packed_inst, instr);
+	else
+		return v3d71_qpu_mul_unpack(devinfo, packed_inst, instr);
+}
+
+static const struct opcode_desc *
+lookup_opcode_from_instr(const struct v3d_device_info *devinfo,
+                         const struct opcode_desc *opcodes, size_t num_opcodes,
+                         v3d_uint8 op)
+{
+	for (int i = 0; i < num_opcodes; i++) {
+		const struct opcode_desc *op_desc = &opcodes[i];
+
+		if (op_desc->op != op)
+			continue;
+
+		if (opcode_invalid_in_version(devinfo, op_desc->first_ver, op_desc->last_ver))
+			continue;
+
+		return op_desc;
+	}
+
+	return NULL;
+}
+
+// The below two functions are from Mesa/src/util/bitscan.c:
+#ifdef HAVE___BUILTIN_FFS
+#elif defined(_MSC_VER) && (_M_IX86 || _M_ARM || _M_AMD64 || _M_IA64)
+#else
+int
+ffs(int i)
+{
+	int bit = 0;
+	if (!i)
+		return bit;
+	if (!(i & 0xffff)) {
+		bit += 16;
+		i >>= 16;
+	}
+	if (!(i & 0xff)) {
+		bit += 8;
+		i >>= 8;
+	}
+	if (!(i & 0xf)) {
+		bit += 4;
+		i >>= 4;
+	}
+	if (!(i & 0x3)) {
+		bit += 2;
+		i >>= 2;
+	}
+	if (!(i & 0x1))
+		bit += 1;
+	return bit + 1;
+}
+#endif
+
+#ifdef HAVE___BUILTIN_FFSLL
+#elif defined(_MSC_VER) && (_M_AMD64 || _M_ARM64 || _M_IA64)
+#else
+int
+ffsll(long long int val)
+{
+	int bit;
+
+	bit = ffs((unsigned) (val & 0xffffffff));
+	if (bit != 0)
+		return bit;
+
+	bit = ffs((unsigned) (val >> 32));
+	if (bit != 0)
+		return 32 + bit;
+
+	return 0;
+}
+#endif
+
+// Resume v3d_pack.c
+
+static v3d_bool
+v3d33_qpu_add_pack(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+{
+	v3d_uint32 waddr = instr->alu.add.waddr;
+	v3d_uint32 mux_a = instr->alu.add.a.mux;
+	v3d_uint32 mux_b = instr->alu.add.b.mux;
+	int nsrc = v3d_qpu_add_op_num_src(instr->alu.add.op);
+	const struct opcode_desc *desc =
+		lookup_opcode_from_instr(devinfo, add_ops_v33,
+								 V3D_ARRAY_SIZE(add_ops_v33),
+								 instr->alu.add.op);
+
+	if (!desc)
+		return FALSE;
+
+	v3d_uint32 opcode = desc->opcode_first;
+
+	/* If an operation doesn't use an arg, its mux values may be used to
+	 * identify the operation type.
+	 */
+	if (nsrc < 2)
+		mux_b = ffs(desc->mux.b_mask) - 1;
+
+	if (nsrc < 1)
+		mux_a = ffs(desc->mux.a_mask) - 1;
+
+	v3d_bool no_magic_write = FALSE;
+
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_STVPMV:
+		waddr = 0;
+		no_magic_write = TRUE;
+		break;
+	case V3D_QPU_A_STVPMD:
+		waddr = 1;
+		no_magic_write = TRUE;
+		break;
+	case V3D_QPU_A_STVPMP:
+		waddr = 2;
+		no_magic_write = TRUE;
+		break;
+
+	case V3D_QPU_A_LDVPMV_IN:
+	case V3D_QPU_A_LDVPMD_IN:
+	case V3D_QPU_A_LDVPMP:
+	case V3D_QPU_A_LDVPMG_IN:
+		if (instr->alu.add.magic_write)
+			return FALSE;
+		break;
+
+	case V3D_QPU_A_LDVPMV_OUT:
+	case V3D_QPU_A_LDVPMD_OUT:
+	case V3D_QPU_A_LDVPMG_OUT:
+		if (instr->alu.add.magic_write)
+			return FALSE;
+		*packed_instr |= V3D_QPU_MA;
+		break;
+
+	default:
+		break;
+	}
+
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_FADD:
+	case V3D_QPU_A_FADDNF:
+	case V3D_QPU_A_FSUB:
+	case V3D_QPU_A_FMIN:
+	case V3D_QPU_A_FMAX:
+	case V3D_QPU_A_FCMP: {
+		v3d_uint32 output_pack;
+		v3d_uint32 a_unpack;
+		v3d_uint32 b_unpack;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
+									   &output_pack)) {
+			return FALSE;
+		}
+		opcode |= output_pack << 4;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &a_unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
+										 &b_unpack)) {
+			return FALSE;
+		}
+
+		/* These operations with commutative operands are
+		 * distinguished by which order their operands come in.
+		 */
+		v3d_bool ordering = a_unpack * 8 + mux_a > b_unpack * 8 + mux_b;
+		if (((instr->alu.add.op == V3D_QPU_A_FMIN ||
+			  instr->alu.add.op == V3D_QPU_A_FADD) && ordering) ||
+			((instr->alu.add.op == V3D_QPU_A_FMAX ||
+			  instr->alu.add.op == V3D_QPU_A_FADDNF) && !ordering)) {
+			v3d_uint32 temp;
+
+			temp = a_unpack;
+			a_unpack = b_unpack;
+			b_unpack = temp;
+
+			temp = mux_a;
+			mux_a = mux_b;
+			mux_b = temp;
+		}
+
+		opcode |= a_unpack << 2;
+		opcode |= b_unpack << 0;
+
+		break;
+	}
+
+	case V3D_QPU_A_VFPACK: {
+		v3d_uint32 a_unpack;
+		v3d_uint32 b_unpack;
+
+		if (instr->alu.add.a.unpack == V3D_QPU_UNPACK_ABS ||
+			instr->alu.add.b.unpack == V3D_QPU_UNPACK_ABS) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &a_unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
+										 &b_unpack)) {
+			return FALSE;
+		}
+
+		opcode = (opcode & ~(0x3 << 2)) | (a_unpack << 2);
+		opcode = (opcode & ~(0x3 << 0)) | (b_unpack << 0);
+
+		break;
+	}
+
+	case V3D_QPU_A_FFLOOR:
+	case V3D_QPU_A_FROUND:
+	case V3D_QPU_A_FTRUNC:
+	case V3D_QPU_A_FCEIL:
+	case V3D_QPU_A_FDX:
+	case V3D_QPU_A_FDY: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		mux_b |= packed;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		if (packed == 0)
+			return FALSE;
+		opcode = (opcode & ~(0x3 << 2)) | packed << 2;
+		break;
+	}
+
+	case V3D_QPU_A_FTOIN:
+	case V3D_QPU_A_FTOIZ:
+	case V3D_QPU_A_FTOUZ:
+	case V3D_QPU_A_FTOC:
+		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE)
+			return FALSE;
+
+		v3d_uint32 packed;
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		if (packed == 0)
+			return FALSE;
+		opcode |= packed << 2;
+
+		break;
+
+	case V3D_QPU_A_VFMIN:
+	case V3D_QPU_A_VFMAX:
+		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
+			instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float16_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		opcode |= packed;
+		break;
+
+	default:
+		if (instr->alu.add.op != V3D_QPU_A_NOP &&
+			(instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
+			 instr->alu.add.a.unpack != V3D_QPU_UNPACK_NONE ||
+			 instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE)) {
+			return FALSE;
+		}
+		break;
+	}
+
+	*packed_instr |= QPU_SET_FIELD(mux_a, V3D_QPU_ADD_A);
+	*packed_instr |= QPU_SET_FIELD(mux_b, V3D_QPU_ADD_B);
+	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_ADD);
+	*packed_instr |= QPU_SET_FIELD(waddr, V3D_QPU_WADDR_A);
+	if (instr->alu.add.magic_write && !no_magic_write)
+		*packed_instr |= V3D_QPU_MA;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d71_qpu_add_pack(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+{
+	v3d_uint32 waddr = instr->alu.add.waddr;
+	v3d_uint32 raddr_a = instr->alu.add.a.raddr;
+	v3d_uint32 raddr_b = instr->alu.add.b.raddr;
+
+	int nsrc = v3d_qpu_add_op_num_src(instr->alu.add.op);
+	const struct opcode_desc *desc =
+		lookup_opcode_from_instr(devinfo, add_ops_v71,
+								 V3D_ARRAY_SIZE(add_ops_v71),
+								 instr->alu.add.op);
+	if (!desc)
+		return FALSE;
+
+	v3d_uint32 opcode = desc->opcode_first;
+
+	/* If an operation doesn't use an arg, its raddr values may be used to
+	 * identify the operation type.
+	 */
+	if (nsrc < 2)
+		raddr_b = ffsll(desc->raddr_mask) - 1;
+
+	v3d_bool no_magic_write = FALSE;
+
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_STVPMV:
+		waddr = 0;
+		no_magic_write = TRUE;
+		break;
+	case V3D_QPU_A_STVPMD:
+		waddr = 1;
+		no_magic_write = TRUE;
+		break;
+	case V3D_QPU_A_STVPMP:
+		waddr = 2;
+		no_magic_write = TRUE;
+		break;
+
+	case V3D_QPU_A_LDVPMV_IN:
+	case V3D_QPU_A_LDVPMD_IN:
+	case V3D_QPU_A_LDVPMP:
+	case V3D_QPU_A_LDVPMG_IN:
+		if (instr->alu.add.magic_write)
+			return FALSE;
+		break;
+
+	case V3D_QPU_A_LDVPMV_OUT:
+	case V3D_QPU_A_LDVPMD_OUT:
+	case V3D_QPU_A_LDVPMG_OUT:
+		if (instr->alu.add.magic_write)
+			return FALSE;
+		*packed_instr |= V3D_QPU_MA;
+		break;
+
+	default:
+		break;
+	}
+
+	switch (instr->alu.add.op) {
+	case V3D_QPU_A_FADD:
+	case V3D_QPU_A_FADDNF:
+	case V3D_QPU_A_FSUB:
+	case V3D_QPU_A_FMIN:
+	case V3D_QPU_A_FMAX:
+	case V3D_QPU_A_FCMP: {
+		v3d_uint32 output_pack;
+		v3d_uint32 a_unpack;
+		v3d_uint32 b_unpack;
+
+		if (instr->alu.add.op != V3D_QPU_A_FCMP) {
+			if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
+										   &output_pack)) {
+				return FALSE;
+			}
+			opcode |= output_pack << 4;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &a_unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
+										 &b_unpack)) {
+			return FALSE;
+		}
+
+		/* These operations with commutative operands are
+		 * distinguished by the order of the operands come in.
+		 */
+		v3d_bool ordering =
+			instr->sig.small_imm_a * 256 + a_unpack * 64 + raddr_a >
+			instr->sig.small_imm_b * 256 + b_unpack * 64 + raddr_b;
+		if (((instr->alu.add.op == V3D_QPU_A_FMIN ||
+			  instr->alu.add.op == V3D_QPU_A_FADD) && ordering) ||
+			((instr->alu.add.op == V3D_QPU_A_FMAX ||
+			  instr->alu.add.op == V3D_QPU_A_FADDNF) && !ordering)) {
+			v3d_uint32 temp;
+
+			temp = a_unpack;
+			a_unpack = b_unpack;
+			b_unpack = temp;
+
+			temp = raddr_a;
+			raddr_a = raddr_b;
+			raddr_b = temp;
+
+			/* If we are swapping raddr_a/b we also need to swap
+			 * small_imm_a/b.
+			 */
+			if (instr->sig.small_imm_a || instr->sig.small_imm_b) {
+				v3d_assert(instr->sig.small_imm_a !=
+						   instr->sig.small_imm_b);
+				struct v3d_qpu_sig new_sig = instr->sig;
+				new_sig.small_imm_a = !instr->sig.small_imm_a;
+				new_sig.small_imm_b = !instr->sig.small_imm_b;
+				v3d_uint32 sig;
+				if (!v3d_qpu_sig_pack(devinfo, &new_sig, &sig))
+					return FALSE;
+				*packed_instr &= ~V3D_QPU_SIG_MASK;
+				*packed_instr |= QPU_SET_FIELD(sig, V3D_QPU_SIG);
+			}
+		}
+
+		opcode |= a_unpack << 2;
+		opcode |= b_unpack << 0;
+
+		break;
+	}
+
+	case V3D_QPU_A_VFPACK: {
+		v3d_uint32 a_unpack;
+		v3d_uint32 b_unpack;
+
+		if (instr->alu.add.a.unpack == V3D_QPU_UNPACK_ABS ||
+			instr->alu.add.b.unpack == V3D_QPU_UNPACK_ABS) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &a_unpack)) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
+										 &b_unpack)) {
+			return FALSE;
+		}
+
+		opcode = (opcode & ~(0x3 << 2)) | (a_unpack << 2);
+		opcode = (opcode & ~(0x3 << 0)) | (b_unpack << 0);
+
+		break;
+	}
+
+	case V3D_QPU_A_FFLOOR:
+	case V3D_QPU_A_FROUND:
+	case V3D_QPU_A_FTRUNC:
+	case V3D_QPU_A_FCEIL:
+	case V3D_QPU_A_FDX:
+	case V3D_QPU_A_FDY: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		raddr_b |= packed;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		if (packed == 0)
+			return FALSE;
+		raddr_b = (raddr_b & ~(0x3 << 2)) | packed << 2;
+		break;
+	}
+
+	case V3D_QPU_A_FTOIN:
+	case V3D_QPU_A_FTOIZ:
+	case V3D_QPU_A_FTOUZ:
+	case V3D_QPU_A_FTOC:
+		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE)
+			return FALSE;
+
+		v3d_uint32 packed;
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		if (packed == 0)
+			return FALSE;
+
+		raddr_b |= (raddr_b & ~(0x3 << 2)) | packed << 2;
+
+		break;
+
+	case V3D_QPU_A_VFMIN:
+	case V3D_QPU_A_VFMAX:
+		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
+			instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE) {
+			return FALSE;
+		}
+
+		if (!v3d_qpu_float16_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		opcode |= packed;
+		break;
+
+	case V3D_QPU_A_MOV: {
+		v3d_uint32 packed;
+
+		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE)
+			return FALSE;
+
+		if (!v3d_qpu_int32_unpack_pack(instr->alu.add.a.unpack,
+									   &packed)) {
+			return FALSE;
+		}
+
+		raddr_b |= packed << 2;
+		break;
+	}
+
+	case V3D_QPU_A_FMOV: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		raddr_b = packed;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		raddr_b |= packed << 2;
+		break;
+	}
+
+	default:
+		if (instr->alu.add.op != V3D_QPU_A_NOP &&
+			(instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
+			 instr->alu.add.a.unpack != V3D_QPU_UNPACK_NONE ||
+			 instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE)) {
+			return FALSE;
+		}
+		break;
+	}
+
+	*packed_instr |= QPU_SET_FIELD(raddr_a, V3D_QPU_RADDR_A);
+	*packed_instr |= QPU_SET_FIELD(raddr_b, V3D_QPU_RADDR_B);
+	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_ADD);
+	*packed_instr |= QPU_SET_FIELD(waddr, V3D_QPU_WADDR_A);
+	if (instr->alu.add.magic_write && !no_magic_write)
+		*packed_instr |= V3D_QPU_MA;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d33_qpu_mul_pack(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+{
+	v3d_uint32 mux_a = instr->alu.mul.a.mux;
+	v3d_uint32 mux_b = instr->alu.mul.b.mux;
+	int nsrc = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
+
+	const struct opcode_desc *desc =
+		lookup_opcode_from_instr(devinfo, mul_ops_v33,
+								 V3D_ARRAY_SIZE(mul_ops_v33),
+								 instr->alu.mul.op);
+
+	if (!desc)
+		return FALSE;
+
+	v3d_uint32 opcode = desc->opcode_first;
+
+	/* Some opcodes have a single valid value for their mux a/b, so set
+	 * that here.  If mux a/b determine packing, it will be set below.
+	 */
+	if (nsrc < 2)
+		mux_b = ffs(desc->mux.b_mask) - 1;
+
+	if (nsrc < 1)
+		mux_a = ffs(desc->mux.a_mask) - 1;
+
+	switch (instr->alu.mul.op) {
+	case V3D_QPU_M_FMUL: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		/* No need for a +1 because desc->opcode_first has a 1 in this
+		 * field.
+		 */
+		opcode += packed << 4;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		opcode |= packed << 2;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.b.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		opcode |= packed << 0;
+		break;
+	}
+
+	case V3D_QPU_M_FMOV: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		opcode |= (packed >> 1) & 1;
+		mux_b = (packed & 1) << 2;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		mux_b |= packed;
+		break;
+	}
+
+	case V3D_QPU_M_VFMUL: {
+		v3d_uint32 packed;
+
+		if (instr->alu.mul.output_pack != V3D_QPU_PACK_NONE)
+			return FALSE;
+
+		if (!v3d_qpu_float16_unpack_pack(instr->alu.mul.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		if (instr->alu.mul.a.unpack == V3D_QPU_UNPACK_SWAP_16)
+			opcode = 8;
+		else
+			opcode |= (packed + 4) & 7;
+
+		if (instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)
+			return FALSE;
+
+		break;
+	}
+
+	default:
+		if (instr->alu.mul.op != V3D_QPU_M_NOP &&
+			(instr->alu.mul.output_pack != V3D_QPU_PACK_NONE ||
+			 instr->alu.mul.a.unpack != V3D_QPU_UNPACK_NONE ||
+			 instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)) {
+			return FALSE;
+		}
+		break;
+	}
+
+	*packed_instr |= QPU_SET_FIELD(mux_a, V3D_QPU_MUL_A);
+	*packed_instr |= QPU_SET_FIELD(mux_b, V3D_QPU_MUL_B);
+
+	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_MUL);
+	*packed_instr |= QPU_SET_FIELD(instr->alu.mul.waddr, V3D_QPU_WADDR_M);
+	if (instr->alu.mul.magic_write)
+		*packed_instr |= V3D_QPU_MM;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d71_qpu_mul_pack(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+{
+	v3d_uint32 raddr_c = instr->alu.mul.a.raddr;
+	v3d_uint32 raddr_d = instr->alu.mul.b.raddr;
+	int nsrc = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
+
+	const struct opcode_desc *desc =
+		lookup_opcode_from_instr(devinfo, mul_ops_v71,
+								 V3D_ARRAY_SIZE(mul_ops_v71),
+								 instr->alu.mul.op);
+	if (!desc)
+		return FALSE;
+
+	v3d_uint32 opcode = desc->opcode_first;
+
+	/* Some opcodes have a single valid value for their raddr_d, so set
+	 * that here.  If raddr_b determine packing, it will be set below.
+	 */
+	if (nsrc < 2)
+		raddr_d = ffsll(desc->raddr_mask) - 1;
+
+	switch (instr->alu.mul.op) {
+	case V3D_QPU_M_FMUL: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		/* No need for a +1 because desc->opcode_first has a 1 in this
+		 * field.
+		 */
+		opcode += packed << 4;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		opcode |= packed << 2;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.b.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		opcode |= packed << 0;
+		break;
+	}
+
+	case V3D_QPU_M_FMOV: {
+		v3d_uint32 packed;
+
+		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
+									   &packed)) {
+			return FALSE;
+		}
+		raddr_d |= packed;
+
+		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		raddr_d |= packed << 2;
+		break;
+	}
+
+	case V3D_QPU_M_VFMUL: {
+		v3d_unreachable("pending v71 update");
+		v3d_uint32 packed;
+
+		if (instr->alu.mul.output_pack != V3D_QPU_PACK_NONE)
+			return FALSE;
+
+		if (!v3d_qpu_float16_unpack_pack(instr->alu.mul.a.unpack,
+										 &packed)) {
+			return FALSE;
+		}
+		if (instr->alu.mul.a.unpack == V3D_QPU_UNPACK_SWAP_16)
+			opcode = 8;
+		else
+			opcode |= (packed + 4) & 7;
+
+		if (instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)
+			return FALSE;
+
+		break;
+	}
+
+	case V3D_QPU_M_MOV: {
+		v3d_uint32 packed;
+
+		if (instr->alu.mul.output_pack != V3D_QPU_PACK_NONE)
+			return FALSE;
+
+		if (!v3d_qpu_int32_unpack_pack(instr->alu.mul.a.unpack,
+									   &packed)) {
+			return FALSE;
+		}
+
+		raddr_d |= packed << 2;
+		break;
+	}
+
+	default:
+		if (instr->alu.mul.op != V3D_QPU_M_NOP &&
+			(instr->alu.mul.output_pack != V3D_QPU_PACK_NONE ||
+			 instr->alu.mul.a.unpack != V3D_QPU_UNPACK_NONE ||
+			 instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)) {
+			return FALSE;
+		}
+		break;
+	}
+
+	*packed_instr |= QPU_SET_FIELD(raddr_c, V3D_QPU_RADDR_C);
+	*packed_instr |= QPU_SET_FIELD(raddr_d, V3D_QPU_RADDR_D);
+	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_MUL);
+	*packed_instr |= QPU_SET_FIELD(instr->alu.mul.waddr, V3D_QPU_WADDR_M);
+	if (instr->alu.mul.magic_write)
+		*packed_instr |= V3D_QPU_MM;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d_qpu_add_pack(const struct v3d_device_info *devinfo,
+                 const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+{
+	if (devinfo->ver < 71)
+		return v3d33_qpu_add_pack(devinfo, instr, packed_instr);
+	else
+		return v3d71_qpu_add_pack(devinfo, instr, packed_instr);
+}
+
+static v3d_bool
+v3d_qpu_mul_pack(const struct v3d_device_info *devinfo,
+                 const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+{
+	if (devinfo->ver < 71)
+		return v3d33_qpu_mul_pack(devinfo, instr, packed_instr);
+	else
+		return v3d71_qpu_mul_pack(devinfo, instr, packed_instr);
+}
+
+static v3d_bool
+v3d_qpu_instr_unpack_alu(const struct v3d_device_info *devinfo,
+                         v3d_uint64 packed_instr,
+                         struct v3d_qpu_instr *instr)
+{
+	instr->type = V3D_QPU_INSTR_TYPE_ALU;
+
+	if (!v3d_qpu_sig_unpack(devinfo,
+							QPU_GET_FIELD(packed_instr, V3D_QPU_SIG),
+							&instr->sig))
+		return FALSE;
+
+	v3d_uint32 packed_cond = QPU_GET_FIELD(packed_instr, V3D_QPU_COND);
+	if (v3d_qpu_sig_writes_address(devinfo, &instr->sig)) {
+		instr->sig_addr = packed_cond & ~V3D_QPU_COND_SIG_MAGIC_ADDR;
+		instr->sig_magic = packed_cond & V3D_QPU_COND_SIG_MAGIC_ADDR;
+
+		instr->flags.ac = V3D_QPU_COND_NONE;
+		instr->flags.mc = V3D_QPU_COND_NONE;
+		instr->flags.apf = V3D_QPU_PF_NONE;
+		instr->flags.mpf = V3D_QPU_PF_NONE;
+		instr->flags.auf = V3D_QPU_UF_NONE;
+		instr->flags.muf = V3D_QPU_UF_NONE;
+	} else {
+		if (!v3d_qpu_flags_unpack(devinfo, packed_cond, &instr->flags))
+			return FALSE;
+	}
+
+	if (devinfo->ver <= 71) {
+		/*
+		 * For v71 this will be set on add/mul unpack, as raddr are now
+		 * part of v3d_qpu_input
+		 */
+		instr->raddr_a = QPU_GET_FIELD(packed_instr, V3D_QPU_RADDR_A);
+		instr->raddr_b = QPU_GET_FIELD(packed_instr, V3D_QPU_RADDR_B);
+	}
+
+	if (!v3d_qpu_add_unpack(devinfo, packed_instr, instr))
+		return FALSE;
+
+	if (!v3d_qpu_mul_unpack(devinfo, packed_instr, instr))
+		return FALSE;
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d_qpu_instr_unpack_branch(const struct v3d_device_info *devinfo,
+                            v3d_uint64 packed_instr,
+                            struct v3d_qpu_instr *instr)
+{
+	instr->type = V3D_QPU_INSTR_TYPE_BRANCH;
+
+	v3d_uint32 cond = QPU_GET_FIELD(packed_instr, V3D_QPU_BRANCH_COND);
+	if (cond == 0)
+		instr->branch.cond = V3D_QPU_BRANCH_COND_ALWAYS;
+	else if (V3D_QPU_BRANCH_COND_A0 + (cond - 2) <=
+			 V3D_QPU_BRANCH_COND_ALLNA)
+		instr->branch.cond = V3D_QPU_BRANCH_COND_A0 + (cond - 2);
+	else
+		return FALSE;
+
+	v3d_uint32 msfign = QPU_GET_FIELD(packed_instr, V3D_QPU_BRANCH_MSFIGN);
+	if (msfign == 3)
+		return FALSE;
+	instr->branch.msfign = msfign;
+
+	instr->branch.bdi = QPU_GET_FIELD(packed_instr, V3D_QPU_BRANCH_BDI);
+
+	instr->branch.ub = packed_instr & V3D_QPU_BRANCH_UB;
+	if (instr->branch.ub) {
+		instr->branch.bdu = QPU_GET_FIELD(packed_instr,
+										  V3D_QPU_BRANCH_BDU);
+	}
+
+	instr->branch.raddr_a = QPU_GET_FIELD(packed_instr,
+										  V3D_QPU_RADDR_A);
+
+	instr->branch.offset = 0;
+
+	instr->branch.offset +=
+		QPU_GET_FIELD(packed_instr,
+					  V3D_QPU_BRANCH_ADDR_LOW) << 3;
+
+	instr->branch.offset +=
+		QPU_GET_FIELD(packed_instr,
+					  V3D_QPU_BRANCH_ADDR_HIGH) << 24;
+
+	return TRUE;
+}
+
+v3d_bool
+v3d_qpu_instr_unpack(const struct v3d_device_info *devinfo,
+                     v3d_uint64 packed_instr,
+                     struct v3d_qpu_instr *instr)
+{
+	if (QPU_GET_FIELD(packed_instr, V3D_QPU_OP_MUL) != 0) {
+		return v3d_qpu_instr_unpack_alu(devinfo, packed_instr, instr);
+	} else {
+		v3d_uint32 sig = QPU_GET_FIELD(packed_instr, V3D_QPU_SIG);
+
+		if ((sig & 24) == 16) {
+			return v3d_qpu_instr_unpack_branch(devinfo, packed_instr,
+											   instr);
+		} else {
+			return FALSE;
+		}
+	}
+}
+
+static v3d_bool
+v3d_qpu_instr_pack_alu(const struct v3d_device_info *devinfo,
+                       const struct v3d_qpu_instr *instr,
+                       v3d_uint64 *packed_instr)
+{
+	v3d_uint32 sig;
+	if (!v3d_qpu_sig_pack(devinfo, &instr->sig, &sig))
+		return FALSE;
+	*packed_instr |= QPU_SET_FIELD(sig, V3D_QPU_SIG);
+
+	if (instr->type == V3D_QPU_INSTR_TYPE_ALU) {
+		if (devinfo->ver < 71) {
+			/*
+			 * For v71 this will be set on add/mul unpack, as raddr are now
+			 * part of v3d_qpu_input
+			 */
+			*packed_instr |= QPU_SET_FIELD(instr->raddr_a, V3D_QPU_RADDR_A);
+			*packed_instr |= QPU_SET_FIELD(instr->raddr_b, V3D_QPU_RADDR_B);
+		}
+
+		if (!v3d_qpu_add_pack(devinfo, instr, packed_instr))
+			return FALSE;
+		if (!v3d_qpu_mul_pack(devinfo, instr, packed_instr))
+			return FALSE;
+
+		v3d_uint32 flags;
+		if (v3d_qpu_sig_writes_address(devinfo, &instr->sig)) {
+			if (instr->flags.ac != V3D_QPU_COND_NONE ||
+				instr->flags.mc != V3D_QPU_COND_NONE ||
+				instr->flags.apf != V3D_QPU_PF_NONE ||
+				instr->flags.mpf != V3D_QPU_PF_NONE ||
+				instr->flags.auf != V3D_QPU_UF_NONE ||
+				instr->flags.muf != V3D_QPU_UF_NONE) {
+				return FALSE;
+			}
+
+			flags = instr->sig_addr;
+			if (instr->sig_magic)
+				flags |= V3D_QPU_COND_SIG_MAGIC_ADDR;
+		} else {
+			if (!v3d_qpu_flags_pack(devinfo, &instr->flags, &flags))
+				return FALSE;
+		}
+
+		*packed_instr |= QPU_SET_FIELD(flags, V3D_QPU_COND);
+	} else {
+		if (v3d_qpu_sig_writes_address(devinfo, &instr->sig))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static v3d_bool
+v3d_qpu_instr_pack_branch(const struct v3d_device_info *devinfo,
+                          const struct v3d_qpu_instr *instr,
+                          v3d_uint64 *packed_instr)
+{
+	*packed_instr |= QPU_SET_FIELD(16, V3D_QPU_SIG);
+
+	if (instr->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS) {
+		*packed_instr |= QPU_SET_FIELD(2 + (instr->branch.cond -
+											V3D_QPU_BRANCH_COND_A0),
+									   V3D_QPU_BRANCH_COND);
+	}
+
+	*packed_instr |= QPU_SET_FIELD(instr->branch.msfign,
+								   V3D_QPU_BRANCH_MSFIGN);
+
+	*packed_instr |= QPU_SET_FIELD(instr->branch.bdi,
+								   V3D_QPU_BRANCH_BDI);
+
+	if (instr->branch.ub) {
+		*packed_instr |= V3D_QPU_BRANCH_UB;
+		*packed_instr |= QPU_SET_FIELD(instr->branch.bdu,
+									   V3D_QPU_BRANCH_BDU);
+	}
+
+	switch (instr->branch.bdi) {
+	case V3D_QPU_BRANCH_DEST_ABS:
+	case V3D_QPU_BRANCH_DEST_REL:
+		*packed_instr |= QPU_SET_FIELD(instr->branch.msfign,
+									   V3D_QPU_BRANCH_MSFIGN);
+
+		*packed_instr |= QPU_SET_FIELD((instr->branch.offset &
+										~0xff000000) >> 3,
+									   V3D_QPU_BRANCH_ADDR_LOW);
+
+		*packed_instr |= QPU_SET_FIELD(instr->branch.offset >> 24,
+									   V3D_QPU_BRANCH_ADDR_HIGH);
+		break;
+	default:
+		break;
+	}
+
+	if (instr->branch.bdi == V3D_QPU_BRANCH_DEST_REGFILE ||
+		instr->branch.bdu == V3D_QPU_BRANCH_DEST_REGFILE) {
+		*packed_instr |= QPU_SET_FIELD(instr->branch.raddr_a,
+									   V3D_QPU_RADDR_A);
+	}
+
+	return TRUE;
+}
+
+v3d_bool
+v3d_qpu_instr_pack(const struct v3d_device_info *devinfo,
+                   const struct v3d_qpu_instr *instr,
+                   v3d_uint64 *packed_instr)
+{
+	*packed_instr = 0;
+
+	switch (instr->type) {
+	case V3D_QPU_INSTR_TYPE_ALU:
+		return v3d_qpu_instr_pack_alu(devinfo, instr, packed_instr);
+	case V3D_QPU_INSTR_TYPE_BRANCH:
+		return v3d_qpu_instr_pack_branch(devinfo, instr, packed_instr);
+	default:
+		return FALSE;
+	}
+}
+
+// >>> qpu_disasm.c
+
+struct disasm_state {
+	const struct v3d_device_info *devinfo;
+	char *string;
+	size_t size;
+	size_t offset;
+};
+
+static void
+append(struct disasm_state *disasm, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	size_t result =
+		v3d_vsnprintf(disasm->string + disasm->offset,
+					  disasm->size - disasm->offset,
+					  fmt, args);
+	va_end(args);
+	if (result >= disasm->size - disasm->offset)
+	{
+		disasm->offset = disasm->size;
+	}
+	else
+	{
+		disasm->offset += result;
+	}
+}
+
+static void
+pad_to(struct disasm_state *disasm, int n)
+{
+	/* FIXME: Do a single append somehow. */
+	while (disasm->offset < n && disasm->offset < disasm->size)
+		append(disasm, " ");
+}
+
+static void
+v3d33_qpu_disasm_raddr(struct disasm_state *disasm,
+                       const struct v3d_qpu_instr *instr,
+                       enum v3d_qpu_mux mux)
+{
+	if (mux == V3D_QPU_MUX_A) {
+		append(disasm, "rf%d", instr->raddr_a);
+	} else if (mux == V3D_QPU_MUX_B) {
+		if (instr->sig.small_imm_b) {
+			v3d_uint32 val = 0;
+			v3d_bool ok =
+				v3d_qpu_small_imm_unpack(disasm->devinfo,
+										 instr->raddr_b,
+										 &val);
+
+			if ((int)val >= -16 && (int)val <= 15)
+				append(disasm, "%d", val);
+			else
+				append(disasm, "0x%08x", val);
+			v3d_assert(ok);
+		} else {
+			append(disasm, "rf%d", instr->raddr_b);
+		}
+	} else {
+		append(disasm, "r%d", mux);
+	}
+}
+
+// Call when you already expect name to be a register file
+static v3d_bool v3d_assemble_parse_register_file(const char* name, const char* end,
+                                                 v3d_uint8* registerFileOut,
+                                                 const char** endOfNameOut)
+{
+	if (v3d_peek(name, end, 0) == 'r' && v3d_peek(name, end, 1) == 'f' &&
+	    v3d_peek(name, end, 2) == '(')
+	{
+		// rf(constant expression)
+		struct v3d_qpu_constant constant;
+		const char* errorMessage = NULL;
+		if (!v3d_qpu_eval_constant(name + 2, end, &constant, endOfNameOut, &errorMessage) ||
+		    constant.isFloat || constant.bits > 31)
+			return FALSE;
+		*registerFileOut = (v3d_uint8)constant.bits;
+		return TRUE;
+	}
+	if (v3d_peek(name, end, 0) == 'r' && v3d_peek(name, end, 1) == 'f')
+	{
+		// Avoid needing atoi
+		char firstDigit = v3d_peek(name, end, 2);
+		if (firstDigit > '9' || firstDigit < '0')
+		{
+			return FALSE;
+		}
+		v3d_uint8 registerFileNumber = firstDigit - '0';
+		char afterFirstDigit = v3d_peek(name, end, 3);
+		v3d_bool hasSecondDigit = (afterFirstDigit <= '9' && afterFirstDigit >= '0');
+		if ((afterFirstDigit != 0 && afterFirstDigit != '.' && afterFirstDigit != ' ' &&
+		     afterFirstDigit != '\t' && afterFirstDigit != ',') &&
+		    !hasSecondDigit)
+		{
+			return FALSE;
+		}
+		if (hasSecondDigit)
+		{
+			registerFileNumber *= 10;
+			registerFileNumber += afterFirstDigit - '0';
+		}
+		if (registerFileNumber > 31)
+		{
+			return FALSE;
+		}
+		*registerFileOut = registerFileNumber;
+		*endOfNameOut = name + (hasSecondDigit ? 4 : 3);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+enum v3d_qpu_assemble_raddr_result
+{
+	v3d_qpu_assemble_raddr_result_success,
+	v3d_qpu_assemble_raddr_result_invalid_register_file,
+	v3d_qpu_assemble_raddr_result_invalid_accumulator_register,
+	v3d_qpu_assemble_raddr_result_invalid_small_immediate,
+	v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates,
+	v3d_qpu_assemble_raddr_result_no_raddr_space,
+	v3d_qpu_assemble_raddr_result_invalid_constant_expression,
+	v3d_qpu_assemble_raddr_result_constant_needs_alu_op,
+	v3d_qpu_assemble_raddr_result_constant_needs_uniform,
+};
+
+static v3d_bool v3d33_qpu_mux_in_use(const struct v3d_qpu_instr* instr, enum v3d_qpu_mux mux)
+{
+	return instr->alu.add.a.mux == mux || instr->alu.add.b.mux == mux ||
+	       instr->alu.mul.a.mux == mux || instr->alu.mul.b.mux == mux;
+}
+
+// Points mux at registerFile, re-using raddr_a or raddr_b if one of them already reads it.
+// Inputs which have not been allocated yet must still be V3D_QPU_MUX_R0.
+// See vir_to_qpu.c set_src() and v3d_generate_code_block()
+static enum v3d_qpu_assemble_raddr_result v3d33_qpu_allocate_raddr(struct v3d_qpu_instr* instr,
+                                                                   enum v3d_qpu_mux* mux,
+                                                                   v3d_uint8 registerFile)
+{
+	if (!v3d33_qpu_mux_in_use(instr, V3D_QPU_MUX_A))
+	{
+		*mux = V3D_QPU_MUX_A;
+		instr->raddr_a = registerFile;
+		return v3d_qpu_assemble_raddr_result_success;
+	}
+
+	// Already set? If so re-use it
+	if (instr->raddr_a == registerFile)
+	{
+		*mux = V3D_QPU_MUX_A;
+		return v3d_qpu_assemble_raddr_result_success;
+	}
+
+	// raddr_b holding a small immediate can't be re-used as a register file read
+	if (v3d33_qpu_mux_in_use(instr, V3D_QPU_MUX_B) &&
+	    (instr->sig.small_imm_b || instr->raddr_b != registerFile))
+		return v3d_qpu_assemble_raddr_result_no_raddr_space;
+
+	*mux = V3D_QPU_MUX_B;
+	instr->raddr_b = registerFile;
+	return v3d_qpu_assemble_raddr_result_success;
+}
+
+// Small immediates can only go in raddr_b. The same immediate may be read by several inputs.
+static enum v3d_qpu_assemble_raddr_result
+v3d33_qpu_allocate_small_imm(struct v3d_qpu_instr* instr, enum v3d_qpu_mux* mux,
+                             v3d_uint8 packedSmallImmediate)
+{
+	if (v3d33_qpu_mux_in_use(instr, V3D_QPU_MUX_B) &&
+	    !(instr->sig.small_imm_b && instr->raddr_b == packedSmallImmediate))
+	{
+		return instr->sig.small_imm_b ?
+		           v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates :
+		           v3d_qpu_assemble_raddr_result_no_raddr_space;
+	}
+
+	*mux = V3D_QPU_MUX_B;
+	instr->raddr_b = packedSmallImmediate;
+	instr->sig.small_imm_b = 1;
+	return v3d_qpu_assemble_raddr_result_success;
+}
+
+// Whether a small immediate name ending at nameEnd is the whole operand, rather than the start of a
+// longer constant expression: only a delimiter, a comment or an unpack suffix may follow it
+static v3d_bool v3d_qpu_small_imm_name_ends_operand(const char* nameEnd, const char* end)
+{
+	if (v3d_peek(nameEnd, end, 0) == '.')
+	{
+		char suffix = v3d_peek(nameEnd, end, 1);
+		return (suffix >= 'a' && suffix <= 'z') || (suffix >= 'A' && suffix <= 'Z');
+	}
+
+	const char* currentChar = nameEnd;
+	while (v3d_peek(currentChar, end, 0) == ' ' || v3d_peek(currentChar, end, 0) == '\t')
+		++currentChar;
+	char next = v3d_peek(currentChar, end, 0);
+	if (next == '/')
+		return v3d_peek(currentChar, end, 1) == '/' || v3d_peek(currentChar, end, 1) == '*';
+	return next == 0 || next == '\n' || next == '\r' || next == ',' || next == ';';
+}
+
+// expressionErrorOut is set for v3d_qpu_assemble_raddr_result_invalid_constant_expression.
+// operandOut is set once the operand parsed, even if it could not be allocated a raddr.
+static enum v3d_qpu_assemble_raddr_result v3d33_qpu_assemble_raddr(
+    const struct v3d_device_info* devinfo, struct v3d_qpu_instr* instr, enum v3d_qpu_mux* mux,
+    const char* name, const char* end, const char** endOfNameOut, const char** expressionErrorOut,
+    struct v3d_qpu_operand* operandOut)
+{
+	// First, figure out what the desired operand is
+	v3d_uint8 desiredOperand = 0;
+	if (v3d_peek(name, end, 0) == 'r' && v3d_peek(name, end, 1) == 'f')
+	{
+		// Register file
+		if (!v3d_assemble_parse_register_file(name, end, &desiredOperand, endOfNameOut))
+			return v3d_qpu_assemble_raddr_result_invalid_register_file;
+
+		*operandOut = v3d_qpu_operand_rf(desiredOperand);
+		return v3d33_qpu_allocate_raddr(instr, mux, desiredOperand);
+	}
+	else if (v3d_peek(name, end, 0) == 'r')
+	{
+		// Accumulator register
+		char accumulator = v3d_peek(name, end, 1);
+		char delimiter = v3d_peek(name, end, 2);
+		if (accumulator < '0' || accumulator > '5' ||
+		    !(delimiter == '\n' || delimiter == '.' || delimiter == ' ' || delimiter == '\t' ||
+		      delimiter == ',' || delimiter == 0))
+			return v3d_qpu_assemble_raddr_result_invalid_accumulator_register;
+		desiredOperand = accumulator - '0';
+		*mux = desiredOperand + V3D_QPU_MUX_R0;  // Unnecessary, but illustrative
+		*endOfNameOut = name + 2;
+		*operandOut = v3d_qpu_operand_acc(desiredOperand);
+		return v3d_qpu_assemble_raddr_result_success;
+	}
+	else
+	{
+		// Small immediate
+		v3d_uint32 packed_small_immediate = 0;
+		const char* endOfSmallImmediateName = NULL;
+		v3d_bool isSmallImmediateName = v3d_qpu_small_imm_from_name(
+		    name, end, &packed_small_immediate, &endOfSmallImmediateName);
+
+		char first = v3d_peek(name, end, 0);
+		v3d_bool mayBeExpression =
+		    first == '(' || first == '-' || first == '~' || (first >= '0' && first <= '9');
+
+		// Constant expression, which still has to come out as a small immediate. A name like "1"
+		// only stands for the whole operand if the expression doesn't carry on past it, as in
+		// "1.5" or "1 << 3". Names the evaluator rejects, like "2f^-8", must end the operand.
+		struct v3d_qpu_constant constant;
+		const char* endOfExpression = NULL;
+		const char* expressionError = NULL;
+		v3d_bool evaluated =
+		    mayBeExpression &&
+		    v3d_qpu_eval_constant(name, end, &constant, &endOfExpression, &expressionError);
+		v3d_bool isExpression =
+		    evaluated && (!isSmallImmediateName || endOfExpression > endOfSmallImmediateName);
+		if (!isExpression)
+		{
+			if (isSmallImmediateName &&
+			    (evaluated ||
+			     v3d_qpu_small_imm_name_ends_operand(endOfSmallImmediateName, end)))
+			{
+				*endOfNameOut = endOfSmallImmediateName;
+				*operandOut = v3d_qpu_operand_small_imm(packed_small_immediate);
+				return v3d33_qpu_allocate_small_imm(instr, mux, (v3d_uint8)packed_small_immediate);
+			}
+			if (!mayBeExpression)
+				return v3d_qpu_assemble_raddr_result_invalid_small_immediate;
+			*expressionErrorOut = expressionError;
+			return v3d_qpu_assemble_raddr_result_invalid_constant_expression;
+		}
+		*endOfNameOut = endOfExpression;
+
+		struct v3d_qpu_constant_plan plan;
+		v3d_qpu_plan_constant(devinfo, constant.bits, &plan);
+		if (plan.source == V3D_QPU_CONSTANT_ALU_OP)
+			return v3d_qpu_assemble_raddr_result_constant_needs_alu_op;
+		if (plan.source == V3D_QPU_CONSTANT_UNIFORM)
+			return v3d_qpu_assemble_raddr_result_constant_needs_uniform;
+		*operandOut = v3d_qpu_operand_small_imm(plan.packedSmallImmediate);
+		return v3d33_qpu_allocate_small_imm(instr, mux, (v3d_uint8)plan.packedSmallImmediate);
+	}
+}
+
+enum v3d_qpu_input_class {
+	V3D_QPU_ADD_A,
+	V3D_QPU_ADD_B,
+	V3D_QPU_MUL_A,
+	V3D_QPU_MUL_B
+};
+
+static void
+v3d71_qpu_disasm_raddr(struct disasm_state *disasm,
+                       const struct v3d_qpu_instr *instr,
+                       v3d_uint8 raddr,
+                       enum v3d_qpu_input_class input_class)
+{
+	v3d_bool is_small_imm = FALSE;
+	switch(input_class) {
+	case V3D_QPU_ADD_A:
+		is_small_imm = instr->sig.small_imm_a;
+		break;
+	case V3D_QPU_ADD_B:
+		is_small_imm = instr->sig.small_imm_b;
+		break;
+	case V3D_QPU_MUL_A:
+		is_small_imm = instr->sig.small_imm_c;
+		break;
+	case V3D_QPU_MUL_B:
+		is_small_imm = instr->sig.small_imm_d;
+		break;
+	}
+
+	if (is_small_imm) {
+		v3d_uint32 val = 0;
+		v3d_bool ok =
+			v3d_qpu_small_imm_unpack(disasm->devinfo,
+									 raddr,
+									 &val);
+
+		if ((int)val >= -16 && (int)val <= 15)
+			append(disasm, "%d", val);
+		else
+			append(disasm, "0x%08x", val);
+		v3d_assert(ok);
+	} else {
+		append(disasm, "rf%d", raddr);
+	}
+}
+
+static void
+v3d_qpu_disasm_raddr(struct disasm_state *disasm,
+                     const struct v3d_qpu_instr *instr,
+                     const struct v3d_qpu_input *input,
+                     enum v3d_qpu_input_class input_class)
+{
+	if (disasm->devinfo->ver < 71)
+		v3d33_qpu_disasm_raddr(disasm, instr, input->mux);
+	else
+		v3d71_qpu_disasm_raddr(disasm, instr, input->raddr, input_class);
+}
+
+static void
+v3d_qpu_disasm_waddr(struct disasm_state *disasm, v3d_uint32 waddr, v3d_bool magic)
+{
+	if (!magic) {
+		append(disasm, "rf%d", waddr);
+		return;
+	}
+
+	const char *name = v3d_qpu_magic_waddr_name(disasm->devinfo, waddr);
+	if (name)
+		append(disasm, "%s", name);
+	else
+		append(disasm, "waddr UNKNOWN %d", waddr);
+}
+
+static void
+v3d_qpu_disasm_add(struct disasm_state *disasm,
+                   const struct v3d_qpu_instr *instr)
+{
+	v3d_bool has_dst = v3d_qpu_add_op_has_dst(instr->alu.add.op);
+	int num_src = v3d_qpu_add_op_num_src(instr->alu.add.op);
+
+	append(disasm, "%s", v3d_qpu_add_op_name(instr->alu.add.op));
+	if (!v3d_qpu_sig_writes_address(disasm->devinfo, &instr->sig))
+		append(disasm, "%s", v3d_qpu_cond_name(instr->flags.ac));
+	append(disasm, "%s", v3d_qpu_pf_name(instr->flags.apf));
+	append(disasm, "%s", v3d_qpu_uf_name(instr->flags.auf));
+
+	append(disasm, " ");
+
+	if (has_dst) {
+		v3d_qpu_disasm_waddr(disasm, instr->alu.add.waddr,
+							 instr->alu.add.magic_write);
+		append(disasm, v3d_qpu_pack_name(instr->alu.add.output_pack));
+	}
+
+	if (num_src >= 1) {
+		if (has_dst)
+			append(disasm, ", ");
+		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.add.a, V3D_QPU_ADD_A);
+		append(disasm, "%s",
+			   v3d_qpu_unpack_name(instr->alu.add.a.unpack));
+	}
+
+	if (num_src >= 2) {
+		append(disasm, ", ");
+		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.add.b, V3D_QPU_ADD_B);
+		append(disasm, "%s",
+			   v3d_qpu_unpack_name(instr->alu.add.b.unpack));
+	}
+}
+
+static void
+v3d_qpu_disasm_mul(struct disasm_state *disasm,
+                   const struct v3d_qpu_instr *instr)
+{
+	v3d_bool has_dst = v3d_qpu_mul_op_has_dst(instr->alu.mul.op);
+	int num_src = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
+
+	pad_to(disasm, 30);
+	append(disasm, "; ");
+
+	append(disasm, "%s", v3d_qpu_mul_op_name(instr->alu.mul.op));
+	if (!v3d_qpu_sig_writes_address(disasm->devinfo, &instr->sig))
+		append(disasm, "%s", v3d_qpu_cond_name(instr->flags.mc));
+	append(disasm, "%s", v3d_qpu_pf_name(instr->flags.mpf));
+	append(disasm, "%s", v3d_qpu_uf_name(instr->flags.muf));
+
+	if (instr->alu.mul.op == V3D_QPU_M_NOP)
+		return;
+
+	append(disasm, " ");
+
+	if (has_dst) {
+		v3d_qpu_disasm_waddr(disasm, instr->alu.mul.waddr,
+							 instr->alu.mul.magic_write);
+		append(disasm, v3d_qpu_pack_name(instr->alu.mul.output_pack));
+	}
+
+	if (num_src >= 1) {
+		if (has_dst)
+			append(disasm, ", ");
+		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.mul.a, V3D_QPU_MUL_A);
+		append(disasm, "%s",
+			   v3d_qpu_unpack_name(instr->alu.mul.a.unpack));
+	}
+
+	if (num_src >= 2) {
+		append(disasm, ", ");
+		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.mul.b, V3D_QPU_MUL_B);
+		append(disasm, "%s",
+			   v3d_qpu_unpack_name(instr->alu.mul.b.unpack));
+	}
+}
+
+static void
+v3d_qpu_disasm_sig_addr(struct disasm_state *disasm,
+                        const struct v3d_qpu_instr *instr)
+{
+	if (disasm->devinfo->ver < 41)
+		return;
+
+	if (!instr->sig_magic)
+		append(disasm, ".rf%d", instr->sig_addr);
+	else {
+		const char *name =
+			v3d_qpu_magic_waddr_name(disasm->devinfo,
+									 instr->sig_addr);
+		if (name)
+			append(disasm, ".%s", name);
+		else
+			append(disasm, ".UNKNOWN%d", instr->sig_addr);
+	}
+}
+
+static void
+v3d_qpu_disasm_sig(struct disasm_state *disasm,
+                   const struct v3d_qpu_instr *instr)
+{
+	const struct v3d_qpu_sig *sig = &instr->sig;
+
+	if (!sig->thrsw &&
+		!sig->ldvary &&
+		!sig->ldvpm &&
+		!sig->ldtmu &&
+		!sig->ldtlb &&
+		!sig->ldtlbu &&
+		!sig->ldunif &&
+		!sig->ldunifrf &&
+		!sig->ldunifa &&
+		!sig->ldunifarf &&
+		!sig->wrtmuc) {
+		return;
+	}
+
+	pad_to(disasm, 60);
+
+	if (sig->thrsw)
+		append(disasm, "; thrsw");
+	if (sig->ldvary) {
+		append(disasm, "; ldvary");
+		v3d_qpu_disasm_sig_addr(disasm, instr);
+	}
+	if (sig->ldvpm)
+		append(disasm, "; ldvpm");
+	if (sig->ldtmu) {
+		append(disasm, "; ldtmu");
+		v3d_qpu_disasm_sig_addr(disasm, instr);
+	}
+	if (sig->ldtlb) {
+		append(disasm, "; ldtlb");
+		v3d_qpu_disasm_sig_addr(disasm, instr);
+	}
+	if (sig->ldtlbu) {
+		append(disasm, "; ldtlbu");
+		v3d_qpu_disasm_sig_addr(disasm, instr);
+	}
+	if (sig->ldunif)
+		append(disasm, "; ldunif");
+	if (sig->ldunifrf) {
+		append(disasm, "; ldunifrf");
+		v3d_qpu_disasm_sig_addr(disasm, instr);
+	}
+	if (sig->ldunifa)
+		append(disasm, "; ldunifa");
+	if (sig->ldunifarf) {
+		append(disasm, "; ldunifarf");
+		v3d_qpu_disasm_sig_addr(disasm, instr);
+	}
+	if (sig->wrtmuc)
+		append(disasm, "; wrtmuc");
+}
+
+// (todo Pi 5) add signals for v3d 7
+const char* sig_names[] = {
+    "thrsw",  "ldvary",   "ldvpm",   "ldtmu",     "ldtlb",  "ldtlbu",
+    "ldunif", "ldunifrf", "ldunifa", "ldunifarf", "wrtmuc",
+};
+
+// Matches sig_names
+v3d_bool sig_has_address[] = {
+	FALSE, TRUE, FALSE, TRUE, TRUE, TRUE,
+	FALSE, TRUE, FALSE, TRUE, FALSE,
+};
+
+// Using the index from matching name in sig_names, get which bit is associated with the signal
+int sig_bits[] =
+{
+// thrsw = 0
+// ldunif = 1
+// ldunifa = 2
+// ldunifrf = 3
+// ldunifarf = 4
+// ldtmu = 5
+// ldvary = 6
+// ldvpm = 7
+// ldtlb = 8
+// ldtlbu = 9
+// ucb = 10
+// rotate = 11
+// wrtmuc = 12
+	0, 6, 7, 5, 8, 9,
+	1, 3, 2, 4, 12,
+};
+
+static v3d_bool v3d_qpu_assemble_signal(struct v3d_qpu_sig* sig, v3d_bool* signalTakesAddress,
+                                        const char* name, const char* end,
+                                        const char** endOfNameOut)
+{
+	for (int index = 0; index < V3D_ARRAY_SIZE(sig_names); ++index)
+	{
+		if (v3d_symbol_equals(sig_names[index], name, end, endOfNameOut))
+		{
+			if (signalTakesAddress)
+				*signalTakesAddress = sig_has_address[index];
+
+			*((v3d_uint32*)sig) |= 1 << sig_bits[index];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void
+v3d_qpu_disasm_alu(struct disasm_state *disasm,
+                   const struct v3d_qpu_instr *instr)
+{
+	v3d_qpu_disasm_add(disasm, instr);
+	v3d_qpu_disasm_mul(disasm, instr);
+	v3d_qpu_disasm_sig(disasm, instr);
+}
+
+static void
+v3d_qpu_disasm_branch(struct disasm_state *disasm,
+                      const struct v3d_qpu_instr *instr)
+{
+	append(disasm, "b");
+	if (instr->branch.ub)
+		append(disasm, "u");
+	append(disasm, "%s", v3d_qpu_branch_cond_name(instr->branch.cond));
+	append(disasm, "%s", v3d_qpu_msfign_name(instr->branch.msfign));
+
+	switch (instr->branch.bdi) {
+	case V3D_QPU_BRANCH_DEST_ABS:
+		append(disasm, "  zero_addr+0x%08x", instr->branch.offset);
+		break;
+
+	case V3D_QPU_BRANCH_DEST_REL:
+		append(disasm, "  %d", instr->branch.offset);
+		break;
+
+	case V3D_QPU_BRANCH_DEST_LINK_REG:
+		append(disasm, "  lri");
+		break;
+
+	case V3D_QPU_BRANCH_DEST_REGFILE:
+		append(disasm, "  rf%d", instr->branch.raddr_a);
+		break;
+	}
+
+	if (instr->branch.ub) {
+		switch (instr->branch.bdu) {
+		case V3D_QPU_BRANCH_DEST_ABS:
+			append(disasm, ", a:unif");
+			break;
+
+		case V3D_QPU_BRANCH_DEST_REL:
+			append(disasm, ", r:unif");
+			break;
+
+		case V3D_QPU_BRANCH_DEST_LINK_REG:
+			append(disasm, ", lri");
+			break;
+
+		case V3D_QPU_BRANCH_DEST_REGFILE:
+			append(disasm, ", rf%d", instr->branch.raddr_a);
+			break;
+		}
+	}
+}
+
+size_t
+v3d_qpu_decode(const struct v3d_device_info *devinfo,
+               const struct v3d_qpu_instr *instr,
+               char* outBuffer, size_t outBufferSize)
+{
+	struct disasm_state disasm = {
+		.string = outBuffer,
+		.size = outBufferSize,
+		.offset = 0,
+		.devinfo = devinfo,
+	};
+
+	switch (instr->type) {
+	case V3D_QPU_INSTR_TYPE_ALU:
+		v3d_qpu_disasm_alu(&disasm, instr);
+		break;
+
+	case V3D_QPU_INSTR_TYPE_BRANCH:
+		v3d_qpu_disasm_branch(&disasm, instr);
+		break;
+	}
+
+	return disasm.offset;
+}
+
+size_t
+v3d_qpu_disasm(const struct v3d_device_info *devinfo, v3d_uint64 inst, char* outBuffer, size_t outBufferSize)
+{
+	struct v3d_qpu_instr instr;
+	v3d_bool ok = v3d_qpu_instr_unpack(devinfo, inst, &instr);
+	v3d_assert(ok); (void)ok;
+
+	return v3d_qpu_decode(devinfo, &instr, outBuffer, outBufferSize);
+}
+
+// Skip through whitespace or comments until e.g. a symbol start is encountered.
+// Returns false if a non-multiline-commented newline or end of string encountered before a symbol
+// was found.
+v3d_bool v3d_qpu_skip_whitespace_comments(const char** readHeadInOut, const char* end)
+{
+	const char* currentChar;
+	int commentDepth = 0;
+	for (currentChar = *readHeadInOut;
+	     v3d_peek(currentChar, end, 0) && (commentDepth || *currentChar != '\n'); ++currentChar)
+	{
+		if (*currentChar == '\t' || *currentChar == '\r' || *currentChar == ' ')
+			continue;
+
+		// C++ style comment to end of line; find the end to make sure we advance the right number
+		// of characters
+		if (!commentDepth && currentChar[0] == '/' && v3d_peek(currentChar, end, 1) == '/')
+		{
+			while (v3d_peek(currentChar, end, 0) && *currentChar != '\n')
+				++currentChar;
+			break;
+		}
+		// /**/-style comments; support nesting. A stray */ outside of a comment is not whitespace.
+		if (commentDepth && currentChar[0] == '*' && v3d_peek(currentChar, end, 1) == '/')
+		{
+			--commentDepth;
+			++currentChar;
+			continue;
+		}
+		if (currentChar[0] == '/' && v3d_peek(currentChar, end, 1) == '*')
+		{
+			++commentDepth;
+			++currentChar;
+		}
+		if (commentDepth)
+			continue;
+
+		*readHeadInOut = currentChar;
+		return TRUE;
+	}
+	*readHeadInOut = currentChar;
+	return FALSE;
+}
+
+// This assembler is written by Macoy Madson (not from Mesa)
+v3d_uint32 v3d_qpu_assemble(struct v3d_qpu_assemble_arguments* args)
+{
+	if (args->devinfo.ver >= 70)
+	{
+		args->errorMessage = "V3D 7.x assembler not implemented";
+		return 0;
+	}
+
+	// Silly, but for consistency in error hint lists
+	static const char* rf_names[] = {
+	    "rf0",  "rf1",  "rf2",  "rf3",  "rf4",  "rf5",  "rf6",  "rf7",  "rf8",  "rf9",  "rf10",
+	    "rf11", "rf12", "rf13", "rf14", "rf15", "rf16", "rf17", "rf18", "rf19", "rf20", "rf21",
+	    "rf22", "rf23", "rf24", "rf25", "rf26", "rf27", "rf28", "rf29", "rf30", "rf31",
+	};
+	static const char* accumulator_register_names[] = {"r0", "r1", "r2", "r3", "r4", "r5"};
+	v3d_bool parsedSuccessfully = TRUE;
+	const char* currentChar = args->assembly;
+	const char* end = args->assemblyEnd;
+	const char** errorHintList = NULL;
+	int numErrorHints = 0;
+
+#define BREAK_ERROR_HINT_SIZE(message, hintList, hintListSize) \
+	if (!parsedSuccessfully)                                   \
+	{                                                          \
+		args->errorAtOffset = currentChar - args->assembly;    \
+		args->errorMessage = (message);                        \
+		errorHintList = (hintList);                            \
+		numErrorHints = hintListSize;                          \
+		break;                                                 \
+	}
+	// NOTE: Assumes V3D_ARRAY_SIZE works on hintList
+#define BREAK_ERROR(message, hintList) \
+	BREAK_ERROR_HINT_SIZE(message, hintList, V3D_ARRAY_SIZE(hintList))
+
+#define BREAK_ERROR_NO_HINTS(message) \
+	BREAK_ERROR_HINT_SIZE(message, NULL, 0)
+
+	// Mostly just to allow us to break to get to standard exit
+	for (int numLoops = 0; numLoops < 1; ++numLoops)
+	{
+		if (!v3d_qpu_skip_whitespace_comments(&currentChar, end))
+		{
+			args->isEmptyLine = TRUE;
+			return currentChar - args->assembly;
+		}
+
+		args->instructionStartsAtOffset = currentChar - args->assembly;
+
+		// If we got this far we hit a character, so it's time to parse
+		// Filter on 'a' because there is a single ALU instruction that starts with b, barrierid.
+		// Since branches are either or b bu, we should be safe using the 'a' to discriminate them.
+		if (v3d_peek(currentChar, end, 0) == 'b' && v3d_peek(currentChar, end, 1) != 'a')
+		{
+			// Branch instruction
+			// TODO
+			parsedSuccessfully = FALSE;
+			args->errorAtOffset = currentChar - args->assembly;
+			args->errorMessage = "Branch instructions unimplemented";
+			break;
+		}
+		else
+		{
+			// ALU instruction
+			// Add and mul are parsed nearly exactly the same
+			struct instruction_outputs
+			{
+				v3d_uint32* op;
+				const char** availableOperations;
+				int numAvailableOperations;
+				const char* operationNotFoundError;
+				struct v3d_qpu_input* inputs[2];
+				v3d_uint8* waddr;
+				v3d_bool* magic_write;
+				enum v3d_qpu_output_pack* output_pack;
+				enum v3d_qpu_cond* cond;
+				enum v3d_qpu_pf* pf;
+				enum v3d_qpu_uf* uf;
+			};
+			struct instruction_outputs outputs[2] = {
+			    {
+			        (v3d_uint32*)&args->instruction.alu.add.op,
+			        add_op_names,
+					V3D_ARRAY_SIZE(add_op_names),
+					"Expected ALU add instruction or nop",
+			        {&args->instruction.alu.add.a, &args->instruction.alu.add.b},
+			        &args->instruction.alu.add.waddr,
+			        &args->instruction.alu.add.magic_write,
+			        &args->instruction.alu.add.output_pack,
+			        &args->instruction.flags.ac,
+			        &args->instruction.flags.apf,
+			        &args->instruction.flags.auf,
+			    },
+				{
+			        (v3d_uint32*)&args->instruction.alu.mul.op,
+			        mul_op_names,
+					V3D_ARRAY_SIZE(mul_op_names),
+					"Expected ALU mul instruction or nop",
+			        {&args->instruction.alu.mul.a, &args->instruction.alu.mul.b},
+			        &args->instruction.alu.mul.waddr,
+			        &args->instruction.alu.mul.magic_write,
+			        &args->instruction.alu.mul.output_pack,
+			        &args->instruction.flags.mc,
+			        &args->instruction.flags.mpf,
+			        &args->instruction.flags.muf,
+			    },
+			};
+			// Search for this for the only other parsing differences
+			const int mulIndex = 1;
+
+			// Kept so the instruction can be rebuilt if it needs too many raddrs
+			struct v3d_qpu_operand sources[2][2] = {0};
+			const char* raddrConflictError = NULL;
+
+			for (int outputIndex = 0; outputIndex < V3D_ARRAY_SIZE(outputs); ++outputIndex)
+			{
+				struct instruction_outputs* output = &outputs[outputIndex];
+				if (outputIndex > 0)
+				{
+					if (!v3d_qpu_skip_whitespace_comments(&currentChar, end) || v3d_peek(currentChar, end, 0) != ';')
+					{
+						parsedSuccessfully = FALSE;
+						BREAK_ERROR_NO_HINTS("Expected ';' between add and mul instructions");
+					}
+					++currentChar;
+
+					if (!v3d_qpu_skip_whitespace_comments(&currentChar, end))
+					{
+						parsedSuccessfully = FALSE;
+						BREAK_ERROR_HINT_SIZE(output->operationNotFoundError,
+						                      output->availableOperations,
+						                      output->numAvailableOperations);
+					}
+				}
+
+				parsedSuccessfully = v3d_qpu_value_from_name_list(
+				    currentChar, end, output->availableOperations, output->numAvailableOperations,
+				    /*dotOptional=*/FALSE, output->op, &currentChar);
+				BREAK_ERROR_HINT_SIZE(output->operationNotFoundError, output->availableOperations,
+				                      output->numAvailableOperations);
+
+				// From vir_to_qpu.c, v3d_qpu_nop() sets magic for NOP. The add and mul op enums
+				// overlap (V3D_QPU_M_NOP is V3D_QPU_A_UMIN), so each side checks its own NOP.
+				v3d_uint32 nopOp = outputIndex == 0 ? V3D_QPU_A_NOP : V3D_QPU_M_NOP;
+				if (*output->op == nopOp)
+				{
+					*output->waddr = V3D_QPU_WADDR_NOP;
+					*output->magic_write = TRUE;
+				}
+
+				// Condition and flags
+				while (v3d_peek(currentChar, end, 0) == '.')
+				{
+					if (v3d_qpu_value_from_name_list(
+							currentChar, end, cond_names, V3D_ARRAY_SIZE(cond_names),
+							/*dotOptional=*/TRUE, (v3d_uint32*)output->cond, &currentChar))
+						continue;
+
+					if (v3d_qpu_value_from_name_list(
+							currentChar, end, pf_names, V3D_ARRAY_SIZE(pf_names),
+							/*dotOptional=*/TRUE, (v3d_uint32*)output->pf, &currentChar))
+						continue;
+
+					if (v3d_qpu_value_from_name_list(
+							currentChar, end, uf_names, V3D_ARRAY_SIZE(uf_names),
+							/*dotOptional=*/TRUE, (v3d_uint32*)output->uf, &currentChar))
+						continue;
+					parsedSuccessfully = FALSE;
+					break;
+				}
+				BREAK_ERROR("Condition, pack flags, or uf unrecognized", cond_pf_uf_names);
+
+				v3d_bool has_dst = FALSE;
+				int num_src = 0;
+				if (outputIndex == mulIndex)
+				{
+					has_dst = v3d_qpu_mul_op_has_dst(*output->op);
+					num_src = v3d_qpu_mul_op_num_src(*output->op);
+				}
+				else
+				{
+					has_dst = v3d_qpu_add_op_has_dst(*output->op);
+					num_src = v3d_qpu_add_op_num_src(*output->op);
+				}
+
+				if (has_dst)
+				{
+					if (!v3d_qpu_skip_whitespace_comments(&currentChar, end))
+					{
+						parsedSuccessfully = FALSE;
+						BREAK_ERROR("Expected destination operand rf0 through rf31 or waddr",
+						            waddr_names);
+					}
+					if (v3d_peek(currentChar, end, 0) == 'r' && v3d_peek(currentChar, end, 1) == 'f')
+					{
+						parsedSuccessfully = v3d_assemble_parse_register_file(
+						    currentChar, end, output->waddr, &currentChar);
+						BREAK_ERROR("Expected rf0 through rf31", rf_names);
+					}
+					else if (v32_qpu_magic_waddr_from_name(
+					             currentChar, end, (enum v3d_qpu_waddr*)output->waddr,
+					             &currentChar))
+					{
+						*(output->magic_write) = TRUE;
+					}
+					else
+						parsedSuccessfully = FALSE;
+					BREAK_ERROR("Expected rf0 through rf31 or waddr", waddr_names);
+
+					parsedSuccessfully = v3d_qpu_value_from_name_list(
+					    currentChar, end, pack_names, V3D_ARRAY_SIZE(pack_names),
+					    /*dotOptional=*/TRUE, (v3d_uint32*)output->output_pack,
+					    &currentChar);
+					BREAK_ERROR("Invalid pack operation", pack_names);
+				}
+
+				for (int src = 0; src < num_src; ++src)
+				{
+					struct v3d_qpu_input* srcInput = output->inputs[src];
+					if (!v3d_qpu_skip_whitespace_comments(&currentChar, end))
+					{
+						parsedSuccessfully = FALSE;
+						BREAK_ERROR_NO_HINTS(
+						    "Expected source operand rf0 through rf31, accumulator register r0-r5, "
+						    "or small immediate");
+					}
+
+					if ((has_dst && src == 0) || src > 0)
+					{
+						if (v3d_peek(currentChar, end, 0) != ',')
+						{
+							parsedSuccessfully = FALSE;
+							BREAK_ERROR_NO_HINTS("Expected , before source operand");
+						}
+						else
+						{
+							++currentChar;
+							if (!v3d_qpu_skip_whitespace_comments(&currentChar, end))
+							{
+								parsedSuccessfully = FALSE;
+								BREAK_ERROR_NO_HINTS(
+								    "Expected source operand rf0 through rf31, accumulator "
+								    "register r0-r5, or small immediate");
+							}
+						}
+					}
+
+					// (todo Pi 5) V3D 71+ support (V3D_QPU_ADD_A input)
+					const char* expressionError = NULL;
+					enum v3d_qpu_assemble_raddr_result raddrResult = v3d33_qpu_assemble_raddr(
+					    &args->devinfo, &args->instruction, &srcInput->mux, currentChar, end,
+					    &currentChar, &expressionError, &sources[outputIndex][src]);
+					parsedSuccessfully = raddrResult == v3d_qpu_assemble_raddr_result_success;
+					const char* raddrError = NULL;
+					const char** raddrList = NULL;
+					int raddrListLength = 0;
+					switch (raddrResult)
+					{
+						case v3d_qpu_assemble_raddr_result_invalid_register_file:
+							raddrError = "Unrecognized register file";
+							raddrList = rf_names;
+							raddrListLength = V3D_ARRAY_SIZE(rf_names);
+							break;
+						case v3d_qpu_assemble_raddr_result_invalid_accumulator_register:
+							raddrError = "Unrecognized accumulator register";
+							raddrList = accumulator_register_names;
+							raddrListLength = V3D_ARRAY_SIZE(accumulator_register_names);
+							break;
+						case v3d_qpu_assemble_raddr_result_invalid_small_immediate:
+							raddrError = "Unrecognized small immediate";
+							raddrList = small_immediates_names;
+							raddrListLength = V3D_ARRAY_SIZE(small_immediates_names);
+							break;
+						case v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates:
+							raddrError =
+							    "Too many small immediates. Only one small immediate may be "
+							    "specified per instruction";
+							break;
+						case v3d_qpu_assemble_raddr_result_no_raddr_space:
+							raddrError =
+							    "Too many unique register files (plus small immediate) specified. "
+							    "Only two unique raddrs (two register files or one register file "
+							    "and one small immediate) may be specified per instruction";
+							break;
+						case v3d_qpu_assemble_raddr_result_invalid_constant_expression:
+							raddrError = expressionError;
+							break;
+						case v3d_qpu_assemble_raddr_result_constant_needs_alu_op:
+							raddrError =
+							    "Constant is not a small immediate. The cheapest way to get it is "
+							    "one ALU op on a small immediate (see v3d_qpu_plan_constant())";
+							break;
+						case v3d_qpu_assemble_raddr_result_constant_needs_uniform:
+							raddrError =
+							    "Constant is not a small immediate and can't be made from one. "
+							    "Load it from a uniform with ldunif instead";
+							break;
+						default:
+							raddrError = "Unspecified error with raddr parsing";
+							break;
+					}
+					// Left for the rebuild below to fix
+					if (args->raddrFixOptions &&
+					    (raddrResult == v3d_qpu_assemble_raddr_result_no_raddr_space ||
+					     raddrResult ==
+					         v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates))
+					{
+						if (!raddrConflictError)
+							raddrConflictError = raddrError;
+						parsedSuccessfully = TRUE;
+					}
+					BREAK_ERROR_HINT_SIZE(raddrError, raddrList, raddrListLength);
+
+					parsedSuccessfully = v3d_qpu_value_from_name_list(
+					    currentChar, end, unpack_names, V3D_ARRAY_SIZE(unpack_names),
+					    /*dotOptional=*/TRUE, (v3d_uint32*)&srcInput->unpack,
+					    &currentChar);
+					BREAK_ERROR("Invalid unpack operation", unpack_names);
+					sources[outputIndex][src].unpack = srcInput->unpack;
+				}
+				// The source loop's break only leaves that loop
+				if (!parsedSuccessfully)
+					break;
+			}
+
+			if (!parsedSuccessfully)
+				break;
+
+			// Finally, parse (optional) signals
+			v3d_bool sigWithAddressSpecified = FALSE;
+			while (v3d_qpu_skip_whitespace_comments(&currentChar, end))
+			{
+				if (v3d_peek(currentChar, end, 0) != ';')
+				{
+					parsedSuccessfully = FALSE;
+					BREAK_ERROR_NO_HINTS("Expected ';' before start of signal");
+				}
+				++currentChar;
+
+				if (!v3d_qpu_skip_whitespace_comments(&currentChar, end))
+				{
+					// Finished with the line. We'll allow dangling ; after mul.
+					break;
+				}
+
+				v3d_bool sigTakesAddress = FALSE;
+				parsedSuccessfully = v3d_qpu_assemble_signal(&args->instruction.sig, &sigTakesAddress,
+															 currentChar, end, &currentChar);
+				BREAK_ERROR("Unrecognized signal name", sig_names);
+
+				if (sigTakesAddress)
+				{
+					if (sigWithAddressSpecified)
+					{
+						parsedSuccessfully = FALSE;
+						BREAK_ERROR_NO_HINTS(
+						    "Too many signals with addresses specified. Only one signal with "
+						    "address may be specified per instruction");
+					}
+					sigWithAddressSpecified = TRUE;
+				}
+
+				// Optional sig_addr
+				if (v3d_peek(currentChar, end, 0) == '.')
+				{
+					if (!sigTakesAddress)
+					{
+						parsedSuccessfully = FALSE;
+						BREAK_ERROR(
+							"Signal does not support an address. Check for a signal variant which does "
+							"take an address",
+							sig_names);
+					}
+					++currentChar;
+					if (v3d_peek(currentChar, end, 0) == 'r' && v3d_peek(currentChar, end, 1) == 'f')
+					{
+						parsedSuccessfully = v3d_assemble_parse_register_file(
+							currentChar, end, &args->instruction.sig_addr, &currentChar);
+						BREAK_ERROR("Expected rf0 through rf31", rf_names);
+					}
+					else
+					{
+						enum v3d_qpu_waddr waddr = 0;
+						parsedSuccessfully =
+							v32_qpu_magic_waddr_from_name(currentChar, end, &waddr, &currentChar);
+						args->instruction.sig_addr = waddr;
+						args->instruction.sig_magic = TRUE;
+					}
+					BREAK_ERROR("Expected rf0 through rf31 or waddr", waddr_names);
+				}
+
+				/* if (v3d_qpu_skip_whitespace_comments(&currentChar, end)) */
+				/* { */
+				/* 	parsedSuccessfully = FALSE; */
+				/* 	BREAK_ERROR("Unexpected text at end of instruction; only one instruction per line allowed", NULL); */
+				/* } */
+			}
+			if (!parsedSuccessfully || !raddrConflictError)
+				break;
+
+			// Rebuild it from the parsed operands, now that everything about it is known
+			struct v3d_qpu_instr* instr = &args->instruction;
+			struct v3d_qpu_operand dsts[2];
+			for (int outputIndex = 0; outputIndex < (int)V3D_ARRAY_SIZE(outputs); ++outputIndex)
+			{
+				struct instruction_outputs* output = &outputs[outputIndex];
+				dsts[outputIndex] = v3d_qpu_operand_none();
+				if (!(outputIndex == mulIndex ? v3d_qpu_mul_op_has_dst(*output->op) :
+				                                v3d_qpu_add_op_has_dst(*output->op)))
+					continue;
+				dsts[outputIndex] = *output->magic_write ? v3d_qpu_operand_magic(*output->waddr) :
+				                                           v3d_qpu_operand_rf(*output->waddr);
+				dsts[outputIndex].pack = *output->output_pack;
+			}
+			struct v3d_qpu_emit_modifiers modifiers = {0};
+			modifiers.flags = instr->flags;
+			modifiers.sig = instr->sig;
+			// Set by the partial allocation; the rebuild decides it again
+			modifiers.sig.small_imm_b = FALSE;
+			modifiers.sig_addr = instr->sig_addr;
+			modifiers.sig_magic = instr->sig_magic;
+
+			struct v3d_qpu_instr instrs[2];
+			int numInstrs = 0;
+			const char* unusedError = NULL;
+			parsedSuccessfully = v3d_qpu_build_alu_fixed(
+			    &args->devinfo, instr->alu.add.op, dsts[0], sources[0][0], sources[0][1],
+			    instr->alu.mul.op, dsts[1], sources[1][0], sources[1][1], &modifiers,
+			    args->raddrFixOptions, instrs, &numInstrs, &args->raddrFix, &unusedError);
+			if (!parsedSuccessfully)
+			{
+				// Nothing else about the instruction is wrong, so this is the conflict the options
+				// could not fix
+				currentChar = args->assembly + args->instructionStartsAtOffset;
+				BREAK_ERROR_NO_HINTS(raddrConflictError);
+			}
+			*instr = instrs[0];
+			if (numInstrs > 1)
+				args->secondInstruction = instrs[1];
+			break;
+		}
+	}
+#undef BREAK_ERROR
+#undef BREAK_ERROR_HINT_SIZE
+
+	if (errorHintList && numErrorHints)
+	{
+		args->hintAvailable = errorHintList;
+		args->numHints = numErrorHints;
 	}
+	if (!parsedSuccessfully)
+		return 0;
+	return currentChar - args->assembly;
 }
 
-static v3d_bool
-v3d_qpu_int32_unpack_pack(enum v3d_qpu_input_unpack unpacked,
-                          v3d_uint32 *packed)
+// Incremental assembly
+
+// FNV-1a. Used for the line cache keys.
+static v3d_uint64 v3d_hash_bytes(const char* bytes, int numBytes, v3d_uint64 hash)
 {
-	switch (unpacked) {
-	case V3D_QPU_UNPACK_NONE:
-		*packed = 0;
-		return TRUE;
-	case V3D_QPU_UNPACK_UL:
-		*packed = 1;
-		return TRUE;
-	case V3D_QPU_UNPACK_UH:
-		*packed = 2;
-		return TRUE;
-	case V3D_QPU_UNPACK_IL:
-		*packed = 3;
-		return TRUE;
-	case V3D_QPU_UNPACK_IH:
-		*packed = 4;
-		return TRUE;
-	default:
-		return FALSE;
+	for (int i = 0; i < numBytes; ++i)
+	{
+		hash ^= (v3d_uint8)bytes[i];
+		hash *= 0x100000001b3ull;
 	}
+	return hash;
 }
 
-static v3d_bool
-v3d_qpu_float16_unpack_unpack(v3d_uint32 packed,
-                              enum v3d_qpu_input_unpack *unpacked)
+static v3d_uint64 v3d_qpu_line_cache_key(const struct v3d_device_info* devinfo, const char* line,
+                                         int lineLength)
 {
-	switch (packed) {
-	case 0:
-		*unpacked = V3D_QPU_UNPACK_NONE;
-		return TRUE;
-	case 1:
-		*unpacked = V3D_QPU_UNPACK_REPLICATE_32F_16;
-		return TRUE;
-	case 2:
-		*unpacked = V3D_QPU_UNPACK_REPLICATE_L_16;
-		return TRUE;
-	case 3:
-		*unpacked = V3D_QPU_UNPACK_REPLICATE_H_16;
-		return TRUE;
-	case 4:
-		*unpacked = V3D_QPU_UNPACK_SWAP_16;
-		return TRUE;
-	default:
-		return FALSE;
-	}
+	v3d_uint64 hash = 0xcbf29ce484222325ull;
+	hash ^= devinfo->ver;
+	hash *= 0x100000001b3ull;
+	hash = v3d_hash_bytes(line, lineLength, hash);
+	// 0 is reserved for empty slots
+	return hash ? hash : 1;
 }
 
-static v3d_bool
-v3d_qpu_float16_unpack_pack(enum v3d_qpu_input_unpack unpacked,
-                            v3d_uint32 *packed)
+void v3d_qpu_assemble_line_cache_init(struct v3d_qpu_assemble_line_cache* cache,
+                                      const struct v3d_device_info* devinfo,
+                                      struct v3d_qpu_assemble_line_cache_entry* entries,
+                                      int numEntries)
 {
-	switch (unpacked) {
-	case V3D_QPU_UNPACK_NONE:
-		*packed = 0;
-		return TRUE;
-	case V3D_QPU_UNPACK_REPLICATE_32F_16:
-		*packed = 1;
-		return TRUE;
-	case V3D_QPU_UNPACK_REPLICATE_L_16:
-		*packed = 2;
-		return TRUE;
-	case V3D_QPU_UNPACK_REPLICATE_H_16:
-		*packed = 3;
-		return TRUE;
-	case V3D_QPU_UNPACK_SWAP_16:
-		*packed = 4;
-		return TRUE;
-	default:
-		return FALSE;
-	}
+	v3d_assert(numEntries > 0 && (numEntries & (numEntries - 1)) == 0);
+	cache->devinfo = *devinfo;
+	cache->entries = entries;
+	cache->numEntries = numEntries;
+	v3d_qpu_assemble_line_cache_clear(cache);
 }
 
-static v3d_bool
-v3d_qpu_float32_pack_pack(enum v3d_qpu_output_pack pack,
-                          v3d_uint32 *packed)
+void v3d_qpu_assemble_line_cache_clear(struct v3d_qpu_assemble_line_cache* cache)
 {
-	switch (pack) {
-	case V3D_QPU_PACK_NONE:
-		*packed = 0;
-		return TRUE;
-	case V3D_QPU_PACK_L:
-		*packed = 1;
-		return TRUE;
-	case V3D_QPU_PACK_H:
-		*packed = 2;
-		return TRUE;
-	default:
-		return FALSE;
+	for (int i = 0; i < cache->numEntries; ++i)
+		cache->entries[i].key = 0;
+	cache->numHits = 0;
+	cache->numMisses = 0;
+}
+
+int v3d_qpu_assemble_line_length(const char* assembly, int assemblyLength)
+{
+	// This must stop exactly where v3d_qpu_skip_whitespace_comments() would, otherwise the cache
+	// key would not cover everything the assembler read.
+	const char* end = assembly + assemblyLength;
+	const char* currentChar = assembly;
+	int commentDepth = 0;
+	for (; v3d_peek(currentChar, end, 0) && (commentDepth || *currentChar != '\n'); ++currentChar)
+	{
+		if (!commentDepth && currentChar[0] == '/' && v3d_peek(currentChar, end, 1) == '/')
+		{
+			while (v3d_peek(currentChar, end, 0) && *currentChar != '\n')
+				++currentChar;
+			break;
+		}
+		if (commentDepth && currentChar[0] == '*' && v3d_peek(currentChar, end, 1) == '/')
+		{
+			--commentDepth;
+			++currentChar;
+		}
+		else if (currentChar[0] == '/' && v3d_peek(currentChar, end, 1) == '*')
+		{
+			++commentDepth;
+			++currentChar;
+		}
 	}
+	return currentChar - assembly;
 }
 
-static v3d_bool
-v3d33_qpu_add_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
-                     struct v3d_qpu_instr *instr)
+// Number of slots looked at before evicting. Keeps lookups bounded when the cache is full.
+#define V3D_QPU_LINE_CACHE_MAX_PROBES 8
+
+const struct v3d_qpu_assemble_line_result*
+v3d_qpu_assemble_line_cached(struct v3d_qpu_assemble_line_cache* cache, const char* line,
+                             int lineLength)
 {
-	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_ADD);
-	v3d_uint32 mux_a = QPU_GET_FIELD(packed_inst, V3D_QPU_ADD_A);
-	v3d_uint32 mux_b = QPU_GET_FIELD(packed_inst, V3D_QPU_ADD_B);
-	v3d_uint32 waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+	v3d_uint64 key = v3d_qpu_line_cache_key(&cache->devinfo, line, lineLength);
+	int mask = cache->numEntries - 1;
+	struct v3d_qpu_assemble_line_cache_entry* slot = NULL;
+	v3d_bool cacheable = lineLength <= V3D_QPU_LINE_CACHE_MAX_LINE_LENGTH;
+	for (int probe = 0;
+	     cacheable && probe < V3D_QPU_LINE_CACHE_MAX_PROBES && probe < cache->numEntries; ++probe)
+	{
+		struct v3d_qpu_assemble_line_cache_entry* entry =
+		    &cache->entries[(key + probe) & mask];
+		if (entry->key == key && entry->lineLength == lineLength &&
+		    (!lineLength || !v3d_memcmp(entry->line, line, lineLength)))
+		{
+			++cache->numHits;
+			return &entry->result;
+		}
+		if (!entry->key && !slot)
+			slot = entry;
+	}
+	// Nothing free nearby; evict whatever lives in the home slot.
+	if (cacheable && !slot)
+		slot = &cache->entries[key & mask];
+
+	++cache->numMisses;
+	struct v3d_qpu_assemble_arguments args = {0};
+	args.devinfo = cache->devinfo;
+	args.assembly = line;
+	args.assemblyEnd = line + lineLength;
+	v3d_uint32 numCharactersAbsorbed = v3d_qpu_assemble(&args);
+
+	struct v3d_qpu_assemble_line_result* result =
+	    cacheable ? &slot->result : &cache->uncachedResult;
+	*result = (struct v3d_qpu_assemble_line_result){0};
+	result->isEmptyLine = args.isEmptyLine;
+	result->instructionStartsAtOffset = args.instructionStartsAtOffset;
+	if (!numCharactersAbsorbed && !args.isEmptyLine)
+	{
+		result->errorMessage =
+		    args.errorMessage ? args.errorMessage : "Unspecified error with assembly";
+		result->errorAtOffset = args.errorAtOffset;
+		result->hintAvailable = args.hintAvailable;
+		result->numHints = args.numHints;
+	}
+	else if (!args.isEmptyLine &&
+	         !v3d_qpu_instr_pack(&cache->devinfo, &args.instruction, &result->packedInstruction))
+	{
+		result->errorMessage = "Instruction is not encodable on this device";
+		result->errorAtOffset = args.instructionStartsAtOffset;
+	}
 
-	v3d_uint32 map_op = op;
-	/* Some big clusters of opcodes are replicated with unpack
-	 * flags
-	 */
-	if (map_op >= 249 && map_op <= 251)
-		map_op = (map_op - 249 + 245);
-	if (map_op >= 253 && map_op <= 255)
-		map_op = (map_op - 253 + 245);
+	if (cacheable)
+	{
+		slot->key = key;
+		slot->lineLength = lineLength;
+		for (int i = 0; i < lineLength; ++i)
+			slot->line[i] = line[i];
+	}
+	return result;
+}
 
-	const struct opcode_desc *desc =
-		lookup_opcode_from_packed(devinfo, add_ops_v33,
-								  V3D_ARRAY_SIZE(add_ops_v33),
-								  map_op, mux_a, mux_b, 0);
+#undef V3D_QPU_LINE_CACHE_MAX_PROBES
 
-	if (!desc)
-		return FALSE;
+int v3d_qpu_assemble_text_cached(struct v3d_qpu_assemble_line_cache* cache, const char* assembly,
+                                 int assemblyLength,
+                                 struct v3d_qpu_assemble_line_result* resultsOut,
+                                 int* lineStartOffsetsOut, int maxLines)
+{
+	const char* end = assembly + assemblyLength;
+	const char* currentChar = assembly;
+	int numLines = 0;
+	for (;;)
+	{
+		int lineLength = v3d_qpu_assemble_line_length(currentChar, end - currentChar);
+		if (numLines < maxLines)
+		{
+			resultsOut[numLines] = *v3d_qpu_assemble_line_cached(cache, currentChar, lineLength);
+			if (lineStartOffsetsOut)
+				lineStartOffsetsOut[numLines] = currentChar - assembly;
+		}
+		++numLines;
 
-	instr->alu.add.op = desc->op;
+		currentChar += lineLength;
+		if (!v3d_peek(currentChar, end, 0))
+			break;
+		++currentChar;  // Newline
+	}
+	return numLines;
+}
 
-	/* FADD/FADDNF and FMIN/FMAX are determined by the orders of the
-	 * operands.
-	 */
-	if (((op >> 2) & 3) * 8 + mux_a > (op & 3) * 8 + mux_b) {
-		if (instr->alu.add.op == V3D_QPU_A_FMIN)
-			instr->alu.add.op = V3D_QPU_A_FMAX;
-		if (instr->alu.add.op == V3D_QPU_A_FADD)
-			instr->alu.add.op = V3D_QPU_A_FADDNF;
+// Streaming assembly
+
+static void v3d_qpu_stream_fail(struct v3d_qpu_assemble_stream_arguments* args,
+                                const char* message, int errorAtOffset, int errorLine)
+{
+	args->errorMessage = message;
+	args->errorAtOffset = errorAtOffset;
+	args->errorLine = errorLine;
+}
+
+v3d_bool v3d_qpu_assemble_stream(struct v3d_qpu_assemble_stream_arguments* args)
+{
+	const int maxBuffered = args->bufferSize;
+	char* buffer = args->buffer;
+	int numBuffered = 0;
+	int lineStart = 0;
+	// Offset in the stream of buffer[0]
+	int bufferStreamOffset = 0;
+	int lineNumber = 1;
+	v3d_bool endOfInput = FALSE;
+
+	args->numInstructions = 0;
+	args->numLines = 0;
+	args->errorMessage = NULL;
+	args->hintAvailable = NULL;
+	args->numHints = 0;
+
+	if (maxBuffered < 1)
+	{
+		v3d_qpu_stream_fail(args, "Stream buffer is too small", 0, lineNumber);
+		return FALSE;
 	}
 
-	/* Some QPU ops require a bit more than just basic opcode and mux a/b
-	 * comparisons to distinguish them.
-	 */
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_STVPMV:
-	case V3D_QPU_A_STVPMD:
-	case V3D_QPU_A_STVPMP:
-		switch (waddr) {
-		case 0:
-			instr->alu.add.op = V3D_QPU_A_STVPMV;
-			break;
-		case 1:
-			instr->alu.add.op = V3D_QPU_A_STVPMD;
-			break;
-		case 2:
-			instr->alu.add.op = V3D_QPU_A_STVPMP;
+	for (;;)
+	{
+		int lineLength =
+		    v3d_qpu_assemble_line_length(buffer + lineStart, numBuffered - lineStart);
+		v3d_bool lineComplete = lineStart + lineLength < numBuffered || endOfInput;
+		if (!lineComplete)
+		{
+			// The line (or a comment opened on it) straddles the end of what we have read so far.
+			// Move it to the front and read more after it.
+			if (lineStart)
+			{
+				numBuffered -= lineStart;
+				for (int i = 0; i < numBuffered; ++i)
+					buffer[i] = buffer[lineStart + i];
+				bufferStreamOffset += lineStart;
+				lineStart = 0;
+			}
+			if (numBuffered == maxBuffered)
+			{
+				v3d_qpu_stream_fail(args, "Line does not fit in the stream buffer",
+				                    bufferStreamOffset, lineNumber);
+				return FALSE;
+			}
+			int numRead = args->read(args->userData, buffer + numBuffered,
+			                         maxBuffered - numBuffered);
+			if (numRead < 0)
+			{
+				v3d_qpu_stream_fail(args, "Failed to read assembly from the stream",
+				                    bufferStreamOffset + numBuffered, lineNumber);
+				return FALSE;
+			}
+			if (numRead == 0)
+				endOfInput = TRUE;
+			numBuffered += numRead;
+			continue;
+		}
+
+		if (lineStart == numBuffered && endOfInput)
 			break;
-		default:
+
+		struct v3d_qpu_assemble_arguments assembleArgs = {0};
+		assembleArgs.devinfo = args->devinfo;
+		assembleArgs.assembly = buffer + lineStart;
+		assembleArgs.assemblyEnd = buffer + lineStart + lineLength;
+		if (!v3d_qpu_assemble(&assembleArgs) && !assembleArgs.isEmptyLine)
+		{
+			v3d_qpu_stream_fail(args, assembleArgs.errorMessage,
+			                    bufferStreamOffset + lineStart + assembleArgs.errorAtOffset,
+			                    lineNumber);
+			args->hintAvailable = assembleArgs.hintAvailable;
+			args->numHints = assembleArgs.numHints;
 			return FALSE;
 		}
-		break;
-	default:
-		break;
-	}
+		if (!assembleArgs.isEmptyLine)
+		{
+			v3d_uint64 packedInstruction = 0;
+			if (!v3d_qpu_instr_pack(&args->devinfo, &assembleArgs.instruction, &packedInstruction))
+			{
+				v3d_qpu_stream_fail(
+				    args, "Instruction is not encodable on this device",
+				    bufferStreamOffset + lineStart + assembleArgs.instructionStartsAtOffset,
+				    lineNumber);
+				return FALSE;
+			}
+			if (!args->emit(args->userData, packedInstruction, lineNumber))
+			{
+				v3d_qpu_stream_fail(args, "Assembly stopped by the emit callback",
+				                    bufferStreamOffset + lineStart, lineNumber);
+				return FALSE;
+			}
+			++args->numInstructions;
+		}
 
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_FADD:
-	case V3D_QPU_A_FADDNF:
-	case V3D_QPU_A_FSUB:
-	case V3D_QPU_A_FMIN:
-	case V3D_QPU_A_FMAX:
-	case V3D_QPU_A_FCMP:
-	case V3D_QPU_A_VFPACK:
-		if (instr->alu.add.op != V3D_QPU_A_VFPACK)
-			instr->alu.add.output_pack = (op >> 4) & 0x3;
-		else
-			instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+		// Multi-line comments count towards the line numbers too
+		for (int i = lineStart; i < lineStart + lineLength; ++i)
+		{
+			if (buffer[i] == '\n')
+				++lineNumber;
+		}
+		args->numLines = lineNumber;
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.add.a.unpack)) {
-			return FALSE;
+		lineStart += lineLength;
+		if (lineStart == numBuffered)
+		{
+			// Only reachable at the end of the input
+			break;
 		}
+		++lineStart;  // Newline
+		++lineNumber;
+	}
+	return TRUE;
+}
+
+// >> qpu_validate.c
+
+struct v3d_qpu_validate_state {
+	const struct v3d_device_info *devinfo;
+	const struct v3d_qpu_instr *last;
+	int ip;
+	int last_sfu_write;
+	int last_branch_ip;
+	int last_thrsw_ip;
+	int first_tlb_z_write;
+
+	/* Set when we've found the last-THRSW signal, or if we were started
+	 * in single-segment mode.
+	 */
+	v3d_bool last_thrsw_found;
+
+	/* Set when we've found the THRSW after the last THRSW */
+	v3d_bool thrend_found;
+
+	int thrsw_count;
+
+	// Include message for ease of use as well as value if e.g. an editor wants to provide helpful
+	// fixups or suggestions.
+	const char* errorMessage;
+	enum v3d_qpu_validate_error error;
+};
+
+static void fail_instr(struct v3d_qpu_validate_state* state, enum v3d_qpu_validate_error error,
+                       const char* msg)
+{
+	state->errorMessage = msg;
+	state->error = error;
+	/* struct v3d_compile *c = state->c; */
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
-										   &instr->alu.add.b.unpack)) {
-			return FALSE;
-		}
-		break;
+	/* fprintf(stderr, "v3d_qpu_validate at ip %d: %s:\n", state->ip, msg); */
 
-	case V3D_QPU_A_FFLOOR:
-	case V3D_QPU_A_FROUND:
-	case V3D_QPU_A_FTRUNC:
-	case V3D_QPU_A_FCEIL:
-	case V3D_QPU_A_FDX:
-	case V3D_QPU_A_FDY:
-		instr->alu.add.output_pack = mux_b & 0x3;
+	/* int dump_ip = 0; */
+	/* vir_for_each_inst_inorder(inst, c) { */
+	/*         v3d_qpu_dump(c->devinfo, &inst->qpu); */
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.add.a.unpack)) {
-			return FALSE;
-		}
-		break;
+	/*         if (dump_ip++ == state->ip) */
+	/*                 fprintf(stderr, " *** ERROR ***"); */
 
-	case V3D_QPU_A_FTOIN:
-	case V3D_QPU_A_FTOIZ:
-	case V3D_QPU_A_FTOUZ:
-	case V3D_QPU_A_FTOC:
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+	/*         fprintf(stderr, "\n"); */
+	/* } */
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.add.a.unpack)) {
-			return FALSE;
-		}
-		break;
+	/* fprintf(stderr, "\n"); */
+}
 
-	case V3D_QPU_A_VFMIN:
-	case V3D_QPU_A_VFMAX:
-		if (!v3d_qpu_float16_unpack_unpack(op & 0x7,
-										   &instr->alu.add.a.unpack)) {
-			return FALSE;
-		}
+static v3d_bool
+in_branch_delay_slots(const struct v3d_qpu_validate_state *state)
+{
+	return (state->ip - state->last_branch_ip) < 3;
+}
 
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
-		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
-		break;
+static v3d_bool
+in_thrsw_delay_slots(const struct v3d_qpu_validate_state *state)
+{
+	return (state->ip - state->last_thrsw_ip) < 3;
+}
 
-	default:
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
-		instr->alu.add.a.unpack = V3D_QPU_UNPACK_NONE;
-		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
-		break;
-	}
+/* static v3d_bool */
+/* qpu_magic_waddr_matches(const struct v3d_qpu_instr *inst, */
+/*                         v3d_bool (*predicate)(enum v3d_qpu_waddr waddr)) */
+/* { */
+/* 	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) */
+/* 		return FALSE; */
 
-	instr->alu.add.a.mux = mux_a;
-	instr->alu.add.b.mux = mux_b;
-	instr->alu.add.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+/* 	if (inst->alu.add.op != V3D_QPU_A_NOP && */
+/* 		inst->alu.add.magic_write && */
+/* 		predicate(inst->alu.add.waddr)) */
+/* 		return TRUE; */
 
-	instr->alu.add.magic_write = FALSE;
-	if (packed_inst & V3D_QPU_MA) {
-		switch (instr->alu.add.op) {
-		case V3D_QPU_A_LDVPMV_IN:
-			instr->alu.add.op = V3D_QPU_A_LDVPMV_OUT;
-			break;
-		case V3D_QPU_A_LDVPMD_IN:
-			instr->alu.add.op = V3D_QPU_A_LDVPMD_OUT;
-			break;
-		case V3D_QPU_A_LDVPMG_IN:
-			instr->alu.add.op = V3D_QPU_A_LDVPMG_OUT;
-			break;
-		default:
-			instr->alu.add.magic_write = TRUE;
-			break;
-		}
-	}
+/* 	if (inst->alu.mul.op != V3D_QPU_M_NOP && */
+/* 		inst->alu.mul.magic_write && */
+/* 		predicate(inst->alu.mul.waddr)) */
+/* 		return TRUE; */
 
-	return TRUE;
-}
+/* 	return FALSE; */
+/* } */
 
+// Returns whether the instruction is valid relative to the current state
 static v3d_bool
-v3d71_qpu_add_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
-                     struct v3d_qpu_instr *instr)
+qpu_validate_inst(struct v3d_qpu_validate_state *state, const struct v3d_qpu_instr* inst)
 {
-	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_ADD);
-	v3d_uint32 raddr_a = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_A);
-	v3d_uint32 raddr_b = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_B);
-	v3d_uint32 waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
-	v3d_uint32 map_op = op;
+	const struct v3d_device_info *devinfo = state->devinfo;
 
-	const struct opcode_desc *desc =
-		lookup_opcode_from_packed(devinfo,
-								  add_ops_v71,
-								  V3D_ARRAY_SIZE(add_ops_v71),
-								  map_op, 0, 0,
-								  raddr_b);
-	if (!desc)
+	// (todo robustness) Find a way to check for tlb z writes using just the instruction rather
+	// than the qinst.
+	/* if (qinst->is_tlb_z_write && state->ip < state->first_tlb_z_write) */
+	/*         state->first_tlb_z_write = state->ip; */
+
+	if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH && state->first_tlb_z_write >= 0 &&
+	    state->ip > state->first_tlb_z_write && inst->branch.msfign != V3D_QPU_MSFIGN_NONE &&
+	    inst->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS &&
+	    inst->branch.cond != V3D_QPU_BRANCH_COND_A0 && inst->branch.cond != V3D_QPU_BRANCH_COND_NA0)
+	{
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_IMPLICIT_BRANCH_MSF_READ_AFTER_TLB_Z_WRITE,
+		           "Implicit branch MSF read after TLB Z write");
 		return FALSE;
+	}
 
-	instr->alu.add.op = desc->op;
+	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
+		return TRUE;
 
-	/* FADD/FADDNF and FMIN/FMAX are determined by the order of the
-	 * operands.
+	if (inst->alu.add.op == V3D_QPU_A_SETMSF && state->first_tlb_z_write >= 0 &&
+	    state->ip > state->first_tlb_z_write)
+	{
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_SETMSF_AFTER_TLB_Z_WRITE,
+		           "SETMSF after TLB Z write");
+		return FALSE;
+	}
+
+	if (state->first_tlb_z_write >= 0 && state->ip > state->first_tlb_z_write &&
+	    inst->alu.add.op == V3D_QPU_A_MSF)
+	{
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_MSF_READ_AFTER_TLB_Z_WRITE,
+		           "MSF read after TLB Z write");
+		return FALSE;
+	}
+
+	if (devinfo->ver < 71)
+	{
+		if (inst->sig.small_imm_a || inst->sig.small_imm_c || inst->sig.small_imm_d)
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SMALL_IMM_A_C_D_ADDED_AFTER_V3D_7_1,
+			           "small imm a/c/d added after V3D 7.1");
+			return FALSE;
+		}
+	}
+	else
+	{
+		if ((inst->sig.small_imm_a || inst->sig.small_imm_b) &&
+		    !(inst->type == V3D_QPU_INSTR_TYPE_ALU && inst->alu.add.op != V3D_QPU_A_NOP))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SMALL_IMM_A_B_USED_BUT_NO_ADD_INST,
+			           "small imm a/b used but no ADD inst");
+			return FALSE;
+		}
+		if ((inst->sig.small_imm_c || inst->sig.small_imm_d) &&
+		    !(inst->type == V3D_QPU_INSTR_TYPE_ALU && inst->alu.mul.op != V3D_QPU_M_NOP))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SMALL_IMM_C_D_USED_BUT_NO_MUL_INST,
+			           "small imm c/d used but no MUL inst");
+			return FALSE;
+		}
+		if (inst->sig.small_imm_a + inst->sig.small_imm_b + inst->sig.small_imm_c +
+		        inst->sig.small_imm_d >
+		    1)
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_MAX_ONE_SMALL_IMMEDIATE_PER_INSTRUCTION,
+			           "only one small immediate can be enabled per instruction");
+			return FALSE;
+		}
+	}
+
+	/* LDVARY writes r5 two instructions later and LDUNIF writes
+	 * r5 one instruction later, which is illegal to have
+	 * together.
 	 */
-	if (instr->sig.small_imm_a * 256 + ((op >> 2) & 3) * 64 + raddr_a >
-		instr->sig.small_imm_b * 256 + (op & 3) * 64 + raddr_b) {
-		if (instr->alu.add.op == V3D_QPU_A_FMIN)
-			instr->alu.add.op = V3D_QPU_A_FMAX;
-		if (instr->alu.add.op == V3D_QPU_A_FADD)
-			instr->alu.add.op = V3D_QPU_A_FADDNF;
+	if (state->last && state->last->sig.ldvary && (inst->sig.ldunif || inst->sig.ldunifa))
+	{
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDUNIF_AFTER_A_LDVARY, "LDUNIF after a LDVARY");
+		return FALSE;
 	}
 
-	/* Some QPU ops require a bit more than just basic opcode and mux a/b
-	 * comparisons to distinguish them.
+	/* GFXH-1633 (fixed since V3D 4.2.14, which is Rpi4)
+	 *
+	 * FIXME: This would not check correctly for V3D 4.2 versions lower
+	 * than V3D 4.2.14, but that is not a real issue because the simulator
+	 * will still catch this, and we are not really targeting any such
+	 * versions anyway.
 	 */
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_STVPMV:
-	case V3D_QPU_A_STVPMD:
-	case V3D_QPU_A_STVPMP:
-		switch (waddr) {
-		case 0:
-			instr->alu.add.op = V3D_QPU_A_STVPMV;
-			break;
-		case 1:
-			instr->alu.add.op = V3D_QPU_A_STVPMD;
-			break;
-		case 2:
-			instr->alu.add.op = V3D_QPU_A_STVPMP;
-			break;
-		default:
+	if (devinfo->ver < 42)
+	{
+		v3d_bool last_reads_ldunif =
+		    (state->last && (state->last->sig.ldunif || state->last->sig.ldunifrf));
+		v3d_bool last_reads_ldunifa =
+		    (state->last && (state->last->sig.ldunifa || state->last->sig.ldunifarf));
+		v3d_bool reads_ldunif = inst->sig.ldunif || inst->sig.ldunifrf;
+		v3d_bool reads_ldunifa = inst->sig.ldunifa || inst->sig.ldunifarf;
+		if ((last_reads_ldunif && reads_ldunifa) || (last_reads_ldunifa && reads_ldunif))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDUNIF_AND_LDUNIFA_CANT_BE_NEXT_TO_EACH_OTHER,
+			           "LDUNIF and LDUNIFA can't be next to each other");
 			return FALSE;
 		}
-		break;
-	default:
-		break;
 	}
 
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_FADD:
-	case V3D_QPU_A_FADDNF:
-	case V3D_QPU_A_FSUB:
-	case V3D_QPU_A_FMIN:
-	case V3D_QPU_A_FMAX:
-	case V3D_QPU_A_FCMP:
-	case V3D_QPU_A_VFPACK:
-		if (instr->alu.add.op != V3D_QPU_A_VFPACK &&
-			instr->alu.add.op != V3D_QPU_A_FCMP) {
-			instr->alu.add.output_pack = (op >> 4) & 0x3;
-		} else {
-			instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+	int tmu_writes = 0;
+	int sfu_writes = 0;
+	int vpm_writes = 0;
+	int tlb_writes = 0;
+	int tsy_writes = 0;
+
+	if (inst->alu.add.op != V3D_QPU_A_NOP) {
+		if (inst->alu.add.magic_write) {
+			if (v3d_qpu_magic_waddr_is_tmu(devinfo,
+										   inst->alu.add.waddr)) {
+				tmu_writes++;
+			}
+			if (v3d_qpu_magic_waddr_is_sfu(inst->alu.add.waddr))
+				sfu_writes++;
+			if (v3d_qpu_magic_waddr_is_vpm(inst->alu.add.waddr))
+				vpm_writes++;
+			if (v3d_qpu_magic_waddr_is_tlb(inst->alu.add.waddr))
+				tlb_writes++;
+			if (v3d_qpu_magic_waddr_is_tsy(inst->alu.add.waddr))
+				tsy_writes++;
+		}
+	}
+
+	if (inst->alu.mul.op != V3D_QPU_M_NOP) {
+		if (inst->alu.mul.magic_write) {
+			if (v3d_qpu_magic_waddr_is_tmu(devinfo,
+										   inst->alu.mul.waddr)) {
+				tmu_writes++;
+			}
+			if (v3d_qpu_magic_waddr_is_sfu(inst->alu.mul.waddr))
+				sfu_writes++;
+			if (v3d_qpu_magic_waddr_is_vpm(inst->alu.mul.waddr))
+				vpm_writes++;
+			if (v3d_qpu_magic_waddr_is_tlb(inst->alu.mul.waddr))
+				tlb_writes++;
+			if (v3d_qpu_magic_waddr_is_tsy(inst->alu.mul.waddr))
+				tsy_writes++;
 		}
+	}
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.add.a.unpack)) {
+	if (in_thrsw_delay_slots(state))
+	{
+		/* There's no way you want to start SFU during the THRSW delay
+		 * slots, since the result would land in the other thread.
+		 */
+		if (sfu_writes)
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SFU_WRITE_STARTED_DURING_THRSW_DELAY_SLOTS,
+			           "SFU write started during THRSW delay slots ");
 			return FALSE;
 		}
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
-										   &instr->alu.add.b.unpack)) {
-			return FALSE;
+		if (inst->sig.ldvary)
+		{
+			if (devinfo->ver == 42)
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDVARY_DURING_THRSW_DELAY_SLOTS,
+				           "LDVARY during THRSW delay slots");
+				return FALSE;
+			}
+			if (devinfo->ver >= 71 && state->ip - state->last_thrsw_ip == 2)
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDVARY_IN_2ND_THRSW_DELAY_SLOT,
+				           "LDVARY in 2nd THRSW delay slot");
+				return FALSE;
+			}
 		}
-		break;
+	}
 
-	case V3D_QPU_A_FFLOOR:
-	case V3D_QPU_A_FROUND:
-	case V3D_QPU_A_FTRUNC:
-	case V3D_QPU_A_FCEIL:
-	case V3D_QPU_A_FDX:
-	case V3D_QPU_A_FDY:
-		instr->alu.add.output_pack = raddr_b & 0x3;
+	/* (void)qpu_magic_waddr_matches; /\* XXX *\/ */
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.add.a.unpack)) {
+	/* SFU r4 results come back two instructions later.  No doing
+	 * r4 read/writes or other SFU lookups until it's done.
+	 */
+	if (state->ip - state->last_sfu_write < 2)
+	{
+		if (v3d_qpu_uses_mux(inst, V3D_QPU_MUX_R4))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_R4_READ_TOO_SOON_AFTER_SFU,
+			           "R4 read too soon after SFU");
 			return FALSE;
 		}
-		break;
-
-	case V3D_QPU_A_FTOIN:
-	case V3D_QPU_A_FTOIZ:
-	case V3D_QPU_A_FTOUZ:
-	case V3D_QPU_A_FTOC:
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
 
-		if (!v3d_qpu_float32_unpack_unpack((raddr_b >> 2) & 0x3,
-										   &instr->alu.add.a.unpack)) {
+		if (v3d_qpu_writes_r4(devinfo, inst))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_R4_WRITE_TOO_SOON_AFTER_SFU,
+			           "R4 write too soon after SFU");
 			return FALSE;
 		}
-		break;
 
-	case V3D_QPU_A_VFMIN:
-	case V3D_QPU_A_VFMAX:
-		v3d_unreachable("pending v71 update");
-		if (!v3d_qpu_float16_unpack_unpack(op & 0x7,
-										   &instr->alu.add.a.unpack)) {
+		if (sfu_writes)
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SFU_WRITE_TOO_SOON_AFTER_SFU,
+			           "SFU write too soon after SFU");
 			return FALSE;
 		}
+	}
 
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
-		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
-		break;
+	/* XXX: The docs say VPM can happen with the others, but the simulator
+	 * disagrees.
+	 */
+	if (tmu_writes + sfu_writes + vpm_writes + tlb_writes + tsy_writes +
+	        (devinfo->ver == 42 ? inst->sig.ldtmu : 0) + inst->sig.ldtlb + inst->sig.ldvpm +
+	        inst->sig.ldtlbu >
+	    1)
+	{
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_ONLY_ONE_OF_TMU_SFU_TSY_TLB_READ_VPM_ALLOWED,
+		           "Only one of [TMU, SFU, TSY, TLB read, VPM] allowed");
+		return FALSE;
+	}
 
-	case V3D_QPU_A_MOV:
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
+	if (sfu_writes)
+		state->last_sfu_write = state->ip;
 
-		if (!v3d_qpu_int32_unpack_unpack((raddr_b >> 2) & 0x7,
-										 &instr->alu.add.a.unpack)) {
+	if (inst->sig.thrsw)
+	{
+		if (in_branch_delay_slots(state))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_THRSW_IN_A_BRANCH_DELAY_SLOT,
+			           "THRSW in a branch delay slot.");
 			return FALSE;
 		}
-		break;
 
-	case V3D_QPU_A_FMOV:
-		instr->alu.add.output_pack = raddr_b & 0x3;
+		if (state->last_thrsw_found)
+			state->thrend_found = TRUE;
 
-		/* Mul alu FMOV has one additional variant */
-		v3d_int32 unpack = (raddr_b >> 2) & 0x7;
-		if (unpack == 7)
-			return FALSE;
+		if (state->last_thrsw_ip == state->ip - 1)
+		{
+			/* If it's the second THRSW in a row, then it's just a
+			 * last-thrsw signal.
+			 */
+			if (state->last_thrsw_found)
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_TWO_LAST_THRSW_SIGNALS,
+				           "Two last-THRSW signals");
+				return FALSE;
+			}
+			state->last_thrsw_found = TRUE;
+		}
+		else
+		{
+			if (in_thrsw_delay_slots(state))
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_THRSW_TOO_CLOSE_TO_ANOTHER_THRSW,
+				           "THRSW too close to another THRSW.");
+				return FALSE;
+			}
+			state->thrsw_count++;
+			state->last_thrsw_ip = state->ip;
+		}
+	}
 
-		if (!v3d_qpu_float32_unpack_unpack(unpack,
-										   &instr->alu.add.a.unpack)) {
-			return FALSE;
+	if (state->thrend_found && state->last_thrsw_ip - state->ip <= 2 &&
+	    inst->type == V3D_QPU_INSTR_TYPE_ALU)
+	{
+		if ((inst->alu.add.op != V3D_QPU_A_NOP && !inst->alu.add.magic_write))
+		{
+			if (devinfo->ver == 42)
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF_WRITE_AFTER_THREND,
+				           "RF write after THREND");
+				return FALSE;
+			}
+			else if (devinfo->ver >= 71)
+			{
+				if (state->last_thrsw_ip - state->ip == 0)
+				{
+					fail_instr(state, V3D_QPU_VALIDATE_ERROR_ADD_RF_WRITE_AT_THREND,
+					           "ADD RF write at THREND");
+					return FALSE;
+				}
+				if (inst->alu.add.waddr == 2 || inst->alu.add.waddr == 3)
+				{
+					fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF2_3_WRITE_AFTER_THREND,
+					           "RF2-3 write after THREND");
+					return FALSE;
+				}
+			}
 		}
-		break;
 
-	default:
-		instr->alu.add.output_pack = V3D_QPU_PACK_NONE;
-		instr->alu.add.a.unpack = V3D_QPU_UNPACK_NONE;
-		instr->alu.add.b.unpack = V3D_QPU_UNPACK_NONE;
-		break;
-	}
+		if ((inst->alu.mul.op != V3D_QPU_M_NOP && !inst->alu.mul.magic_write))
+		{
+			if (devinfo->ver == 42)
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF_WRITE_AFTER_THREND,
+				           "RF write after THREND");
+				return FALSE;
+			}
+			else if (devinfo->ver >= 71)
+			{
+				if (state->last_thrsw_ip - state->ip == 0)
+				{
+					fail_instr(state, V3D_QPU_VALIDATE_ERROR_MUL_RF_WRITE_AT_THREND,
+					           "MUL RF write at THREND");
+					return FALSE;
+				}
 
-	instr->alu.add.a.raddr = raddr_a;
-	instr->alu.add.b.raddr = raddr_b;
-	instr->alu.add.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_A);
+				if (inst->alu.mul.waddr == 2 || inst->alu.mul.waddr == 3)
+				{
+					fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF2_3_WRITE_AFTER_THREND,
+					           "RF2-3 write after THREND");
+					return FALSE;
+				}
+			}
+		}
 
-	instr->alu.add.magic_write = FALSE;
-	if (packed_inst & V3D_QPU_MA) {
-		switch (instr->alu.add.op) {
-		case V3D_QPU_A_LDVPMV_IN:
-			instr->alu.add.op = V3D_QPU_A_LDVPMV_OUT;
-			break;
-		case V3D_QPU_A_LDVPMD_IN:
-			instr->alu.add.op = V3D_QPU_A_LDVPMD_OUT;
-			break;
-		case V3D_QPU_A_LDVPMG_IN:
-			instr->alu.add.op = V3D_QPU_A_LDVPMG_OUT;
-			break;
-		default:
-			instr->alu.add.magic_write = TRUE;
-			break;
+		if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) && !inst->sig_magic)
+		{
+			if (devinfo->ver == 42)
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF_WRITE_AFTER_THREND,
+				           "RF write after THREND");
+				return FALSE;
+			}
+			else if (devinfo->ver >= 71 && (inst->sig_addr == 2 || inst->sig_addr == 3))
+			{
+				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF2_3_WRITE_AFTER_THREND,
+				           "RF2-3 write after THREND");
+				return FALSE;
+			}
+		}
+
+		/* GFXH-1625: No TMUWT in the last instruction */
+		if (state->last_thrsw_ip - state->ip == 2 && inst->alu.add.op == V3D_QPU_A_TMUWT)
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_TMUWT_IN_LAST_INSTRUCTION,
+			           "TMUWT in last instruction");
+			return FALSE;
 		}
 	}
 
+	if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH)
+	{
+		if (in_branch_delay_slots(state))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_BRANCH_IN_A_BRANCH_DELAY_SLOT,
+			           "branch in a branch delay slot.");
+			return FALSE;
+		}
+		if (in_thrsw_delay_slots(state))
+		{
+			fail_instr(state, V3D_QPU_VALIDATE_ERROR_BRANCH_IN_A_THRSW_DELAY_SLOT,
+			           "branch in a THRSW delay slot.");
+			return FALSE;
+		}
+		state->last_branch_ip = state->ip;
+	}
 	return TRUE;
 }
 
-static v3d_bool
-v3d_qpu_add_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
-                   struct v3d_qpu_instr *instr)
+static void qpu_validate_begin(struct v3d_qpu_validate_state* state,
+                               const struct v3d_device_info* devinfo)
 {
-	if (devinfo->ver < 71)
-		return v3d33_qpu_add_unpack(devinfo, packed_inst, instr);
-	else
-		return v3d71_qpu_add_unpack(devinfo, packed_inst, instr);
+	*state = (struct v3d_qpu_validate_state){
+	    .devinfo = devinfo,
+	    .last_sfu_write = -10,
+	    .last_thrsw_ip = -10,
+	    .last_branch_ip = -10,
+	    .first_tlb_z_write = 0x7fffffff /*INT_MAX*/,
+	    .ip = 0,
+
+	    // (todo) Not sure what to put here, since it relies on there having been a compile phase
+	    /* .last_thrsw_found = !c->last_thrsw, */
+		.last_thrsw_found = FALSE,
+	};
 }
 
-static v3d_bool
-v3d33_qpu_mul_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
-                     struct v3d_qpu_instr *instr)
+// Checks the whole-program rules once every instruction has gone through qpu_validate_inst().
+// Only the thrsw signals of the final two instructions are needed.
+static v3d_bool qpu_validate_finish(struct v3d_qpu_validate_state* state, int numInstructions,
+                                    v3d_bool secondToLastThrsw, v3d_bool lastThrsw)
 {
-	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_MUL);
-	v3d_uint32 mux_a = QPU_GET_FIELD(packed_inst, V3D_QPU_MUL_A);
-	v3d_uint32 mux_b = QPU_GET_FIELD(packed_inst, V3D_QPU_MUL_B);
-
+	if (state->thrsw_count > 1 && !state->last_thrsw_found)
 	{
-		const struct opcode_desc *desc =
-			lookup_opcode_from_packed(devinfo,
-									  mul_ops_v33,
-									  V3D_ARRAY_SIZE(mul_ops_v33),
-									  op, mux_a, mux_b, 0);
-		if (!desc)
-			return FALSE;
-
-		instr->alu.mul.op = desc->op;
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_THREAD_SWITCH_FOUND_WITHOUT_LAST_THRSW_IN_PROGRAM,
+		           "thread switch found without last-THRSW in program");
+		return FALSE;
 	}
 
-	switch (instr->alu.mul.op) {
-	case V3D_QPU_M_FMUL:
-		instr->alu.mul.output_pack = ((op >> 4) & 0x3) - 1;
-
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.mul.a.unpack)) {
-			return FALSE;
-		}
+	// (todo) Figure out this thrsw business
+	/* if (!state->thrend_found) */
+	/* { */
+	/* 	fail_instr(state, V3D_QPU_VALIDATE_ERROR_NO_PROGRAM_END_THRSW_FOUND, */
+	/* 	           "No program-end THRSW found"); */
+	/* 	return FALSE; */
+	/* } */
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
-										   &instr->alu.mul.b.unpack)) {
-			return FALSE;
-		}
+	if (numInstructions < 3 || secondToLastThrsw || lastThrsw)
+	{
+		fail_instr(state, V3D_QPU_VALIDATE_ERROR_NO_PROGRAM_END_THRSW_DELAY_SLOTS,
+		           "THRSW needs two delay slot instructions");
+		return FALSE;
+	}
+	return TRUE;
+}
 
-		break;
+v3d_bool v3d_qpu_validate(const struct v3d_device_info* devinfo, struct v3d_qpu_instr* instructions,
+                          int numInstructions, struct v3d_qpu_validate_result* results)
+{
+	struct v3d_qpu_validate_state state;
+	qpu_validate_begin(&state, devinfo);
 
-	case V3D_QPU_M_FMOV:
-		instr->alu.mul.output_pack = (((op & 1) << 1) +
-									  ((mux_b >> 2) & 1));
+	/* // Find the last thrsw. I am not sure this is correct. */
+	/* for (int instructionIndex = numInstructions - 1; instructionIndex >= 0; --instructionIndex) */
+	/* { */
+	/* 	if (instructions[instructionIndex].sig.thrsw) */
+	/* 	{ */
+	/* 		state.last_thrsw_found = TRUE; */
+	/* 		break; */
+	/* 	} */
+	/* } */
 
-		if (!v3d_qpu_float32_unpack_unpack(mux_b & 0x3,
-										   &instr->alu.mul.a.unpack)) {
-			return FALSE;
+	v3d_bool hasError = FALSE;
+	for (int instructionIndex = 0; instructionIndex < numInstructions; ++instructionIndex)
+	{
+		if (!qpu_validate_inst(&state, &instructions[instructionIndex]))
+		{
+			results->errorInstructionIndex = instructionIndex;
+			hasError = TRUE;
+			break;
 		}
 
-		break;
+		state.last = &instructions[instructionIndex];
+		state.ip++;
+	}
 
-	case V3D_QPU_M_VFMUL:
-		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+	if (!hasError &&
+	    !qpu_validate_finish(&state, numInstructions,
+	                         numInstructions >= 2 && instructions[numInstructions - 2].sig.thrsw,
+	                         numInstructions >= 1 && instructions[numInstructions - 1].sig.thrsw))
+	{
+		results->errorInstructionIndex = numInstructions - 1;
+		hasError = TRUE;
+	}
 
-		if (!v3d_qpu_float16_unpack_unpack(((op & 0x7) - 4) & 7,
-										   &instr->alu.mul.a.unpack)) {
-			return FALSE;
-		}
+	if (hasError)
+	{
+		results->errorMessage = state.errorMessage;
+		results->error = state.error;
+		return FALSE;
+	}
 
-		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
+	return TRUE;
+}
 
-		break;
+// Fused assembly
 
-	default:
-		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
-		instr->alu.mul.a.unpack = V3D_QPU_UNPACK_NONE;
-		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
-		break;
+static int v3d_count_newlines(const char* start, const char* end)
+{
+	int numNewlines = 0;
+	for (const char* currentChar = start; currentChar < end; ++currentChar)
+	{
+		if (*currentChar == '\n')
+			++numNewlines;
 	}
+	return numNewlines;
+}
 
-	instr->alu.mul.a.mux = mux_a;
-	instr->alu.mul.b.mux = mux_b;
-	instr->alu.mul.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_M);
-	instr->alu.mul.magic_write = (packed_inst & V3D_QPU_MM) ? TRUE : FALSE;
+// Walks the assembly a line at a time for v3d_qpu_assemble_program() and v3d_qpu_assemble_file().
+// Each v3d_qpu_line_walk_next() assembles one line, packs its instructions and validates them
+// against the ones before. The validator only ever looks back one instruction, so the unpacked
+// form of the current and previous instructions is all that is kept.
+struct v3d_qpu_line_walk
+{
+	// Inputs
+	const struct v3d_device_info* devinfo;
+	const char* assembly;
+	const char* end;
+	const struct v3d_qpu_raddr_fix_options* raddrFixOptions;
+	// Optional, packed instructions are only counted without it
+	v3d_uint64* instructionsOut;
+	int maxInstructions;
+	// Optional, filled alongside instructionsOut
+	int* instructionOffsetsOut;
+	int* instructionLinesOut;
+	// Cleared after the first validation error, and after a line fails as the instruction
+	// sequence has a hole in it then
+	v3d_bool validating;
+
+	// Outputs, for the line just walked
+	struct v3d_qpu_assemble_arguments line;
+	v3d_bool assembled;
+	int lineNumber;
+	int instructionOffset;
+	int instructionLine;
+	// Set if the line failed to assemble or pack, or didn't fit in instructionsOut
+	const char* errorMessage;
+	int errorAtOffset;
+	int errorLine;
+	// Set if one of the line's instructions failed validation
+	const char* validateErrorMessage;
+	enum v3d_qpu_validate_error validateError;
+	int validateErrorInstructionIndex;
 
-	return TRUE;
+	// Outputs, running totals
+	int numInstructions;
+	int lastInstructionOffset;
+	int lastInstructionLine;
+
+	const char* currentChar;
+	int nextLineNumber;
+	v3d_bool finished;
+	struct v3d_qpu_validate_state state;
+	struct v3d_qpu_instr instructions[2];
+	int currentInstruction;
+	v3d_bool secondToLastThrsw;
+	v3d_bool lastThrsw;
+};
+
+static void v3d_qpu_line_walk_begin(struct v3d_qpu_line_walk* walk,
+                                    const struct v3d_device_info* devinfo, const char* assembly,
+                                    int assemblyLength)
+{
+	*walk = (struct v3d_qpu_line_walk){0};
+	walk->devinfo = devinfo;
+	walk->assembly = assembly;
+	walk->end = assembly + assemblyLength;
+	walk->validating = TRUE;
+	walk->currentChar = assembly;
+	walk->nextLineNumber = 1;
+	qpu_validate_begin(&walk->state, devinfo);
 }
 
-static v3d_bool
-v3d71_qpu_mul_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
-                     struct v3d_qpu_instr *instr)
+// Returns FALSE once every line was walked
+static v3d_bool v3d_qpu_line_walk_next(struct v3d_qpu_line_walk* walk)
 {
-	v3d_uint32 op = QPU_GET_FIELD(packed_inst, V3D_QPU_OP_MUL);
-	v3d_uint32 raddr_c = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_C);
-	v3d_uint32 raddr_d = QPU_GET_FIELD(packed_inst, V3D_QPU_RADDR_D);
+	if (walk->finished)
+		return FALSE;
 
+	const char* currentChar = walk->currentChar;
+	int lineLength = v3d_qpu_assemble_line_length(currentChar, walk->end - currentChar);
+	int lineOffset = currentChar - walk->assembly;
+	walk->lineNumber = walk->nextLineNumber;
+	walk->errorMessage = NULL;
+	walk->validateErrorMessage = NULL;
+
+	struct v3d_qpu_assemble_arguments* line = &walk->line;
+	*line = (struct v3d_qpu_assemble_arguments){0};
+	line->devinfo = *walk->devinfo;
+	line->assembly = currentChar;
+	line->assemblyEnd = currentChar + lineLength;
+	line->raddrFixOptions = walk->raddrFixOptions;
+	walk->assembled = v3d_qpu_assemble(line) != 0;
+
+	if (!walk->assembled && !line->isEmptyLine)
 	{
-		const struct opcode_desc *desc =
-			lookup_opcode_from_packed(devinfo,
-									  mul_ops_v71,
-									  V3D_ARRAY_SIZE(mul_ops_v71),
-									  op, 0, 0,
-									  raddr_d);
-		if (!desc)
-			return FALSE;
-
-		instr->alu.mul.op = desc->op;
+		walk->errorMessage = line->errorMessage;
+		walk->errorAtOffset = lineOffset + line->errorAtOffset;
 	}
+	else if (!line->isEmptyLine)
+	{
+		walk->instructionOffset = lineOffset + line->instructionStartsAtOffset;
+		walk->instructionLine =
+		    walk->lineNumber +
+		    v3d_count_newlines(currentChar, walk->assembly + walk->instructionOffset);
+		walk->errorAtOffset = walk->instructionOffset;
+		const struct v3d_qpu_instr* lineInstructions[2] = {&line->instruction,
+		                                                   &line->secondInstruction};
+		int numLineInstructions = line->raddrFix != V3D_QPU_RADDR_FIX_NONE ? 2 : 1;
+
+		for (int i = 0; i < numLineInstructions; ++i)
+		{
+			v3d_uint64 packedInstruction = 0;
+			if (!v3d_qpu_instr_pack(walk->devinfo, lineInstructions[i], &packedInstruction))
+				walk->errorMessage = "Instruction is not encodable on this device";
+			else if (walk->instructionsOut)
+			{
+				if (walk->numInstructions >= walk->maxInstructions)
+					walk->errorMessage = "Too many instructions for the output buffer";
+				else
+				{
+					walk->instructionsOut[walk->numInstructions] = packedInstruction;
+					if (walk->instructionOffsetsOut)
+						walk->instructionOffsetsOut[walk->numInstructions] = walk->instructionOffset;
+					if (walk->instructionLinesOut)
+						walk->instructionLinesOut[walk->numInstructions] = walk->instructionLine;
+				}
+			}
+			if (walk->errorMessage)
+				break;
 
-	switch (instr->alu.mul.op) {
-	case V3D_QPU_M_FMUL:
-		instr->alu.mul.output_pack = ((op >> 4) & 0x3) - 1;
-
-		if (!v3d_qpu_float32_unpack_unpack((op >> 2) & 0x3,
-										   &instr->alu.mul.a.unpack)) {
-			return FALSE;
-		}
+			struct v3d_qpu_instr* instruction = &walk->instructions[walk->currentInstruction];
+			*instruction = *lineInstructions[i];
+			if (walk->validating && !qpu_validate_inst(&walk->state, instruction))
+			{
+				walk->validating = FALSE;
+				walk->validateErrorMessage = walk->state.errorMessage;
+				walk->validateError = walk->state.error;
+				walk->validateErrorInstructionIndex = walk->numInstructions;
+			}
+			walk->state.last = instruction;
+			walk->state.ip++;
+			walk->currentInstruction ^= 1;
 
-		if (!v3d_qpu_float32_unpack_unpack((op >> 0) & 0x3,
-										   &instr->alu.mul.b.unpack)) {
-			return FALSE;
+			walk->secondToLastThrsw = walk->lastThrsw;
+			walk->lastThrsw = instruction->sig.thrsw;
+			walk->lastInstructionOffset = walk->instructionOffset;
+			walk->lastInstructionLine = walk->instructionLine;
+			++walk->numInstructions;
 		}
+	}
 
-		break;
+	if (walk->errorMessage)
+	{
+		walk->validating = FALSE;
+		walk->errorLine = walk->lineNumber +
+		                  v3d_count_newlines(currentChar, walk->assembly + walk->errorAtOffset);
+	}
 
-	case V3D_QPU_M_FMOV:
-		instr->alu.mul.output_pack = raddr_d & 0x3;
+	walk->nextLineNumber =
+	    walk->lineNumber + v3d_count_newlines(currentChar, currentChar + lineLength) + 1;
+	currentChar += lineLength;
+	if (!v3d_peek(currentChar, walk->end, 0))
+		walk->finished = TRUE;
+	else
+		++currentChar;  // Newline
+	walk->currentChar = currentChar;
+	return TRUE;
+}
 
-		if (!v3d_qpu_float32_unpack_unpack((raddr_d >> 2) & 0x7,
-										   &instr->alu.mul.a.unpack)) {
-			return FALSE;
-		}
+// Checks the rules that need the whole program once every line was walked
+static v3d_bool v3d_qpu_line_walk_finish(struct v3d_qpu_line_walk* walk)
+{
+	if (!walk->validating || qpu_validate_finish(&walk->state, walk->numInstructions,
+	                                             walk->secondToLastThrsw, walk->lastThrsw))
+		return TRUE;
 
-		break;
+	walk->validateErrorMessage = walk->state.errorMessage;
+	walk->validateError = walk->state.error;
+	walk->validateErrorInstructionIndex = walk->numInstructions - 1;
+	return FALSE;
+}
 
-	case V3D_QPU_M_VFMUL:
-		v3d_unreachable("pending v71 update");
-		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+static void v3d_qpu_program_fail(struct v3d_qpu_assemble_program_arguments* args,
+                                 const char* message, int errorAtOffset, int errorLine)
+{
+	args->errorMessage = message;
+	args->errorAtOffset = errorAtOffset;
+	args->errorLine = errorLine;
+}
 
-		if (!v3d_qpu_float16_unpack_unpack(((op & 0x7) - 4) & 7,
-										   &instr->alu.mul.a.unpack)) {
+v3d_bool v3d_qpu_assemble_program(struct v3d_qpu_assemble_program_arguments* args)
+{
+	args->numInstructions = 0;
+	args->errorMessage = NULL;
+	args->errorAtOffset = 0;
+	args->errorLine = 0;
+	args->hintAvailable = NULL;
+	args->numHints = 0;
+	args->validateResult = (struct v3d_qpu_validate_result){0};
+
+	struct v3d_qpu_line_walk walk;
+	v3d_qpu_line_walk_begin(&walk, &args->devinfo, args->assembly, args->assemblyLength);
+	walk.instructionsOut = args->instructionsOut;
+	walk.maxInstructions = args->maxInstructions;
+	walk.instructionOffsetsOut = args->instructionOffsetsOut;
+	walk.instructionLinesOut = args->instructionLinesOut;
+
+	while (v3d_qpu_line_walk_next(&walk))
+	{
+		if (walk.errorMessage)
+		{
+			v3d_qpu_program_fail(args, walk.errorMessage, walk.errorAtOffset, walk.errorLine);
+			args->hintAvailable = walk.line.hintAvailable;
+			args->numHints = walk.line.numHints;
+			return FALSE;
+		}
+		if (walk.validateErrorMessage)
+		{
+			args->validateResult.errorInstructionIndex = walk.validateErrorInstructionIndex;
+			args->validateResult.errorMessage = walk.validateErrorMessage;
+			args->validateResult.error = walk.validateError;
+			v3d_qpu_program_fail(args, walk.validateErrorMessage, walk.instructionOffset,
+			                     walk.instructionLine);
 			return FALSE;
 		}
+		args->numInstructions = walk.numInstructions;
+	}
 
-		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
+	if (!v3d_qpu_line_walk_finish(&walk))
+	{
+		args->validateResult.errorInstructionIndex = walk.validateErrorInstructionIndex;
+		args->validateResult.errorMessage = walk.validateErrorMessage;
+		args->validateResult.error = walk.validateError;
+		v3d_qpu_program_fail(args, walk.validateErrorMessage, walk.lastInstructionOffset,
+		                     walk.lastInstructionLine);
+		return FALSE;
+	}
+	return TRUE;
+}
 
-		break;
+// Instruction builder
 
-	case V3D_QPU_M_MOV:
-		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
+struct v3d_qpu_operand v3d_qpu_operand_none(void)
+{
+	struct v3d_qpu_operand operand = {0};
+	return operand;
+}
 
-		if (!v3d_qpu_int32_unpack_unpack((raddr_d >> 2) & 0x7,
-										 &instr->alu.mul.a.unpack)) {
-			return FALSE;
-		}
-		break;
+struct v3d_qpu_operand v3d_qpu_operand_rf(int registerFile)
+{
+	struct v3d_qpu_operand operand = {0};
+	operand.kind = V3D_QPU_OPERAND_REGISTER_FILE;
+	operand.index = registerFile;
+	return operand;
+}
 
-	default:
-		instr->alu.mul.output_pack = V3D_QPU_PACK_NONE;
-		instr->alu.mul.a.unpack = V3D_QPU_UNPACK_NONE;
-		instr->alu.mul.b.unpack = V3D_QPU_UNPACK_NONE;
-		break;
-	}
+struct v3d_qpu_operand v3d_qpu_operand_acc(int accumulator)
+{
+	struct v3d_qpu_operand operand = {0};
+	operand.kind = V3D_QPU_OPERAND_ACCUMULATOR;
+	operand.index = accumulator;
+	return operand;
+}
 
-	instr->alu.mul.a.raddr = raddr_c;
-	instr->alu.mul.b.raddr = raddr_d;
-	instr->alu.mul.waddr = QPU_GET_FIELD(packed_inst, V3D_QPU_WADDR_M);
-	instr->alu.mul.magic_write = (packed_inst & V3D_QPU_MM) ? TRUE : FALSE;
+struct v3d_qpu_operand v3d_qpu_operand_magic(enum v3d_qpu_waddr waddr)
+{
+	struct v3d_qpu_operand operand = {0};
+	operand.kind = V3D_QPU_OPERAND_MAGIC;
+	operand.index = waddr;
+	return operand;
+}
 
-	return TRUE;
+struct v3d_qpu_operand v3d_qpu_operand_small_imm(v3d_uint32 packedSmallImmediate)
+{
+	struct v3d_qpu_operand operand = {0};
+	operand.kind = V3D_QPU_OPERAND_SMALL_IMMEDIATE;
+	operand.index = (int)packedSmallImmediate;
+	return operand;
 }
 
-static v3d_bool
-v3d_qpu_mul_unpack(const struct v3d_device_info *devinfo, v3d_uint64 packed_inst,
-                   struct v3d_qpu_instr *instr)
+v3d_bool v3d_qpu_operand_small_imm_value(const struct v3d_device_info* devinfo, v3d_uint32 value,
+                                         struct v3d_qpu_operand* operandOut)
 {
-	if (devinfo->ver < 71)
-		return v3d33_qpu_mul_unpack(devinfo, packed_inst, instr);
-	else
-		return v3d71_qpu_mul_unpack(devinfo, packed_inst, instr);
+	v3d_uint32 packedSmallImmediate = 0;
+	if (!v3d_qpu_small_imm_pack(devinfo, value, &packedSmallImmediate))
+		return FALSE;
+	*operandOut = v3d_qpu_operand_small_imm(packedSmallImmediate);
+	return TRUE;
 }
 
-static const struct opcode_desc *
-lookup_opcode_from_instr(const struct v3d_device_info *devinfo,
-                         const struct opcode_desc *opcodes, size_t num_opcodes,
-                         v3d_uint8 op)
+struct v3d_qpu_operand v3d_qpu_operand_unpack(struct v3d_qpu_operand operand,
+                                              enum v3d_qpu_input_unpack unpack)
 {
-	for (int i = 0; i < num_opcodes; i++) {
-		const struct opcode_desc *op_desc = &opcodes[i];
+	operand.unpack = unpack;
+	return operand;
+}
 
-		if (op_desc->op != op)
-			continue;
+struct v3d_qpu_operand v3d_qpu_operand_pack(struct v3d_qpu_operand operand,
+                                            enum v3d_qpu_output_pack pack)
+{
+	operand.pack = pack;
+	return operand;
+}
 
-		if (opcode_invalid_in_version(devinfo, op_desc->first_ver, op_desc->last_ver))
-			continue;
+void v3d_qpu_builder_init(struct v3d_qpu_builder* builder, const struct v3d_device_info* devinfo,
+                          v3d_uint64* code, int capacity, v3d_qpu_builder_grow_func grow,
+                          void* userData)
+{
+	*builder = (struct v3d_qpu_builder){0};
+	builder->devinfo = *devinfo;
+	builder->code = code;
+	builder->capacity = capacity;
+	builder->grow = grow;
+	builder->userData = userData;
+}
 
-		return op_desc;
+static const char* v3d_qpu_build_dst(v3d_bool hasDst, struct v3d_qpu_operand dst,
+                                     v3d_uint8* waddr, v3d_bool* magicWrite,
+                                     enum v3d_qpu_output_pack* outputPack)
+{
+	if (!hasDst)
+	{
+		if (dst.kind != V3D_QPU_OPERAND_NONE)
+			return "Operation does not have a destination";
+		// From vir_to_qpu.c, v3d_qpu_nop() sets magic for NOP
+		*waddr = V3D_QPU_WADDR_NOP;
+		*magicWrite = TRUE;
+		return NULL;
 	}
 
+	switch (dst.kind)
+	{
+		case V3D_QPU_OPERAND_REGISTER_FILE:
+			if (dst.index < 0 || dst.index > 63)
+				return "Expected rf0 through rf63";
+			*waddr = dst.index;
+			*magicWrite = FALSE;
+			break;
+		case V3D_QPU_OPERAND_ACCUMULATOR:
+			if (dst.index < 0 || dst.index > 5)
+				return "Expected accumulator register r0-r5";
+			*waddr = V3D_QPU_WADDR_R0 + dst.index;
+			*magicWrite = TRUE;
+			break;
+		case V3D_QPU_OPERAND_MAGIC:
+			if (dst.index < 0 || dst.index > 63)
+				return "Expected waddr";
+			*waddr = dst.index;
+			*magicWrite = TRUE;
+			break;
+		default:
+			return "Expected destination operand rf0 through rf63, accumulator, or waddr";
+	}
+	*outputPack = dst.pack;
 	return NULL;
 }
 
-// The below two functions are from Mesa/src/util/bitscan.c:
-#ifdef HAVE___BUILTIN_FFS
-#elif defined(_MSC_VER) && (_M_IX86 || _M_ARM || _M_AMD64 || _M_IA64)
-#else
-int
-ffs(int i)
+static const char* v3d_qpu_build_src(struct v3d_qpu_instr* instr, int numSrc, int src,
+                                     struct v3d_qpu_operand operand, struct v3d_qpu_input* input)
 {
-	int bit = 0;
-	if (!i)
-		return bit;
-	if (!(i & 0xffff)) {
-		bit += 16;
-		i >>= 16;
+	if (src >= numSrc)
+	{
+		if (operand.kind != V3D_QPU_OPERAND_NONE)
+			return "Too many source operands for operation";
+		return NULL;
 	}
-	if (!(i & 0xff)) {
-		bit += 8;
-		i >>= 8;
+
+	enum v3d_qpu_assemble_raddr_result raddrResult = v3d_qpu_assemble_raddr_result_success;
+	switch (operand.kind)
+	{
+		case V3D_QPU_OPERAND_REGISTER_FILE:
+			if (operand.index < 0 || operand.index > 63)
+				return "Expected rf0 through rf63";
+			raddrResult = v3d33_qpu_allocate_raddr(instr, &input->mux, operand.index);
+			break;
+		case V3D_QPU_OPERAND_ACCUMULATOR:
+			if (operand.index < 0 || operand.index > 5)
+				return "Expected accumulator register r0-r5";
+			input->mux = V3D_QPU_MUX_R0 + operand.index;
+			break;
+		case V3D_QPU_OPERAND_SMALL_IMMEDIATE:
+			if (operand.index < 0 || operand.index >= (int)V3D_ARRAY_SIZE(small_immediates))
+				return "Unrecognized small immediate";
+			raddrResult = v3d33_qpu_allocate_small_imm(instr, &input->mux, operand.index);
+			break;
+		case V3D_QPU_OPERAND_NONE:
+			return "Missing source operand";
+		default:
+			return "Expected source operand rf0 through rf63, accumulator register r0-r5, or small "
+			       "immediate";
 	}
-	if (!(i & 0xf)) {
-		bit += 4;
-		i >>= 4;
+
+	switch (raddrResult)
+	{
+		case v3d_qpu_assemble_raddr_result_success:
+			break;
+		case v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates:
+			return "Too many small immediates. Only one small immediate may be used per "
+			       "instruction";
+		default:
+			return "Too many unique register files (plus small immediate). Only two unique raddrs "
+			       "may be used per instruction";
 	}
-	if (!(i & 0x3)) {
-		bit += 2;
-		i >>= 2;
+	input->unpack = operand.unpack;
+	return NULL;
+}
+
+v3d_bool v3d_qpu_build_alu(const struct v3d_device_info* devinfo, enum v3d_qpu_add_op addOp,
+                           struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                           struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                           struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                           struct v3d_qpu_operand mulB,
+                           const struct v3d_qpu_emit_modifiers* modifiers,
+                           struct v3d_qpu_instr* instrOut, const char** errorMessageOut)
+{
+	struct v3d_qpu_instr* instr = instrOut;
+	*instr = (struct v3d_qpu_instr){0};
+	*errorMessageOut = NULL;
+	if (devinfo->ver >= 70)
+	{
+		*errorMessageOut = "V3D 7.x builder not implemented";
+		return FALSE;
 	}
-	if (!(i & 0x1))
-		bit += 1;
-	return bit + 1;
+
+	instr->type = V3D_QPU_INSTR_TYPE_ALU;
+	if (modifiers)
+	{
+		instr->flags = modifiers->flags;
+		instr->sig = modifiers->sig;
+		instr->sig_addr = modifiers->sig_addr;
+		instr->sig_magic = modifiers->sig_magic;
+	}
+	instr->alu.add.op = addOp;
+	instr->alu.mul.op = mulOp;
+
+	const char* error =
+	    v3d_qpu_build_dst(v3d_qpu_add_op_has_dst(addOp), addDst, &instr->alu.add.waddr,
+	                      &instr->alu.add.magic_write, &instr->alu.add.output_pack);
+	if (!error)
+		error = v3d_qpu_build_dst(v3d_qpu_mul_op_has_dst(mulOp), mulDst, &instr->alu.mul.waddr,
+		                          &instr->alu.mul.magic_write, &instr->alu.mul.output_pack);
+
+	// Same order as the assembler allocates them in, so both produce identical encodings
+	int numAddSrc = v3d_qpu_add_op_num_src(addOp);
+	int numMulSrc = v3d_qpu_mul_op_num_src(mulOp);
+	if (!error)
+		error = v3d_qpu_build_src(instr, numAddSrc, 0, addA, &instr->alu.add.a);
+	if (!error)
+		error = v3d_qpu_build_src(instr, numAddSrc, 1, addB, &instr->alu.add.b);
+	if (!error)
+		error = v3d_qpu_build_src(instr, numMulSrc, 0, mulA, &instr->alu.mul.a);
+	if (!error)
+		error = v3d_qpu_build_src(instr, numMulSrc, 1, mulB, &instr->alu.mul.b);
+
+	*errorMessageOut = error;
+	return error == NULL;
 }
-#endif
 
-#ifdef HAVE___BUILTIN_FFSLL
-#elif defined(_MSC_VER) && (_M_AMD64 || _M_ARM64 || _M_IA64)
-#else
-int
-ffsll(long long int val)
+static v3d_bool v3d_qpu_builder_fail(struct v3d_qpu_builder* builder, const char* message)
 {
-	int bit;
+	if (!builder->errorMessage)
+	{
+		builder->errorMessage = message;
+		builder->errorInstructionIndex = builder->numInstructions;
+	}
+	return FALSE;
+}
 
-	bit = ffs((unsigned) (val & 0xffffffff));
-	if (bit != 0)
-		return bit;
+v3d_bool v3d_qpu_emit_instr(struct v3d_qpu_builder* builder, const struct v3d_qpu_instr* instr)
+{
+	if (builder->errorMessage)
+		return FALSE;
 
-	bit = ffs((unsigned) (val >> 32));
-	if (bit != 0)
-		return 32 + bit;
+	if (builder->numInstructions >= builder->capacity)
+	{
+		int minCapacity = builder->numInstructions + 1;
+		if (!builder->grow ||
+		    !builder->grow(builder->userData, &builder->code, &builder->capacity, minCapacity) ||
+		    builder->capacity < minCapacity)
+			return v3d_qpu_builder_fail(builder, "Out of space for instructions");
+	}
 
-	return 0;
+	if (!v3d_qpu_instr_pack(&builder->devinfo, instr, &builder->code[builder->numInstructions]))
+		return v3d_qpu_builder_fail(builder, "Instruction is not encodable on this device");
+	++builder->numInstructions;
+	return TRUE;
 }
-#endif
 
-// Resume v3d_pack.c
-
-static v3d_bool
-v3d33_qpu_add_pack(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+v3d_bool v3d_qpu_emit_alu(struct v3d_qpu_builder* builder, enum v3d_qpu_add_op addOp,
+                          struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                          struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                          struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                          struct v3d_qpu_operand mulB,
+                          const struct v3d_qpu_emit_modifiers* modifiers)
 {
-	v3d_uint32 waddr = instr->alu.add.waddr;
-	v3d_uint32 mux_a = instr->alu.add.a.mux;
-	v3d_uint32 mux_b = instr->alu.add.b.mux;
-	int nsrc = v3d_qpu_add_op_num_src(instr->alu.add.op);
-	const struct opcode_desc *desc =
-		lookup_opcode_from_instr(devinfo, add_ops_v33,
-								 V3D_ARRAY_SIZE(add_ops_v33),
-								 instr->alu.add.op);
-
-	if (!desc)
+	if (builder->errorMessage)
 		return FALSE;
 
-	v3d_uint32 opcode = desc->opcode_first;
-
-	/* If an operation doesn't use an arg, its mux values may be used to
-	 * identify the operation type.
-	 */
-	if (nsrc < 2)
-		mux_b = ffs(desc->mux.b_mask) - 1;
+	struct v3d_qpu_instr instr;
+	const char* error = NULL;
+	if (!v3d_qpu_build_alu(&builder->devinfo, addOp, addDst, addA, addB, mulOp, mulDst, mulA,
+	                       mulB, modifiers, &instr, &error))
+		return v3d_qpu_builder_fail(builder, error);
+	return v3d_qpu_emit_instr(builder, &instr);
+}
 
-	if (nsrc < 1)
-		mux_a = ffs(desc->mux.a_mask) - 1;
+v3d_bool v3d_qpu_emit_nop(struct v3d_qpu_builder* builder,
+                          const struct v3d_qpu_emit_modifiers* modifiers)
+{
+	struct v3d_qpu_operand none = {0};
+	return v3d_qpu_emit_alu(builder, V3D_QPU_A_NOP, none, none, none, V3D_QPU_M_NOP, none, none,
+	                        none, modifiers);
+}
 
-	v3d_bool no_magic_write = FALSE;
+// Relative branch offsets are in bytes from the instruction after the branch's delay slots.
+// See v3d_compiler.c / vir_to_qpu.c, where offsets are computed from branch_qpu_ip + 4.
+static v3d_uint32 v3d_qpu_branch_offset(int branchInstruction, int targetInstruction)
+{
+	return (v3d_uint32)((targetInstruction - (branchInstruction + 4)) * (int)sizeof(v3d_uint64));
+}
 
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_STVPMV:
-		waddr = 0;
-		no_magic_write = TRUE;
-		break;
-	case V3D_QPU_A_STVPMD:
-		waddr = 1;
-		no_magic_write = TRUE;
-		break;
-	case V3D_QPU_A_STVPMP:
-		waddr = 2;
-		no_magic_write = TRUE;
-		break;
+v3d_bool v3d_qpu_emit_branch(struct v3d_qpu_builder* builder, enum v3d_qpu_branch_cond cond,
+                             int targetInstruction)
+{
+	struct v3d_qpu_instr instr = {0};
+	instr.type = V3D_QPU_INSTR_TYPE_BRANCH;
+	instr.branch.cond = cond;
+	instr.branch.msfign = V3D_QPU_MSFIGN_NONE;
+	instr.branch.bdi = V3D_QPU_BRANCH_DEST_REL;
+	instr.branch.offset = v3d_qpu_branch_offset(builder->numInstructions, targetInstruction);
+	return v3d_qpu_emit_instr(builder, &instr);
+}
 
-	case V3D_QPU_A_LDVPMV_IN:
-	case V3D_QPU_A_LDVPMD_IN:
-	case V3D_QPU_A_LDVPMP:
-	case V3D_QPU_A_LDVPMG_IN:
-		v3d_assert(!instr->alu.add.magic_write);
-		break;
+v3d_bool v3d_qpu_builder_set_branch_target(struct v3d_qpu_builder* builder,
+                                           int branchInstruction, int targetInstruction)
+{
+	struct v3d_qpu_instr instr;
+	if (branchInstruction < 0 || branchInstruction >= builder->numInstructions ||
+	    !v3d_qpu_instr_unpack(&builder->devinfo, builder->code[branchInstruction], &instr) ||
+	    instr.type != V3D_QPU_INSTR_TYPE_BRANCH || instr.branch.bdi != V3D_QPU_BRANCH_DEST_REL)
+		return v3d_qpu_builder_fail(builder, "Expected a relative branch instruction");
+
+	instr.branch.offset = v3d_qpu_branch_offset(branchInstruction, targetInstruction);
+	if (!v3d_qpu_instr_pack(&builder->devinfo, &instr, &builder->code[branchInstruction]))
+		return v3d_qpu_builder_fail(builder, "Instruction is not encodable on this device");
+	return TRUE;
+}
 
-	case V3D_QPU_A_LDVPMV_OUT:
-	case V3D_QPU_A_LDVPMD_OUT:
-	case V3D_QPU_A_LDVPMG_OUT:
-		v3d_assert(!instr->alu.add.magic_write);
-		*packed_instr |= V3D_QPU_MA;
-		break;
+// Arena allocation
 
-	default:
-		break;
-	}
+#define V3D_ARENA_ALIGNMENT 16
 
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_FADD:
-	case V3D_QPU_A_FADDNF:
-	case V3D_QPU_A_FSUB:
-	case V3D_QPU_A_FMIN:
-	case V3D_QPU_A_FMAX:
-	case V3D_QPU_A_FCMP: {
-		v3d_uint32 output_pack;
-		v3d_uint32 a_unpack;
-		v3d_uint32 b_unpack;
+void v3d_arena_init_fixed(struct v3d_arena* arena, void* buffer, size_t size)
+{
+	*arena = (struct v3d_arena){0};
+	arena->memory = (char*)buffer;
+	arena->capacity = size;
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
-									   &output_pack)) {
-			return FALSE;
-		}
-		opcode |= output_pack << 4;
+void v3d_arena_init_blocks(struct v3d_arena* arena, size_t blockSize,
+                           v3d_arena_alloc_func allocBlock, v3d_arena_free_func freeBlock,
+                           void* userData)
+{
+	*arena = (struct v3d_arena){0};
+	arena->blockSize = blockSize;
+	arena->allocBlock = allocBlock;
+	arena->freeBlock = freeBlock;
+	arena->userData = userData;
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &a_unpack)) {
-			return FALSE;
-		}
+static void v3d_arena_use_block(struct v3d_arena* arena, struct v3d_arena_block* block)
+{
+	arena->currentBlock = block;
+	arena->memory = (char*)(block + 1);
+	arena->capacity = block->size;
+	arena->used = 0;
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
-										 &b_unpack)) {
-			return FALSE;
-		}
+// Returns NULL if size bytes don't fit in the current region
+static void* v3d_arena_bump(struct v3d_arena* arena, size_t size)
+{
+	if (!arena->memory)
+		return NULL;
+	size_t address = (size_t)(arena->memory + arena->used);
+	size_t padding = (V3D_ARENA_ALIGNMENT - (address & (V3D_ARENA_ALIGNMENT - 1))) &
+	                 (V3D_ARENA_ALIGNMENT - 1);
+	if (arena->used + padding > arena->capacity ||
+	    size > arena->capacity - arena->used - padding)
+		return NULL;
 
-		/* These operations with commutative operands are
-		 * distinguished by which order their operands come in.
-		 */
-		v3d_bool ordering = a_unpack * 8 + mux_a > b_unpack * 8 + mux_b;
-		if (((instr->alu.add.op == V3D_QPU_A_FMIN ||
-			  instr->alu.add.op == V3D_QPU_A_FADD) && ordering) ||
-			((instr->alu.add.op == V3D_QPU_A_FMAX ||
-			  instr->alu.add.op == V3D_QPU_A_FADDNF) && !ordering)) {
-			v3d_uint32 temp;
+	void* memory = arena->memory + arena->used + padding;
+	arena->used += padding + size;
+	arena->bytesUsed += padding + size;
+	if (arena->bytesUsed > arena->peakBytesUsed)
+		arena->peakBytesUsed = arena->bytesUsed;
+	return memory;
+}
 
-			temp = a_unpack;
-			a_unpack = b_unpack;
-			b_unpack = temp;
+void* v3d_arena_alloc(struct v3d_arena* arena, size_t size)
+{
+	void* memory = v3d_arena_bump(arena, size);
+	if (memory || !arena->allocBlock)
+		return memory;
 
-			temp = mux_a;
-			mux_a = mux_b;
-			mux_b = temp;
-		}
+	// Move on to blocks kept from before the last reset. One which is too small for this
+	// allocation is skipped until the next reset.
+	while (arena->currentBlock && arena->currentBlock->next)
+	{
+		v3d_arena_use_block(arena, arena->currentBlock->next);
+		memory = v3d_arena_bump(arena, size);
+		if (memory)
+			return memory;
+	}
+
+	size_t blockSize = arena->blockSize;
+	if (blockSize < size + V3D_ARENA_ALIGNMENT)
+		blockSize = size + V3D_ARENA_ALIGNMENT;
+	struct v3d_arena_block* block = (struct v3d_arena_block*)arena->allocBlock(
+	    arena->userData, sizeof(struct v3d_arena_block) + blockSize);
+	if (!block)
+		return NULL;
+	block->next = NULL;
+	block->size = blockSize;
+	if (arena->currentBlock)
+		arena->currentBlock->next = block;
+	else
+		arena->firstBlock = block;
+	++arena->numBlocks;
 
-		opcode |= a_unpack << 2;
-		opcode |= b_unpack << 0;
+	v3d_arena_use_block(arena, block);
+	return v3d_arena_bump(arena, size);
+}
 
-		break;
+void* v3d_arena_alloc_zeroed(struct v3d_arena* arena, size_t size)
+{
+	char* memory = (char*)v3d_arena_alloc(arena, size);
+	if (memory)
+	{
+		for (size_t i = 0; i < size; ++i)
+			memory[i] = 0;
 	}
+	return memory;
+}
 
-	case V3D_QPU_A_VFPACK: {
-		v3d_uint32 a_unpack;
-		v3d_uint32 b_unpack;
+struct v3d_arena_marker v3d_arena_mark(struct v3d_arena* arena)
+{
+	struct v3d_arena_marker marker;
+	marker.block = arena->currentBlock;
+	marker.used = arena->used;
+	marker.bytesUsed = arena->bytesUsed;
+	return marker;
+}
 
-		if (instr->alu.add.a.unpack == V3D_QPU_UNPACK_ABS ||
-			instr->alu.add.b.unpack == V3D_QPU_UNPACK_ABS) {
-			return FALSE;
-		}
+void v3d_arena_restore(struct v3d_arena* arena, struct v3d_arena_marker marker)
+{
+	if (marker.block)
+		v3d_arena_use_block(arena, marker.block);
+	else if (arena->allocBlock)
+	{
+		// Marked before the first block was allocated
+		v3d_arena_reset(arena);
+		return;
+	}
+	arena->used = marker.used;
+	arena->bytesUsed = marker.bytesUsed;
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &a_unpack)) {
-			return FALSE;
-		}
+void v3d_arena_reset(struct v3d_arena* arena)
+{
+	if (arena->firstBlock)
+		v3d_arena_use_block(arena, arena->firstBlock);
+	arena->used = 0;
+	arena->bytesUsed = 0;
+}
+
+void v3d_arena_release(struct v3d_arena* arena)
+{
+	if (!arena->allocBlock)
+	{
+		v3d_arena_reset(arena);
+		return;
+	}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
-										 &b_unpack)) {
-			return FALSE;
-		}
+	struct v3d_arena_block* block = arena->firstBlock;
+	while (block)
+	{
+		struct v3d_arena_block* next = block->next;
+		if (arena->freeBlock)
+			arena->freeBlock(arena->userData, block);
+		block = next;
+	}
+	arena->firstBlock = NULL;
+	arena->currentBlock = NULL;
+	arena->memory = NULL;
+	arena->capacity = 0;
+	arena->used = 0;
+	arena->bytesUsed = 0;
+	arena->numBlocks = 0;
+}
 
-		opcode = (opcode & ~(0x3 << 2)) | (a_unpack << 2);
-		opcode = (opcode & ~(0x3 << 0)) | (b_unpack << 0);
+v3d_bool v3d_qpu_assemble_line_cache_init_arena(struct v3d_qpu_assemble_line_cache* cache,
+                                                const struct v3d_device_info* devinfo,
+                                                struct v3d_arena* arena, int numEntries)
+{
+	struct v3d_qpu_assemble_line_cache_entry* entries =
+	    V3D_ARENA_ALLOC_ARRAY(arena, struct v3d_qpu_assemble_line_cache_entry, numEntries);
+	if (!entries)
+		return FALSE;
+	v3d_qpu_assemble_line_cache_init(cache, devinfo, entries, numEntries);
+	return TRUE;
+}
 
-		break;
+static v3d_bool v3d_qpu_builder_arena_grow(void* userData, v3d_uint64** code, int* capacity,
+                                           int minCapacity)
+{
+	struct v3d_arena* arena = (struct v3d_arena*)userData;
+	int newCapacity = *capacity * 2;
+	if (newCapacity < minCapacity)
+		newCapacity = minCapacity;
+	size_t extraBytes = sizeof(v3d_uint64) * (size_t)(newCapacity - *capacity);
+
+	// Usually nothing else was allocated since the code, so it can simply be extended
+	if ((char*)(*code + *capacity) == arena->memory + arena->used &&
+	    extraBytes <= arena->capacity - arena->used)
+	{
+		arena->used += extraBytes;
+		arena->bytesUsed += extraBytes;
+		if (arena->bytesUsed > arena->peakBytesUsed)
+			arena->peakBytesUsed = arena->bytesUsed;
+		*capacity = newCapacity;
+		return TRUE;
 	}
 
-	case V3D_QPU_A_FFLOOR:
-	case V3D_QPU_A_FROUND:
-	case V3D_QPU_A_FTRUNC:
-	case V3D_QPU_A_FCEIL:
-	case V3D_QPU_A_FDX:
-	case V3D_QPU_A_FDY: {
-		v3d_uint32 packed;
+	v3d_uint64* newCode = V3D_ARENA_ALLOC_ARRAY(arena, v3d_uint64, newCapacity);
+	if (!newCode)
+		return FALSE;
+	for (int i = 0; i < *capacity; ++i)
+		newCode[i] = (*code)[i];
+	*code = newCode;
+	*capacity = newCapacity;
+	return TRUE;
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
-									   &packed)) {
-			return FALSE;
-		}
-		mux_b |= packed;
+v3d_bool v3d_qpu_builder_init_arena(struct v3d_qpu_builder* builder,
+                                    const struct v3d_device_info* devinfo, struct v3d_arena* arena,
+                                    int initialCapacity)
+{
+	if (initialCapacity < 1)
+		initialCapacity = 1;
+	v3d_uint64* code = V3D_ARENA_ALLOC_ARRAY(arena, v3d_uint64, initialCapacity);
+	v3d_qpu_builder_init(builder, devinfo, code, code ? initialCapacity : 0,
+	                     v3d_qpu_builder_arena_grow, arena);
+	return code != NULL;
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
-		}
-		if (packed == 0)
-			return FALSE;
-		opcode = (opcode & ~(0x3 << 2)) | packed << 2;
-		break;
+// Whole-file diagnostics
+
+// Returns FALSE once no more diagnostics can be recorded
+static v3d_bool v3d_qpu_file_add_diagnostic(struct v3d_qpu_assemble_file_arguments* args,
+                                            struct v3d_qpu_diagnostic** tail,
+                                            const char* message, int offset, int line)
+{
+	if (args->diagnosticsTruncated)
+		return FALSE;
+	if (args->maxDiagnostics && args->numDiagnostics >= args->maxDiagnostics)
+	{
+		args->diagnosticsTruncated = TRUE;
+		return FALSE;
 	}
 
-	case V3D_QPU_A_FTOIN:
-	case V3D_QPU_A_FTOIZ:
-	case V3D_QPU_A_FTOUZ:
-	case V3D_QPU_A_FTOC:
-		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE)
-			return FALSE;
+	struct v3d_qpu_diagnostic* diagnostic =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_diagnostic, 1);
+	if (!diagnostic)
+	{
+		args->diagnosticsTruncated = TRUE;
+		return FALSE;
+	}
+	*diagnostic = (struct v3d_qpu_diagnostic){0};
+	diagnostic->errorMessage = message;
+	diagnostic->errorAtOffset = offset;
+	diagnostic->line = line;
 
-		v3d_uint32 packed;
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
-		}
-		if (packed == 0)
-			return FALSE;
-		opcode |= packed << 2;
+	if (*tail)
+		(*tail)->next = diagnostic;
+	else
+		args->diagnostics = diagnostic;
+	*tail = diagnostic;
+	++args->numDiagnostics;
+	return TRUE;
+}
 
-		break;
+static void v3d_qpu_file_add_note(struct v3d_qpu_assemble_file_arguments* args,
+                                  struct v3d_qpu_diagnostic** tail, enum v3d_qpu_raddr_fix fix,
+                                  int offset, int line)
+{
+	struct v3d_qpu_diagnostic* note =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_diagnostic, 1);
+	if (!note)
+		return;
+	*note = (struct v3d_qpu_diagnostic){0};
+	note->errorMessage = v3d_qpu_raddr_fix_description(fix);
+	note->errorAtOffset = offset;
+	note->line = line;
+	note->raddrFix = fix;
+
+	if (*tail)
+		(*tail)->next = note;
+	else
+		args->notes = note;
+	*tail = note;
+	++args->numNotes;
+}
 
-	case V3D_QPU_A_VFMIN:
-	case V3D_QPU_A_VFMAX:
-		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
-			instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE) {
-			return FALSE;
-		}
+v3d_bool v3d_qpu_assemble_file(struct v3d_qpu_assemble_file_arguments* args)
+{
+	struct v3d_qpu_diagnostic* tail = NULL;
+	struct v3d_qpu_diagnostic* noteTail = NULL;
+
+	args->numInstructions = 0;
+	args->diagnostics = NULL;
+	args->numDiagnostics = 0;
+	args->diagnosticsTruncated = FALSE;
+	args->notes = NULL;
+	args->numNotes = 0;
+
+	struct v3d_qpu_line_walk walk;
+	v3d_qpu_line_walk_begin(&walk, &args->devinfo, args->assembly, args->assemblyLength);
+	walk.raddrFixOptions = args->raddrFixOptions;
+	walk.instructionsOut = args->instructionsOut;
+	walk.maxInstructions = args->maxInstructions;
+	walk.validating = args->validate;
+
+	while (v3d_qpu_line_walk_next(&walk))
+	{
+		if (walk.assembled && walk.line.raddrFix != V3D_QPU_RADDR_FIX_NONE)
+			v3d_qpu_file_add_note(args, &noteTail, walk.line.raddrFix, walk.instructionOffset,
+			                      walk.instructionLine);
 
-		if (!v3d_qpu_float16_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
-		}
-		opcode |= packed;
-		break;
+		if (walk.validateErrorMessage &&
+		    v3d_qpu_file_add_diagnostic(args, &tail, walk.validateErrorMessage,
+		                                walk.instructionOffset, walk.instructionLine))
+			tail->validateError = walk.validateError;
 
-	default:
-		if (instr->alu.add.op != V3D_QPU_A_NOP &&
-			(instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
-			 instr->alu.add.a.unpack != V3D_QPU_UNPACK_NONE ||
-			 instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE)) {
-			return FALSE;
+		if (walk.errorMessage)
+		{
+			if (!v3d_qpu_file_add_diagnostic(args, &tail, walk.errorMessage, walk.errorAtOffset,
+			                                 walk.errorLine))
+				break;
+			tail->hintAvailable = walk.line.hintAvailable;
+			tail->numHints = walk.line.numHints;
 		}
-		break;
 	}
+	args->numInstructions = walk.numInstructions;
 
-	*packed_instr |= QPU_SET_FIELD(mux_a, V3D_QPU_ADD_A);
-	*packed_instr |= QPU_SET_FIELD(mux_b, V3D_QPU_ADD_B);
-	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_ADD);
-	*packed_instr |= QPU_SET_FIELD(waddr, V3D_QPU_WADDR_A);
-	if (instr->alu.add.magic_write && !no_magic_write)
-		*packed_instr |= V3D_QPU_MA;
-
-	return TRUE;
+	if (!v3d_qpu_line_walk_finish(&walk) &&
+	    v3d_qpu_file_add_diagnostic(args, &tail, walk.validateErrorMessage,
+	                                walk.lastInstructionOffset, walk.lastInstructionLine))
+		tail->validateError = walk.validateError;
+	return args->numDiagnostics == 0 && !args->diagnosticsTruncated;
 }
 
-static v3d_bool
-v3d71_qpu_add_pack(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
-{
-	v3d_uint32 waddr = instr->alu.add.waddr;
-	v3d_uint32 raddr_a = instr->alu.add.a.raddr;
-	v3d_uint32 raddr_b = instr->alu.add.b.raddr;
+// Preprocessor
 
-	int nsrc = v3d_qpu_add_op_num_src(instr->alu.add.op);
-	const struct opcode_desc *desc =
-		lookup_opcode_from_instr(devinfo, add_ops_v71,
-								 V3D_ARRAY_SIZE(add_ops_v71),
-								 instr->alu.add.op);
-	if (!desc)
-		return FALSE;
+#define V3D_QPU_PP_MAX_PARAMS 16
+#define V3D_QPU_PP_MAX_DEPTH 32
+#define V3D_QPU_PP_MAX_SYMBOL_VALUE 256
 
-	v3d_uint32 opcode = desc->opcode_first;
+struct v3d_qpu_pp_span
+{
+	const char* text;
+	int length;
+};
 
-	/* If an operation doesn't use an arg, its raddr values may be used to
-	 * identify the operation type.
-	 */
-	if (nsrc < 2)
-		raddr_b = ffsll(desc->raddr_mask) - 1;
+// A line of a file or macro expansion
+struct v3d_qpu_pp_line
+{
+	int offset;
+	int length;
+	int line;
+};
 
-	v3d_bool no_magic_write = FALSE;
+// Text along with where its lines are. Text from the caller isn't split up front, in which case
+// lines is NULL.
+struct v3d_qpu_pp_text
+{
+	const char* text;
+	int length;
+	const struct v3d_qpu_pp_line* lines;
+	int numLines;
+};
 
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_STVPMV:
-		waddr = 0;
-		no_magic_write = TRUE;
-		break;
-	case V3D_QPU_A_STVPMD:
-		waddr = 1;
-		no_magic_write = TRUE;
-		break;
-	case V3D_QPU_A_STVPMP:
-		waddr = 2;
-		no_magic_write = TRUE;
-		break;
+struct v3d_qpu_pp_expansion
+{
+	struct v3d_qpu_pp_expansion* next;
+	v3d_uint64 key;
+	struct v3d_qpu_pp_span* arguments;
+	struct v3d_qpu_pp_text text;
+};
 
-	case V3D_QPU_A_LDVPMV_IN:
-	case V3D_QPU_A_LDVPMD_IN:
-	case V3D_QPU_A_LDVPMP:
-	case V3D_QPU_A_LDVPMG_IN:
-		v3d_assert(!instr->alu.add.magic_write);
-		break;
+struct v3d_qpu_pp_macro
+{
+	struct v3d_qpu_pp_macro* next;
+	struct v3d_qpu_pp_span name;
+	struct v3d_qpu_pp_span params[V3D_QPU_PP_MAX_PARAMS];
+	int numParams;
+	struct v3d_qpu_pp_span body;
+	struct v3d_qpu_pp_expansion* expansions;
+};
 
-	case V3D_QPU_A_LDVPMV_OUT:
-	case V3D_QPU_A_LDVPMD_OUT:
-	case V3D_QPU_A_LDVPMG_OUT:
-		v3d_assert(!instr->alu.add.magic_write);
-		*packed_instr |= V3D_QPU_MA;
-		break;
+struct v3d_qpu_pp_symbol
+{
+	struct v3d_qpu_pp_symbol* next;
+	struct v3d_qpu_pp_span name;
+	char* value;
+	int valueLength;
+	int valueCapacity;
+};
 
-	default:
-		break;
-	}
+struct v3d_qpu_pp_include
+{
+	struct v3d_qpu_pp_include* next;
+	struct v3d_qpu_pp_span path;
+	struct v3d_qpu_pp_text text;
+};
 
-	switch (instr->alu.add.op) {
-	case V3D_QPU_A_FADD:
-	case V3D_QPU_A_FADDNF:
-	case V3D_QPU_A_FSUB:
-	case V3D_QPU_A_FMIN:
-	case V3D_QPU_A_FMAX:
-	case V3D_QPU_A_FCMP: {
-		v3d_uint32 output_pack;
-		v3d_uint32 a_unpack;
-		v3d_uint32 b_unpack;
+void v3d_qpu_preprocessor_init(struct v3d_qpu_preprocessor* preprocessor, struct v3d_arena* arena,
+                               v3d_qpu_include_func loadInclude, void* userData)
+{
+	*preprocessor = (struct v3d_qpu_preprocessor){0};
+	preprocessor->arena = arena;
+	preprocessor->loadInclude = loadInclude;
+	preprocessor->userData = userData;
+}
 
-		if (instr->alu.add.op != V3D_QPU_A_FCMP) {
-			if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
-										   &output_pack)) {
-				return FALSE;
-			}
-			opcode |= output_pack << 4;
-		}
+static v3d_bool v3d_qpu_pp_span_equals(struct v3d_qpu_pp_span a, struct v3d_qpu_pp_span b)
+{
+	return a.length == b.length && (!a.length || v3d_memcmp(a.text, b.text, a.length) == 0);
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &a_unpack)) {
-			return FALSE;
-		}
+static v3d_bool v3d_qpu_pp_span_is(struct v3d_qpu_pp_span span, const char* string)
+{
+	int i = 0;
+	while (i < span.length && string[i] && span.text[i] == string[i])
+		++i;
+	return i == span.length && !string[i];
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
-										 &b_unpack)) {
-			return FALSE;
-		}
+// Returns NULL if the arena is out of memory
+static const char* v3d_qpu_pp_copy(struct v3d_arena* arena, const char* text, int length)
+{
+	char* copy = V3D_ARENA_ALLOC_ARRAY(arena, char, length ? length : 1);
+	if (!copy)
+		return NULL;
+	for (int i = 0; i < length; ++i)
+		copy[i] = text[i];
+	return copy;
+}
 
-		/* These operations with commutative operands are
-		 * distinguished by the order of the operands come in.
-		 */
-		v3d_bool ordering =
-			instr->sig.small_imm_a * 256 + a_unpack * 64 + raddr_a >
-			instr->sig.small_imm_b * 256 + b_unpack * 64 + raddr_b;
-		if (((instr->alu.add.op == V3D_QPU_A_FMIN ||
-			  instr->alu.add.op == V3D_QPU_A_FADD) && ordering) ||
-			((instr->alu.add.op == V3D_QPU_A_FMAX ||
-			  instr->alu.add.op == V3D_QPU_A_FADDNF) && !ordering)) {
-			v3d_uint32 temp;
+static v3d_bool v3d_qpu_pp_is_identifier_char(char c, v3d_bool first)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+	       (!first && c >= '0' && c <= '9');
+}
 
-			temp = a_unpack;
-			a_unpack = b_unpack;
-			b_unpack = temp;
+static int v3d_qpu_pp_identifier_length(const char* text, const char* end)
+{
+	int length = 0;
+	while (text + length < end && v3d_qpu_pp_is_identifier_char(text[length], length == 0))
+		++length;
+	return length;
+}
 
-			temp = raddr_a;
-			raddr_a = raddr_b;
-			raddr_b = temp;
+static const char* v3d_qpu_pp_skip_spaces(const char* currentChar, const char* end)
+{
+	while (currentChar < end && (*currentChar == ' ' || *currentChar == '\t' || *currentChar == '\r'))
+		++currentChar;
+	return currentChar;
+}
 
-			/* If we are swapping raddr_a/b we also need to swap
-			 * small_imm_a/b.
-			 */
-			if (instr->sig.small_imm_a || instr->sig.small_imm_b) {
-				v3d_assert(instr->sig.small_imm_a !=
-						   instr->sig.small_imm_b);
-				struct v3d_qpu_sig new_sig = instr->sig;
-				new_sig.small_imm_a = !instr->sig.small_imm_a;
-				new_sig.small_imm_b = !instr->sig.small_imm_b;
-				v3d_uint32 sig;
-				if (!v3d_qpu_sig_pack(devinfo, &new_sig, &sig))
-					return FALSE;
-				*packed_instr &= ~V3D_QPU_SIG_MASK;
-				*packed_instr |= QPU_SET_FIELD(sig, V3D_QPU_SIG);
-			}
+// Trims whitespace and a trailing // comment
+static struct v3d_qpu_pp_span v3d_qpu_pp_trim(const char* start, const char* end)
+{
+	for (const char* currentChar = start; currentChar + 1 < end; ++currentChar)
+	{
+		if (currentChar[0] == '/' && currentChar[1] == '/')
+		{
+			end = currentChar;
+			break;
+		}
+	}
+	start = v3d_qpu_pp_skip_spaces(start, end);
+	while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+		--end;
+	struct v3d_qpu_pp_span span = {start, (int)(end - start)};
+	return span;
+}
+
+// Splits a comma separated list. Returns the count, or -1 if there are too many.
+static int v3d_qpu_pp_split(const char* start, const char* end, struct v3d_qpu_pp_span* spansOut,
+                            int maxSpans)
+{
+	struct v3d_qpu_pp_span all = v3d_qpu_pp_trim(start, end);
+	if (!all.length)
+		return 0;
+	int numSpans = 0;
+	const char* itemStart = all.text;
+	const char* allEnd = all.text + all.length;
+	for (const char* currentChar = all.text; currentChar <= allEnd; ++currentChar)
+	{
+		if (currentChar == allEnd || *currentChar == ',')
+		{
+			if (numSpans >= maxSpans)
+				return -1;
+			spansOut[numSpans++] = v3d_qpu_pp_trim(itemStart, currentChar);
+			itemStart = currentChar + 1;
 		}
+	}
+	return numSpans;
+}
+
+// Walks the lines of text. *offset and *lineNumber should start at 0 and 1.
+static v3d_bool v3d_qpu_pp_next_line(const struct v3d_qpu_pp_text* text, int* index, int* offset,
+                                     int* lineNumber, struct v3d_qpu_pp_line* lineOut)
+{
+	if (text->lines)
+	{
+		if (*index >= text->numLines)
+			return FALSE;
+		*lineOut = text->lines[(*index)++];
+		return TRUE;
+	}
 
-		opcode |= a_unpack << 2;
-		opcode |= b_unpack << 0;
+	if (*offset > text->length)
+		return FALSE;
+	int lineLength = v3d_qpu_assemble_line_length(text->text + *offset, text->length - *offset);
+	lineOut->offset = *offset;
+	lineOut->length = lineLength;
+	lineOut->line = *lineNumber;
+	++*index;
+
+	const char* lineEnd = text->text + *offset + lineLength;
+	for (const char* currentChar = text->text + *offset; currentChar < lineEnd; ++currentChar)
+	{
+		if (*currentChar == '\n')
+			++*lineNumber;
+	}
+	if (*offset + lineLength >= text->length || *lineEnd != '\n')
+		*offset = text->length + 1;
+	else
+	{
+		*offset += lineLength + 1;
+		++*lineNumber;
+	}
+	return TRUE;
+}
 
-		break;
+// Splits text into lines up front so it never has to be scanned again
+static v3d_bool v3d_qpu_pp_split_lines(struct v3d_arena* arena, const char* text, int length,
+                                       struct v3d_qpu_pp_text* textOut)
+{
+	struct v3d_qpu_pp_text unsplit = {text, length, NULL, 0};
+	struct v3d_qpu_pp_line line;
+	int index = 0;
+	int offset = 0;
+	int lineNumber = 1;
+	while (v3d_qpu_pp_next_line(&unsplit, &index, &offset, &lineNumber, &line))
+		;
+
+	struct v3d_qpu_pp_line* lines = V3D_ARENA_ALLOC_ARRAY(arena, struct v3d_qpu_pp_line, index);
+	if (!lines)
+		return FALSE;
+	textOut->text = text;
+	textOut->length = length;
+	textOut->lines = lines;
+	textOut->numLines = index;
+
+	index = 0;
+	offset = 0;
+	lineNumber = 1;
+	while (v3d_qpu_pp_next_line(&unsplit, &index, &offset, &lineNumber, &lines[index]))
+		;
+	return TRUE;
+}
+
+static struct v3d_qpu_pp_symbol* v3d_qpu_pp_find_symbol(struct v3d_qpu_preprocessor* preprocessor,
+                                                        struct v3d_qpu_pp_span name)
+{
+	for (struct v3d_qpu_pp_symbol* symbol = preprocessor->symbols; symbol; symbol = symbol->next)
+	{
+		if (v3d_qpu_pp_span_equals(symbol->name, name))
+			return symbol;
 	}
+	return NULL;
+}
 
-	case V3D_QPU_A_VFPACK: {
-		v3d_uint32 a_unpack;
-		v3d_uint32 b_unpack;
+static struct v3d_qpu_pp_macro* v3d_qpu_pp_find_macro(struct v3d_qpu_preprocessor* preprocessor,
+                                                      struct v3d_qpu_pp_span name)
+{
+	for (struct v3d_qpu_pp_macro* macro = preprocessor->macros; macro; macro = macro->next)
+	{
+		if (v3d_qpu_pp_span_equals(macro->name, name))
+			return macro;
+	}
+	return NULL;
+}
 
-		if (instr->alu.add.a.unpack == V3D_QPU_UNPACK_ABS ||
-			instr->alu.add.b.unpack == V3D_QPU_UNPACK_ABS) {
+v3d_bool v3d_qpu_preprocessor_set(struct v3d_qpu_preprocessor* preprocessor, const char* name,
+                                  int nameLength, const char* value, int valueLength)
+{
+	struct v3d_qpu_pp_span nameSpan = {name, nameLength};
+	struct v3d_qpu_pp_symbol* symbol = v3d_qpu_pp_find_symbol(preprocessor, nameSpan);
+	if (!symbol)
+	{
+		symbol = V3D_ARENA_ALLOC_ARRAY(preprocessor->arena, struct v3d_qpu_pp_symbol, 1);
+		if (!symbol)
 			return FALSE;
-		}
-
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &a_unpack)) {
+		*symbol = (struct v3d_qpu_pp_symbol){0};
+		symbol->name.text = v3d_qpu_pp_copy(preprocessor->arena, name, nameLength);
+		symbol->name.length = nameLength;
+		if (!symbol->name.text)
 			return FALSE;
-		}
+		symbol->next = preprocessor->symbols;
+		preprocessor->symbols = symbol;
+	}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.b.unpack,
-										 &b_unpack)) {
+	// Variants usually set the same symbols each time, so the old value's memory is reused
+	if (valueLength > symbol->valueCapacity)
+	{
+		char* newValue = V3D_ARENA_ALLOC_ARRAY(preprocessor->arena, char, valueLength);
+		if (!newValue)
 			return FALSE;
-		}
+		symbol->value = newValue;
+		symbol->valueCapacity = valueLength;
+	}
+	for (int i = 0; i < valueLength; ++i)
+		symbol->value[i] = value[i];
+	symbol->valueLength = valueLength;
+	return TRUE;
+}
 
-		opcode = (opcode & ~(0x3 << 2)) | (a_unpack << 2);
-		opcode = (opcode & ~(0x3 << 0)) | (b_unpack << 0);
+struct v3d_qpu_pp_state
+{
+	struct v3d_qpu_preprocessor* preprocessor;
+	struct v3d_qpu_preprocess_arguments* args;
+};
 
-		break;
+static v3d_bool v3d_qpu_pp_fail(struct v3d_qpu_pp_state* state,
+                                const struct v3d_qpu_preprocess_line_origin* origin,
+                                const char* message)
+{
+	if (!state->args->errorMessage)
+	{
+		state->args->errorMessage = message;
+		state->args->errorOrigin = *origin;
 	}
+	return FALSE;
+}
 
-	case V3D_QPU_A_FFLOOR:
-	case V3D_QPU_A_FROUND:
-	case V3D_QPU_A_FTRUNC:
-	case V3D_QPU_A_FCEIL:
-	case V3D_QPU_A_FDX:
-	case V3D_QPU_A_FDY: {
-		v3d_uint32 packed;
-
-		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
-									   &packed)) {
-			return FALSE;
+// Writes text with symbols replaced by their values. Returns the length, which may be larger than
+// capacity, in which case only capacity characters were written.
+static int v3d_qpu_pp_substitute_symbols(struct v3d_qpu_preprocessor* preprocessor,
+                                         const char* text, int length, char* out, int capacity)
+{
+	const char* end = text + length;
+	int outLength = 0;
+	for (const char* currentChar = text; currentChar < end;)
+	{
+		const char* copyFrom = currentChar;
+		int copyLength = 1;
+		if (v3d_qpu_pp_is_identifier_char(*currentChar, TRUE))
+		{
+			struct v3d_qpu_pp_span name = {currentChar,
+			                               v3d_qpu_pp_identifier_length(currentChar, end)};
+			struct v3d_qpu_pp_symbol* symbol = v3d_qpu_pp_find_symbol(preprocessor, name);
+			copyLength = name.length;
+			if (symbol)
+			{
+				copyFrom = symbol->value;
+				copyLength = symbol->valueLength;
+			}
+			currentChar += name.length;
 		}
-		raddr_b |= packed;
+		else if (v3d_qpu_pp_is_identifier_char(*currentChar, FALSE))
+		{
+			// Numbers like 0x1f must not have their tail treated as an identifier
+			while (currentChar + copyLength < end &&
+			       v3d_qpu_pp_is_identifier_char(currentChar[copyLength], FALSE))
+				++copyLength;
+			currentChar += copyLength;
+		}
+		else
+			++currentChar;
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
+		for (int i = 0; i < copyLength; ++i)
+		{
+			// A /* */ comment can span lines. Keep it on one so output lines match origins.
+			char c = copyFrom[i] == '\n' ? ' ' : copyFrom[i];
+			if (outLength + i < capacity)
+				out[outLength + i] = c;
 		}
-		if (packed == 0)
-			return FALSE;
-		raddr_b = (raddr_b & ~(0x3 << 2)) | packed << 2;
-		break;
+		outLength += copyLength;
 	}
+	return outLength;
+}
 
-	case V3D_QPU_A_FTOIN:
-	case V3D_QPU_A_FTOIZ:
-	case V3D_QPU_A_FTOUZ:
-	case V3D_QPU_A_FTOC:
-		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE)
-			return FALSE;
+static v3d_bool v3d_qpu_pp_emit_line(struct v3d_qpu_pp_state* state, const char* text,
+                                     int length, const struct v3d_qpu_preprocess_line_origin* origin)
+{
+	struct v3d_qpu_preprocess_arguments* args = state->args;
+	int capacity = args->outputCapacity - args->outputLength;
+	int written = v3d_qpu_pp_substitute_symbols(state->preprocessor, text, length,
+	                                            args->output + args->outputLength, capacity);
+	if (written + 1 > capacity)
+		return v3d_qpu_pp_fail(state, origin, "Output buffer too small for expanded assembly");
+	args->outputLength += written;
+	args->output[args->outputLength++] = '\n';
+	if (args->originsOut && args->numLines < args->maxOrigins)
+		args->originsOut[args->numLines] = *origin;
+	++args->numLines;
+	return TRUE;
+}
 
-		v3d_uint32 packed;
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
+// Replaces \param in the body with the arguments, into the arena
+static v3d_bool v3d_qpu_pp_expand(struct v3d_arena* arena, const struct v3d_qpu_pp_macro* macro,
+                                  const struct v3d_qpu_pp_span* arguments,
+                                  struct v3d_qpu_pp_text* textOut)
+{
+	const char* end = macro->body.text + macro->body.length;
+	char* expanded = NULL;
+	int length = 0;
+	// Measure, then write
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		length = 0;
+		for (const char* currentChar = macro->body.text; currentChar < end;)
+		{
+			const char* copyFrom = currentChar;
+			int copyLength = 1;
+			if (*currentChar == '\\')
+			{
+				struct v3d_qpu_pp_span name = {
+				    currentChar + 1, v3d_qpu_pp_identifier_length(currentChar + 1, end)};
+				for (int i = 0; name.length && i < macro->numParams; ++i)
+				{
+					if (v3d_qpu_pp_span_equals(macro->params[i], name))
+					{
+						copyFrom = arguments[i].text;
+						copyLength = arguments[i].length;
+						currentChar += name.length;
+						break;
+					}
+				}
+			}
+			++currentChar;
+
+			if (expanded)
+			{
+				for (int i = 0; i < copyLength; ++i)
+					expanded[length + i] = copyFrom[i];
+			}
+			length += copyLength;
 		}
-		if (packed == 0)
-			return FALSE;
+		if (!expanded)
+		{
+			expanded = V3D_ARENA_ALLOC_ARRAY(arena, char, length ? length : 1);
+			if (!expanded)
+				return FALSE;
+		}
+	}
+	return v3d_qpu_pp_split_lines(arena, expanded, length, textOut);
+}
 
-		raddr_b |= (raddr_b & ~(0x3 << 2)) | packed << 2;
+static v3d_bool v3d_qpu_pp_process(struct v3d_qpu_pp_state* state,
+                                   const struct v3d_qpu_pp_text* text, struct v3d_qpu_pp_span path,
+                                   const struct v3d_qpu_preprocess_line_origin* callOrigin,
+                                   int depth);
 
-		break;
+static v3d_bool v3d_qpu_pp_use_macro(struct v3d_qpu_pp_state* state, struct v3d_qpu_pp_macro* macro,
+                                     const char* argumentsStart, const char* lineEnd,
+                                     const struct v3d_qpu_preprocess_line_origin* origin, int depth)
+{
+	if (depth >= V3D_QPU_PP_MAX_DEPTH)
+		return v3d_qpu_pp_fail(state, origin,
+		                       "Macros or includes nested too deeply (are they recursive?)");
+	struct v3d_qpu_preprocessor* preprocessor = state->preprocessor;
+	struct v3d_qpu_pp_span arguments[V3D_QPU_PP_MAX_PARAMS];
+	int numArguments =
+	    v3d_qpu_pp_split(argumentsStart, lineEnd, arguments, V3D_QPU_PP_MAX_PARAMS);
+	if (numArguments != macro->numParams)
+		return v3d_qpu_pp_fail(state, origin, "Wrong number of macro arguments");
+
+	v3d_uint64 key = 0xcbf29ce484222325ull;
+	for (int i = 0; i < numArguments; ++i)
+	{
+		key = v3d_hash_bytes(arguments[i].text, arguments[i].length, key);
+		key = v3d_hash_bytes(",", 1, key);
+	}
 
-	case V3D_QPU_A_VFMIN:
-	case V3D_QPU_A_VFMAX:
-		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
-			instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE) {
-			return FALSE;
-		}
+	struct v3d_qpu_pp_expansion* expansion = macro->expansions;
+	for (; expansion; expansion = expansion->next)
+	{
+		if (expansion->key != key)
+			continue;
+		int i = 0;
+		while (i < numArguments && v3d_qpu_pp_span_equals(expansion->arguments[i], arguments[i]))
+			++i;
+		if (i == numArguments)
+			break;
+	}
 
-		if (!v3d_qpu_float16_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
+	if (expansion)
+		++preprocessor->numExpansionHits;
+	else
+	{
+		++preprocessor->numExpansionMisses;
+		struct v3d_arena* arena = preprocessor->arena;
+		expansion = V3D_ARENA_ALLOC_ARRAY(arena, struct v3d_qpu_pp_expansion, 1);
+		if (!expansion)
+			return v3d_qpu_pp_fail(state, origin, "Out of memory for macro expansion");
+		*expansion = (struct v3d_qpu_pp_expansion){0};
+		expansion->key = key;
+		expansion->arguments =
+		    V3D_ARENA_ALLOC_ARRAY(arena, struct v3d_qpu_pp_span, numArguments ? numArguments : 1);
+		if (!expansion->arguments)
+			return v3d_qpu_pp_fail(state, origin, "Out of memory for macro expansion");
+		for (int i = 0; i < numArguments; ++i)
+		{
+			expansion->arguments[i].text =
+			    v3d_qpu_pp_copy(arena, arguments[i].text, arguments[i].length);
+			expansion->arguments[i].length = arguments[i].length;
+			if (!expansion->arguments[i].text)
+				return v3d_qpu_pp_fail(state, origin, "Out of memory for macro expansion");
 		}
-		opcode |= packed;
-		break;
+		if (!v3d_qpu_pp_expand(arena, macro, expansion->arguments, &expansion->text))
+			return v3d_qpu_pp_fail(state, origin, "Out of memory for macro expansion");
+		expansion->next = macro->expansions;
+		macro->expansions = expansion;
+	}
 
-	case V3D_QPU_A_MOV: {
-		v3d_uint32 packed;
+	struct v3d_qpu_pp_span noPath = {NULL, 0};
+	return v3d_qpu_pp_process(state, &expansion->text, noPath, origin, depth + 1);
+}
 
-		if (instr->alu.add.output_pack != V3D_QPU_PACK_NONE)
-			return FALSE;
+static v3d_bool v3d_qpu_pp_include(struct v3d_qpu_pp_state* state, const char* argumentsStart,
+                                   const char* lineEnd,
+                                   const struct v3d_qpu_preprocess_line_origin* origin, int depth)
+{
+	if (depth >= V3D_QPU_PP_MAX_DEPTH)
+		return v3d_qpu_pp_fail(state, origin,
+		                       "Macros or includes nested too deeply (are they recursive?)");
+	struct v3d_qpu_preprocessor* preprocessor = state->preprocessor;
+	struct v3d_qpu_pp_span quoted = v3d_qpu_pp_trim(argumentsStart, lineEnd);
+	if (quoted.length < 2 || quoted.text[0] != '"' || quoted.text[quoted.length - 1] != '"')
+		return v3d_qpu_pp_fail(state, origin, "Expected .include \"path\"");
+	struct v3d_qpu_pp_span path = {quoted.text + 1, quoted.length - 2};
+
+	struct v3d_qpu_pp_include* include = preprocessor->includes;
+	while (include && !v3d_qpu_pp_span_equals(include->path, path))
+		include = include->next;
+
+	if (include)
+		++preprocessor->numIncludeHits;
+	else
+	{
+		const char* loadedText = NULL;
+		int loadedLength = 0;
+		if (!preprocessor->loadInclude ||
+		    !preprocessor->loadInclude(preprocessor->userData, path.text, path.length,
+		                               &loadedText, &loadedLength))
+			return v3d_qpu_pp_fail(state, origin, "Could not load include");
+		++preprocessor->numIncludeLoads;
+
+		struct v3d_arena* arena = preprocessor->arena;
+		include = V3D_ARENA_ALLOC_ARRAY(arena, struct v3d_qpu_pp_include, 1);
+		const char* text = v3d_qpu_pp_copy(arena, loadedText, loadedLength);
+		const char* pathCopy = v3d_qpu_pp_copy(arena, path.text, path.length);
+		if (!include || !text || !pathCopy)
+			return v3d_qpu_pp_fail(state, origin, "Out of memory for include");
+		*include = (struct v3d_qpu_pp_include){0};
+		include->path.text = pathCopy;
+		include->path.length = path.length;
+		if (!v3d_qpu_pp_split_lines(arena, text, loadedLength, &include->text))
+			return v3d_qpu_pp_fail(state, origin, "Out of memory for include");
+		include->next = preprocessor->includes;
+		preprocessor->includes = include;
+	}
+
+	return v3d_qpu_pp_process(state, &include->text, include->path, NULL, depth + 1);
+}
 
-		if (!v3d_qpu_int32_unpack_pack(instr->alu.add.a.unpack,
-									   &packed)) {
-			return FALSE;
+// .macro on line, with the body running up to the matching .endm. Leaves *index, *offset, and
+// *lineNumber after the .endm.
+static v3d_bool v3d_qpu_pp_define_macro(struct v3d_qpu_pp_state* state,
+                                        const struct v3d_qpu_pp_text* text,
+                                        const char* argumentsStart, const char* lineEnd,
+                                        const struct v3d_qpu_preprocess_line_origin* origin,
+                                        int* index, int* offset, int* lineNumber)
+{
+	struct v3d_qpu_preprocessor* preprocessor = state->preprocessor;
+	struct v3d_qpu_pp_macro macro = {0};
+	const char* nameStart = v3d_qpu_pp_skip_spaces(argumentsStart, lineEnd);
+	macro.name.text = nameStart;
+	macro.name.length = v3d_qpu_pp_identifier_length(nameStart, lineEnd);
+	if (!macro.name.length)
+		return v3d_qpu_pp_fail(state, origin, "Expected macro name after .macro");
+	macro.numParams = v3d_qpu_pp_split(nameStart + macro.name.length, lineEnd, macro.params,
+	                                   V3D_QPU_PP_MAX_PARAMS);
+	if (macro.numParams < 0)
+		return v3d_qpu_pp_fail(state, origin, "Too many macro parameters");
+	for (int i = 0; i < macro.numParams; ++i)
+	{
+		if (!macro.params[i].length ||
+		    v3d_qpu_pp_identifier_length(macro.params[i].text,
+		                                 macro.params[i].text + macro.params[i].length) !=
+		        macro.params[i].length)
+			return v3d_qpu_pp_fail(state, origin, "Macro parameters must be identifiers");
+	}
+
+	const char* bodyStart = lineEnd + 1;
+	struct v3d_qpu_pp_line line;
+	for (;;)
+	{
+		if (!v3d_qpu_pp_next_line(text, index, offset, lineNumber, &line))
+			return v3d_qpu_pp_fail(state, origin, ".macro without .endm");
+		const char* lineStart = text->text + line.offset;
+		const char* currentChar = v3d_qpu_pp_skip_spaces(lineStart, lineStart + line.length);
+		if (currentChar < lineStart + line.length && *currentChar == '.')
+		{
+			struct v3d_qpu_pp_span directive = {
+			    currentChar + 1,
+			    v3d_qpu_pp_identifier_length(currentChar + 1, lineStart + line.length)};
+			if (v3d_qpu_pp_span_is(directive, "endm"))
+				break;
+			if (v3d_qpu_pp_span_is(directive, "macro"))
+				return v3d_qpu_pp_fail(state, origin, ".macro inside of a .macro");
 		}
+	}
+	if (bodyStart > text->text + line.offset)
+		bodyStart = text->text + line.offset;
+	macro.body.text = bodyStart;
+	macro.body.length = (int)(text->text + line.offset - bodyStart);
 
-		raddr_b |= packed << 2;
-		break;
+	// Re-defining a macro the same way, e.g. from an include used by every variant, keeps the
+	// expansions made so far
+	struct v3d_qpu_pp_macro* existing = v3d_qpu_pp_find_macro(preprocessor, macro.name);
+	if (existing && existing->numParams == macro.numParams &&
+	    v3d_qpu_pp_span_equals(existing->body, macro.body))
+	{
+		int i = 0;
+		while (i < macro.numParams && v3d_qpu_pp_span_equals(existing->params[i], macro.params[i]))
+			++i;
+		if (i == macro.numParams)
+			return TRUE;
 	}
 
-	case V3D_QPU_A_FMOV: {
-		v3d_uint32 packed;
+	struct v3d_arena* arena = preprocessor->arena;
+	struct v3d_qpu_pp_macro* newMacro = V3D_ARENA_ALLOC_ARRAY(arena, struct v3d_qpu_pp_macro, 1);
+	if (!newMacro)
+		return v3d_qpu_pp_fail(state, origin, "Out of memory for macro");
+	*newMacro = macro;
+	newMacro->name.text = v3d_qpu_pp_copy(arena, macro.name.text, macro.name.length);
+	newMacro->body.text = v3d_qpu_pp_copy(arena, macro.body.text, macro.body.length);
+	v3d_bool copied = newMacro->name.text && newMacro->body.text;
+	for (int i = 0; i < macro.numParams; ++i)
+	{
+		newMacro->params[i].text = v3d_qpu_pp_copy(arena, macro.params[i].text,
+		                                           macro.params[i].length);
+		copied = copied && newMacro->params[i].text;
+	}
+	if (!copied)
+		return v3d_qpu_pp_fail(state, origin, "Out of memory for macro");
+	// In front, so it shadows any earlier definition
+	newMacro->next = preprocessor->macros;
+	preprocessor->macros = newMacro;
+	return TRUE;
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.add.output_pack,
-									   &packed)) {
-			return FALSE;
-		}
-		raddr_b = packed;
+static v3d_bool v3d_qpu_pp_process(struct v3d_qpu_pp_state* state,
+                                   const struct v3d_qpu_pp_text* text, struct v3d_qpu_pp_span path,
+                                   const struct v3d_qpu_preprocess_line_origin* callOrigin,
+                                   int depth)
+{
+	struct v3d_qpu_preprocessor* preprocessor = state->preprocessor;
+	struct v3d_qpu_pp_line line;
+	int index = 0;
+	int offset = 0;
+	int lineNumber = 1;
+	while (v3d_qpu_pp_next_line(text, &index, &offset, &lineNumber, &line))
+	{
+		struct v3d_qpu_preprocess_line_origin origin = {path.text, path.length, line.line};
+		if (callOrigin)
+			origin = *callOrigin;
+
+		const char* lineStart = text->text + line.offset;
+		const char* lineEnd = lineStart + line.length;
+		const char* currentChar = lineStart;
+		if (!v3d_qpu_skip_whitespace_comments(&currentChar, lineEnd))
+			continue;
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.add.a.unpack,
-										 &packed)) {
-			return FALSE;
+		if (*currentChar == '.')
+		{
+			++currentChar;
+			struct v3d_qpu_pp_span directive = {
+			    currentChar, v3d_qpu_pp_identifier_length(currentChar, lineEnd)};
+			currentChar += directive.length;
+
+			if (v3d_qpu_pp_span_is(directive, "set"))
+			{
+				currentChar = v3d_qpu_pp_skip_spaces(currentChar, lineEnd);
+				struct v3d_qpu_pp_span name = {currentChar,
+				                               v3d_qpu_pp_identifier_length(currentChar, lineEnd)};
+				if (!name.length)
+					return v3d_qpu_pp_fail(state, &origin, "Expected symbol name after .set");
+				currentChar = v3d_qpu_pp_skip_spaces(currentChar + name.length, lineEnd);
+				if (currentChar < lineEnd && *currentChar == ',')
+					++currentChar;
+				struct v3d_qpu_pp_span value = v3d_qpu_pp_trim(currentChar, lineEnd);
+
+				// Symbols in the value are replaced now, so .set A, A + 1 works
+				char substituted[V3D_QPU_PP_MAX_SYMBOL_VALUE];
+				int substitutedLength = v3d_qpu_pp_substitute_symbols(
+				    preprocessor, value.text, value.length, substituted, sizeof(substituted));
+				if (substitutedLength > (int)sizeof(substituted))
+					return v3d_qpu_pp_fail(state, &origin, "Symbol value too long");
+				if (!v3d_qpu_preprocessor_set(preprocessor, name.text, name.length, substituted,
+				                              substitutedLength))
+					return v3d_qpu_pp_fail(state, &origin, "Out of memory for symbol");
+			}
+			else if (v3d_qpu_pp_span_is(directive, "include"))
+			{
+				if (!v3d_qpu_pp_include(state, currentChar, lineEnd, &origin, depth))
+					return FALSE;
+			}
+			else if (v3d_qpu_pp_span_is(directive, "macro"))
+			{
+				if (!v3d_qpu_pp_define_macro(state, text, currentChar, lineEnd, &origin, &index,
+				                             &offset, &lineNumber))
+					return FALSE;
+			}
+			else if (v3d_qpu_pp_span_is(directive, "endm"))
+				return v3d_qpu_pp_fail(state, &origin, ".endm without .macro");
+			else
+				return v3d_qpu_pp_fail(state, &origin, "Unknown directive");
+			continue;
 		}
-		raddr_b |= packed << 2;
-		break;
-	}
 
-	default:
-		if (instr->alu.add.op != V3D_QPU_A_NOP &&
-			(instr->alu.add.output_pack != V3D_QPU_PACK_NONE ||
-			 instr->alu.add.a.unpack != V3D_QPU_UNPACK_NONE ||
-			 instr->alu.add.b.unpack != V3D_QPU_UNPACK_NONE)) {
-			return FALSE;
+		struct v3d_qpu_pp_span name = {currentChar,
+		                               v3d_qpu_pp_identifier_length(currentChar, lineEnd)};
+		struct v3d_qpu_pp_macro* macro =
+		    name.length ? v3d_qpu_pp_find_macro(preprocessor, name) : NULL;
+		if (macro)
+		{
+			if (!v3d_qpu_pp_use_macro(state, macro, currentChar + name.length, lineEnd, &origin,
+			                          depth))
+				return FALSE;
 		}
-		break;
+		else if (!v3d_qpu_pp_emit_line(state, lineStart, line.length, &origin))
+			return FALSE;
 	}
-
-	*packed_instr |= QPU_SET_FIELD(raddr_a, V3D_QPU_RADDR_A);
-	*packed_instr |= QPU_SET_FIELD(raddr_b, V3D_QPU_RADDR_B);
-	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_ADD);
-	*packed_instr |= QPU_SET_FIELD(waddr, V3D_QPU_WADDR_A);
-	if (instr->alu.add.magic_write && !no_magic_write)
-		*packed_instr |= V3D_QPU_MA;
-
 	return TRUE;
 }
 
-static v3d_bool
-v3d33_qpu_mul_pack(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+v3d_bool v3d_qpu_preprocess(struct v3d_qpu_preprocessor* preprocessor,
+                            struct v3d_qpu_preprocess_arguments* args)
 {
-	v3d_uint32 mux_a = instr->alu.mul.a.mux;
-	v3d_uint32 mux_b = instr->alu.mul.b.mux;
-	int nsrc = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
+	args->outputLength = 0;
+	args->numLines = 0;
+	args->errorMessage = NULL;
+	args->errorOrigin = (struct v3d_qpu_preprocess_line_origin){0};
+
+	struct v3d_qpu_pp_state state = {preprocessor, args};
+	struct v3d_qpu_pp_text source = {args->source, args->sourceLength, NULL, 0};
+	struct v3d_qpu_pp_span noPath = {NULL, 0};
+	return v3d_qpu_pp_process(&state, &source, noPath, NULL, 0);
+}
 
-	const struct opcode_desc *desc =
-		lookup_opcode_from_instr(devinfo, mul_ops_v33,
-								 V3D_ARRAY_SIZE(mul_ops_v33),
-								 instr->alu.mul.op);
+// Constant expressions
 
-	if (!desc)
-		return FALSE;
+// Each '(' or unary operator recurses, so this keeps hostile input from overflowing the stack
+#define V3D_CONSTANT_MAX_DEPTH 64
 
-	v3d_uint32 opcode = desc->opcode_first;
+struct v3d_constant_parser
+{
+	const char* currentChar;
+	const char* end;
+	const char* errorMessage;
+	int depth;
+};
 
-	/* Some opcodes have a single valid value for their mux a/b, so set
-	 * that here.  If mux a/b determine packing, it will be set below.
-	 */
-	if (nsrc < 2)
-		mux_b = ffs(desc->mux.b_mask) - 1;
+struct v3d_constant_value
+{
+	v3d_bool isFloat;
+	long long integer;
+	double real;
+};
+
+union v3d_float_bits
+{
+	float real;
+	v3d_uint32 bits;
+};
+
+// Unlike v3d_peek(), never reads past a null terminator before offset
+static char v3d_constant_peek(struct v3d_constant_parser* parser, int offset)
+{
+	for (int i = 0; i < offset; ++i)
+	{
+		if (!v3d_peek(parser->currentChar, parser->end, i))
+			return 0;
+	}
+	return v3d_peek(parser->currentChar, parser->end, offset);
+}
+
+static void v3d_constant_skip_spaces(struct v3d_constant_parser* parser)
+{
+	while (v3d_constant_peek(parser, 0) == ' ' || v3d_constant_peek(parser, 0) == '\t')
+		++parser->currentChar;
+}
+
+static v3d_bool v3d_constant_fail(struct v3d_constant_parser* parser, const char* message)
+{
+	if (!parser->errorMessage)
+		parser->errorMessage = message;
+	return FALSE;
+}
 
-	if (nsrc < 1)
-		mux_a = ffs(desc->mux.a_mask) - 1;
+static double v3d_constant_as_real(struct v3d_constant_value value)
+{
+	return value.isFloat ? value.real : (double)value.integer;
+}
 
-	switch (instr->alu.mul.op) {
-	case V3D_QPU_M_FMUL: {
-		v3d_uint32 packed;
+static v3d_bool v3d_constant_is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
-									   &packed)) {
-			return FALSE;
+static v3d_bool v3d_constant_parse_number(struct v3d_constant_parser* parser,
+                                          struct v3d_constant_value* valueOut)
+{
+	*valueOut = (struct v3d_constant_value){0};
+	if (v3d_constant_peek(parser, 0) == '0' &&
+	    (v3d_constant_peek(parser, 1) == 'x' || v3d_constant_peek(parser, 1) == 'X'))
+	{
+		parser->currentChar += 2;
+		int numDigits = 0;
+		for (;; ++numDigits, ++parser->currentChar)
+		{
+			char c = v3d_constant_peek(parser, 0);
+			int digit = 0;
+			if (c >= '0' && c <= '9')
+				digit = c - '0';
+			else if (c >= 'a' && c <= 'f')
+				digit = c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F')
+				digit = c - 'A' + 10;
+			else
+				break;
+			valueOut->integer = valueOut->integer * 16 + digit;
+			if (valueOut->integer > 0xffffffffll)
+				return v3d_constant_fail(parser, "Constant does not fit in 32 bits");
 		}
-		/* No need for a +1 because desc->opcode_first has a 1 in this
-		 * field.
-		 */
-		opcode += packed << 4;
+		if (!numDigits)
+			return v3d_constant_fail(parser, "Expected hex digits after 0x");
+		return TRUE;
+	}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
-										 &packed)) {
-			return FALSE;
+	double real = 0.0;
+	while (v3d_constant_is_digit(v3d_constant_peek(parser, 0)))
+	{
+		int digit = v3d_constant_peek(parser, 0) - '0';
+		real = real * 10.0 + digit;
+		valueOut->integer = valueOut->integer * 10 + digit;
+		if (valueOut->integer > 0xffffffffll)
+			return v3d_constant_fail(parser, "Constant does not fit in 32 bits");
+		++parser->currentChar;
+	}
+
+	// A '.' followed by a letter is an unpack suffix, not a fraction
+	if (v3d_constant_peek(parser, 0) == '.' && v3d_constant_is_digit(v3d_constant_peek(parser, 1)))
+	{
+		valueOut->isFloat = TRUE;
+		++parser->currentChar;
+		double scale = 0.1;
+		while (v3d_constant_is_digit(v3d_constant_peek(parser, 0)))
+		{
+			real += (v3d_constant_peek(parser, 0) - '0') * scale;
+			scale *= 0.1;
+			++parser->currentChar;
 		}
-		opcode |= packed << 2;
+	}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.b.unpack,
-										 &packed)) {
-			return FALSE;
+	char exponentSign = v3d_constant_peek(parser, 1);
+	if ((v3d_constant_peek(parser, 0) == 'e' || v3d_constant_peek(parser, 0) == 'E') &&
+	    (v3d_constant_is_digit(exponentSign) ||
+	     ((exponentSign == '-' || exponentSign == '+') &&
+	      v3d_constant_is_digit(v3d_constant_peek(parser, 2)))))
+	{
+		valueOut->isFloat = TRUE;
+		++parser->currentChar;
+		v3d_bool negative = v3d_constant_peek(parser, 0) == '-';
+		if (!v3d_constant_is_digit(v3d_constant_peek(parser, 0)))
+			++parser->currentChar;
+		int exponent = 0;
+		while (v3d_constant_is_digit(v3d_constant_peek(parser, 0)))
+		{
+			if (exponent < 100)
+				exponent = exponent * 10 + (v3d_constant_peek(parser, 0) - '0');
+			++parser->currentChar;
 		}
-		opcode |= packed << 0;
-		break;
+		for (int i = 0; i < exponent; ++i)
+			real = negative ? real / 10.0 : real * 10.0;
 	}
 
-	case V3D_QPU_M_FMOV: {
-		v3d_uint32 packed;
+	if (v3d_constant_peek(parser, 0) == 'f' || v3d_constant_peek(parser, 0) == 'F')
+	{
+		valueOut->isFloat = TRUE;
+		++parser->currentChar;
+	}
+	valueOut->real = real;
+	return TRUE;
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
-									   &packed)) {
-			return FALSE;
-		}
-		opcode |= (packed >> 1) & 1;
-		mux_b = (packed & 1) << 2;
+static v3d_bool v3d_constant_parse_binary(struct v3d_constant_parser* parser, int level,
+                                          struct v3d_constant_value* valueOut);
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
-										 &packed)) {
+static v3d_bool v3d_constant_parse_unary(struct v3d_constant_parser* parser,
+                                         struct v3d_constant_value* valueOut)
+{
+	v3d_constant_skip_spaces(parser);
+	char c = v3d_constant_peek(parser, 0);
+	if ((c == '-' || c == '~' || c == '+' || c == '(') && parser->depth >= V3D_CONSTANT_MAX_DEPTH)
+		return v3d_constant_fail(parser, "Constant expression nested too deeply");
+	if (c == '-' || c == '~' || c == '+')
+	{
+		++parser->currentChar;
+		++parser->depth;
+		v3d_bool parsed = v3d_constant_parse_unary(parser, valueOut);
+		--parser->depth;
+		if (!parsed)
 			return FALSE;
+		if (c == '-')
+		{
+			valueOut->integer = -valueOut->integer;
+			valueOut->real = -valueOut->real;
 		}
-		mux_b |= packed;
-		break;
+		else if (c == '~')
+		{
+			if (valueOut->isFloat)
+				return v3d_constant_fail(parser, "Bitwise operators only take integers");
+			valueOut->integer = ~valueOut->integer;
+		}
+		return TRUE;
+	}
+	if (c == '(')
+	{
+		++parser->currentChar;
+		++parser->depth;
+		v3d_bool parsed = v3d_constant_parse_binary(parser, 0, valueOut);
+		--parser->depth;
+		if (!parsed)
+			return FALSE;
+		v3d_constant_skip_spaces(parser);
+		if (v3d_constant_peek(parser, 0) != ')')
+			return v3d_constant_fail(parser, "Expected ')' in constant expression");
+		++parser->currentChar;
+		return TRUE;
 	}
+	if (v3d_constant_is_digit(c))
+		return v3d_constant_parse_number(parser, valueOut);
+	return v3d_constant_fail(parser, "Expected number or '(' in constant expression");
+}
 
-	case V3D_QPU_M_VFMUL: {
-		v3d_uint32 packed;
+// Returns the precedence level of the operator at the read head, or -1 if there isn't one.
+// operatorLength is set to the number of characters it takes up.
+static int v3d_constant_operator_level(struct v3d_constant_parser* parser, int* operatorLength)
+{
+	char c = v3d_constant_peek(parser, 0);
+	char next = v3d_constant_peek(parser, 1);
+	*operatorLength = 1;
+	switch (c)
+	{
+		case '|':
+			return 0;
+		case '^':
+			return 1;
+		case '&':
+			return 2;
+		case '<':
+		case '>':
+			if (next != c)
+				return -1;
+			*operatorLength = 2;
+			return 3;
+		case '+':
+		case '-':
+			return 4;
+		case '/':
+			// A comment ends the expression
+			if (next == '/' || next == '*')
+				return -1;
+			return 5;
+		case '*':
+		case '%':
+			return 5;
+		default:
+			return -1;
+	}
+}
 
-		if (instr->alu.mul.output_pack != V3D_QPU_PACK_NONE)
-			return FALSE;
+static v3d_bool v3d_constant_apply(struct v3d_constant_parser* parser, char op,
+                                   struct v3d_constant_value* left,
+                                   struct v3d_constant_value right)
+{
+	if (left->isFloat || right.isFloat)
+	{
+		double a = v3d_constant_as_real(*left);
+		double b = v3d_constant_as_real(right);
+		left->isFloat = TRUE;
+		switch (op)
+		{
+			case '+':
+				left->real = a + b;
+				return TRUE;
+			case '-':
+				left->real = a - b;
+				return TRUE;
+			case '*':
+				left->real = a * b;
+				return TRUE;
+			case '/':
+				if (b == 0.0)
+					return v3d_constant_fail(parser, "Division by zero in constant expression");
+				left->real = a / b;
+				return TRUE;
+			default:
+				return v3d_constant_fail(parser, "Bitwise operators only take integers");
+		}
+	}
+
+	long long a = left->integer;
+	long long b = right.integer;
+	switch (op)
+	{
+		case '|':
+			left->integer = a | b;
+			break;
+		case '^':
+			left->integer = a ^ b;
+			break;
+		case '&':
+			left->integer = a & b;
+			break;
+		case '<':
+		case '>':
+			if (b < 0 || b > 32)
+				return v3d_constant_fail(parser, "Shift amount must be 0 through 32");
+			left->integer = op == '<' ? (long long)((unsigned long long)a << b) : a >> b;
+			break;
+		case '+':
+			left->integer = a + b;
+			break;
+		case '-':
+			left->integer = a - b;
+			break;
+		case '*':
+			left->integer = a * b;
+			break;
+		case '/':
+		case '%':
+			if (b == 0)
+				return v3d_constant_fail(parser, "Division by zero in constant expression");
+			left->integer = op == '/' ? a / b : a % b;
+			break;
+	}
+	// Keep intermediate values from overflowing the 64 bit math
+	if (left->integer > 0xffffffffll || left->integer < -0x80000000ll)
+		return v3d_constant_fail(parser, "Constant does not fit in 32 bits");
+	return TRUE;
+}
 
-		if (!v3d_qpu_float16_unpack_pack(instr->alu.mul.a.unpack,
-										 &packed)) {
-			return FALSE;
+static v3d_bool v3d_constant_parse_binary(struct v3d_constant_parser* parser, int level,
+                                          struct v3d_constant_value* valueOut)
+{
+	if (level > 5)
+		return v3d_constant_parse_unary(parser, valueOut);
+	if (!v3d_constant_parse_binary(parser, level + 1, valueOut))
+		return FALSE;
+	for (;;)
+	{
+		const char* beforeSpaces = parser->currentChar;
+		v3d_constant_skip_spaces(parser);
+		int operatorLength = 0;
+		if (v3d_constant_operator_level(parser, &operatorLength) != level)
+		{
+			// Trailing spaces aren't part of the expression
+			parser->currentChar = beforeSpaces;
+			return TRUE;
 		}
-		if (instr->alu.mul.a.unpack == V3D_QPU_UNPACK_SWAP_16)
-			opcode = 8;
-		else
-			opcode |= (packed + 4) & 7;
+		char op = v3d_constant_peek(parser, 0);
+		parser->currentChar += operatorLength;
 
-		if (instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)
+		struct v3d_constant_value right;
+		if (!v3d_constant_parse_binary(parser, level + 1, &right))
+			return FALSE;
+		if (!v3d_constant_apply(parser, op, valueOut, right))
 			return FALSE;
+	}
+}
 
-		break;
+v3d_bool v3d_qpu_eval_constant(const char* expression, const char* end,
+                               struct v3d_qpu_constant* constantOut,
+                               const char** endOfExpressionOut, const char** errorMessageOut)
+{
+	struct v3d_constant_parser parser = {expression, end, NULL, 0};
+	struct v3d_constant_value value;
+	if (!v3d_constant_parse_binary(&parser, 0, &value))
+	{
+		*errorMessageOut = parser.errorMessage;
+		return FALSE;
 	}
 
-	default:
-		if (instr->alu.mul.op != V3D_QPU_M_NOP &&
-			(instr->alu.mul.output_pack != V3D_QPU_PACK_NONE ||
-			 instr->alu.mul.a.unpack != V3D_QPU_UNPACK_NONE ||
-			 instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)) {
+	constantOut->isFloat = value.isFloat;
+	if (value.isFloat)
+	{
+		union v3d_float_bits converted;
+		converted.real = (float)value.real;
+		constantOut->bits = converted.bits;
+	}
+	else
+	{
+		if (value.integer > 0xffffffffll || value.integer < -0x80000000ll)
+		{
+			*errorMessageOut = "Constant does not fit in 32 bits";
 			return FALSE;
 		}
-		break;
+		constantOut->bits = (v3d_uint32)value.integer;
 	}
+	*endOfExpressionOut = parser.currentChar;
+	*errorMessageOut = NULL;
+	return TRUE;
+}
 
-	*packed_instr |= QPU_SET_FIELD(mux_a, V3D_QPU_MUL_A);
-	*packed_instr |= QPU_SET_FIELD(mux_b, V3D_QPU_MUL_B);
-
-	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_MUL);
-	*packed_instr |= QPU_SET_FIELD(instr->alu.mul.waddr, V3D_QPU_WADDR_M);
-	if (instr->alu.mul.magic_write)
-		*packed_instr |= V3D_QPU_MM;
+static float v3d_bits_to_float(v3d_uint32 bits)
+{
+	union v3d_float_bits converted;
+	converted.bits = bits;
+	return converted.real;
+}
 
-	return TRUE;
+static v3d_uint32 v3d_float_to_bits(float real)
+{
+	union v3d_float_bits converted;
+	converted.real = real;
+	return converted.bits;
 }
 
-static v3d_bool
-v3d71_qpu_mul_pack(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+void v3d_qpu_plan_constant(const struct v3d_device_info* devinfo, v3d_uint32 bits,
+                           struct v3d_qpu_constant_plan* planOut)
 {
-	v3d_uint32 raddr_c = instr->alu.mul.a.raddr;
-	v3d_uint32 raddr_d = instr->alu.mul.b.raddr;
-	int nsrc = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
+	*planOut = (struct v3d_qpu_constant_plan){0};
+	planOut->addOp = V3D_QPU_A_NOP;
+	planOut->mulOp = V3D_QPU_M_NOP;
+	if (v3d_qpu_small_imm_pack(devinfo, bits, &planOut->packedSmallImmediate))
+	{
+		planOut->source = V3D_QPU_CONSTANT_SMALL_IMMEDIATE;
+		return;
+	}
 
-	const struct opcode_desc *desc =
-		lookup_opcode_from_instr(devinfo, mul_ops_v71,
-								 V3D_ARRAY_SIZE(mul_ops_v71),
-								 instr->alu.mul.op);
-	if (!desc)
-		return FALSE;
+	// What each op gives when its operands are all the same small immediate
+	for (v3d_uint32 packed = 0; packed < V3D_ARRAY_SIZE(small_immediates); ++packed)
+	{
+		v3d_uint32 value = small_immediates[packed];
+		float real = v3d_bits_to_float(value);
+		v3d_int32 integer = (v3d_int32)value;
+		// smul24 only looks at the low 24 bits, sign extended
+		long long low24 = (v3d_int32)(value << 8) >> 8;
+		struct
+		{
+			enum v3d_qpu_add_op addOp;
+			enum v3d_qpu_mul_op mulOp;
+			v3d_uint32 result;
+		} candidates[] = {
+		    {V3D_QPU_A_ITOF, V3D_QPU_M_NOP, v3d_float_to_bits((float)integer)},
+		    {V3D_QPU_A_NEG, V3D_QPU_M_NOP, (v3d_uint32)0 - value},
+		    {V3D_QPU_A_NOT, V3D_QPU_M_NOP, ~value},
+		    {V3D_QPU_A_ADD, V3D_QPU_M_NOP, value + value},
+		    {V3D_QPU_A_SHL, V3D_QPU_M_NOP, value << (value & 31)},
+		    {V3D_QPU_A_FADD, V3D_QPU_M_NOP, v3d_float_to_bits(real + real)},
+		    {V3D_QPU_A_NOP, V3D_QPU_M_FMUL, v3d_float_to_bits(real * real)},
+		    {V3D_QPU_A_NOP, V3D_QPU_M_SMUL24, (v3d_uint32)(low24 * low24)},
+		};
+		for (int i = 0; i < (int)V3D_ARRAY_SIZE(candidates); ++i)
+		{
+			if (candidates[i].result != bits)
+				continue;
+			planOut->source = V3D_QPU_CONSTANT_ALU_OP;
+			planOut->packedSmallImmediate = packed;
+			planOut->addOp = candidates[i].addOp;
+			planOut->mulOp = candidates[i].mulOp;
+			return;
+		}
+	}
 
-	v3d_uint32 opcode = desc->opcode_first;
+	planOut->source = V3D_QPU_CONSTANT_UNIFORM;
+}
 
-	/* Some opcodes have a single valid value for their raddr_d, so set
-	 * that here.  If raddr_b determine packing, it will be set below.
-	 */
-	if (nsrc < 2)
-		raddr_d = ffsll(desc->raddr_mask) - 1;
+// Raddr conflict resolution
 
-	switch (instr->alu.mul.op) {
-	case V3D_QPU_M_FMUL: {
-		v3d_uint32 packed;
+const char* v3d_qpu_raddr_fix_description(enum v3d_qpu_raddr_fix fix)
+{
+	switch (fix)
+	{
+		case V3D_QPU_RADDR_FIX_NONE:
+			return "Fit as written";
+		case V3D_QPU_RADDR_FIX_SPLIT:
+			return "Split the add and mul ops into two instructions to fit the raddr limit";
+		case V3D_QPU_RADDR_FIX_MOVE:
+			return "Moved a source into the scratch accumulator with an extra instruction to fit "
+			       "the raddr limit";
+	}
+	return "Unknown fix";
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
-									   &packed)) {
-			return FALSE;
-		}
-		/* No need for a +1 because desc->opcode_first has a 1 in this
-		 * field.
-		 */
-		opcode += packed << 4;
+static v3d_bool v3d_qpu_operand_same_source(struct v3d_qpu_operand a, struct v3d_qpu_operand b)
+{
+	return a.kind == b.kind && a.index == b.index;
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
-										 &packed)) {
-			return FALSE;
-		}
-		opcode |= packed << 2;
+// Whether sources (addA, addB, mulA, mulB, with unused ones V3D_QPU_OPERAND_NONE) fit in raddr_a
+// and raddr_b
+static v3d_bool v3d_qpu_sources_fit_raddrs(const struct v3d_qpu_operand* sources)
+{
+	int numRegisterFiles = 0;
+	int numSmallImmediates = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (sources[i].kind != V3D_QPU_OPERAND_REGISTER_FILE &&
+		    sources[i].kind != V3D_QPU_OPERAND_SMALL_IMMEDIATE)
+			continue;
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.b.unpack,
-										 &packed)) {
-			return FALSE;
+		v3d_bool alreadyRead = FALSE;
+		for (int j = 0; j < i; ++j)
+		{
+			if (v3d_qpu_operand_same_source(sources[i], sources[j]))
+				alreadyRead = TRUE;
 		}
-		opcode |= packed << 0;
-		break;
+		if (alreadyRead)
+			continue;
+
+		if (sources[i].kind == V3D_QPU_OPERAND_REGISTER_FILE)
+			++numRegisterFiles;
+		else
+			++numSmallImmediates;
 	}
+	return numSmallImmediates <= 1 && numRegisterFiles + numSmallImmediates <= 2;
+}
 
-	case V3D_QPU_M_FMOV: {
-		v3d_uint32 packed;
+// Whether input of instr reads what a write to waddr changes, taking the write as complete
+static v3d_bool v3d_qpu_input_reads_write(const struct v3d_qpu_instr* instr,
+                                          const struct v3d_qpu_input* input, v3d_uint8 waddr,
+                                          v3d_bool magicWrite)
+{
+	if (!magicWrite)
+		return (input->mux == V3D_QPU_MUX_A && instr->raddr_a == waddr) ||
+		       (input->mux == V3D_QPU_MUX_B && !instr->sig.small_imm_b &&
+		        instr->raddr_b == waddr);
+	if (waddr <= V3D_QPU_WADDR_R5)
+		return input->mux == V3D_QPU_MUX_R0 + (waddr - V3D_QPU_WADDR_R0);
+	// SFU results arrive in r4
+	if (v3d_qpu_magic_waddr_is_sfu(waddr))
+		return input->mux == V3D_QPU_MUX_R4;
+	return FALSE;
+}
 
-		if (!v3d_qpu_float32_pack_pack(instr->alu.mul.output_pack,
-									   &packed)) {
-			return FALSE;
-		}
-		raddr_d |= packed;
+static v3d_bool v3d_qpu_magic_waddr_has_side_effects(v3d_uint8 waddr)
+{
+	return waddr != V3D_QPU_WADDR_NOP && waddr > V3D_QPU_WADDR_R5;
+}
 
-		if (!v3d_qpu_float32_unpack_pack(instr->alu.mul.a.unpack,
-										 &packed)) {
-			return FALSE;
-		}
-		raddr_d |= packed << 2;
-		break;
-	}
+// first and second each hold one op of a split instruction. Checks second still reads the values
+// the original instruction read once first has run.
+static v3d_bool v3d_qpu_split_order_valid(const struct v3d_qpu_instr* first,
+                                          const struct v3d_qpu_instr* second, v3d_bool addFirst)
+{
+	if (v3d_qpu_writes_flags(first) && v3d_qpu_reads_flags(second))
+		return FALSE;
 
-	case V3D_QPU_M_VFMUL: {
-		v3d_unreachable("pending v71 update");
-		v3d_uint32 packed;
+	v3d_uint8 firstWaddr = addFirst ? first->alu.add.waddr : first->alu.mul.waddr;
+	v3d_bool firstMagic = addFirst ? first->alu.add.magic_write : first->alu.mul.magic_write;
+	v3d_uint8 secondWaddr = addFirst ? second->alu.mul.waddr : second->alu.add.waddr;
+	v3d_bool secondMagic = addFirst ? second->alu.mul.magic_write : second->alu.add.magic_write;
+	if (firstMagic && firstWaddr == V3D_QPU_WADDR_NOP)
+		return TRUE;
 
-		if (instr->alu.mul.output_pack != V3D_QPU_PACK_NONE)
+	// Which of two writes to the same register wins is not worth preserving
+	if (firstWaddr == secondWaddr && firstMagic == secondMagic)
+		return FALSE;
+	if (firstMagic && secondMagic && v3d_qpu_magic_waddr_has_side_effects(firstWaddr) &&
+	    v3d_qpu_magic_waddr_has_side_effects(secondWaddr))
+		return FALSE;
+
+	int numSrc = addFirst ? v3d_qpu_mul_op_num_src(second->alu.mul.op) :
+	                        v3d_qpu_add_op_num_src(second->alu.add.op);
+	const struct v3d_qpu_input* inputs[2] = {
+	    addFirst ? &second->alu.mul.a : &second->alu.add.a,
+	    addFirst ? &second->alu.mul.b : &second->alu.add.b,
+	};
+	for (int src = 0; src < numSrc; ++src)
+	{
+		if (v3d_qpu_input_reads_write(second, inputs[src], firstWaddr, firstMagic))
 			return FALSE;
+	}
+	return TRUE;
+}
 
-		if (!v3d_qpu_float16_unpack_pack(instr->alu.mul.a.unpack,
-										 &packed)) {
+static v3d_bool v3d_qpu_try_split(const struct v3d_device_info* devinfo,
+                                  enum v3d_qpu_add_op addOp, struct v3d_qpu_operand addDst,
+                                  struct v3d_qpu_operand addA, struct v3d_qpu_operand addB,
+                                  enum v3d_qpu_mul_op mulOp, struct v3d_qpu_operand mulDst,
+                                  struct v3d_qpu_operand mulA, struct v3d_qpu_operand mulB,
+                                  const struct v3d_qpu_emit_modifiers* modifiers,
+                                  struct v3d_qpu_instr instrsOut[2])
+{
+	struct v3d_qpu_emit_modifiers addModifiers = {0};
+	struct v3d_qpu_emit_modifiers mulModifiers = {0};
+	if (modifiers)
+	{
+		// Signals belong to the whole instruction, so there's no right half to put them in
+		static const struct v3d_qpu_sig noSignals = {0};
+		if (v3d_memcmp(&modifiers->sig, &noSignals, sizeof(noSignals)) || modifiers->sig_magic)
 			return FALSE;
-		}
-		if (instr->alu.mul.a.unpack == V3D_QPU_UNPACK_SWAP_16)
-			opcode = 8;
-		else
-			opcode |= (packed + 4) & 7;
 
-		if (instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)
+		addModifiers.flags.ac = modifiers->flags.ac;
+		addModifiers.flags.apf = modifiers->flags.apf;
+		addModifiers.flags.auf = modifiers->flags.auf;
+		mulModifiers.flags.mc = modifiers->flags.mc;
+		mulModifiers.flags.mpf = modifiers->flags.mpf;
+		mulModifiers.flags.muf = modifiers->flags.muf;
+	}
+
+	struct v3d_qpu_operand none = v3d_qpu_operand_none();
+	struct v3d_qpu_instr addHalf;
+	struct v3d_qpu_instr mulHalf;
+	const char* error = NULL;
+	if (!v3d_qpu_build_alu(devinfo, addOp, addDst, addA, addB, V3D_QPU_M_NOP, none, none, none,
+	                       &addModifiers, &addHalf, &error) ||
+	    !v3d_qpu_build_alu(devinfo, V3D_QPU_A_NOP, none, none, none, mulOp, mulDst, mulA, mulB,
+	                       &mulModifiers, &mulHalf, &error))
+		return FALSE;
+
+	if (v3d_qpu_split_order_valid(&addHalf, &mulHalf, /*addFirst=*/TRUE))
+	{
+		instrsOut[0] = addHalf;
+		instrsOut[1] = mulHalf;
+		return TRUE;
+	}
+	if (v3d_qpu_split_order_valid(&mulHalf, &addHalf, /*addFirst=*/FALSE))
+	{
+		instrsOut[0] = mulHalf;
+		instrsOut[1] = addHalf;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// sources are addA, addB, mulA, mulB
+static v3d_bool v3d_qpu_try_move(const struct v3d_device_info* devinfo,
+                                 enum v3d_qpu_add_op addOp, struct v3d_qpu_operand addDst,
+                                 enum v3d_qpu_mul_op mulOp, struct v3d_qpu_operand mulDst,
+                                 const struct v3d_qpu_operand* sources,
+                                 const struct v3d_qpu_emit_modifiers* modifiers,
+                                 int scratchAccumulator, struct v3d_qpu_instr instrsOut[2])
+{
+	struct v3d_qpu_operand scratch = v3d_qpu_operand_acc(scratchAccumulator);
+	for (int i = 0; i < 4; ++i)
+	{
+		if (v3d_qpu_operand_same_source(sources[i], scratch))
 			return FALSE;
-
-		break;
 	}
 
-	case V3D_QPU_M_MOV: {
-		v3d_uint32 packed;
-
-		if (instr->alu.mul.output_pack != V3D_QPU_PACK_NONE)
-			return FALSE;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (sources[i].kind != V3D_QPU_OPERAND_REGISTER_FILE &&
+		    sources[i].kind != V3D_QPU_OPERAND_SMALL_IMMEDIATE)
+			continue;
 
-		if (!v3d_qpu_int32_unpack_pack(instr->alu.mul.a.unpack,
-									   &packed)) {
-			return FALSE;
+		// Every input reading this source reads the scratch accumulator instead, keeping their
+		// unpacks
+		struct v3d_qpu_operand moved[4];
+		for (int j = 0; j < 4; ++j)
+		{
+			moved[j] = sources[j];
+			if (v3d_qpu_operand_same_source(sources[j], sources[i]))
+				moved[j] = v3d_qpu_operand_unpack(scratch, sources[j].unpack);
 		}
+		if (!v3d_qpu_sources_fit_raddrs(moved))
+			continue;
 
-		raddr_d |= packed << 2;
-		break;
+		struct v3d_qpu_operand none = v3d_qpu_operand_none();
+		struct v3d_qpu_operand value = sources[i];
+		value.unpack = V3D_QPU_UNPACK_NONE;
+		const char* error = NULL;
+		if (!v3d_qpu_build_alu(devinfo, V3D_QPU_A_NOP, none, none, none, V3D_QPU_M_MOV, scratch,
+		                       value, none, NULL, &instrsOut[0], &error) ||
+		    !v3d_qpu_build_alu(devinfo, addOp, addDst, moved[0], moved[1], mulOp, mulDst,
+		                       moved[2], moved[3], modifiers, &instrsOut[1], &error))
+			continue;
+		return TRUE;
 	}
+	return FALSE;
+}
 
-	default:
-		if (instr->alu.mul.op != V3D_QPU_M_NOP &&
-			(instr->alu.mul.output_pack != V3D_QPU_PACK_NONE ||
-			 instr->alu.mul.a.unpack != V3D_QPU_UNPACK_NONE ||
-			 instr->alu.mul.b.unpack != V3D_QPU_UNPACK_NONE)) {
-			return FALSE;
-		}
-		break;
+v3d_bool v3d_qpu_build_alu_fixed(const struct v3d_device_info* devinfo, enum v3d_qpu_add_op addOp,
+                                 struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                                 struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                                 struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                                 struct v3d_qpu_operand mulB,
+                                 const struct v3d_qpu_emit_modifiers* modifiers,
+                                 const struct v3d_qpu_raddr_fix_options* options,
+                                 struct v3d_qpu_instr instrsOut[2], int* numInstrsOut,
+                                 enum v3d_qpu_raddr_fix* fixOut, const char** errorMessageOut)
+{
+	*numInstrsOut = 1;
+	*fixOut = V3D_QPU_RADDR_FIX_NONE;
+
+	int numAddSrc = v3d_qpu_add_op_num_src(addOp);
+	int numMulSrc = v3d_qpu_mul_op_num_src(mulOp);
+	struct v3d_qpu_operand none = v3d_qpu_operand_none();
+	struct v3d_qpu_operand sources[4] = {
+	    numAddSrc > 0 ? addA : none,
+	    numAddSrc > 1 ? addB : none,
+	    numMulSrc > 0 ? mulA : none,
+	    numMulSrc > 1 ? mulB : none,
+	};
+	// Anything else wrong with the instruction is reported as usual
+	if (v3d_qpu_sources_fit_raddrs(sources) || devinfo->ver >= 70)
+		return v3d_qpu_build_alu(devinfo, addOp, addDst, addA, addB, mulOp, mulDst, mulA, mulB,
+		                         modifiers, &instrsOut[0], errorMessageOut);
+
+	*errorMessageOut = NULL;
+	if (options && options->allowSplit &&
+	    v3d_qpu_try_split(devinfo, addOp, addDst, addA, addB, mulOp, mulDst, mulA, mulB,
+	                      modifiers, instrsOut))
+	{
+		*numInstrsOut = 2;
+		*fixOut = V3D_QPU_RADDR_FIX_SPLIT;
+		return TRUE;
 	}
 
-	*packed_instr |= QPU_SET_FIELD(raddr_c, V3D_QPU_RADDR_C);
-	*packed_instr |= QPU_SET_FIELD(raddr_d, V3D_QPU_RADDR_D);
-	*packed_instr |= QPU_SET_FIELD(opcode, V3D_QPU_OP_MUL);
-	*packed_instr |= QPU_SET_FIELD(instr->alu.mul.waddr, V3D_QPU_WADDR_M);
-	if (instr->alu.mul.magic_write)
-		*packed_instr |= V3D_QPU_MM;
+	if (options && options->allowMove && devinfo->has_accumulators &&
+	    options->scratchAccumulator >= 0 && options->scratchAccumulator <= 5 &&
+	    v3d_qpu_try_move(devinfo, addOp, addDst, mulOp, mulDst, sources, modifiers,
+	                     options->scratchAccumulator, instrsOut))
+	{
+		*numInstrsOut = 2;
+		*fixOut = V3D_QPU_RADDR_FIX_MOVE;
+		return TRUE;
+	}
 
-	return TRUE;
+	// No fix applied, so let the regular build report the conflict
+	return v3d_qpu_build_alu(devinfo, addOp, addDst, addA, addB, mulOp, mulDst, mulA, mulB,
+	                         modifiers, &instrsOut[0], errorMessageOut);
 }
 
-static v3d_bool
-v3d_qpu_add_pack(const struct v3d_device_info *devinfo,
-                 const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+v3d_bool v3d_qpu_emit_alu_fixed(struct v3d_qpu_builder* builder, enum v3d_qpu_add_op addOp,
+                                struct v3d_qpu_operand addDst, struct v3d_qpu_operand addA,
+                                struct v3d_qpu_operand addB, enum v3d_qpu_mul_op mulOp,
+                                struct v3d_qpu_operand mulDst, struct v3d_qpu_operand mulA,
+                                struct v3d_qpu_operand mulB,
+                                const struct v3d_qpu_emit_modifiers* modifiers,
+                                const struct v3d_qpu_raddr_fix_options* options,
+                                enum v3d_qpu_raddr_fix* fixOut)
 {
-	if (devinfo->ver < 71)
-		return v3d33_qpu_add_pack(devinfo, instr, packed_instr);
-	else
-		return v3d71_qpu_add_pack(devinfo, instr, packed_instr);
+	if (builder->errorMessage)
+		return FALSE;
+
+	struct v3d_qpu_instr instrs[2];
+	int numInstrs = 0;
+	enum v3d_qpu_raddr_fix fix = V3D_QPU_RADDR_FIX_NONE;
+	const char* error = NULL;
+	if (!v3d_qpu_build_alu_fixed(&builder->devinfo, addOp, addDst, addA, addB, mulOp, mulDst,
+	                             mulA, mulB, modifiers, options, instrs, &numInstrs, &fix, &error))
+		return v3d_qpu_builder_fail(builder, error);
+	if (fixOut)
+		*fixOut = fix;
+	for (int i = 0; i < numInstrs; ++i)
+	{
+		if (!v3d_qpu_emit_instr(builder, &instrs[i]))
+			return FALSE;
+	}
+	return TRUE;
 }
 
-static v3d_bool
-v3d_qpu_mul_pack(const struct v3d_device_info *devinfo,
-                 const struct v3d_qpu_instr *instr, v3d_uint64 *packed_instr)
+// Hazard fixing
+
+// Registers and flags an instruction reads or writes, including implicit writes such as r4 from
+// SFU and ldtmu, or r5 from ldunif. V3D 4.x only.
+struct v3d_qpu_reg_usage
 {
-	if (devinfo->ver < 71)
-		return v3d33_qpu_mul_pack(devinfo, instr, packed_instr);
+	v3d_uint64 rfReads;
+	v3d_uint64 rfWrites;
+	v3d_uint8 accReads;
+	v3d_uint8 accWrites;
+	v3d_bool readsFlags;
+	v3d_bool writesFlags;
+};
+
+static void v3d_qpu_input_usage(const struct v3d_qpu_instr* instr,
+                                const struct v3d_qpu_input* input, struct v3d_qpu_reg_usage* usage)
+{
+	if (input->mux == V3D_QPU_MUX_A)
+		usage->rfReads |= 1ull << instr->raddr_a;
+	else if (input->mux == V3D_QPU_MUX_B)
+	{
+		if (!instr->sig.small_imm_b)
+			usage->rfReads |= 1ull << instr->raddr_b;
+	}
 	else
-		return v3d71_qpu_mul_pack(devinfo, instr, packed_instr);
+		usage->accReads |= 1 << (input->mux - V3D_QPU_MUX_R0);
 }
 
-static v3d_bool
-v3d_qpu_instr_unpack_alu(const struct v3d_device_info *devinfo,
-                         v3d_uint64 packed_instr,
-                         struct v3d_qpu_instr *instr)
+static void v3d_qpu_dst_usage(v3d_uint8 waddr, v3d_bool magicWrite,
+                              struct v3d_qpu_reg_usage* usage)
 {
-	instr->type = V3D_QPU_INSTR_TYPE_ALU;
-
-	if (!v3d_qpu_sig_unpack(devinfo,
-							QPU_GET_FIELD(packed_instr, V3D_QPU_SIG),
-							&instr->sig))
-		return FALSE;
-
-	v3d_uint32 packed_cond = QPU_GET_FIELD(packed_instr, V3D_QPU_COND);
-	if (v3d_qpu_sig_writes_address(devinfo, &instr->sig)) {
-		instr->sig_addr = packed_cond & ~V3D_QPU_COND_SIG_MAGIC_ADDR;
-		instr->sig_magic = packed_cond & V3D_QPU_COND_SIG_MAGIC_ADDR;
+	if (!magicWrite)
+		usage->rfWrites |= 1ull << waddr;
+	else if (waddr <= V3D_QPU_WADDR_R5)
+		usage->accWrites |= 1 << (waddr - V3D_QPU_WADDR_R0);
+}
 
-		instr->flags.ac = V3D_QPU_COND_NONE;
-		instr->flags.mc = V3D_QPU_COND_NONE;
-		instr->flags.apf = V3D_QPU_PF_NONE;
-		instr->flags.mpf = V3D_QPU_PF_NONE;
-		instr->flags.auf = V3D_QPU_UF_NONE;
-		instr->flags.muf = V3D_QPU_UF_NONE;
-	} else {
-		if (!v3d_qpu_flags_unpack(devinfo, packed_cond, &instr->flags))
-			return FALSE;
+static void v3d_qpu_get_reg_usage(const struct v3d_device_info* devinfo,
+                                  const struct v3d_qpu_instr* instr,
+                                  struct v3d_qpu_reg_usage* usageOut)
+{
+	struct v3d_qpu_reg_usage* usage = usageOut;
+	*usage = (struct v3d_qpu_reg_usage){0};
+	usage->readsFlags = v3d_qpu_reads_flags(instr);
+	if (instr->type == V3D_QPU_INSTR_TYPE_BRANCH)
+	{
+		if (instr->branch.bdi == V3D_QPU_BRANCH_DEST_REGFILE)
+			usage->rfReads |= 1ull << instr->branch.raddr_a;
+		return;
 	}
+	usage->writesFlags = v3d_qpu_writes_flags(instr);
+
+	int numAddSrc = v3d_qpu_add_op_num_src(instr->alu.add.op);
+	if (numAddSrc > 0)
+		v3d_qpu_input_usage(instr, &instr->alu.add.a, usage);
+	if (numAddSrc > 1)
+		v3d_qpu_input_usage(instr, &instr->alu.add.b, usage);
+	int numMulSrc = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
+	if (numMulSrc > 0)
+		v3d_qpu_input_usage(instr, &instr->alu.mul.a, usage);
+	if (numMulSrc > 1)
+		v3d_qpu_input_usage(instr, &instr->alu.mul.b, usage);
+
+	if (instr->alu.add.op != V3D_QPU_A_NOP && v3d_qpu_add_op_has_dst(instr->alu.add.op))
+		v3d_qpu_dst_usage(instr->alu.add.waddr, instr->alu.add.magic_write, usage);
+	if (instr->alu.mul.op != V3D_QPU_M_NOP && v3d_qpu_mul_op_has_dst(instr->alu.mul.op))
+		v3d_qpu_dst_usage(instr->alu.mul.waddr, instr->alu.mul.magic_write, usage);
+	if (v3d_qpu_sig_writes_address(devinfo, &instr->sig))
+		v3d_qpu_dst_usage(instr->sig_addr, instr->sig_magic, usage);
+
+	if (v3d_qpu_writes_r3(devinfo, instr))
+		usage->accWrites |= 1 << 3;
+	if (v3d_qpu_writes_r4(devinfo, instr))
+		usage->accWrites |= 1 << 4;
+	if (v3d_qpu_writes_r5(devinfo, instr))
+		usage->accWrites |= 1 << 5;
+}
 
-	if (devinfo->ver <= 71) {
-		/*
-		 * For v71 this will be set on add/mul unpack, as raddr are now
-		 * part of v3d_qpu_input
-		 */
-		instr->raddr_a = QPU_GET_FIELD(packed_instr, V3D_QPU_RADDR_A);
-		instr->raddr_b = QPU_GET_FIELD(packed_instr, V3D_QPU_RADDR_B);
+// Whether swapping the order of the two instructions could change what either computes
+static v3d_bool v3d_qpu_reg_usage_conflicts(const struct v3d_qpu_reg_usage* a,
+                                            const struct v3d_qpu_reg_usage* b)
+{
+	return (a->rfWrites & (b->rfReads | b->rfWrites)) || (a->rfReads & b->rfWrites) ||
+	       (a->accWrites & (b->accReads | b->accWrites)) || (a->accReads & b->accWrites) ||
+	       (a->writesFlags && (b->readsFlags || b->writesFlags)) ||
+	       (a->readsFlags && b->writesFlags);
+}
+
+// Ops which do more than compute their result, so their order with other instructions matters
+static v3d_bool v3d_qpu_add_op_has_side_effects(enum v3d_qpu_add_op op)
+{
+	switch (op)
+	{
+		case V3D_QPU_A_FLAPUSH:
+		case V3D_QPU_A_FLBPUSH:
+		case V3D_QPU_A_FLPOP:
+		case V3D_QPU_A_RECIP:
+		case V3D_QPU_A_RSQRT:
+		case V3D_QPU_A_EXP:
+		case V3D_QPU_A_LOG:
+		case V3D_QPU_A_SIN:
+		case V3D_QPU_A_RSQRT2:
+		case V3D_QPU_A_SETMSF:
+		case V3D_QPU_A_SETREVF:
+		case V3D_QPU_A_MSF:
+		case V3D_QPU_A_REVF:
+		case V3D_QPU_A_VDWWT:
+		case V3D_QPU_A_TMUWT:
+		case V3D_QPU_A_VPMSETUP:
+		case V3D_QPU_A_VPMWT:
+		case V3D_QPU_A_LDVPMV_IN:
+		case V3D_QPU_A_LDVPMV_OUT:
+		case V3D_QPU_A_LDVPMD_IN:
+		case V3D_QPU_A_LDVPMD_OUT:
+		case V3D_QPU_A_LDVPMP:
+		case V3D_QPU_A_LDVPMG_IN:
+		case V3D_QPU_A_LDVPMG_OUT:
+		case V3D_QPU_A_STVPMV:
+		case V3D_QPU_A_STVPMD:
+		case V3D_QPU_A_STVPMP:
+			return TRUE;
+		default:
+			return !v3d_qpu_add_op_has_dst(op);
 	}
+}
 
-	if (!v3d_qpu_add_unpack(devinfo, packed_instr, instr))
+// ALU instructions which only write registers, so they can be reordered with independent ones
+static v3d_bool v3d_qpu_instr_is_movable(const struct v3d_qpu_instr* instr)
+{
+	if (instr->type != V3D_QPU_INSTR_TYPE_ALU)
 		return FALSE;
 
-	if (!v3d_qpu_mul_unpack(devinfo, packed_instr, instr))
+	static const struct v3d_qpu_sig noSignals = {0};
+	struct v3d_qpu_sig sig = instr->sig;
+	sig.small_imm_b = FALSE;
+	if (v3d_memcmp(&sig, &noSignals, sizeof(noSignals)))
 		return FALSE;
 
+	if (instr->alu.add.op == V3D_QPU_A_NOP && instr->alu.mul.op == V3D_QPU_M_NOP)
+		return FALSE;
+	if (instr->alu.add.op != V3D_QPU_A_NOP &&
+	    (v3d_qpu_add_op_has_side_effects(instr->alu.add.op) ||
+	     (instr->alu.add.magic_write && instr->alu.add.waddr > V3D_QPU_WADDR_R5)))
+		return FALSE;
+	if (instr->alu.mul.op != V3D_QPU_M_NOP &&
+	    (!v3d_qpu_mul_op_has_dst(instr->alu.mul.op) ||
+	     (instr->alu.mul.magic_write && instr->alu.mul.waddr > V3D_QPU_WADDR_R5)))
+		return FALSE;
 	return TRUE;
 }
 
-static v3d_bool
-v3d_qpu_instr_unpack_branch(const struct v3d_device_info *devinfo,
-                            v3d_uint64 packed_instr,
-                            struct v3d_qpu_instr *instr)
+static int v3d_qpu_branch_target(int branchInstruction, v3d_uint32 offset)
 {
-	instr->type = V3D_QPU_INSTR_TYPE_BRANCH;
+	return branchInstruction + 4 + (int)offset / (int)sizeof(v3d_uint64);
+}
 
-	v3d_uint32 cond = QPU_GET_FIELD(packed_instr, V3D_QPU_BRANCH_COND);
-	if (cond == 0)
-		instr->branch.cond = V3D_QPU_BRANCH_COND_ALWAYS;
-	else if (V3D_QPU_BRANCH_COND_A0 + (cond - 2) <=
-			 V3D_QPU_BRANCH_COND_ALLNA)
-		instr->branch.cond = V3D_QPU_BRANCH_COND_A0 + (cond - 2);
-	else
-		return FALSE;
+// isBranchTargetOut has numInstructions + 1 entries, the last for branches to the end
+static void v3d_qpu_find_branch_targets(const struct v3d_qpu_instr* instructions,
+                                        int numInstructions, v3d_bool* isBranchTargetOut)
+{
+	for (int i = 0; i <= numInstructions; ++i)
+		isBranchTargetOut[i] = FALSE;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		if (instructions[i].type != V3D_QPU_INSTR_TYPE_BRANCH ||
+		    instructions[i].branch.bdi != V3D_QPU_BRANCH_DEST_REL)
+			continue;
+		int target = v3d_qpu_branch_target(i, instructions[i].branch.offset);
+		if (target >= 0 && target <= numInstructions)
+			isBranchTargetOut[target] = TRUE;
+	}
+}
 
-	v3d_uint32 msfign = QPU_GET_FIELD(packed_instr, V3D_QPU_BRANCH_MSFIGN);
-	if (msfign == 3)
-		return FALSE;
-	instr->branch.msfign = msfign;
+// Whether an instruction following the first numInstructions lands in the delay slots of a branch.
+// in_branch_delay_slots() can't tell, as qpu_validate_inst() stops looking at branches early.
+static v3d_bool v3d_qpu_next_in_branch_delay_slots(const struct v3d_qpu_instr* instructions,
+                                                   int numInstructions)
+{
+	for (int back = 1; back <= 3 && back <= numInstructions; ++back)
+	{
+		if (instructions[numInstructions - back].type == V3D_QPU_INSTR_TYPE_BRANCH)
+			return TRUE;
+	}
+	return FALSE;
+}
 
-	instr->branch.bdi = QPU_GET_FIELD(packed_instr, V3D_QPU_BRANCH_BDI);
+void v3d_qpu_remap_branches(struct v3d_qpu_instr* instructions, int numInstructions,
+                            const int* oldIndices, const int* newIndices, int numOldInstructions)
+{
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		struct v3d_qpu_instr* instr = &instructions[i];
+		if (oldIndices[i] < 0 || instr->type != V3D_QPU_INSTR_TYPE_BRANCH ||
+		    instr->branch.bdi != V3D_QPU_BRANCH_DEST_REL)
+			continue;
 
-	instr->branch.ub = packed_instr & V3D_QPU_BRANCH_UB;
-	if (instr->branch.ub) {
-		instr->branch.bdu = QPU_GET_FIELD(packed_instr,
-										  V3D_QPU_BRANCH_BDU);
+		int oldTarget = v3d_qpu_branch_target(oldIndices[i], instr->branch.offset);
+		int newTarget = oldTarget;
+		if (oldTarget > numOldInstructions)
+			newTarget = newIndices[numOldInstructions] + (oldTarget - numOldInstructions);
+		else if (oldTarget >= 0)
+			newTarget = newIndices[oldTarget];
+		instr->branch.offset = v3d_qpu_branch_offset(i, newTarget);
 	}
+}
 
-	instr->branch.raddr_a = QPU_GET_FIELD(packed_instr,
-										  V3D_QPU_RADDR_A);
-
-	instr->branch.offset = 0;
+// Every hazard the validator knows of clears within this many instructions
+#define V3D_QPU_MAX_HAZARD_PADDING 3
+// How far ahead to look for an instruction to fill a gap with
+#define V3D_QPU_HAZARD_FILLER_WINDOW 8
 
-	instr->branch.offset +=
-		QPU_GET_FIELD(packed_instr,
-					  V3D_QPU_BRANCH_ADDR_LOW) << 3;
+static v3d_bool v3d_qpu_hazard_fixable_by_delay(enum v3d_qpu_validate_error error)
+{
+	switch (error)
+	{
+		case V3D_QPU_VALIDATE_ERROR_LDUNIF_AFTER_A_LDVARY:
+		case V3D_QPU_VALIDATE_ERROR_LDUNIF_AND_LDUNIFA_CANT_BE_NEXT_TO_EACH_OTHER:
+		case V3D_QPU_VALIDATE_ERROR_SFU_WRITE_STARTED_DURING_THRSW_DELAY_SLOTS:
+		case V3D_QPU_VALIDATE_ERROR_LDVARY_DURING_THRSW_DELAY_SLOTS:
+		case V3D_QPU_VALIDATE_ERROR_LDVARY_IN_2ND_THRSW_DELAY_SLOT:
+		case V3D_QPU_VALIDATE_ERROR_R4_READ_TOO_SOON_AFTER_SFU:
+		case V3D_QPU_VALIDATE_ERROR_R4_WRITE_TOO_SOON_AFTER_SFU:
+		case V3D_QPU_VALIDATE_ERROR_SFU_WRITE_TOO_SOON_AFTER_SFU:
+		case V3D_QPU_VALIDATE_ERROR_THRSW_TOO_CLOSE_TO_ANOTHER_THRSW:
+		case V3D_QPU_VALIDATE_ERROR_BRANCH_IN_A_THRSW_DELAY_SLOT:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
 
-	instr->branch.offset +=
-		QPU_GET_FIELD(packed_instr,
-					  V3D_QPU_BRANCH_ADDR_HIGH) << 24;
+static v3d_bool v3d_qpu_fix_hazards_fail(struct v3d_qpu_fix_hazards_arguments* args,
+                                         const char* message, enum v3d_qpu_validate_error error,
+                                         int instructionIndex)
+{
+	args->errorMessage = message;
+	args->error = error;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
+static v3d_bool v3d_qpu_fix_hazards_emit(struct v3d_qpu_fix_hazards_arguments* args,
+                                         struct v3d_qpu_validate_state* state, int* oldIndices,
+                                         const struct v3d_qpu_instr* instr, int oldIndex)
+{
+	if (args->numInstructionsOut >= args->maxInstructions)
+		return FALSE;
+	args->instructionsOut[args->numInstructionsOut] = *instr;
+	oldIndices[args->numInstructionsOut] = oldIndex;
+	state->last = &args->instructionsOut[args->numInstructionsOut];
+	state->ip++;
+	++args->numInstructionsOut;
 	return TRUE;
 }
 
-v3d_bool
-v3d_qpu_instr_unpack(const struct v3d_device_info *devinfo,
-                     v3d_uint64 packed_instr,
-                     struct v3d_qpu_instr *instr)
+static void v3d_qpu_fix_hazards_record(struct v3d_qpu_fix_hazards_arguments* args,
+                                       const struct v3d_qpu_hazard_fix* fix)
 {
-	if (QPU_GET_FIELD(packed_instr, V3D_QPU_OP_MUL) != 0) {
-		return v3d_qpu_instr_unpack_alu(devinfo, packed_instr, instr);
-	} else {
-		v3d_uint32 sig = QPU_GET_FIELD(packed_instr, V3D_QPU_SIG);
-
-		if ((sig & 24) == 16) {
-			return v3d_qpu_instr_unpack_branch(devinfo, packed_instr,
-											   instr);
-		} else {
-			return FALSE;
-		}
-	}
+	if (args->fixesOut && args->numFixes < args->maxFixes)
+		args->fixesOut[args->numFixes] = *fix;
+	++args->numFixes;
 }
 
-static v3d_bool
-v3d_qpu_instr_pack_alu(const struct v3d_device_info *devinfo,
-                       const struct v3d_qpu_instr *instr,
-                       v3d_uint64 *packed_instr)
+// Padding in front of instruction inputIndex pushes whatever is left of the current THRSW delay
+// slots past the thread switch, where accumulators no longer hold the same values
+static v3d_bool v3d_qpu_thrsw_slots_can_grow(const struct v3d_qpu_fix_hazards_arguments* args,
+                                             const struct v3d_qpu_validate_state* state,
+                                             const v3d_bool* moved, int inputIndex)
 {
-	v3d_uint32 sig;
-	if (!v3d_qpu_sig_pack(devinfo, &instr->sig, &sig))
+	// The program ends at that thread switch
+	if (state->thrend_found)
 		return FALSE;
-	*packed_instr |= QPU_SET_FIELD(sig, V3D_QPU_SIG);
-
-	if (instr->type == V3D_QPU_INSTR_TYPE_ALU) {
-		if (devinfo->ver < 71) {
-			/*
-			 * For v71 this will be set on add/mul unpack, as raddr are now
-			 * part of v3d_qpu_input
-			 */
-			*packed_instr |= QPU_SET_FIELD(instr->raddr_a, V3D_QPU_RADDR_A);
-			*packed_instr |= QPU_SET_FIELD(instr->raddr_b, V3D_QPU_RADDR_B);
-		}
 
-		if (!v3d_qpu_add_pack(devinfo, instr, packed_instr))
-			return FALSE;
-		if (!v3d_qpu_mul_pack(devinfo, instr, packed_instr))
+	int numLeftInSlots = 3 - (state->ip - state->last_thrsw_ip);
+	for (int i = inputIndex; i < args->numInstructions && numLeftInSlots > 0; ++i)
+	{
+		if (moved[i])
+			continue;
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, &args->instructions[i], &usage);
+		if (usage.accReads)
 			return FALSE;
+		--numLeftInSlots;
+	}
+	return TRUE;
+}
 
-		v3d_uint32 flags;
-		if (v3d_qpu_sig_writes_address(devinfo, &instr->sig)) {
-			if (instr->flags.ac != V3D_QPU_COND_NONE ||
-				instr->flags.mc != V3D_QPU_COND_NONE ||
-				instr->flags.apf != V3D_QPU_PF_NONE ||
-				instr->flags.mpf != V3D_QPU_PF_NONE ||
-				instr->flags.auf != V3D_QPU_UF_NONE ||
-				instr->flags.muf != V3D_QPU_UF_NONE) {
-				return FALSE;
-			}
+// Finds a later instruction which can run in front of instruction inputIndex instead of a NOP.
+// gapEndInOut is the latest input instruction already moved in front of it.
+static int v3d_qpu_find_hazard_filler(const struct v3d_qpu_fix_hazards_arguments* args,
+                                      const struct v3d_qpu_validate_state* state,
+                                      const v3d_bool* isBranchTarget, const v3d_bool* moved,
+                                      int inputIndex, int* gapEndInOut,
+                                      struct v3d_qpu_validate_state* stateOut)
+{
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	if (args->devinfo.ver >= 71 || instructions[inputIndex].type == V3D_QPU_INSTR_TYPE_BRANCH ||
+	    instructions[inputIndex].sig.thrsw)
+		return -1;
+
+	for (int candidate = inputIndex + 1;
+	     candidate < args->numInstructions &&
+	     candidate <= inputIndex + V3D_QPU_HAZARD_FILLER_WINDOW;
+	     ++candidate)
+	{
+		const struct v3d_qpu_instr* instr = &instructions[candidate];
+		// Nothing moves across these
+		if (isBranchTarget[candidate] || instr->type == V3D_QPU_INSTR_TYPE_BRANCH ||
+		    instr->sig.thrsw)
+			return -1;
+		if (moved[candidate] || !v3d_qpu_instr_is_movable(instr))
+			continue;
 
-			flags = instr->sig_addr;
-			if (instr->sig_magic)
-				flags |= V3D_QPU_COND_SIG_MAGIC_ADDR;
-		} else {
-			if (!v3d_qpu_flags_pack(devinfo, &instr->flags, &flags))
-				return FALSE;
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, instr, &usage);
+		v3d_bool independent = TRUE;
+		int lastPassed = candidate - 1 > *gapEndInOut ? candidate - 1 : *gapEndInOut;
+		for (int other = inputIndex; other <= lastPassed && independent; ++other)
+		{
+			struct v3d_qpu_reg_usage otherUsage;
+			v3d_qpu_get_reg_usage(&args->devinfo, &instructions[other], &otherUsage);
+			if (other != candidate && v3d_qpu_reg_usage_conflicts(&usage, &otherUsage))
+				independent = FALSE;
 		}
+		// Writes from the last two instructions may still be in flight, e.g. ldvary's r5
+		for (int back = 1; back <= 2 && back <= args->numInstructionsOut && independent; ++back)
+		{
+			struct v3d_qpu_reg_usage otherUsage;
+			v3d_qpu_get_reg_usage(&args->devinfo,
+			                      &args->instructionsOut[args->numInstructionsOut - back],
+			                      &otherUsage);
+			if (v3d_qpu_reg_usage_conflicts(&usage, &otherUsage))
+				independent = FALSE;
+		}
+		if (!independent)
+			continue;
 
-		*packed_instr |= QPU_SET_FIELD(flags, V3D_QPU_COND);
-	} else {
-		if (v3d_qpu_sig_writes_address(devinfo, &instr->sig))
-			return FALSE;
-	}
-
-	return TRUE;
+		*stateOut = *state;
+		if (!qpu_validate_inst(stateOut, instr))
+			continue;
+		if (candidate > *gapEndInOut)
+			*gapEndInOut = candidate;
+		return candidate;
+	}
+	return -1;
 }
 
-static v3d_bool
-v3d_qpu_instr_pack_branch(const struct v3d_device_info *devinfo,
-                          const struct v3d_qpu_instr *instr,
-                          v3d_uint64 *packed_instr)
+v3d_bool v3d_qpu_fix_hazards(struct v3d_qpu_fix_hazards_arguments* args)
 {
-	*packed_instr |= QPU_SET_FIELD(16, V3D_QPU_SIG);
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->cyclesAdded = 0;
+	args->numInstructionsMoved = 0;
+	args->numFixes = 0;
+	args->errorMessage = NULL;
+	args->error = V3D_QPU_VALIDATE_ERROR_NONE;
+	args->errorInstructionIndex = 0;
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	v3d_bool* isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* moved = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, args->maxInstructions + 1);
+	if (!isBranchTarget || !moved || !newIndices || !oldIndices)
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_fix_hazards_fail(args, "Out of arena memory",
+		                                V3D_QPU_VALIDATE_ERROR_NONE, 0);
+	}
+
+	for (int i = 0; i <= numInstructions; ++i)
+		moved[i] = FALSE;
+	v3d_qpu_find_branch_targets(instructions, numInstructions, isBranchTarget);
+
+	struct v3d_qpu_instr nop = {0};
+	nop.type = V3D_QPU_INSTR_TYPE_ALU;
+	nop.alu.add.op = V3D_QPU_A_NOP;
+	nop.alu.mul.op = V3D_QPU_M_NOP;
+	nop.alu.add.waddr = V3D_QPU_WADDR_NOP;
+	nop.alu.add.magic_write = TRUE;
+	nop.alu.mul.waddr = V3D_QPU_WADDR_NOP;
+	nop.alu.mul.magic_write = TRUE;
+
+	struct v3d_qpu_validate_state state;
+	qpu_validate_begin(&state, &args->devinfo);
+	v3d_bool succeeded = TRUE;
+	for (int i = 0; i < numInstructions && succeeded; ++i)
+	{
+		if (moved[i])
+			continue;
+		newIndices[i] = args->numInstructionsOut;
 
-	if (instr->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS) {
-		*packed_instr |= QPU_SET_FIELD(2 + (instr->branch.cond -
-											V3D_QPU_BRANCH_COND_A0),
-									   V3D_QPU_BRANCH_COND);
-	}
+		struct v3d_qpu_hazard_fix fix = {0};
+		fix.instructionIndex = i;
+		int gapEnd = i;
+		for (;;)
+		{
+			struct v3d_qpu_validate_state trial = state;
+			if (qpu_validate_inst(&trial, &instructions[i]))
+			{
+				state = trial;
+				break;
+			}
 
-	*packed_instr |= QPU_SET_FIELD(instr->branch.msfign,
-								   V3D_QPU_BRANCH_MSFIGN);
+			const char* whyNot = NULL;
+			if (!v3d_qpu_hazard_fixable_by_delay(trial.error) ||
+			    fix.numNopsInserted + fix.numInstructionsMoved >= V3D_QPU_MAX_HAZARD_PADDING)
+				whyNot = trial.errorMessage;
+			else if (v3d_qpu_next_in_branch_delay_slots(args->instructionsOut,
+			                                            args->numInstructionsOut))
+				whyNot = "Fixing the hazard would change what runs in branch delay slots";
+			else if (in_thrsw_delay_slots(&state) &&
+			         !v3d_qpu_thrsw_slots_can_grow(args, &state, moved, i))
+				whyNot = "Fixing the hazard would move THRSW delay slot instructions which read "
+				         "accumulators past the thread switch";
+			if (whyNot)
+			{
+				succeeded = v3d_qpu_fix_hazards_fail(args, whyNot, trial.error, i);
+				break;
+			}
+			fix.error = trial.error;
 
-	*packed_instr |= QPU_SET_FIELD(instr->branch.bdi,
-								   V3D_QPU_BRANCH_BDI);
+			int filler = -1;
+			if (args->allowMoves && !in_thrsw_delay_slots(&state))
+				filler = v3d_qpu_find_hazard_filler(args, &state, isBranchTarget, moved, i,
+				                                    &gapEnd, &trial);
+			if (filler >= 0)
+			{
+				moved[filler] = TRUE;
+				newIndices[filler] = args->numInstructionsOut;
+				++fix.numInstructionsMoved;
+			}
+			else
+			{
+				trial = state;
+				if (!qpu_validate_inst(&trial, &nop))
+				{
+					succeeded = v3d_qpu_fix_hazards_fail(args, trial.errorMessage, trial.error, i);
+					break;
+				}
+				++fix.numNopsInserted;
+			}
+			state = trial;
+			if (!v3d_qpu_fix_hazards_emit(args, &state, oldIndices,
+			                              filler >= 0 ? &instructions[filler] : &nop, filler))
+			{
+				succeeded = v3d_qpu_fix_hazards_fail(
+				    args, "Too many instructions for the output buffer",
+				    V3D_QPU_VALIDATE_ERROR_NONE, i);
+				break;
+			}
+		}
+		if (!succeeded)
+			break;
 
-	if (instr->branch.ub) {
-		*packed_instr |= V3D_QPU_BRANCH_UB;
-		*packed_instr |= QPU_SET_FIELD(instr->branch.bdu,
-									   V3D_QPU_BRANCH_BDU);
+		if (!v3d_qpu_fix_hazards_emit(args, &state, oldIndices, &instructions[i], i))
+		{
+			succeeded = v3d_qpu_fix_hazards_fail(args, "Too many instructions for the output buffer",
+			                                      V3D_QPU_VALIDATE_ERROR_NONE, i);
+			break;
+		}
+		if (fix.error != V3D_QPU_VALIDATE_ERROR_NONE)
+		{
+			v3d_qpu_fix_hazards_record(args, &fix);
+			args->cyclesAdded += fix.numNopsInserted;
+			args->numInstructionsMoved += fix.numInstructionsMoved;
+		}
 	}
 
-	switch (instr->branch.bdi) {
-	case V3D_QPU_BRANCH_DEST_ABS:
-	case V3D_QPU_BRANCH_DEST_REL:
-		*packed_instr |= QPU_SET_FIELD(instr->branch.msfign,
-									   V3D_QPU_BRANCH_MSFIGN);
-
-		*packed_instr |= QPU_SET_FIELD((instr->branch.offset &
-										~0xff000000) >> 3,
-									   V3D_QPU_BRANCH_ADDR_LOW);
+	// The program-end THRSW delay slots
+	struct v3d_qpu_hazard_fix endFix = {0};
+	endFix.instructionIndex = numInstructions;
+	while (succeeded)
+	{
+		int numOut = args->numInstructionsOut;
+		struct v3d_qpu_validate_state trial = state;
+		if (qpu_validate_finish(&trial, numOut,
+		                        numOut >= 2 && args->instructionsOut[numOut - 2].sig.thrsw,
+		                        numOut >= 1 && args->instructionsOut[numOut - 1].sig.thrsw))
+			break;
+		if (trial.error != V3D_QPU_VALIDATE_ERROR_NO_PROGRAM_END_THRSW_DELAY_SLOTS ||
+		    endFix.numNopsInserted >= V3D_QPU_MAX_HAZARD_PADDING)
+		{
+			succeeded =
+			    v3d_qpu_fix_hazards_fail(args, trial.errorMessage, trial.error, numInstructions);
+			break;
+		}
+		endFix.error = trial.error;
 
-		*packed_instr |= QPU_SET_FIELD(instr->branch.offset >> 24,
-									   V3D_QPU_BRANCH_ADDR_HIGH);
-		break;
-	default:
-		break;
+		trial = state;
+		if (!qpu_validate_inst(&trial, &nop))
+		{
+			succeeded =
+			    v3d_qpu_fix_hazards_fail(args, trial.errorMessage, trial.error, numInstructions);
+			break;
+		}
+		state = trial;
+		if (!v3d_qpu_fix_hazards_emit(args, &state, oldIndices, &nop, -1))
+		{
+			succeeded = v3d_qpu_fix_hazards_fail(args, "Too many instructions for the output buffer",
+			                                      V3D_QPU_VALIDATE_ERROR_NONE, numInstructions);
+			break;
+		}
+		++endFix.numNopsInserted;
 	}
 
-	if (instr->branch.bdi == V3D_QPU_BRANCH_DEST_REGFILE ||
-		instr->branch.bdu == V3D_QPU_BRANCH_DEST_REGFILE) {
-		*packed_instr |= QPU_SET_FIELD(instr->branch.raddr_a,
-									   V3D_QPU_RADDR_A);
+	if (succeeded)
+	{
+		if (endFix.error != V3D_QPU_VALIDATE_ERROR_NONE)
+		{
+			v3d_qpu_fix_hazards_record(args, &endFix);
+			args->cyclesAdded += endFix.numNopsInserted;
+		}
+		newIndices[numInstructions] = args->numInstructionsOut;
+		v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, oldIndices,
+		                       newIndices, numInstructions);
 	}
-
-	return TRUE;
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
 }
 
-v3d_bool
-v3d_qpu_instr_pack(const struct v3d_device_info *devinfo,
-                   const struct v3d_qpu_instr *instr,
-                   v3d_uint64 *packed_instr)
-{
-	*packed_instr = 0;
+// Dual-issue pairing
 
-	switch (instr->type) {
-	case V3D_QPU_INSTR_TYPE_ALU:
-		return v3d_qpu_instr_pack_alu(devinfo, instr, packed_instr);
-	case V3D_QPU_INSTR_TYPE_BRANCH:
-		return v3d_qpu_instr_pack_branch(devinfo, instr, packed_instr);
-	default:
-		return FALSE;
-	}
-}
+// How far ahead to look for an instruction to pair with
+#define V3D_QPU_PAIR_WINDOW 8
 
-// >>> qpu_disasm.c
+static struct v3d_qpu_operand v3d_qpu_input_operand(const struct v3d_qpu_instr* instr,
+                                                    const struct v3d_qpu_input* input)
+{
+	struct v3d_qpu_operand operand;
+	if (input->mux == V3D_QPU_MUX_A)
+		operand = v3d_qpu_operand_rf(instr->raddr_a);
+	else if (input->mux == V3D_QPU_MUX_B)
+		operand = instr->sig.small_imm_b ? v3d_qpu_operand_small_imm(instr->raddr_b) :
+		                                   v3d_qpu_operand_rf(instr->raddr_b);
+	else
+		operand = v3d_qpu_operand_acc(input->mux - V3D_QPU_MUX_R0);
+	return v3d_qpu_operand_unpack(operand, input->unpack);
+}
 
-struct disasm_state {
-	const struct v3d_device_info *devinfo;
-	char *string;
-	size_t size;
-	size_t offset;
-};
+static struct v3d_qpu_operand v3d_qpu_waddr_operand(v3d_bool hasDst, v3d_uint8 waddr,
+                                                    v3d_bool magicWrite,
+                                                    enum v3d_qpu_output_pack pack)
+{
+	if (!hasDst)
+		return v3d_qpu_operand_none();
+	struct v3d_qpu_operand operand =
+	    magicWrite ? v3d_qpu_operand_magic(waddr) : v3d_qpu_operand_rf(waddr);
+	return v3d_qpu_operand_pack(operand, pack);
+}
 
-static void
-append(struct disasm_state *disasm, const char *fmt, ...)
+// Takes the add op of addInstr, the mul op of mulInstr and the signals of sigInstr
+static v3d_bool v3d_qpu_merge_alu(const struct v3d_device_info* devinfo,
+                                  const struct v3d_qpu_instr* addInstr,
+                                  const struct v3d_qpu_instr* mulInstr,
+                                  const struct v3d_qpu_instr* sigInstr,
+                                  struct v3d_qpu_instr* mergedOut)
 {
-	va_list args;
-	va_start(args, fmt);
-	size_t result =
-		v3d_vsnprintf(disasm->string + disasm->offset,
-					  disasm->size - disasm->offset,
-					  fmt, args);
-	va_end(args);
-	if (result >= disasm->size - disasm->offset)
-	{
-		disasm->offset = disasm->size;
-	}
-	else
-	{
-		disasm->offset += result;
-	}
+	struct v3d_qpu_emit_modifiers modifiers = {0};
+	modifiers.flags.ac = addInstr->flags.ac;
+	modifiers.flags.apf = addInstr->flags.apf;
+	modifiers.flags.auf = addInstr->flags.auf;
+	modifiers.flags.mc = mulInstr->flags.mc;
+	modifiers.flags.mpf = mulInstr->flags.mpf;
+	modifiers.flags.muf = mulInstr->flags.muf;
+	modifiers.sig = sigInstr->sig;
+	// Decided again by the build
+	modifiers.sig.small_imm_b = FALSE;
+	modifiers.sig_addr = sigInstr->sig_addr;
+	modifiers.sig_magic = sigInstr->sig_magic;
+
+	const struct v3d_qpu_alu_instr* add = &addInstr->alu;
+	const struct v3d_qpu_alu_instr* mul = &mulInstr->alu;
+	int numAddSrc = v3d_qpu_add_op_num_src(add->add.op);
+	int numMulSrc = v3d_qpu_mul_op_num_src(mul->mul.op);
+	struct v3d_qpu_operand none = v3d_qpu_operand_none();
+	const char* error = NULL;
+	v3d_uint64 packed = 0;
+	return v3d_qpu_build_alu(
+	           devinfo, add->add.op,
+	           v3d_qpu_waddr_operand(v3d_qpu_add_op_has_dst(add->add.op), add->add.waddr,
+	                                 add->add.magic_write, add->add.output_pack),
+	           numAddSrc > 0 ? v3d_qpu_input_operand(addInstr, &add->add.a) : none,
+	           numAddSrc > 1 ? v3d_qpu_input_operand(addInstr, &add->add.b) : none, mul->mul.op,
+	           v3d_qpu_waddr_operand(v3d_qpu_mul_op_has_dst(mul->mul.op), mul->mul.waddr,
+	                                 mul->mul.magic_write, mul->mul.output_pack),
+	           numMulSrc > 0 ? v3d_qpu_input_operand(mulInstr, &mul->mul.a) : none,
+	           numMulSrc > 1 ? v3d_qpu_input_operand(mulInstr, &mul->mul.b) : none, &modifiers,
+	           mergedOut, &error) &&
+	       v3d_qpu_instr_pack(devinfo, mergedOut, &packed);
 }
 
-static void
-pad_to(struct disasm_state *disasm, int n)
+// Whether the instruction only uses one of the ALUs
+static v3d_bool v3d_qpu_instr_is_half(const struct v3d_qpu_instr* instr, v3d_bool* isAddOut)
 {
-	/* FIXME: Do a single append somehow. */
-	while (disasm->offset < n && disasm->offset < disasm->size)
-		append(disasm, " ");
+	if (instr->type != V3D_QPU_INSTR_TYPE_ALU ||
+	    (instr->alu.add.op == V3D_QPU_A_NOP) == (instr->alu.mul.op == V3D_QPU_M_NOP))
+		return FALSE;
+	*isAddOut = instr->alu.add.op != V3D_QPU_A_NOP;
+	return TRUE;
 }
 
-static void
-v3d33_qpu_disasm_raddr(struct disasm_state *disasm,
-                       const struct v3d_qpu_instr *instr,
-                       enum v3d_qpu_mux mux)
+// Validates merged in place of instruction first, followed by the next few instructions which
+// are left, since removing the second half can bring hazards closer together
+static v3d_bool v3d_qpu_pair_stays_valid(const struct v3d_qpu_pair_arguments* args,
+                                         const struct v3d_qpu_validate_state* state,
+                                         const v3d_bool* consumed,
+                                         const struct v3d_qpu_instr* merged, int first,
+                                         int second)
 {
-	if (mux == V3D_QPU_MUX_A) {
-		append(disasm, "rf%d", instr->raddr_a);
-	} else if (mux == V3D_QPU_MUX_B) {
-		if (instr->sig.small_imm_b) {
-			v3d_uint32 val = 0;
-			v3d_bool ok =
-				v3d_qpu_small_imm_unpack(disasm->devinfo,
-										 instr->raddr_b,
-										 &val);
+	struct v3d_qpu_validate_state trial = *state;
+	if (!qpu_validate_inst(&trial, merged))
+		return FALSE;
+	trial.last = merged;
+	trial.ip++;
 
-			if ((int)val >= -16 && (int)val <= 15)
-				append(disasm, "%d", val);
-			else
-				append(disasm, "0x%08x", val);
-			v3d_assert(ok);
-		} else {
-			append(disasm, "rf%d", instr->raddr_b);
-		}
-	} else {
-		append(disasm, "r%d", mux);
+	int numChecked = 0;
+	for (int i = first + 1; i < args->numInstructions && numChecked < V3D_QPU_MAX_HAZARD_PADDING;
+	     ++i)
+	{
+		if (consumed[i] || i == second)
+			continue;
+		if (!qpu_validate_inst(&trial, &args->instructions[i]))
+			return FALSE;
+		trial.last = &args->instructions[i];
+		trial.ip++;
+		++numChecked;
 	}
+	return TRUE;
 }
 
-// Call when you already expect name to be a register file
-static v3d_bool v3d_assemble_parse_register_file(const char* name, v3d_uint8* registerFileOut,
-                                                 const char** endOfNameOut)
+// Finds an instruction to merge into instruction first, returning its index or -1
+static int v3d_qpu_find_pair(const struct v3d_qpu_pair_arguments* args,
+                             const struct v3d_qpu_validate_state* state,
+                             const v3d_bool* isBranchTarget, const v3d_bool* consumed, int first,
+                             struct v3d_qpu_instr* mergedOut)
 {
-	if (name[0] == 'r' && name[1] == 'f')
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	v3d_bool firstIsAdd = FALSE;
+	if (!v3d_qpu_instr_is_half(&instructions[first], &firstIsAdd) ||
+	    instructions[first].sig.thrsw ||
+	    v3d_qpu_next_in_branch_delay_slots(args->instructionsOut, args->numInstructionsOut) ||
+	    in_thrsw_delay_slots(state))
+		return -1;
+
+	struct v3d_qpu_reg_usage inFlight[2];
+	int numInFlight = 0;
+	for (int back = 1; back <= 2 && back <= args->numInstructionsOut; ++back)
+		v3d_qpu_get_reg_usage(&args->devinfo,
+		                      &args->instructionsOut[args->numInstructionsOut - back],
+		                      &inFlight[numInFlight++]);
+
+	for (int candidate = first + 1;
+	     candidate < args->numInstructions && candidate <= first + V3D_QPU_PAIR_WINDOW;
+	     ++candidate)
 	{
-		// Avoid needing atoi
-		if (name[2] > '9' || name[2] < '0')
-		{
-			return FALSE;
-		}
-		v3d_uint8 registerFileNumber = name[2] - '0';
-		v3d_bool hasSecondDigit = (name[3] <= '9' && name[3] >= '0');
-		if ((name[3] != 0 && name[3] != '.' && name[3] != ' ' && name[3] != '\t' &&
-		     name[3] != ',') &&
-		    !hasSecondDigit)
-		{
-			return FALSE;
-		}
-		if (hasSecondDigit)
+		const struct v3d_qpu_instr* instr = &instructions[candidate];
+		// Nothing moves across these
+		if (isBranchTarget[candidate] || instr->type == V3D_QPU_INSTR_TYPE_BRANCH ||
+		    instr->sig.thrsw)
+			return -1;
+
+		v3d_bool candidateIsAdd = FALSE;
+		if (consumed[candidate] || !v3d_qpu_instr_is_half(instr, &candidateIsAdd) ||
+		    candidateIsAdd == firstIsAdd || !v3d_qpu_instr_is_movable(instr))
+			continue;
+
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, instr, &usage);
+		v3d_bool independent = TRUE;
+		for (int other = first; other < candidate && independent; ++other)
 		{
-			registerFileNumber *= 10;
-			registerFileNumber += name[3] - '0';
+			if (consumed[other])
+				continue;
+			struct v3d_qpu_reg_usage otherUsage;
+			v3d_qpu_get_reg_usage(&args->devinfo, &instructions[other], &otherUsage);
+			if (v3d_qpu_reg_usage_conflicts(&usage, &otherUsage))
+				independent = FALSE;
 		}
-		if (registerFileNumber > 31)
+		for (int i = 0; i < numInFlight && independent; ++i)
 		{
-			return FALSE;
+			if (v3d_qpu_reg_usage_conflicts(&usage, &inFlight[i]))
+				independent = FALSE;
 		}
-		*registerFileOut = registerFileNumber;
-		*endOfNameOut = name + (hasSecondDigit ? 4 : 3);
-		return TRUE;
+		if (!independent)
+			continue;
+
+		const struct v3d_qpu_instr* addInstr = firstIsAdd ? &instructions[first] : instr;
+		const struct v3d_qpu_instr* mulInstr = firstIsAdd ? instr : &instructions[first];
+		if (!v3d_qpu_merge_alu(&args->devinfo, addInstr, mulInstr, &instructions[first],
+		                       mergedOut) ||
+		    !v3d_qpu_pair_stays_valid(args, state, consumed, mergedOut, first, candidate))
+			continue;
+		return candidate;
 	}
-	return FALSE;
+	return -1;
 }
 
-enum v3d_qpu_assemble_raddr_result
+static v3d_bool v3d_qpu_pair_fail(struct v3d_qpu_pair_arguments* args, const char* message,
+                                  int instructionIndex)
 {
-	v3d_qpu_assemble_raddr_result_success,
-	v3d_qpu_assemble_raddr_result_invalid_register_file,
-	v3d_qpu_assemble_raddr_result_invalid_accumulator_register,
-	v3d_qpu_assemble_raddr_result_invalid_small_immediate,
-	v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates,
-	v3d_qpu_assemble_raddr_result_no_raddr_space,
-};
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
-// See vir_to_qpu.c set_src() and v3d_generate_code_block()
-static enum v3d_qpu_assemble_raddr_result v3d33_qpu_assemble_raddr(struct v3d_qpu_instr* instr,
-                                                                   enum v3d_qpu_mux* mux,
-                                                                   const char* name,
-                                                                   const char** endOfNameOut)
+v3d_bool v3d_qpu_pair_instructions(struct v3d_qpu_pair_arguments* args)
 {
-	// First, figure out what the desired operand is
-	v3d_uint8 desiredOperand = 0;
-	if (name[0] == 'r' && name[1] == 'f')
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->numPairs = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_pair_fail(args, "V3D 7.x pairing not implemented", 0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	v3d_bool* isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* consumed = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	if (!isBranchTarget || !consumed || !newIndices || !oldIndices)
 	{
-		// Register file
-		if (!v3d_assemble_parse_register_file(name, &desiredOperand, endOfNameOut))
-			return v3d_qpu_assemble_raddr_result_invalid_register_file;
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_pair_fail(args, "Out of arena memory", 0);
+	}
+	for (int i = 0; i <= numInstructions; ++i)
+		consumed[i] = FALSE;
+	v3d_qpu_find_branch_targets(instructions, numInstructions, isBranchTarget);
+
+	struct v3d_qpu_validate_state state;
+	qpu_validate_begin(&state, &args->devinfo);
+	v3d_bool succeeded = TRUE;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		if (consumed[i])
+			continue;
 
-		if (instr->alu.add.a.mux == V3D_QPU_MUX_A || instr->alu.add.b.mux == V3D_QPU_MUX_A ||
-		    instr->alu.mul.a.mux == V3D_QPU_MUX_A || instr->alu.mul.b.mux == V3D_QPU_MUX_A)
+		struct v3d_qpu_instr merged;
+		int second = v3d_qpu_find_pair(args, &state, isBranchTarget, consumed, i, &merged);
+		const struct v3d_qpu_instr* instr = second >= 0 ? &merged : &instructions[i];
+		if (!qpu_validate_inst(&state, instr))
 		{
-			// Already set? If so re-use it
-			if (instr->raddr_a == desiredOperand)
-			{
-				*mux = V3D_QPU_MUX_A;
-				return v3d_qpu_assemble_raddr_result_success;
-			}
-			else
-			{
-				if ((instr->alu.add.a.mux == V3D_QPU_MUX_B ||
-				     instr->alu.add.b.mux == V3D_QPU_MUX_B ||
-				     instr->alu.mul.a.mux == V3D_QPU_MUX_B ||
-				     instr->alu.mul.b.mux == V3D_QPU_MUX_B) &&
-				    instr->raddr_b != desiredOperand)
-					return v3d_qpu_assemble_raddr_result_no_raddr_space;
-
-				*mux = V3D_QPU_MUX_B;
-				instr->raddr_b = desiredOperand;
-				return v3d_qpu_assemble_raddr_result_success;
-			}
+			succeeded = v3d_qpu_pair_fail(args, state.errorMessage, i);
+			break;
 		}
-		else
+
+		int outIndex = args->numInstructionsOut++;
+		args->instructionsOut[outIndex] = *instr;
+		oldIndices[outIndex] = i;
+		newIndices[i] = outIndex;
+		state.last = &args->instructionsOut[outIndex];
+		state.ip++;
+		if (second >= 0)
 		{
-			*mux = V3D_QPU_MUX_A;
-			instr->raddr_a = desiredOperand;
-			return v3d_qpu_assemble_raddr_result_success;
+			consumed[second] = TRUE;
+			newIndices[second] = outIndex;
+			++args->numPairs;
 		}
 	}
-	else if (name[0] == 'r')
+
+	// Programs under three instructions never validate, so pairing may not take them there
+	if (succeeded && args->numPairs && args->numInstructionsOut < 3)
 	{
-		// Accumulator register
-		if (name[1] < '0' || name[1] > '5' ||
-		    !(name[2] == '\n' || name[2] == '.' || name[2] == ' ' || name[2] == '\t' ||
-		      name[2] == ',' || name[2] == 0))
-			return v3d_qpu_assemble_raddr_result_invalid_accumulator_register;
-		desiredOperand = name[1] - '0';
-		*mux = desiredOperand + V3D_QPU_MUX_R0;  // Unnecessary, but illustrative
-		*endOfNameOut = name + 2;
-		return v3d_qpu_assemble_raddr_result_success;
+		for (int i = 0; i < numInstructions; ++i)
+		{
+			args->instructionsOut[i] = instructions[i];
+			oldIndices[i] = i;
+			newIndices[i] = i;
+		}
+		args->numInstructionsOut = numInstructions;
+		args->numPairs = 0;
 	}
-	else
+
+	if (succeeded)
 	{
-		// Small immediate
-		v3d_uint32 packed_small_immediate = 0;
-		if (!v3d_qpu_small_imm_from_name(name, &packed_small_immediate, endOfNameOut))
-			return v3d_qpu_assemble_raddr_result_invalid_small_immediate;
-
-		desiredOperand = (v3d_uint8)packed_small_immediate;
-		// Small immediate must occuby raddr_b
-		if (instr->alu.add.a.mux == V3D_QPU_MUX_B || instr->alu.add.b.mux == V3D_QPU_MUX_B ||
-		    instr->alu.mul.a.mux == V3D_QPU_MUX_B || instr->alu.mul.b.mux == V3D_QPU_MUX_B)
-			return v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates;
-
-		*mux = V3D_QPU_MUX_B;
-		instr->raddr_b = desiredOperand;
-		instr->sig.small_imm_b = 1;
-		return v3d_qpu_assemble_raddr_result_success;
+		newIndices[numInstructions] = args->numInstructionsOut;
+		v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, oldIndices,
+		                       newIndices, numInstructions);
+
+		struct v3d_qpu_validate_result result = {0};
+		if (!v3d_qpu_validate(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+		                      &result))
+		{
+			int errorIndex = result.errorInstructionIndex;
+			succeeded = v3d_qpu_pair_fail(
+			    args, result.errorMessage,
+			    errorIndex >= 0 && errorIndex < args->numInstructionsOut ? oldIndices[errorIndex] :
+			                                                              numInstructions);
+		}
+	}
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
+}
+
+// List scheduling
+
+// Most instructions in one DAG, so predecessors fit a bit mask. Longer runs are split.
+#define V3D_QPU_SCHEDULE_MAX_NODES 64
+// Cycles until an SFU or ldvary result can be used
+#define V3D_QPU_SFU_LATENCY 2
+#define V3D_QPU_LDVARY_LATENCY 2
+// ldtmu stalls until its data arrives rather than reading too soon, so this only pulls TMU
+// accesses earlier and pushes ldtmu later
+#define V3D_QPU_TMU_LATENCY 8
+
+struct v3d_qpu_schedule_node
+{
+	const struct v3d_qpu_instr* instr;
+	int inputIndex;
+	struct v3d_qpu_reg_usage usage;
+	// Bit mask of the nodes which must issue first
+	v3d_uint64 preds;
+	// Longest latency path from here to the end of the run
+	int priority;
+	int outIndex;
+};
+
+// Everything which carries over from one run to the next
+struct v3d_qpu_schedule_state
+{
+	struct v3d_qpu_validate_state validate;
+	int numInstructionsOut;
+	// What the last ldvary writes, which isn't there until V3D_QPU_LDVARY_LATENCY later
+	struct v3d_qpu_reg_usage ldvaryWrites;
+	int lastLdvaryOut;
+};
+
+struct v3d_qpu_schedule_context
+{
+	struct v3d_qpu_schedule_arguments* args;
+	int* oldIndices;
+	struct v3d_qpu_instr nop;
+};
+
+static v3d_bool v3d_qpu_schedule_fail(struct v3d_qpu_schedule_arguments* args,
+                                      const char* message, int instructionIndex)
+{
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
+
+// NOPs which only spend a cycle, which the scheduler can drop and insert as needed
+static v3d_bool v3d_qpu_instr_is_plain_nop(const struct v3d_qpu_instr* instr)
+{
+	static const struct v3d_qpu_sig noSignals = {0};
+	return instr->type == V3D_QPU_INSTR_TYPE_ALU && instr->alu.add.op == V3D_QPU_A_NOP &&
+	       instr->alu.mul.op == V3D_QPU_M_NOP &&
+	       !v3d_memcmp(&instr->sig, &noSignals, sizeof(noSignals)) &&
+	       !v3d_qpu_writes_flags(instr);
+}
+
+// End of the branch or THRSW at first and its delay slots, including any branch or THRSW in them
+static int v3d_qpu_delay_slots_end(const struct v3d_qpu_instr* instructions,
+                                   int numInstructions, int first)
+{
+	int end = first + 1;
+	for (int i = first; i < end && i < numInstructions; ++i)
+	{
+		if (instructions[i].type == V3D_QPU_INSTR_TYPE_BRANCH && end < i + 4)
+			end = i + 4;
+		else if (instructions[i].sig.thrsw && end < i + 3)
+			end = i + 3;
 	}
+	return end < numInstructions ? end : numInstructions;
 }
 
-enum v3d_qpu_input_class {
-	V3D_QPU_ADD_A,
-	V3D_QPU_ADD_B,
-	V3D_QPU_MUL_A,
-	V3D_QPU_MUL_B
-};
+static int v3d_qpu_schedule_latency(const struct v3d_device_info* devinfo,
+                                    const struct v3d_qpu_schedule_node* before,
+                                    const struct v3d_qpu_schedule_node* after)
+{
+	if (v3d_qpu_uses_sfu(before->instr) && (after->usage.accReads & (1 << 4)))
+		return V3D_QPU_SFU_LATENCY;
+	if (before->instr->sig.ldvary)
+		return V3D_QPU_LDVARY_LATENCY;
+	if (v3d_qpu_writes_tmu(devinfo, before->instr) && after->instr->sig.ldtmu)
+		return V3D_QPU_TMU_LATENCY;
+	return 1;
+}
 
-static void
-v3d71_qpu_disasm_raddr(struct disasm_state *disasm,
-                       const struct v3d_qpu_instr *instr,
-                       v3d_uint8 raddr,
-                       enum v3d_qpu_input_class input_class)
+// Cycle at which all results the node depends on are there, given where its predecessors went
+static int v3d_qpu_schedule_ready_cycle(const struct v3d_device_info* devinfo,
+                                        const struct v3d_qpu_schedule_node* nodes, int node,
+                                        v3d_bool inputOrder)
 {
-	v3d_bool is_small_imm = FALSE;
-	switch(input_class) {
-	case V3D_QPU_ADD_A:
-		is_small_imm = instr->sig.small_imm_a;
-		break;
-	case V3D_QPU_ADD_B:
-		is_small_imm = instr->sig.small_imm_b;
-		break;
-	case V3D_QPU_MUL_A:
-		is_small_imm = instr->sig.small_imm_c;
-		break;
-	case V3D_QPU_MUL_B:
-		is_small_imm = instr->sig.small_imm_d;
-		break;
+	int ready = 0;
+	for (int pred = 0; pred < node; ++pred)
+	{
+		if (!((nodes[node].preds >> pred) & 1))
+			continue;
+		int issued = inputOrder ? nodes[pred].inputIndex : nodes[pred].outIndex;
+		int latency = v3d_qpu_schedule_latency(devinfo, &nodes[pred], &nodes[node]);
+		if (ready < issued + latency)
+			ready = issued + latency;
 	}
+	return ready;
+}
 
-	if (is_small_imm) {
-		v3d_uint32 val = 0;
-		v3d_bool ok =
-			v3d_qpu_small_imm_unpack(disasm->devinfo,
-									 raddr,
-									 &val);
+// Whether instr can be next, i.e. it validates and doesn't touch what an ldvary is still writing
+static v3d_bool v3d_qpu_schedule_can_issue(const struct v3d_qpu_schedule_state* state,
+                                           const struct v3d_qpu_instr* instr,
+                                           const struct v3d_qpu_reg_usage* usage,
+                                           struct v3d_qpu_validate_state* validateOut)
+{
+	if (state->numInstructionsOut - state->lastLdvaryOut < V3D_QPU_LDVARY_LATENCY &&
+	    v3d_qpu_reg_usage_conflicts(&state->ldvaryWrites, usage))
+		return FALSE;
+	*validateOut = state->validate;
+	return qpu_validate_inst(validateOut, instr);
+}
 
-		if ((int)val >= -16 && (int)val <= 15)
-			append(disasm, "%d", val);
-		else
-			append(disasm, "0x%08x", val);
-		v3d_assert(ok);
-	} else {
-		append(disasm, "rf%d", raddr);
+// Appends an instruction which was already validated into validate
+static v3d_bool v3d_qpu_schedule_emit(struct v3d_qpu_schedule_context* context,
+                                      struct v3d_qpu_schedule_state* state,
+                                      const struct v3d_qpu_validate_state* validate,
+                                      const struct v3d_qpu_instr* instr, int inputIndex)
+{
+	struct v3d_qpu_schedule_arguments* args = context->args;
+	if (state->numInstructionsOut >= args->maxInstructions)
+		return v3d_qpu_schedule_fail(args, "Too many instructions for the output", inputIndex);
+
+	int outIndex = state->numInstructionsOut++;
+	args->instructionsOut[outIndex] = *instr;
+	context->oldIndices[outIndex] = inputIndex;
+	state->validate = *validate;
+	state->validate.last = &args->instructionsOut[outIndex];
+	state->validate.ip++;
+	if (instr->sig.ldvary)
+	{
+		v3d_qpu_get_reg_usage(&args->devinfo, instr, &state->ldvaryWrites);
+		state->ldvaryWrites.rfReads = 0;
+		state->ldvaryWrites.accReads = 0;
+		state->ldvaryWrites.readsFlags = FALSE;
+		state->ldvaryWrites.writesFlags = FALSE;
+		state->lastLdvaryOut = outIndex;
 	}
+	return TRUE;
 }
 
-static void
-v3d_qpu_disasm_raddr(struct disasm_state *disasm,
-                     const struct v3d_qpu_instr *instr,
-                     const struct v3d_qpu_input *input,
-                     enum v3d_qpu_input_class input_class)
+static v3d_bool v3d_qpu_schedule_emit_nop(struct v3d_qpu_schedule_context* context,
+                                          struct v3d_qpu_schedule_state* state, int inputIndex)
 {
-	if (disasm->devinfo->ver < 71)
-		v3d33_qpu_disasm_raddr(disasm, instr, input->mux);
-	else
-		v3d71_qpu_disasm_raddr(disasm, instr, input->raddr, input_class);
+	struct v3d_qpu_validate_state validate = state->validate;
+	if (!qpu_validate_inst(&validate, &context->nop))
+		return v3d_qpu_schedule_fail(context->args, validate.errorMessage, inputIndex);
+	return v3d_qpu_schedule_emit(context, state, &validate, &context->nop, -1);
 }
 
-static void
-v3d_qpu_disasm_waddr(struct disasm_state *disasm, v3d_uint32 waddr, v3d_bool magic)
+// Copies a branch or THRSW with its delay slots, padding in front of them until they validate
+static v3d_bool v3d_qpu_schedule_fixed(struct v3d_qpu_schedule_context* context,
+                                       struct v3d_qpu_schedule_state* state, int first, int end)
 {
-	if (!magic) {
-		append(disasm, "rf%d", waddr);
-		return;
+	struct v3d_qpu_schedule_arguments* args = context->args;
+	for (int numNops = 0;; ++numNops)
+	{
+		struct v3d_qpu_schedule_state trial = *state;
+		const char* errorMessage = NULL;
+		int errorIndex = first;
+		for (int i = first; i < end && !errorMessage; ++i)
+		{
+			const struct v3d_qpu_instr* instr = &args->instructions[i];
+			struct v3d_qpu_reg_usage usage;
+			v3d_qpu_get_reg_usage(&args->devinfo, instr, &usage);
+			struct v3d_qpu_validate_state validate;
+			if (!v3d_qpu_schedule_can_issue(&trial, instr, &usage, &validate))
+			{
+				errorMessage = validate.errorMessage ? validate.errorMessage :
+				                                       "Read of ldvary result too soon";
+				errorIndex = i;
+			}
+			else if (!v3d_qpu_schedule_emit(context, &trial, &validate, instr, i))
+				return FALSE;
+		}
+		if (!errorMessage)
+		{
+			*state = trial;
+			return TRUE;
+		}
+		if (numNops == V3D_QPU_MAX_HAZARD_PADDING)
+			return v3d_qpu_schedule_fail(args, errorMessage, errorIndex);
+		if (!v3d_qpu_schedule_emit_nop(context, state, first))
+			return FALSE;
 	}
+}
 
-	const char *name = v3d_qpu_magic_waddr_name(disasm->devinfo, waddr);
-	if (name)
-		append(disasm, "%s", name);
-	else
-		append(disasm, "waddr UNKNOWN %d", waddr);
+// Whether node should issue rather than best: nodes whose results are ready come first, then
+// those on the longest path, or if nothing is ready, those which are closest to it
+static v3d_bool v3d_qpu_schedule_prefer(const struct v3d_qpu_schedule_node* nodes, int cycle,
+                                        int node, int ready, int best, int bestReady)
+{
+	if ((ready <= cycle) != (bestReady <= cycle))
+		return ready <= cycle;
+	if (ready > cycle && ready != bestReady)
+		return ready < bestReady;
+	return nodes[node].priority > nodes[best].priority;
 }
 
-static void
-v3d_qpu_disasm_add(struct disasm_state *disasm,
-                   const struct v3d_qpu_instr *instr)
+// Issues the nodes of a run in DAG order, or in their input order, padding with NOPs where
+// nothing can issue yet
+static v3d_bool v3d_qpu_schedule_run(struct v3d_qpu_schedule_context* context,
+                                     struct v3d_qpu_schedule_state* state,
+                                     struct v3d_qpu_schedule_node* nodes, int numNodes,
+                                     v3d_bool keepOrder, int* numNopsOut, int* stallsOut)
 {
-	v3d_bool has_dst = v3d_qpu_add_op_has_dst(instr->alu.add.op);
-	int num_src = v3d_qpu_add_op_num_src(instr->alu.add.op);
+	const struct v3d_device_info* devinfo = &context->args->devinfo;
+	v3d_uint64 issued = 0;
+	int numNopsInARow = 0;
+	*numNopsOut = 0;
+	*stallsOut = 0;
+	for (int numIssued = 0; numIssued < numNodes;)
+	{
+		int cycle = state->numInstructionsOut;
+		int best = -1;
+		int bestReady = 0;
+		struct v3d_qpu_validate_state bestValidate;
+		const char* errorMessage = NULL;
+		int errorIndex = 0;
+		for (int node = 0; node < numNodes; ++node)
+		{
+			if (((issued >> node) & 1) || (nodes[node].preds & ~issued))
+				continue;
 
-	append(disasm, "%s", v3d_qpu_add_op_name(instr->alu.add.op));
-	if (!v3d_qpu_sig_writes_address(disasm->devinfo, &instr->sig))
-		append(disasm, "%s", v3d_qpu_cond_name(instr->flags.ac));
-	append(disasm, "%s", v3d_qpu_pf_name(instr->flags.apf));
-	append(disasm, "%s", v3d_qpu_uf_name(instr->flags.auf));
+			struct v3d_qpu_validate_state validate;
+			int ready = v3d_qpu_schedule_ready_cycle(devinfo, nodes, node, FALSE);
+			if (!v3d_qpu_schedule_can_issue(state, nodes[node].instr, &nodes[node].usage,
+			                                &validate))
+			{
+				if (!errorMessage)
+				{
+					errorMessage = validate.errorMessage ? validate.errorMessage :
+					                                       "Read of ldvary result too soon";
+					errorIndex = nodes[node].inputIndex;
+				}
+			}
+			else if (best < 0 ||
+			         v3d_qpu_schedule_prefer(nodes, cycle, node, ready, best, bestReady))
+			{
+				best = node;
+				bestReady = ready;
+				bestValidate = validate;
+			}
+			// Input order only ever has the next node to choose from
+			if (keepOrder)
+				break;
+		}
 
-	append(disasm, " ");
+		if (best < 0)
+		{
+			if (numNopsInARow == V3D_QPU_MAX_HAZARD_PADDING)
+				return v3d_qpu_schedule_fail(context->args, errorMessage, errorIndex);
+			if (!v3d_qpu_schedule_emit_nop(context, state, errorIndex))
+				return FALSE;
+			++numNopsInARow;
+			++*numNopsOut;
+			continue;
+		}
 
-	if (has_dst) {
-		v3d_qpu_disasm_waddr(disasm, instr->alu.add.waddr,
-							 instr->alu.add.magic_write);
-		append(disasm, v3d_qpu_pack_name(instr->alu.add.output_pack));
+		if (!v3d_qpu_schedule_emit(context, state, &bestValidate, nodes[best].instr,
+		                           nodes[best].inputIndex))
+			return FALSE;
+		if (bestReady > cycle)
+			*stallsOut += bestReady - cycle;
+		nodes[best].outIndex = cycle;
+		issued |= 1ull << best;
+		++numIssued;
+		numNopsInARow = 0;
 	}
+	return TRUE;
+}
 
-	if (num_src >= 1) {
-		if (has_dst)
-			append(disasm, ", ");
-		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.add.a, V3D_QPU_ADD_A);
-		append(disasm, "%s",
-			   v3d_qpu_unpack_name(instr->alu.add.a.unpack));
+// Builds the DAG of the nodes of a run and schedules it. Falls back to the input order if that
+// needs fewer NOPs, e.g. when the previous run ends differently than before.
+static v3d_bool v3d_qpu_schedule_dag(struct v3d_qpu_schedule_context* context,
+                                     struct v3d_qpu_schedule_state* state,
+                                     struct v3d_qpu_schedule_node* nodes, int numNodes)
+{
+	struct v3d_qpu_schedule_arguments* args = context->args;
+	const struct v3d_device_info* devinfo = &args->devinfo;
+	v3d_uint64 ordered = 0;
+	for (int node = 0; node < numNodes; ++node)
+	{
+		nodes[node].preds = 0;
+		for (int pred = 0; pred < node; ++pred)
+		{
+			if (v3d_qpu_reg_usage_conflicts(&nodes[pred].usage, &nodes[node].usage))
+				nodes[node].preds |= 1ull << pred;
+		}
+		if (!v3d_qpu_instr_is_movable(nodes[node].instr))
+		{
+			nodes[node].preds |= ordered;
+			ordered |= 1ull << node;
+		}
+	}
+	for (int node = numNodes - 1; node >= 0; --node)
+	{
+		nodes[node].priority = 1;
+		for (int succ = node + 1; succ < numNodes; ++succ)
+		{
+			if (!((nodes[succ].preds >> node) & 1))
+				continue;
+			int priority = nodes[succ].priority +
+			               v3d_qpu_schedule_latency(devinfo, &nodes[node], &nodes[succ]);
+			if (nodes[node].priority < priority)
+				nodes[node].priority = priority;
+		}
+	}
+	for (int node = 0; node < numNodes; ++node)
+	{
+		int ready = v3d_qpu_schedule_ready_cycle(devinfo, nodes, node, TRUE);
+		if (ready > nodes[node].inputIndex)
+			args->estimatedStallsBefore += ready - nodes[node].inputIndex;
 	}
 
-	if (num_src >= 2) {
-		append(disasm, ", ");
-		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.add.b, V3D_QPU_ADD_B);
-		append(disasm, "%s",
-			   v3d_qpu_unpack_name(instr->alu.add.b.unpack));
+	struct v3d_qpu_schedule_state start = *state;
+	int numNops, stalls;
+	if (!v3d_qpu_schedule_run(context, state, nodes, numNodes, FALSE, &numNops, &stalls))
+		return FALSE;
+	if (numNops > 0)
+	{
+		int scheduledNumNops = numNops;
+		*state = start;
+		if (!v3d_qpu_schedule_run(context, state, nodes, numNodes, TRUE, &numNops, &stalls) ||
+		    numNops >= scheduledNumNops)
+		{
+			*state = start;
+			args->errorMessage = NULL;
+			if (!v3d_qpu_schedule_run(context, state, nodes, numNodes, FALSE, &numNops,
+			                          &stalls))
+				return FALSE;
+		}
 	}
+	args->estimatedStallsAfter += stalls;
+	return TRUE;
 }
 
-static void
-v3d_qpu_disasm_mul(struct disasm_state *disasm,
-                   const struct v3d_qpu_instr *instr)
+v3d_bool v3d_qpu_schedule(struct v3d_qpu_schedule_arguments* args)
 {
-	v3d_bool has_dst = v3d_qpu_mul_op_has_dst(instr->alu.mul.op);
-	int num_src = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
-
-	pad_to(disasm, 30);
-	append(disasm, "; ");
-
-	append(disasm, "%s", v3d_qpu_mul_op_name(instr->alu.mul.op));
-	if (!v3d_qpu_sig_writes_address(disasm->devinfo, &instr->sig))
-		append(disasm, "%s", v3d_qpu_cond_name(instr->flags.mc));
-	append(disasm, "%s", v3d_qpu_pf_name(instr->flags.mpf));
-	append(disasm, "%s", v3d_qpu_uf_name(instr->flags.muf));
-
-	if (instr->alu.mul.op == V3D_QPU_M_NOP)
-		return;
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->estimatedStallsBefore = 0;
+	args->estimatedStallsAfter = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_schedule_fail(args, "V3D 7.x scheduling not implemented", 0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	v3d_bool* isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, args->maxInstructions + 1);
+	struct v3d_qpu_schedule_node* nodes = V3D_ARENA_ALLOC_ARRAY(
+	    args->arena, struct v3d_qpu_schedule_node, V3D_QPU_SCHEDULE_MAX_NODES);
+	if (!isBranchTarget || !newIndices || !oldIndices || !nodes)
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_schedule_fail(args, "Out of arena memory", 0);
+	}
+	v3d_qpu_find_branch_targets(instructions, numInstructions, isBranchTarget);
+
+	struct v3d_qpu_schedule_context context = {0};
+	context.args = args;
+	context.oldIndices = oldIndices;
+	context.nop.type = V3D_QPU_INSTR_TYPE_ALU;
+	context.nop.alu.add.op = V3D_QPU_A_NOP;
+	context.nop.alu.mul.op = V3D_QPU_M_NOP;
+	context.nop.alu.add.waddr = V3D_QPU_WADDR_NOP;
+	context.nop.alu.add.magic_write = TRUE;
+	context.nop.alu.mul.waddr = V3D_QPU_WADDR_NOP;
+	context.nop.alu.mul.magic_write = TRUE;
+
+	struct v3d_qpu_schedule_state state = {0};
+	qpu_validate_begin(&state.validate, &args->devinfo);
+	state.lastLdvaryOut = -V3D_QPU_LDVARY_LATENCY;
+	v3d_bool succeeded = TRUE;
+	for (int i = 0; i < numInstructions && succeeded;)
+	{
+		int outStart = state.numInstructionsOut;
+		if (instructions[i].type == V3D_QPU_INSTR_TYPE_BRANCH || instructions[i].sig.thrsw)
+		{
+			int end = v3d_qpu_delay_slots_end(instructions, numInstructions, i);
+			succeeded = v3d_qpu_schedule_fixed(&context, &state, i, end);
+			for (int j = i; j < end && succeeded; ++j)
+				newIndices[j] = state.numInstructionsOut - (end - j);
+			newIndices[i] = outStart;
+			i = end;
+			continue;
+		}
 
-	append(disasm, " ");
+		int numNodes = 0;
+		int end = i;
+		for (; end < numInstructions && numNodes < V3D_QPU_SCHEDULE_MAX_NODES; ++end)
+		{
+			const struct v3d_qpu_instr* instr = &instructions[end];
+			if (instr->type == V3D_QPU_INSTR_TYPE_BRANCH || instr->sig.thrsw ||
+			    (end > i && isBranchTarget[end]))
+				break;
+			newIndices[end] = outStart;
+			if (v3d_qpu_instr_is_plain_nop(instr))
+				continue;
+			struct v3d_qpu_schedule_node* node = &nodes[numNodes++];
+			node->instr = instr;
+			node->inputIndex = end;
+			v3d_qpu_get_reg_usage(&args->devinfo, instr, &node->usage);
+		}
 
-	if (has_dst) {
-		v3d_qpu_disasm_waddr(disasm, instr->alu.mul.waddr,
-							 instr->alu.mul.magic_write);
-		append(disasm, v3d_qpu_pack_name(instr->alu.mul.output_pack));
+		succeeded = v3d_qpu_schedule_dag(&context, &state, nodes, numNodes);
+		for (int node = 0; node < numNodes && succeeded; ++node)
+			newIndices[nodes[node].inputIndex] = nodes[node].outIndex;
+		newIndices[i] = outStart;
+		i = end;
 	}
+	args->numInstructionsOut = state.numInstructionsOut;
 
-	if (num_src >= 1) {
-		if (has_dst)
-			append(disasm, ", ");
-		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.mul.a, V3D_QPU_MUL_A);
-		append(disasm, "%s",
-			   v3d_qpu_unpack_name(instr->alu.mul.a.unpack));
-	}
+	if (succeeded)
+	{
+		newIndices[numInstructions] = args->numInstructionsOut;
+		v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, oldIndices,
+		                       newIndices, numInstructions);
 
-	if (num_src >= 2) {
-		append(disasm, ", ");
-		v3d_qpu_disasm_raddr(disasm, instr, &instr->alu.mul.b, V3D_QPU_MUL_B);
-		append(disasm, "%s",
-			   v3d_qpu_unpack_name(instr->alu.mul.b.unpack));
+		struct v3d_qpu_validate_result result = {0};
+		if (!v3d_qpu_validate(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+		                      &result))
+		{
+			int errorIndex = result.errorInstructionIndex;
+			succeeded = v3d_qpu_schedule_fail(
+			    args, result.errorMessage,
+			    errorIndex >= 0 && errorIndex < args->numInstructionsOut &&
+			            oldIndices[errorIndex] >= 0 ?
+			        oldIndices[errorIndex] :
+			        numInstructions);
+		}
 	}
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
 }
 
-static void
-v3d_qpu_disasm_sig_addr(struct disasm_state *disasm,
-                        const struct v3d_qpu_instr *instr)
-{
-	if (disasm->devinfo->ver < 41)
-		return;
+// Delay slot filling
 
-	if (!instr->sig_magic)
-		append(disasm, ".rf%d", instr->sig_addr);
-	else {
-		const char *name =
-			v3d_qpu_magic_waddr_name(disasm->devinfo,
-									 instr->sig_addr);
-		if (name)
-			append(disasm, ".%s", name);
-		else
-			append(disasm, ".UNKNOWN%d", instr->sig_addr);
-	}
+// How far in front of a branch or THRSW to look for instructions to move into its delay slots
+#define V3D_QPU_DELAY_SLOT_FILL_WINDOW 8
+
+static int v3d_qpu_num_delay_slots(const struct v3d_qpu_instr* instr)
+{
+	if (instr->type == V3D_QPU_INSTR_TYPE_BRANCH)
+		return 3;
+	return instr->sig.thrsw ? 2 : 0;
 }
 
-static void
-v3d_qpu_disasm_sig(struct disasm_state *disasm,
-                   const struct v3d_qpu_instr *instr)
+static v3d_bool v3d_qpu_fill_delay_slots_fail(struct v3d_qpu_fill_delay_slots_arguments* args,
+                                              const char* message, int instructionIndex)
 {
-	const struct v3d_qpu_sig *sig = &instr->sig;
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
-	if (!sig->thrsw &&
-		!sig->ldvary &&
-		!sig->ldvpm &&
-		!sig->ldtmu &&
-		!sig->ldtlb &&
-		!sig->ldtlbu &&
-		!sig->ldunif &&
-		!sig->ldunifrf &&
-		!sig->ldunifa &&
-		!sig->ldunifarf &&
-		!sig->wrtmuc) {
-		return;
+// Whether instruction candidate can run after everything up to the delay slot, given the fills so
+// far. fills holds the input index of the instruction placed into each slot, or -1.
+static v3d_bool v3d_qpu_can_fill_slot(const struct v3d_qpu_fill_delay_slots_arguments* args,
+                                      const int* fills, const v3d_bool* moved, int candidate,
+                                      int slot)
+{
+	struct v3d_qpu_reg_usage candidateUsage;
+	v3d_qpu_get_reg_usage(&args->devinfo, &args->instructions[candidate], &candidateUsage);
+	for (int i = candidate + 1; i < slot; ++i)
+	{
+		if (moved[i])
+			continue;
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, &args->instructions[fills[i] >= 0 ? fills[i] : i],
+		                      &usage);
+		if (v3d_qpu_reg_usage_conflicts(&candidateUsage, &usage))
+			return FALSE;
 	}
+	return TRUE;
+}
 
-	pad_to(disasm, 60);
+// Writes out the program with the fills so far and validates it
+static v3d_bool v3d_qpu_fill_delay_slots_build(struct v3d_qpu_fill_delay_slots_arguments* args,
+                                               const int* fills, const v3d_bool* moved,
+                                               int* oldIndices, int* newIndices,
+                                               struct v3d_qpu_validate_result* resultOut)
+{
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		if (moved[i])
+			continue;
+		int source = fills[i] >= 0 ? fills[i] : i;
+		int outIndex = args->numInstructionsOut++;
+		args->instructionsOut[outIndex] = args->instructions[source];
+		oldIndices[outIndex] = source;
+		newIndices[source] = outIndex;
+		newIndices[i] = outIndex;
+	}
+	newIndices[numInstructions] = args->numInstructionsOut;
+	v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, oldIndices,
+	                       newIndices, numInstructions);
+
+	*resultOut = (struct v3d_qpu_validate_result){0};
+	return v3d_qpu_validate(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+	                        resultOut);
+}
 
-	if (sig->thrsw)
-		append(disasm, "; thrsw");
-	if (sig->ldvary) {
-		append(disasm, "; ldvary");
-		v3d_qpu_disasm_sig_addr(disasm, instr);
-	}
-	if (sig->ldvpm)
-		append(disasm, "; ldvpm");
-	if (sig->ldtmu) {
-		append(disasm, "; ldtmu");
-		v3d_qpu_disasm_sig_addr(disasm, instr);
-	}
-	if (sig->ldtlb) {
-		append(disasm, "; ldtlb");
-		v3d_qpu_disasm_sig_addr(disasm, instr);
+v3d_bool v3d_qpu_fill_delay_slots(struct v3d_qpu_fill_delay_slots_arguments* args)
+{
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->numSlotsFilled = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_fill_delay_slots_fail(args, "V3D 7.x delay slot filling not implemented",
+		                                     0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	v3d_bool* isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* inDelaySlots = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* moved = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* fills = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	if (!isBranchTarget || !inDelaySlots || !moved || !fills || !newIndices || !oldIndices)
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_fill_delay_slots_fail(args, "Out of arena memory", 0);
 	}
-	if (sig->ldtlbu) {
-		append(disasm, "; ldtlbu");
-		v3d_qpu_disasm_sig_addr(disasm, instr);
+	v3d_qpu_find_branch_targets(instructions, numInstructions, isBranchTarget);
+	int lastThrsw = numInstructions;
+	for (int i = 0; i <= numInstructions; ++i)
+	{
+		inDelaySlots[i] = FALSE;
+		moved[i] = FALSE;
+		fills[i] = -1;
 	}
-	if (sig->ldunif)
-		append(disasm, "; ldunif");
-	if (sig->ldunifrf) {
-		append(disasm, "; ldunifrf");
-		v3d_qpu_disasm_sig_addr(disasm, instr);
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		int numSlots = v3d_qpu_num_delay_slots(&instructions[i]);
+		for (int slot = i + 1; slot <= i + numSlots && slot < numInstructions; ++slot)
+			inDelaySlots[slot] = TRUE;
+		if (instructions[i].sig.thrsw)
+			lastThrsw = i;
 	}
-	if (sig->ldunifa)
-		append(disasm, "; ldunifa");
-	if (sig->ldunifarf) {
-		append(disasm, "; ldunifarf");
-		v3d_qpu_disasm_sig_addr(disasm, instr);
+
+	struct v3d_qpu_validate_result result;
+	v3d_bool succeeded = v3d_qpu_fill_delay_slots_build(args, fills, moved, oldIndices,
+	                                                    newIndices, &result);
+	if (!succeeded)
+		v3d_qpu_fill_delay_slots_fail(args, result.errorMessage, result.errorInstructionIndex);
+
+	for (int control = 0; control < numInstructions && succeeded; ++control)
+	{
+		int numSlots = v3d_qpu_num_delay_slots(&instructions[control]);
+		// Branches and THRSW in delay slots, e.g. the final THRSW pair, keep their slots as they
+		// are, as do those which are jumped to, as the moved instructions wouldn't run before
+		if (!numSlots || inDelaySlots[control] || isBranchTarget[control])
+			continue;
+
+		for (int slot = control + 1; slot <= control + numSlots && slot < numInstructions; ++slot)
+		{
+			// The final THRSW's delay slots run as the program ends
+			if (slot > lastThrsw || isBranchTarget[slot] ||
+			    !v3d_qpu_instr_is_plain_nop(&instructions[slot]))
+				continue;
+
+			for (int candidate = control - 1;
+			     candidate >= 0 && control - candidate <= V3D_QPU_DELAY_SLOT_FILL_WINDOW;
+			     --candidate)
+			{
+				if (isBranchTarget[candidate] || inDelaySlots[candidate] ||
+				    v3d_qpu_num_delay_slots(&instructions[candidate]))
+					break;
+				if (moved[candidate] || !v3d_qpu_instr_is_movable(&instructions[candidate]) ||
+				    !v3d_qpu_can_fill_slot(args, fills, moved, candidate, slot))
+					continue;
+
+				fills[slot] = candidate;
+				moved[candidate] = TRUE;
+				if (v3d_qpu_fill_delay_slots_build(args, fills, moved, oldIndices, newIndices,
+				                                   &result))
+				{
+					++args->numSlotsFilled;
+					break;
+				}
+				fills[slot] = -1;
+				moved[candidate] = FALSE;
+			}
+		}
 	}
-	if (sig->wrtmuc)
-		append(disasm, "; wrtmuc");
+
+	// The last build may have been a failed attempt
+	if (succeeded)
+		succeeded = v3d_qpu_fill_delay_slots_build(args, fills, moved, oldIndices, newIndices,
+		                                           &result);
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
 }
 
-// (todo Pi 5) add signals for v3d 7
-const char* sig_names[] = {
-    "thrsw",  "ldvary",   "ldvpm",   "ldtmu",     "ldtlb",  "ldtlbu",
-    "ldunif", "ldunifrf", "ldunifa", "ldunifarf", "wrtmuc",
-};
+// Cycle estimation
 
-// Matches sig_names
-v3d_bool sig_has_address[] = {
-	FALSE, TRUE, FALSE, TRUE, TRUE, TRUE,
-	FALSE, TRUE, FALSE, TRUE, FALSE,
-};
+#define V3D_QPU_DEFAULT_TMU_LATENCY 20
+#define V3D_QPU_DEFAULT_VPM_LATENCY 4
+#define V3D_QPU_DEFAULT_THRSW_CYCLES 8
+// Lookups tracked at once. Older ones are assumed done.
+#define V3D_QPU_MAX_TMU_LOOKUPS 16
 
-// Using the index from matching name in sig_names, get which bit is associated with the signal
-int sig_bits[] =
+const char* v3d_qpu_stall_reason_name(enum v3d_qpu_stall_reason reason)
 {
-// thrsw = 0
-// ldunif = 1
-// ldunifa = 2
-// ldunifrf = 3
-// ldunifarf = 4
-// ldtmu = 5
-// ldvary = 6
-// ldvpm = 7
-// ldtlb = 8
-// ldtlbu = 9
-// ucb = 10
-// rotate = 11
-// wrtmuc = 12
-	0, 6, 7, 5, 8, 9,
-	1, 3, 2, 4, 12,
-};
+	switch (reason)
+	{
+		case V3D_QPU_STALL_NONE:
+			return "none";
+		case V3D_QPU_STALL_SFU:
+			return "sfu";
+		case V3D_QPU_STALL_LDVARY:
+			return "ldvary";
+		case V3D_QPU_STALL_TMU:
+			return "tmu";
+		case V3D_QPU_STALL_VPM:
+			return "vpm";
+		case V3D_QPU_STALL_THRSW:
+			return "thrsw";
+		case V3D_QPU_STALL_REASON_COUNT:
+			break;
+	}
+	return "unknown";
+}
 
-static v3d_bool v3d_qpu_assemble_signal(struct v3d_qpu_sig* sig, v3d_bool* signalTakesAddress,
-                                        const char* name, const char** endOfNameOut)
+// Writes which start a TMU lookup, rather than only setting up its parameters
+static v3d_bool v3d_qpu_magic_waddr_starts_tmu_lookup(enum v3d_qpu_waddr waddr)
 {
-	for (int index = 0; index < V3D_ARRAY_SIZE(sig_names); ++index)
+	switch (waddr)
 	{
-		if (v3d_symbol_equals(sig_names[index], name, endOfNameOut))
-		{
-			if (signalTakesAddress)
-				*signalTakesAddress = sig_has_address[index];
-
-			*((v3d_uint32*)sig) |= 1 << sig_bits[index];
+		case V3D_QPU_WADDR_TMUA:
+		case V3D_QPU_WADDR_TMUAU:
+		case V3D_QPU_WADDR_TMUS:
+		case V3D_QPU_WADDR_TMUSCM:
+		case V3D_QPU_WADDR_TMUSF:
+		case V3D_QPU_WADDR_TMUSLOD:
+		case V3D_QPU_WADDR_TMUHS:
+		case V3D_QPU_WADDR_TMUHSCM:
+		case V3D_QPU_WADDR_TMUHSF:
+		case V3D_QPU_WADDR_TMUHSLOD:
 			return TRUE;
-		}
+		default:
+			return FALSE;
 	}
-	return FALSE;
 }
 
-static void
-v3d_qpu_disasm_alu(struct disasm_state *disasm,
-                   const struct v3d_qpu_instr *instr)
+static v3d_bool v3d_qpu_starts_tmu_lookup(const struct v3d_qpu_instr* instr)
 {
-	v3d_qpu_disasm_add(disasm, instr);
-	v3d_qpu_disasm_mul(disasm, instr);
-	v3d_qpu_disasm_sig(disasm, instr);
+	return instr->type == V3D_QPU_INSTR_TYPE_ALU &&
+	       ((instr->alu.add.op != V3D_QPU_A_NOP && instr->alu.add.magic_write &&
+	         v3d_qpu_magic_waddr_starts_tmu_lookup(instr->alu.add.waddr)) ||
+	        (instr->alu.mul.op != V3D_QPU_M_NOP && instr->alu.mul.magic_write &&
+	         v3d_qpu_magic_waddr_starts_tmu_lookup(instr->alu.mul.waddr)));
 }
 
-static void
-v3d_qpu_disasm_branch(struct disasm_state *disasm,
-                      const struct v3d_qpu_instr *instr)
+// What an instruction may have to wait for. Registers keep the cycle their last write lands in.
+struct v3d_qpu_estimate_state
 {
-	append(disasm, "b");
-	if (instr->branch.ub)
-		append(disasm, "u");
-	append(disasm, "%s", v3d_qpu_branch_cond_name(instr->branch.cond));
-	append(disasm, "%s", v3d_qpu_msfign_name(instr->branch.msfign));
-
-	switch (instr->branch.bdi) {
-	case V3D_QPU_BRANCH_DEST_ABS:
-		append(disasm, "  zero_addr+0x%08x", instr->branch.offset);
-		break;
+	int rfReady[64];
+	enum v3d_qpu_stall_reason rfReason[64];
+	int accReady[6];
+	enum v3d_qpu_stall_reason accReason[6];
+	// Ring of when outstanding TMU lookups finish, oldest first
+	int tmuReady[V3D_QPU_MAX_TMU_LOOKUPS];
+	int firstTmuLookup;
+	int numTmuLookups;
+	int vpmReady;
+	// Index of the instruction after the delay slots of the last THRSW, or -1
+	int switchAt;
+};
 
-	case V3D_QPU_BRANCH_DEST_REL:
-		append(disasm, "  %d", instr->branch.offset);
-		break;
+static void v3d_qpu_estimate_wait(int ready, enum v3d_qpu_stall_reason reason, int* issueInOut,
+                                  enum v3d_qpu_stall_reason* reasonInOut)
+{
+	if (ready <= *issueInOut)
+		return;
+	*issueInOut = ready;
+	*reasonInOut = reason;
+}
 
-	case V3D_QPU_BRANCH_DEST_LINK_REG:
-		append(disasm, "  lri");
-		break;
+static void v3d_qpu_estimate_writes(struct v3d_qpu_estimate_state* state,
+                                    const struct v3d_qpu_reg_usage* usage, int ready,
+                                    enum v3d_qpu_stall_reason reason)
+{
+	for (int rf = 0; rf < 64; ++rf)
+	{
+		if (!((usage->rfWrites >> rf) & 1))
+			continue;
+		state->rfReady[rf] = ready;
+		state->rfReason[rf] = reason;
+	}
+	for (int acc = 0; acc < 6; ++acc)
+	{
+		if (!((usage->accWrites >> acc) & 1))
+			continue;
+		state->accReady[acc] = ready;
+		state->accReason[acc] = reason;
+	}
+}
 
-	case V3D_QPU_BRANCH_DEST_REGFILE:
-		append(disasm, "  rf%d", instr->branch.raddr_a);
-		break;
+v3d_bool v3d_qpu_estimate_cycles(struct v3d_qpu_estimate_cycles_arguments* args)
+{
+	args->cycles = 0;
+	args->stallCycles = 0;
+	for (int reason = 0; reason < V3D_QPU_STALL_REASON_COUNT; ++reason)
+		args->stallCyclesByReason[reason] = 0;
+	args->errorMessage = NULL;
+	if (args->devinfo.ver >= 70)
+	{
+		args->errorMessage = "V3D 7.x cycle estimation not implemented";
+		return FALSE;
 	}
 
-	if (instr->branch.ub) {
-		switch (instr->branch.bdu) {
-		case V3D_QPU_BRANCH_DEST_ABS:
-			append(disasm, ", a:unif");
-			break;
+	int tmuLatency = args->tmuLatency > 0 ? args->tmuLatency : V3D_QPU_DEFAULT_TMU_LATENCY;
+	int vpmLatency = args->vpmLatency > 0 ? args->vpmLatency : V3D_QPU_DEFAULT_VPM_LATENCY;
+	int thrswCycles = args->thrswCycles > 0 ? args->thrswCycles : V3D_QPU_DEFAULT_THRSW_CYCLES;
 
-		case V3D_QPU_BRANCH_DEST_REL:
-			append(disasm, ", r:unif");
-			break;
+	struct v3d_qpu_estimate_state state = {0};
+	state.switchAt = -1;
+	int cycle = 0;
+	for (int i = 0; i < args->numInstructions; ++i)
+	{
+		const struct v3d_qpu_instr* instr = &args->instructions[i];
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, instr, &usage);
+
+		int issue = cycle;
+		enum v3d_qpu_stall_reason reason = V3D_QPU_STALL_NONE;
+		if (i == state.switchAt)
+			v3d_qpu_estimate_wait(cycle + thrswCycles, V3D_QPU_STALL_THRSW, &issue, &reason);
+		for (int rf = 0; rf < 64; ++rf)
+		{
+			if ((usage.rfReads >> rf) & 1)
+				v3d_qpu_estimate_wait(state.rfReady[rf], state.rfReason[rf], &issue, &reason);
+		}
+		for (int acc = 0; acc < 6; ++acc)
+		{
+			if ((usage.accReads >> acc) & 1)
+				v3d_qpu_estimate_wait(state.accReady[acc], state.accReason[acc], &issue,
+				                      &reason);
+		}
+		if (v3d_qpu_waits_on_tmu(instr) && state.numTmuLookups > 0)
+		{
+			// ldtmu waits for the oldest lookup, tmuwt for all of them
+			int last = instr->sig.ldtmu ? state.firstTmuLookup :
+			                              (state.firstTmuLookup + state.numTmuLookups - 1) %
+			                                  V3D_QPU_MAX_TMU_LOOKUPS;
+			v3d_qpu_estimate_wait(state.tmuReady[last], V3D_QPU_STALL_TMU, &issue, &reason);
+			int numDone = instr->sig.ldtmu ? 1 : state.numTmuLookups;
+			state.firstTmuLookup = (state.firstTmuLookup + numDone) % V3D_QPU_MAX_TMU_LOOKUPS;
+			state.numTmuLookups -= numDone;
+		}
+		if (v3d_qpu_waits_vpm(instr))
+			v3d_qpu_estimate_wait(state.vpmReady, V3D_QPU_STALL_VPM, &issue, &reason);
+
+		int stallCycles = issue - cycle;
+		args->stallCycles += stallCycles;
+		args->stallCyclesByReason[reason] += stallCycles;
+		if (args->timingsOut)
+		{
+			args->timingsOut[i].cycle = issue;
+			args->timingsOut[i].stallCycles = stallCycles;
+			args->timingsOut[i].stallReason = reason;
+		}
+		cycle = issue + 1;
 
-		case V3D_QPU_BRANCH_DEST_LINK_REG:
-			append(disasm, ", lri");
-			break;
+		// Results other instructions may have to wait for
+		v3d_qpu_estimate_writes(&state, &usage, issue + 1, V3D_QPU_STALL_NONE);
+		if (instr->sig.ldvary)
+		{
+			struct v3d_qpu_reg_usage ldvaryUsage = {0};
+			if (v3d_qpu_sig_writes_address(&args->devinfo, &instr->sig))
+				v3d_qpu_dst_usage(instr->sig_addr, instr->sig_magic, &ldvaryUsage);
+			if (v3d_qpu_writes_r5(&args->devinfo, instr))
+				ldvaryUsage.accWrites |= 1 << 5;
+			v3d_qpu_estimate_writes(&state, &ldvaryUsage, issue + V3D_QPU_LDVARY_LATENCY,
+			                        V3D_QPU_STALL_LDVARY);
+		}
+		if (v3d_qpu_uses_sfu(instr))
+		{
+			state.accReady[4] = issue + V3D_QPU_SFU_LATENCY;
+			state.accReason[4] = V3D_QPU_STALL_SFU;
+		}
+		if (v3d_qpu_starts_tmu_lookup(instr))
+		{
+			if (state.numTmuLookups == V3D_QPU_MAX_TMU_LOOKUPS)
+			{
+				state.firstTmuLookup = (state.firstTmuLookup + 1) % V3D_QPU_MAX_TMU_LOOKUPS;
+				--state.numTmuLookups;
+			}
+			int next = (state.firstTmuLookup + state.numTmuLookups++) % V3D_QPU_MAX_TMU_LOOKUPS;
+			state.tmuReady[next] = issue + tmuLatency;
+		}
+		if (v3d_qpu_writes_vpm(instr))
+			state.vpmReady = issue + vpmLatency;
+		if (instr->sig.thrsw)
+			state.switchAt = i + 3;
+	}
+	args->cycles = cycle;
+	return TRUE;
+}
 
-		case V3D_QPU_BRANCH_DEST_REGFILE:
-			append(disasm, ", rf%d", instr->branch.raddr_a);
-			break;
+// Instruction mix
+
+void v3d_qpu_count_instruction_mix(const struct v3d_device_info* devinfo,
+                                   const struct v3d_qpu_instr* instructions, int numInstructions,
+                                   struct v3d_qpu_instruction_mix* mixOut)
+{
+	struct v3d_qpu_instruction_mix* mix = mixOut;
+	*mix = (struct v3d_qpu_instruction_mix){0};
+	mix->numInstructions = numInstructions;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		const struct v3d_qpu_instr* instr = &instructions[i];
+		const struct v3d_qpu_sig* sig = &instr->sig;
+		if (instr->type == V3D_QPU_INSTR_TYPE_BRANCH)
+		{
+			++mix->numBranches;
+			mix->numUniformLoads += instr->branch.ub &&
+			                        (instr->branch.bdu == V3D_QPU_BRANCH_DEST_ABS ||
+			                         instr->branch.bdu == V3D_QPU_BRANCH_DEST_REL);
+			continue;
 		}
+
+		static const struct v3d_qpu_sig noSignals = {0};
+		++mix->numAluInstructions;
+		mix->numAddOps += instr->alu.add.op != V3D_QPU_A_NOP;
+		mix->numMulOps += instr->alu.mul.op != V3D_QPU_M_NOP;
+		mix->numNops += instr->alu.add.op == V3D_QPU_A_NOP &&
+		                instr->alu.mul.op == V3D_QPU_M_NOP &&
+		                !v3d_memcmp(sig, &noSignals, sizeof(noSignals));
+		mix->numSfuOps += v3d_qpu_uses_sfu(instr);
+		mix->numTmuWrites += v3d_qpu_writes_tmu(devinfo, instr);
+		mix->numLdtmu += sig->ldtmu != 0;
+		mix->numVpmOps += v3d_qpu_uses_vpm(instr);
+		mix->numTlbOps += v3d_qpu_uses_tlb(instr);
+		mix->numUniformLoads += (sig->ldunif != 0) + (sig->ldunifrf != 0);
+		mix->numUniformLoads +=
+		    (instr->alu.add.magic_write &&
+		     v3d_qpu_magic_waddr_loads_unif((enum v3d_qpu_waddr)instr->alu.add.waddr)) ||
+		    (instr->alu.mul.magic_write &&
+		     v3d_qpu_magic_waddr_loads_unif((enum v3d_qpu_waddr)instr->alu.mul.waddr));
+		mix->numUnifaLoads += sig->ldunifa || sig->ldunifarf;
+		mix->numLdvary += sig->ldvary != 0;
+		mix->numThrsw += sig->thrsw != 0;
+		mix->numSmallImmediates +=
+		    sig->small_imm_a || sig->small_imm_b || sig->small_imm_c || sig->small_imm_d;
 	}
 }
 
-size_t
-v3d_qpu_decode(const struct v3d_device_info *devinfo,
-               const struct v3d_qpu_instr *instr,
-               char* outBuffer, size_t outBufferSize)
+struct v3d_qpu_report_state
 {
-	struct disasm_state disasm = {
-		.string = outBuffer,
-		.size = outBufferSize,
-		.offset = 0,
-		.devinfo = devinfo,
-	};
+	char* string;
+	size_t size;
+	size_t offset;
+	enum v3d_qpu_report_format format;
+	int numFields;
+};
 
-	switch (instr->type) {
-	case V3D_QPU_INSTR_TYPE_ALU:
-		v3d_qpu_disasm_alu(&disasm, instr);
-		break;
+static void v3d_qpu_report_append(struct v3d_qpu_report_state* report, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	char* string = report->offset < report->size ? report->string + report->offset : NULL;
+	size_t size = report->offset < report->size ? report->size - report->offset : 0;
+	int result = v3d_vsnprintf(string, size, format, args);
+	va_end(args);
+	if (result > 0)
+		report->offset += (size_t)result;
+}
 
-	case V3D_QPU_INSTR_TYPE_BRANCH:
-		v3d_qpu_disasm_branch(&disasm, instr);
-		break;
+// Writes one count, followed by its share of total unless total is negative
+static void v3d_qpu_report_field(struct v3d_qpu_report_state* report, const char* jsonName,
+                                 const char* textName, int count, int total)
+{
+	if (report->format == V3D_QPU_REPORT_FORMAT_JSON)
+	{
+		v3d_qpu_report_append(report, "%s\n  \"%s\": %d", report->numFields ? "," : "",
+		                      jsonName, count);
+		if (total >= 0)
+			v3d_qpu_report_append(report, ",\n  \"%sRatio\": %.3f", jsonName,
+			                      total ? (double)count / total : 0.0);
+	}
+	else
+	{
+		v3d_qpu_report_append(report, "%-20s %d", textName, count);
+		if (total >= 0)
+			v3d_qpu_report_append(report, " (%.1f%%)", total ? 100.0 * count / total : 0.0);
+		v3d_qpu_report_append(report, "\n");
 	}
+	++report->numFields;
+}
 
-	return disasm.offset;
+size_t v3d_qpu_format_instruction_mix(const struct v3d_qpu_instruction_mix* mix,
+                                      enum v3d_qpu_report_format format, char* outBuffer,
+                                      size_t outBufferSize)
+{
+	struct v3d_qpu_report_state report = {0};
+	report.string = outBuffer;
+	report.size = outBufferSize;
+	report.format = format;
+	if (outBuffer && outBufferSize)
+		outBuffer[0] = '\0';
+
+	int total = mix->numInstructions;
+	if (format == V3D_QPU_REPORT_FORMAT_JSON)
+		v3d_qpu_report_append(&report, "{");
+	v3d_qpu_report_field(&report, "instructions", "instructions", total, -1);
+	v3d_qpu_report_field(&report, "aluInstructions", "alu instructions", mix->numAluInstructions,
+	                     -1);
+	v3d_qpu_report_field(&report, "branches", "branches", mix->numBranches, -1);
+	v3d_qpu_report_field(&report, "addOps", "add ops", mix->numAddOps, total);
+	v3d_qpu_report_field(&report, "mulOps", "mul ops", mix->numMulOps, total);
+	v3d_qpu_report_field(&report, "nops", "nops", mix->numNops, total);
+	v3d_qpu_report_field(&report, "sfuOps", "sfu ops", mix->numSfuOps, -1);
+	v3d_qpu_report_field(&report, "tmuWrites", "tmu writes", mix->numTmuWrites, -1);
+	v3d_qpu_report_field(&report, "ldtmu", "ldtmu", mix->numLdtmu, -1);
+	v3d_qpu_report_field(&report, "vpmOps", "vpm ops", mix->numVpmOps, -1);
+	v3d_qpu_report_field(&report, "tlbOps", "tlb ops", mix->numTlbOps, -1);
+	v3d_qpu_report_field(&report, "uniformLoads", "uniform loads", mix->numUniformLoads, -1);
+	v3d_qpu_report_field(&report, "unifaLoads", "unifa loads", mix->numUnifaLoads, -1);
+	v3d_qpu_report_field(&report, "ldvary", "ldvary", mix->numLdvary, -1);
+	v3d_qpu_report_field(&report, "thrsw", "thrsw", mix->numThrsw, -1);
+	v3d_qpu_report_field(&report, "smallImmediates", "small immediates",
+	                     mix->numSmallImmediates, total);
+	if (format == V3D_QPU_REPORT_FORMAT_JSON)
+		v3d_qpu_report_append(&report, "\n}\n");
+	return report.offset;
 }
 
-size_t
-v3d_qpu_disasm(const struct v3d_device_info *devinfo, v3d_uint64 inst, char* outBuffer, size_t outBufferSize)
+// Register allocation
+
+// Accumulators which may hold virtual registers. r4 and r5 are written implicitly by SFU, ldtmu,
+// ldunif and ldvary, so they're left alone.
+#define V3D_QPU_RA_NUM_ACCUMULATORS 4
+#define V3D_QPU_RA_NUM_REGISTER_FILE 32
+
+struct v3d_qpu_ra_occurrence
 {
-	struct v3d_qpu_instr instr;
-	v3d_bool ok = v3d_qpu_instr_unpack(devinfo, inst, &instr);
-	v3d_assert(ok); (void)ok;
+	int vreg;
+	int instruction;
+	// Of the '%' in the source, and including it
+	int offset;
+	int length;
+	int line;
+	v3d_bool isWrite;
+	// Next occurrence of the same virtual register, or -1
+	int next;
+};
 
-	return v3d_qpu_decode(devinfo, &instr, outBuffer, outBufferSize);
+struct v3d_qpu_ra_vreg
+{
+	const char* name;
+	int nameLength;
+	int firstOccurrence;
+	int lastOccurrence;
+	// Instructions it lives between, inclusive
+	int start;
+	int end;
+	int lastWrite;
+	v3d_bool livesAcrossThreadSwitch;
+	struct v3d_qpu_operand reg;
+};
+
+struct v3d_qpu_ra_instruction
+{
+	int line;
+	int offset;
+	// rf reads left for virtual registers, after the raddrs the instruction uses already
+	int rfReadsLeft;
+	v3d_bool thrsw;
+};
+
+static v3d_bool v3d_qpu_ra_fail(struct v3d_qpu_allocate_registers_arguments* args,
+                                const char* message, int line, int offset)
+{
+	args->errorMessage = message;
+	args->errorLine = line;
+	args->errorAtOffset = offset;
+	return FALSE;
 }
 
-// Skip through whitespace or comments until e.g. a symbol start is encountered.
-// Returns false if a non-multiline-commented newline or end of string encountered before a symbol
-// was found.
-v3d_bool v3d_qpu_skip_whitespace_comments(const char** readHeadInOut)
+// Length of the virtual register name at text, which starts with '%', including the '%'
+static int v3d_qpu_ra_vreg_length(const char* text, const char* end)
 {
-	const char* currentChar;
+	int length = 1;
+	while (text + length < end && v3d_qpu_pp_is_identifier_char(text[length], FALSE))
+		++length;
+	return length;
+}
+
+// Copies a line with every virtual register outside of comments replaced by accumulator, so the
+// assembler can decode everything else about it. Optionally records where each one was, along
+// with which part of the instruction (add, mul, then signals) and which operand it is in.
+static int v3d_qpu_ra_substitute_line(const char* line, int lineLength, char accumulator,
+                                      char* lineOut, struct v3d_qpu_ra_occurrence* occurrencesOut,
+                                      int* partsOut, int* operandsOut, int* numOccurrencesOut)
+{
+	const char* end = line + lineLength;
+	int outLength = 0;
 	int commentDepth = 0;
-	for (currentChar = *readHeadInOut; *currentChar && (commentDepth || *currentChar != '\n');
-	     ++currentChar)
+	int part = 0;
+	int operand = 0;
+	for (const char* currentChar = line; currentChar < end;)
 	{
-		if (*currentChar == '\t' || *currentChar == '\r' || *currentChar == ' ')
-			continue;
-
-		// C++ style comment to end of line; find the end to make sure we advance the right number
-		// of characters
-		if (!commentDepth && currentChar[0] == '/' && currentChar[1] == '/')
+		if (!commentDepth && currentChar[0] == '/' && v3d_peek(currentChar, end, 1) == '/')
 		{
-			while (*currentChar && *currentChar != '\n')
-				++currentChar;
+			while (currentChar < end)
+				lineOut[outLength++] = *currentChar++;
 			break;
 		}
-		// /**/-style comments; support nesting.
-		if (currentChar[0] == '*' && currentChar[1] == '/')
+		if (commentDepth && currentChar[0] == '*' && v3d_peek(currentChar, end, 1) == '/')
 		{
 			--commentDepth;
-			++currentChar;
-			continue;
+			lineOut[outLength++] = *currentChar++;
 		}
-		if (currentChar[0] == '/' && currentChar[1] == '*')
+		else if (currentChar[0] == '/' && v3d_peek(currentChar, end, 1) == '*')
 		{
 			++commentDepth;
-			++currentChar;
+			lineOut[outLength++] = *currentChar++;
 		}
-		if (commentDepth)
+		else if (!commentDepth && currentChar[0] == ';')
+		{
+			++part;
+			operand = 0;
+		}
+		else if (!commentDepth && currentChar[0] == ',')
+			++operand;
+		// Otherwise it's modulo in a constant expression
+		else if (!commentDepth && currentChar[0] == '%' &&
+		         v3d_qpu_pp_is_identifier_char(v3d_peek(currentChar, end, 1), TRUE))
+		{
+			int length = v3d_qpu_ra_vreg_length(currentChar, end);
+			if (occurrencesOut)
+			{
+				struct v3d_qpu_ra_occurrence* occurrence = &occurrencesOut[*numOccurrencesOut];
+				occurrence->offset = currentChar - line;
+				occurrence->length = length;
+				partsOut[*numOccurrencesOut] = part;
+				operandsOut[*numOccurrencesOut] = operand;
+				++*numOccurrencesOut;
+			}
+			lineOut[outLength++] = 'r';
+			lineOut[outLength++] = accumulator;
+			currentChar += length;
+			continue;
+		}
+		lineOut[outLength++] = *currentChar++;
+	}
+	return outLength;
+}
+
+static int v3d_qpu_ra_find_vreg(const struct v3d_qpu_ra_vreg* vregs, int numVregs,
+                                const char* name, int nameLength)
+{
+	for (int vreg = 0; vreg < numVregs; ++vreg)
+	{
+		if (vregs[vreg].nameLength == nameLength &&
+		    !v3d_memcmp(vregs[vreg].name, name, nameLength))
+			return vreg;
+	}
+	return -1;
+}
+
+static int v3d_count_bits(v3d_uint64 bits)
+{
+	int numBits = 0;
+	for (; bits; bits &= bits - 1)
+		++numBits;
+	return numBits;
+}
+
+// Whether the register held by owner is free again by the time vreg is first written
+static v3d_bool v3d_qpu_ra_expired(const struct v3d_qpu_ra_vreg* owner,
+                                   const struct v3d_qpu_ra_vreg* vreg)
+{
+	// An instruction may read the old value and write the new one, but not write both
+	return owner->end < vreg->start || (owner->end == vreg->start && owner->lastWrite != vreg->start);
+}
+
+// Whether every instruction which reads vreg can read one more rf
+static v3d_bool v3d_qpu_ra_fits_raddrs(const struct v3d_qpu_ra_occurrence* occurrences,
+                                       const struct v3d_qpu_ra_instruction* instructions,
+                                       const struct v3d_qpu_ra_vreg* vreg, int* fullInstructionOut)
+{
+	for (int index = vreg->firstOccurrence; index >= 0; index = occurrences[index].next)
+	{
+		const struct v3d_qpu_ra_occurrence* occurrence = &occurrences[index];
+		if (!occurrence->isWrite && instructions[occurrence->instruction].rfReadsLeft <= 0)
+		{
+			*fullInstructionOut = occurrence->instruction;
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void v3d_qpu_ra_use_raddrs(const struct v3d_qpu_ra_occurrence* occurrences,
+                                  struct v3d_qpu_ra_instruction* instructions,
+                                  const struct v3d_qpu_ra_vreg* vreg)
+{
+	int lastInstruction = -1;
+	for (int index = vreg->firstOccurrence; index >= 0; index = occurrences[index].next)
+	{
+		const struct v3d_qpu_ra_occurrence* occurrence = &occurrences[index];
+		if (occurrence->isWrite || occurrence->instruction == lastInstruction)
 			continue;
+		--instructions[occurrence->instruction].rfReadsLeft;
+		lastInstruction = occurrence->instruction;
+	}
+}
 
-		*readHeadInOut = currentChar;
-		return TRUE;
+// Writes e.g. "rf12" or "r0", without a null terminator
+static int v3d_qpu_ra_register_name(struct v3d_qpu_operand reg, char* nameOut)
+{
+	int nameLength = 0;
+	nameOut[nameLength++] = 'r';
+	if (reg.kind == V3D_QPU_OPERAND_REGISTER_FILE)
+	{
+		nameOut[nameLength++] = 'f';
+		if (reg.index >= 10)
+			nameOut[nameLength++] = '0' + reg.index / 10;
 	}
-	*readHeadInOut = currentChar;
-	return FALSE;
+	nameOut[nameLength++] = '0' + reg.index % 10;
+	return nameLength;
 }
 
-// This assembler is written by Macoy Madson (not from Mesa)
-v3d_uint32 v3d_qpu_assemble(struct v3d_qpu_assemble_arguments* args)
+static v3d_bool v3d_qpu_ra_append(struct v3d_qpu_allocate_registers_arguments* args,
+                                  const char* text, int length)
+{
+	if (args->outputLength + length > args->outputCapacity)
+		return FALSE;
+	for (int i = 0; i < length; ++i)
+		args->output[args->outputLength++] = text[i];
+	return TRUE;
+}
+
+v3d_bool v3d_qpu_allocate_registers(struct v3d_qpu_allocate_registers_arguments* args)
 {
+	const char* source = args->source;
+	const char* end = source + args->sourceLength;
+	args->outputLength = 0;
+	args->numVirtualRegisters = 0;
+	args->numRegisterFile = 0;
+	args->numAccumulators = 0;
+	args->errorMessage = NULL;
+	args->errorLine = 0;
+	args->errorAtOffset = 0;
 	if (args->devinfo.ver >= 70)
+		return v3d_qpu_ra_fail(args, "V3D 7.x register allocation not implemented", 0, 0);
+
+	// Every line is at most one instruction and every '%' at most one virtual register occurrence
+	int maxInstructions = v3d_count_newlines(source, end) + 1;
+	int maxOccurrences = 0;
+	for (const char* currentChar = source; currentChar < end; ++currentChar)
+		maxOccurrences += *currentChar == '%';
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	struct v3d_qpu_ra_instruction* instructions =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_ra_instruction, maxInstructions);
+	struct v3d_qpu_ra_occurrence* occurrences =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_ra_occurrence, maxOccurrences + 1);
+	struct v3d_qpu_ra_vreg* vregs =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_ra_vreg, maxOccurrences + 1);
+	int* parts = V3D_ARENA_ALLOC_ARRAY(args->arena, int, maxOccurrences + 1);
+	int* operands = V3D_ARENA_ALLOC_ARRAY(args->arena, int, maxOccurrences + 1);
+	char* lineBuffer = V3D_ARENA_ALLOC_ARRAY(args->arena, char, args->sourceLength + 1);
+	if (!instructions || !occurrences || !vregs || !parts || !operands || !lineBuffer)
 	{
-		args->errorMessage = "V3D 7.x assembler not implemented";
-		return 0;
-	}
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_ra_fail(args, "Out of arena memory", 0, 0);
+	}
+
+	// Decode each line to find out which virtual registers are written, which registers the
+	// program uses itself, and how many raddrs are left over. Two different placeholder
+	// accumulators tell the accumulators in the source apart.
+	int numInstructions = 0;
+	int numOccurrences = 0;
+	int numVregs = 0;
+	v3d_uint64 namedRegisterFile = 0;
+	v3d_uint8 namedAccumulators = 0;
+	int lineNumber = 1;
+	v3d_bool succeeded = TRUE;
+	for (const char* currentChar = source; succeeded;)
+	{
+		int lineLength = v3d_qpu_assemble_line_length(currentChar, end - currentChar);
+		int lineOffset = currentChar - source;
+		int firstOccurrence = numOccurrences;
+		struct v3d_qpu_instr decoded[2];
+		v3d_bool isEmptyLine = FALSE;
+		for (int pass = 0; pass < 2 && succeeded && !isEmptyLine; ++pass)
+		{
+			int substitutedLength = v3d_qpu_ra_substitute_line(
+			    currentChar, lineLength, pass ? '1' : '0', lineBuffer,
+			    pass ? NULL : occurrences, parts, operands, &numOccurrences);
+			struct v3d_qpu_assemble_arguments assembleArgs = {0};
+			assembleArgs.devinfo = args->devinfo;
+			assembleArgs.assembly = lineBuffer;
+			assembleArgs.assemblyEnd = lineBuffer + substitutedLength;
+			v3d_uint32 assembled = v3d_qpu_assemble(&assembleArgs);
+			if (!assembled && !assembleArgs.isEmptyLine)
+				succeeded = v3d_qpu_ra_fail(args, assembleArgs.errorMessage, lineNumber,
+				                            lineOffset);
+			else if (assembleArgs.isEmptyLine)
+				isEmptyLine = TRUE;
+			else
+				decoded[pass] = assembleArgs.instruction;
+		}
 
-	// Silly, but for consistency in error hint lists
-	static const char* rf_names[] = {
-	    "rf0",  "rf1",  "rf2",  "rf3",  "rf4",  "rf5",  "rf6",  "rf7",  "rf8",  "rf9",  "rf10",
-	    "rf11", "rf12", "rf13", "rf14", "rf15", "rf16", "rf17", "rf18", "rf19", "rf20", "rf21",
-	    "rf22", "rf23", "rf24", "rf25", "rf26", "rf27", "rf28", "rf29", "rf30", "rf31",
-	};
-	static const char* accumulator_register_names[] = {"r0", "r1", "r2", "r3", "r4", "r5"};
-	v3d_bool parsedSuccessfully = TRUE;
-	const char* currentChar = args->assembly;
-	const char** errorHintList = NULL;
-	int numErrorHints = 0;
+		if (succeeded && !isEmptyLine)
+		{
+			const struct v3d_qpu_instr* instr = &decoded[0];
+			for (int index = firstOccurrence; index < numOccurrences; ++index)
+			{
+				struct v3d_qpu_ra_occurrence* occurrence = &occurrences[index];
+				occurrence->offset += lineOffset;
+				occurrence->instruction = numInstructions;
+				occurrence->line =
+				    lineNumber + v3d_count_newlines(currentChar, source + occurrence->offset);
+				occurrence->next = -1;
+				// Destinations come first, and signals only take destinations
+				occurrence->isWrite =
+				    parts[index] >= 2 ||
+				    (operands[index] == 0 &&
+				     (parts[index] == 0 ? v3d_qpu_add_op_has_dst(instr->alu.add.op) :
+				                          v3d_qpu_mul_op_has_dst(instr->alu.mul.op)));
+
+				const char* name = source + occurrence->offset + 1;
+				int nameLength = occurrence->length - 1;
+				int vreg = v3d_qpu_ra_find_vreg(vregs, numVregs, name, nameLength);
+				if (vreg < 0)
+				{
+					vreg = numVregs++;
+					vregs[vreg] = (struct v3d_qpu_ra_vreg){0};
+					vregs[vreg].name = name;
+					vregs[vreg].nameLength = nameLength;
+					vregs[vreg].firstOccurrence = index;
+				}
+				else
+					occurrences[vregs[vreg].lastOccurrence].next = index;
+				vregs[vreg].lastOccurrence = index;
+				occurrence->vreg = vreg;
+			}
 
-#define BREAK_ERROR_HINT_SIZE(message, hintList, hintListSize) \
-	if (!parsedSuccessfully)                                   \
-	{                                                          \
-		args->errorAtOffset = currentChar - args->assembly;    \
-		args->errorMessage = (message);                        \
-		errorHintList = (hintList);                            \
-		numErrorHints = hintListSize;                          \
-		break;                                                 \
+			struct v3d_qpu_reg_usage usages[2];
+			v3d_qpu_get_reg_usage(&args->devinfo, &decoded[0], &usages[0]);
+			v3d_qpu_get_reg_usage(&args->devinfo, &decoded[1], &usages[1]);
+			namedRegisterFile |= usages[0].rfReads | usages[0].rfWrites;
+			namedAccumulators |= (usages[0].accReads | usages[0].accWrites) &
+			                     (usages[1].accReads | usages[1].accWrites);
+
+			struct v3d_qpu_ra_instruction* raInstruction = &instructions[numInstructions++];
+			raInstruction->line = lineNumber;
+			raInstruction->offset = lineOffset;
+			raInstruction->rfReadsLeft =
+			    (instr->sig.small_imm_b ? 1 : 2) - v3d_count_bits(usages[0].rfReads);
+			raInstruction->thrsw = instr->sig.thrsw;
+		}
+		else
+			numOccurrences = firstOccurrence;
+
+		lineNumber += v3d_count_newlines(currentChar, currentChar + lineLength);
+		currentChar += lineLength;
+		if (!v3d_peek(currentChar, end, 0))
+			break;
+		++currentChar;  // Newline
+		++lineNumber;
 	}
-	// NOTE: Assumes V3D_ARRAY_SIZE works on hintList
-#define BREAK_ERROR(message, hintList) \
-	BREAK_ERROR_HINT_SIZE(message, hintList, V3D_ARRAY_SIZE(hintList))
 
-#define BREAK_ERROR_NO_HINTS(message) \
-	BREAK_ERROR_HINT_SIZE(message, NULL, 0)
+	// Live ranges
+	for (int vreg = 0; vreg < numVregs && succeeded; ++vreg)
+	{
+		struct v3d_qpu_ra_vreg* ra = &vregs[vreg];
+		ra->start = occurrences[ra->firstOccurrence].instruction;
+		ra->end = occurrences[ra->lastOccurrence].instruction;
+		ra->lastWrite = -1;
+		for (int index = ra->firstOccurrence; index >= 0; index = occurrences[index].next)
+		{
+			const struct v3d_qpu_ra_occurrence* occurrence = &occurrences[index];
+			if (occurrence->isWrite)
+				ra->lastWrite = occurrence->instruction;
+			else if (occurrence->instruction == ra->start)
+			{
+				succeeded = v3d_qpu_ra_fail(args, "Virtual register is read before it is written",
+				                            occurrence->line, occurrence->offset);
+				break;
+			}
+		}
+		// The thread switches once the THRSW delay slots are done
+		for (int thrsw = 0; thrsw < numInstructions; ++thrsw)
+		{
+			if (instructions[thrsw].thrsw && ra->start <= thrsw + 2 && ra->end > thrsw + 2)
+				ra->livesAcrossThreadSwitch = TRUE;
+		}
+	}
 
-	// Mostly just to allow us to break to get to standard exit
-	for (int numLoops = 0; numLoops < 1; ++numLoops)
+	// Linear scan. Virtual registers are numbered in the order they're first written.
+	int registerFileOwners[V3D_QPU_RA_NUM_REGISTER_FILE];
+	int accumulatorOwners[V3D_QPU_RA_NUM_ACCUMULATORS];
+	for (int rf = 0; rf < V3D_QPU_RA_NUM_REGISTER_FILE; ++rf)
+	{
+		v3d_bool reserved = ((args->reservedRegisterFile >> rf) & 1) ||
+		                    ((namedRegisterFile >> rf) & 1);
+		registerFileOwners[rf] = reserved ? numVregs : -1;
+	}
+	for (int acc = 0; acc < V3D_QPU_RA_NUM_ACCUMULATORS; ++acc)
+	{
+		v3d_bool reserved = !args->devinfo.has_accumulators || ((namedAccumulators >> acc) & 1);
+		accumulatorOwners[acc] = reserved ? numVregs : -1;
+	}
+	v3d_uint32 accumulatorsUsed = 0;
+	for (int vreg = 0; vreg < numVregs && succeeded; ++vreg)
 	{
-		if (!v3d_qpu_skip_whitespace_comments(&currentChar))
+		struct v3d_qpu_ra_vreg* ra = &vregs[vreg];
+		for (int rf = 0; rf < V3D_QPU_RA_NUM_REGISTER_FILE; ++rf)
 		{
-			args->isEmptyLine = TRUE;
-			return currentChar - args->assembly;
+			int owner = registerFileOwners[rf];
+			if (owner >= 0 && owner < numVregs && v3d_qpu_ra_expired(&vregs[owner], ra))
+				registerFileOwners[rf] = -1;
+		}
+		for (int acc = 0; acc < V3D_QPU_RA_NUM_ACCUMULATORS; ++acc)
+		{
+			int owner = accumulatorOwners[acc];
+			if (owner >= 0 && owner < numVregs && v3d_qpu_ra_expired(&vregs[owner], ra))
+				accumulatorOwners[acc] = -1;
 		}
 
-		args->instructionStartsAtOffset = currentChar - args->assembly;
+		ra->reg = v3d_qpu_operand_none();
+		for (int acc = 0; acc < V3D_QPU_RA_NUM_ACCUMULATORS && !ra->livesAcrossThreadSwitch;
+		     ++acc)
+		{
+			if (accumulatorOwners[acc] >= 0)
+				continue;
+			accumulatorOwners[acc] = vreg;
+			accumulatorsUsed |= 1 << acc;
+			ra->reg = v3d_qpu_operand_acc(acc);
+			break;
+		}
+		if (ra->reg.kind != V3D_QPU_OPERAND_NONE)
+			continue;
 
-		// If we got this far we hit a character, so it's time to parse
-		// Filter on 'a' because there is a single ALU instruction that starts with b, barrierid.
-		// Since branches are either or b bu, we should be safe using the 'a' to discriminate them.
-		if (currentChar[0] == 'b' && currentChar[1] != 'a')
+		int fullInstruction = 0;
+		if (!v3d_qpu_ra_fits_raddrs(occurrences, instructions, ra, &fullInstruction))
 		{
-			// Branch instruction
-			// TODO
-			parsedSuccessfully = FALSE;
-			args->errorAtOffset = currentChar - args->assembly;
-			args->errorMessage = "Branch instructions unimplemented";
+			succeeded = v3d_qpu_ra_fail(
+			    args, "Too many register file reads in one instruction",
+			    instructions[fullInstruction].line, instructions[fullInstruction].offset);
 			break;
 		}
-		else
+		for (int rf = 0; rf < V3D_QPU_RA_NUM_REGISTER_FILE; ++rf)
 		{
-			// ALU instruction
-			// Add and mul are parsed nearly exactly the same
-			struct instruction_outputs
-			{
-				v3d_uint32* op;
-				const char** availableOperations;
-				int numAvailableOperations;
-				const char* operationNotFoundError;
-				struct v3d_qpu_input* inputs[2];
-				v3d_uint8* waddr;
-				v3d_bool* magic_write;
-				enum v3d_qpu_output_pack* output_pack;
-			};
-			struct instruction_outputs outputs[2] = {
-			    {
-			        (v3d_uint32*)&args->instruction.alu.add.op,
-			        add_op_names,
-					V3D_ARRAY_SIZE(add_op_names),
-					"Expected ALU add instruction or nop",
-			        {&args->instruction.alu.add.a, &args->instruction.alu.add.b},
-			        &args->instruction.alu.add.waddr,
-			        &args->instruction.alu.add.magic_write,
-			        &args->instruction.alu.add.output_pack,
-			    },
-				{
-			        (v3d_uint32*)&args->instruction.alu.mul.op,
-			        mul_op_names,
-					V3D_ARRAY_SIZE(mul_op_names),
-					"Expected ALU mul instruction or nop",
-			        {&args->instruction.alu.mul.a, &args->instruction.alu.mul.b},
-			        &args->instruction.alu.mul.waddr,
-			        &args->instruction.alu.mul.magic_write,
-			        &args->instruction.alu.mul.output_pack,
-			    },
-			};
-			// Search for this for the only other parsing differences
-			const int mulIndex = 1;
-
-			for (int outputIndex = 0; outputIndex < V3D_ARRAY_SIZE(outputs); ++outputIndex)
-			{
-				struct instruction_outputs* output = &outputs[outputIndex];
-				if (outputIndex > 0)
-				{
-					if (!v3d_qpu_skip_whitespace_comments(&currentChar) || currentChar[0] != ';')
-					{
-						parsedSuccessfully = FALSE;
-						BREAK_ERROR_NO_HINTS("Expected ';' between add and mul instructions");
-					}
-					++currentChar;
-
-					if (!v3d_qpu_skip_whitespace_comments(&currentChar))
-					{
-						parsedSuccessfully = FALSE;
-						BREAK_ERROR_HINT_SIZE(output->operationNotFoundError,
-						                      output->availableOperations,
-						                      output->numAvailableOperations);
-					}
-				}
-
-				parsedSuccessfully = v3d_qpu_value_from_name_list(
-				    currentChar, output->availableOperations, output->numAvailableOperations,
-				    /*dotOptional=*/FALSE, output->op, &currentChar);
-				BREAK_ERROR_HINT_SIZE(output->operationNotFoundError, output->availableOperations,
-				                      output->numAvailableOperations);
-
-				// From vir_to_qpu.c, v3d_qpu_nop() sets magic for NOP
-				if (*output->op == V3D_QPU_M_NOP || *output->op == V3D_QPU_A_NOP)
-				{
-					*output->waddr = V3D_QPU_WADDR_NOP;
-					*output->magic_write = TRUE;
-				}
+			if (registerFileOwners[rf] >= 0)
+				continue;
+			registerFileOwners[rf] = vreg;
+			ra->reg = v3d_qpu_operand_rf(rf);
+			v3d_qpu_ra_use_raddrs(occurrences, instructions, ra);
+			if (args->numRegisterFile < rf + 1)
+				args->numRegisterFile = rf + 1;
+			break;
+		}
+		if (ra->reg.kind == V3D_QPU_OPERAND_NONE)
+			succeeded = v3d_qpu_ra_fail(args, "Out of registers",
+			                            occurrences[ra->firstOccurrence].line,
+			                            occurrences[ra->firstOccurrence].offset);
+	}
 
-				// Condition and flags
-				while (*currentChar == '.')
-				{
-					if (v3d_qpu_value_from_name_list(
-							currentChar, cond_names, V3D_ARRAY_SIZE(cond_names),
-							/*dotOptional=*/TRUE, (v3d_uint32*)&args->instruction.flags.ac,
-							&currentChar))
-						continue;
+	if (succeeded)
+	{
+		for (int rf = 0; rf < 64; ++rf)
+		{
+			if (((namedRegisterFile >> rf) & 1) && args->numRegisterFile < rf + 1)
+				args->numRegisterFile = rf + 1;
+		}
+		args->numAccumulators = v3d_count_bits(accumulatorsUsed);
+		args->numVirtualRegisters = numVregs;
+		for (int vreg = 0; vreg < numVregs && vreg < args->maxAssignments; ++vreg)
+		{
+			args->assignmentsOut[vreg].name = vregs[vreg].name;
+			args->assignmentsOut[vreg].nameLength = vregs[vreg].nameLength;
+			args->assignmentsOut[vreg].reg = vregs[vreg].reg;
+		}
 
-					if (v3d_qpu_value_from_name_list(
-							currentChar, pf_names, V3D_ARRAY_SIZE(pf_names),
-							/*dotOptional=*/TRUE, (v3d_uint32*)&args->instruction.flags.mpf,
-							&currentChar))
-						continue;
+		// Occurrences are in source order
+		int copiedTo = 0;
+		for (int index = 0; index < numOccurrences && succeeded; ++index)
+		{
+			const struct v3d_qpu_ra_occurrence* occurrence = &occurrences[index];
+			struct v3d_qpu_operand reg = vregs[occurrence->vreg].reg;
+			char name[4];
+			int nameLength = v3d_qpu_ra_register_name(reg, name);
+			succeeded = v3d_qpu_ra_append(args, source + copiedTo, occurrence->offset - copiedTo) &&
+			            v3d_qpu_ra_append(args, name, nameLength);
+			copiedTo = occurrence->offset + occurrence->length;
+		}
+		if (succeeded)
+			succeeded = v3d_qpu_ra_append(args, source + copiedTo, args->sourceLength - copiedTo);
+		if (!succeeded)
+			v3d_qpu_ra_fail(args, "Output buffer too small", 0, 0);
+	}
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
+}
 
-					if (v3d_qpu_value_from_name_list(
-							currentChar, uf_names, V3D_ARRAY_SIZE(uf_names),
-							/*dotOptional=*/TRUE, (v3d_uint32*)&args->instruction.flags.muf,
-							&currentChar))
-						continue;
-					parsedSuccessfully = FALSE;
-					break;
-				}
-				BREAK_ERROR("Condition, pack flags, or uf unrecognized", cond_pf_uf_names);
+// Liveness
 
-				v3d_bool has_dst = FALSE;
-				int num_src = 0;
-				if (outputIndex == mulIndex)
-				{
-					has_dst = v3d_qpu_mul_op_has_dst(*output->op);
-					num_src = v3d_qpu_mul_op_num_src(*output->op);
-				}
-				else
-				{
-					has_dst = v3d_qpu_add_op_has_dst(*output->op);
-					num_src = v3d_qpu_add_op_num_src(*output->op);
-				}
+#define V3D_QPU_FLAG_A 1
+#define V3D_QPU_FLAG_B 2
 
-				if (has_dst)
-				{
-					if (!v3d_qpu_skip_whitespace_comments(&currentChar))
-					{
-						parsedSuccessfully = FALSE;
-						BREAK_ERROR("Expected destination operand rf0 through rf31 or waddr",
-						            waddr_names);
-					}
-					if (currentChar[0] == 'r' && currentChar[1] == 'f')
-					{
-						parsedSuccessfully = v3d_assemble_parse_register_file(
-						    currentChar, output->waddr, &currentChar);
-						BREAK_ERROR("Expected rf0 through rf31", rf_names);
-					}
-					else if (v32_qpu_magic_waddr_from_name(
-					             currentChar, (enum v3d_qpu_waddr*)output->waddr,
-					             &currentChar))
-					{
-						*(output->magic_write) = TRUE;
-					}
-					else
-						parsedSuccessfully = FALSE;
-					BREAK_ERROR("Expected rf0 through rf31 or waddr", waddr_names);
+// Registers and flags holding a value which may still be read
+struct v3d_qpu_liveness
+{
+	v3d_uint64 rf;
+	v3d_uint8 acc;
+	// V3D_QPU_FLAG_A and V3D_QPU_FLAG_B
+	v3d_uint8 flags;
+};
 
-					parsedSuccessfully = v3d_qpu_value_from_name_list(
-					    currentChar, pack_names, V3D_ARRAY_SIZE(pack_names),
-					    /*dotOptional=*/TRUE, (v3d_uint32*)output->output_pack,
-					    &currentChar);
-					BREAK_ERROR("Invalid pack operation", pack_names);
-				}
+// Registers an instruction always overwrites before the next one runs. A conditional write may
+// keep the old value, and ldvary's write lands an instruction later.
+static void v3d_qpu_get_kills(const struct v3d_device_info* devinfo,
+                              const struct v3d_qpu_instr* instr, struct v3d_qpu_reg_usage* killsOut)
+{
+	*killsOut = (struct v3d_qpu_reg_usage){0};
+	if (instr->type != V3D_QPU_INSTR_TYPE_ALU)
+		return;
+	if (instr->alu.add.op != V3D_QPU_A_NOP && v3d_qpu_add_op_has_dst(instr->alu.add.op) &&
+	    instr->flags.ac == V3D_QPU_COND_NONE)
+		v3d_qpu_dst_usage(instr->alu.add.waddr, instr->alu.add.magic_write, killsOut);
+	if (instr->alu.mul.op != V3D_QPU_M_NOP && v3d_qpu_mul_op_has_dst(instr->alu.mul.op) &&
+	    instr->flags.mc == V3D_QPU_COND_NONE)
+		v3d_qpu_dst_usage(instr->alu.mul.waddr, instr->alu.mul.magic_write, killsOut);
+	if (v3d_qpu_sig_writes_address(devinfo, &instr->sig) && !instr->sig.ldvary)
+		v3d_qpu_dst_usage(instr->sig_addr, instr->sig_magic, killsOut);
+}
 
-				for (int src = 0; src < num_src; ++src)
-				{
-					struct v3d_qpu_input* srcInput = output->inputs[src];
-					if (!v3d_qpu_skip_whitespace_comments(&currentChar))
-					{
-						parsedSuccessfully = FALSE;
-						BREAK_ERROR_NO_HINTS(
-						    "Expected source operand rf0 through rf31, accumulator register r0-r5, "
-						    "or small immediate");
-					}
+static v3d_uint8 v3d_qpu_cond_flags(enum v3d_qpu_cond cond)
+{
+	switch (cond)
+	{
+		case V3D_QPU_COND_IFA:
+		case V3D_QPU_COND_IFNA:
+			return V3D_QPU_FLAG_A;
+		case V3D_QPU_COND_IFB:
+		case V3D_QPU_COND_IFNB:
+			return V3D_QPU_FLAG_B;
+		default:
+			return 0;
+	}
+}
 
-					if ((has_dst && src == 0) || src > 0)
-					{
-						if (currentChar[0] != ',')
-						{
-							parsedSuccessfully = FALSE;
-							BREAK_ERROR_NO_HINTS("Expected , before source operand");
-						}
-						else
-						{
-							++currentChar;
-							if (!v3d_qpu_skip_whitespace_comments(&currentChar))
-							{
-								parsedSuccessfully = FALSE;
-								BREAK_ERROR_NO_HINTS(
-								    "Expected source operand rf0 through rf31, accumulator "
-								    "register r0-r5, or small immediate");
-							}
-						}
-					}
+// Flags the add ops which return something about them read
+static v3d_uint8 v3d_qpu_add_op_flags(enum v3d_qpu_add_op op)
+{
+	switch (op)
+	{
+		case V3D_QPU_A_VFLA:
+		case V3D_QPU_A_VFLNA:
+		case V3D_QPU_A_FLAPUSH:
+		case V3D_QPU_A_FLAFIRST:
+		case V3D_QPU_A_FLNAFIRST:
+			return V3D_QPU_FLAG_A;
+		case V3D_QPU_A_VFLB:
+		case V3D_QPU_A_VFLNB:
+		case V3D_QPU_A_FLBPUSH:
+			return V3D_QPU_FLAG_B;
+		default:
+			return 0;
+	}
+}
 
-					// (todo Pi 5) V3D 71+ support (V3D_QPU_ADD_A input)
-					enum v3d_qpu_assemble_raddr_result raddrResult = v3d33_qpu_assemble_raddr(
-					    &args->instruction, &srcInput->mux, currentChar, &currentChar);
-					parsedSuccessfully = raddrResult == v3d_qpu_assemble_raddr_result_success;
-					const char* raddrError = NULL;
-					const char** raddrList = NULL;
-					int raddrListLength = 0;
-					switch (raddrResult)
-					{
-						case v3d_qpu_assemble_raddr_result_invalid_register_file:
-							raddrError = "Unrecognized register file";
-							raddrList = rf_names;
-							raddrListLength = V3D_ARRAY_SIZE(rf_names);
-							break;
-						case v3d_qpu_assemble_raddr_result_invalid_accumulator_register:
-							raddrError = "Unrecognized accumulator register";
-							raddrList = accumulator_register_names;
-							raddrListLength = V3D_ARRAY_SIZE(accumulator_register_names);
-							break;
-						case v3d_qpu_assemble_raddr_result_invalid_small_immediate:
-							raddrError = "Unrecognized small immediate";
-							raddrList = small_immediates_names;
-							raddrListLength = V3D_ARRAY_SIZE(small_immediates_names);
-							break;
-						case v3d_qpu_assemble_raddr_result_no_raddr_space_too_many_immediates:
-							raddrError =
-							    "Too many small immediates. Only one small immediate may be "
-							    "specified per instruction";
-							break;
-						case v3d_qpu_assemble_raddr_result_no_raddr_space:
-							raddrError =
-							    "Too many unique register files (plus small immediate) specified. "
-							    "Only two unique raddrs (two register files or one register file "
-							    "and one small immediate) may be specified per instruction";
-							break;
-						default:
-							raddrError = "Unspecified error with raddr parsing";
-							break;
-					}
-					BREAK_ERROR_HINT_SIZE(raddrError, raddrList, raddrListLength);
+static struct v3d_qpu_liveness v3d_qpu_liveness_in(const struct v3d_device_info* devinfo,
+                                                   const struct v3d_qpu_instr* instr,
+                                                   struct v3d_qpu_liveness liveOut)
+{
+	struct v3d_qpu_reg_usage usage;
+	struct v3d_qpu_reg_usage kills;
+	v3d_qpu_get_reg_usage(devinfo, instr, &usage);
+	v3d_qpu_get_kills(devinfo, instr, &kills);
+	struct v3d_qpu_liveness liveIn;
+	liveIn.rf = usage.rfReads | (liveOut.rf & ~kills.rfWrites);
+	liveIn.acc = usage.accReads | (liveOut.acc & ~kills.accWrites);
+	if (instr->type == V3D_QPU_INSTR_TYPE_BRANCH)
+	{
+		liveIn.flags = liveOut.flags;
+		if (instr->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS)
+			liveIn.flags |= V3D_QPU_FLAG_A;
+		return liveIn;
+	}
+
+	// Each push moves A to B and sets A. Updates combine with the flags already there.
+	v3d_uint8 flags = liveOut.flags;
+	if (instr->flags.mpf != V3D_QPU_PF_NONE)
+		flags = (flags & V3D_QPU_FLAG_B) ? V3D_QPU_FLAG_A : 0;
+	if (instr->flags.apf != V3D_QPU_PF_NONE)
+		flags = (flags & V3D_QPU_FLAG_B) ? V3D_QPU_FLAG_A : 0;
+	if (flags && (instr->flags.auf != V3D_QPU_UF_NONE || instr->flags.muf != V3D_QPU_UF_NONE))
+		flags = V3D_QPU_FLAG_A | V3D_QPU_FLAG_B;
+	// Conditions and ops read the flags from before the instruction
+	flags |= v3d_qpu_add_op_flags(instr->alu.add.op);
+	if (instr->alu.add.op != V3D_QPU_A_NOP)
+		flags |= v3d_qpu_cond_flags(instr->flags.ac);
+	if (instr->alu.mul.op != V3D_QPU_M_NOP)
+		flags |= v3d_qpu_cond_flags(instr->flags.mc);
+	liveIn.flags = flags;
+	return liveIn;
+}
 
-					parsedSuccessfully = v3d_qpu_value_from_name_list(
-					    currentChar, unpack_names, V3D_ARRAY_SIZE(unpack_names),
-					    /*dotOptional=*/TRUE, (v3d_uint32*)&srcInput->unpack,
-					    &currentChar);
-					BREAK_ERROR("Invalid unpack operation", unpack_names);
-				}
+// What is live after instruction i, from liveIn of every instruction. A branch takes effect after
+// its three delay slots. Branches to somewhere other than a relative target within the program
+// could go anywhere, so unknownTarget is live after them.
+static struct v3d_qpu_liveness v3d_qpu_liveness_out(const struct v3d_qpu_instr* instructions,
+                                                    int numInstructions,
+                                                    const struct v3d_qpu_liveness* liveIn,
+                                                    struct v3d_qpu_liveness unknownTarget, int i)
+{
+	const struct v3d_qpu_instr* branch = NULL;
+	if (i >= 3 && instructions[i - 3].type == V3D_QPU_INSTR_TYPE_BRANCH)
+		branch = &instructions[i - 3];
+
+	struct v3d_qpu_liveness liveOut = {0};
+	const struct v3d_qpu_liveness* successors[2] = {NULL, NULL};
+	if (i + 1 < numInstructions && (!branch || branch->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS))
+		successors[0] = &liveIn[i + 1];
+	if (branch && branch->branch.bdi != V3D_QPU_BRANCH_DEST_REL)
+		successors[1] = &unknownTarget;
+	else if (branch)
+	{
+		int target = v3d_qpu_branch_target(i - 3, branch->branch.offset);
+		successors[1] =
+		    target >= 0 && target < numInstructions ? &liveIn[target] : &unknownTarget;
+	}
+	for (int successor = 0; successor < 2; ++successor)
+	{
+		if (!successors[successor])
+			continue;
+		liveOut.rf |= successors[successor]->rf;
+		liveOut.acc |= successors[successor]->acc;
+		liveOut.flags |= successors[successor]->flags;
+	}
+	return liveOut;
+}
+
+// Fills liveInOut with what is live before each instruction, working backwards until nothing
+// changes, which takes one more pass per loop nesting level
+static void v3d_qpu_compute_liveness(const struct v3d_device_info* devinfo,
+                                     const struct v3d_qpu_instr* instructions,
+                                     int numInstructions, struct v3d_qpu_liveness unknownTarget,
+                                     struct v3d_qpu_liveness* liveInOut)
+{
+	for (int i = 0; i < numInstructions; ++i)
+		liveInOut[i] = (struct v3d_qpu_liveness){0};
+	for (v3d_bool changed = TRUE; changed;)
+	{
+		changed = FALSE;
+		for (int i = numInstructions - 1; i >= 0; --i)
+		{
+			struct v3d_qpu_liveness liveIn = v3d_qpu_liveness_in(
+			    devinfo, &instructions[i],
+			    v3d_qpu_liveness_out(instructions, numInstructions, liveInOut, unknownTarget, i));
+			if (liveIn.rf != liveInOut[i].rf || liveIn.acc != liveInOut[i].acc ||
+			    liveIn.flags != liveInOut[i].flags)
+			{
+				liveInOut[i] = liveIn;
+				changed = TRUE;
 			}
+		}
+	}
+}
 
-			if (!parsedSuccessfully)
-				break;
+// Occupancy
 
-			// Finally, parse (optional) signals
-			v3d_bool sigWithAddressSpecified = FALSE;
-			while (v3d_qpu_skip_whitespace_comments(&currentChar))
-			{
-				if (currentChar[0] != ';')
-				{
-					parsedSuccessfully = FALSE;
-					BREAK_ERROR_NO_HINTS("Expected ';' before start of signal");
-				}
-				++currentChar;
+// Entries in the physical register file, which the threads on a QPU split between them
+#define V3D_QPU_REGISTER_FILE_SIZE 64
 
-				if (!v3d_qpu_skip_whitespace_comments(&currentChar))
-				{
-					// Finished with the line. We'll allow dangling ; after mul.
-					break;
-				}
+static v3d_bool v3d_qpu_occupancy_fail(struct v3d_qpu_analyze_occupancy_arguments* args,
+                                       const char* message, int instructionIndex)
+{
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
-				v3d_bool sigTakesAddress = FALSE;
-				parsedSuccessfully = v3d_qpu_assemble_signal(&args->instruction.sig, &sigTakesAddress,
-															 currentChar, &currentChar);
-				BREAK_ERROR("Unrecognized signal name", sig_names);
+static int v3d_qpu_max_threads_for_register_file(int numRegisterFile)
+{
+	int threads = 4;
+	while (threads > 1 && numRegisterFile > V3D_QPU_REGISTER_FILE_SIZE / threads)
+		threads /= 2;
+	return threads;
+}
 
-				if (sigTakesAddress)
-				{
-					if (sigWithAddressSpecified)
-					{
-						parsedSuccessfully = FALSE;
-						BREAK_ERROR_NO_HINTS(
-						    "Too many signals with addresses specified. Only one signal with "
-						    "address may be specified per instruction");
-					}
-					sigWithAddressSpecified = TRUE;
-				}
+v3d_bool v3d_qpu_analyze_occupancy(struct v3d_qpu_analyze_occupancy_arguments* args)
+{
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->maxLiveRegisterFile = 0;
+	args->maxLiveInstructionIndex = 0;
+	args->numRegisterFile = 0;
+	args->highestRegisterFileInstructionIndex = -1;
+	args->numThreadSwitches = 0;
+	args->lastThreadSwitchFound = FALSE;
+	args->maxThreads = 1;
+	args->maxThreadsIfRenumbered = 1;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_occupancy_fail(args, "V3D 7.x occupancy analysis not implemented", 0);
 
-				// Optional sig_addr
-				if (currentChar[0] == '.')
-				{
-					if (!sigTakesAddress)
-					{
-						parsedSuccessfully = FALSE;
-						BREAK_ERROR(
-							"Signal does not support an address. Check for a signal variant which does "
-							"take an address",
-							sig_names);
-					}
-					++currentChar;
-					if (currentChar[0] == 'r' && currentChar[1] == 'f')
-					{
-						parsedSuccessfully = v3d_assemble_parse_register_file(
-							currentChar, &args->instruction.sig_addr, &currentChar);
-						BREAK_ERROR("Expected rf0 through rf31", rf_names);
-					}
-					else
-					{
-						enum v3d_qpu_waddr waddr = 0;
-						parsedSuccessfully =
-							v32_qpu_magic_waddr_from_name(currentChar, &waddr, &currentChar);
-						args->instruction.sig_addr = waddr;
-						args->instruction.sig_magic = TRUE;
-					}
-					BREAK_ERROR("Expected rf0 through rf31 or waddr", waddr_names);
-				}
+	// Thread switches are checked with the validator's own bookkeeping
+	struct v3d_qpu_validate_state state;
+	qpu_validate_begin(&state, &args->devinfo);
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		if (!qpu_validate_inst(&state, &instructions[i]))
+			return v3d_qpu_occupancy_fail(args, state.errorMessage, i);
+		state.last = &instructions[i];
+		state.ip++;
+	}
+	if (!qpu_validate_finish(&state, numInstructions,
+	                         numInstructions >= 2 && instructions[numInstructions - 2].sig.thrsw,
+	                         numInstructions >= 1 && instructions[numInstructions - 1].sig.thrsw))
+		return v3d_qpu_occupancy_fail(args, state.errorMessage, numInstructions - 1);
+	args->numThreadSwitches = state.thrsw_count;
+	args->lastThreadSwitchFound = state.last_thrsw_found;
 
-				/* if (v3d_qpu_skip_whitespace_comments(&currentChar)) */
-				/* { */
-				/* 	parsedSuccessfully = FALSE; */
-				/* 	BREAK_ERROR("Unexpected text at end of instruction; only one instruction per line allowed", NULL); */
-				/* } */
+	struct v3d_qpu_liveness allUsed = {0};
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, &instructions[i], &usage);
+		v3d_uint64 used = usage.rfReads | usage.rfWrites;
+		for (int rf = args->numRegisterFile; rf < V3D_QPU_REGISTER_FILE_SIZE; ++rf)
+		{
+			if ((used >> rf) & 1)
+			{
+				args->numRegisterFile = rf + 1;
+				args->highestRegisterFileInstructionIndex = i;
 			}
-			// Finished with the instruction
-			break;
 		}
+		allUsed.rf |= used;
 	}
-#undef BREAK_ERROR
-#undef BREAK_ERROR_HINT_SIZE
 
-	if (errorHintList && numErrorHints)
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	struct v3d_qpu_liveness* liveIn =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_liveness, numInstructions + 1);
+	if (!liveIn)
 	{
-		args->hintAvailable = errorHintList;
-		args->numHints = numErrorHints;
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_occupancy_fail(args, "Out of arena memory", 0);
 	}
-	if (!parsedSuccessfully)
-		return 0;
-	return currentChar - args->assembly;
+	v3d_qpu_compute_liveness(&args->devinfo, instructions, numInstructions, allUsed, liveIn);
+
+	// A register read for the last time can be written again by the same instruction
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, &instructions[i], &usage);
+		struct v3d_qpu_liveness liveOut =
+		    v3d_qpu_liveness_out(instructions, numInstructions, liveIn, allUsed, i);
+		int live = v3d_count_bits(liveIn[i].rf);
+		int liveAfter = v3d_count_bits(liveOut.rf | usage.rfWrites);
+		if (liveAfter > live)
+			live = liveAfter;
+		if (live > args->maxLiveRegisterFile)
+		{
+			args->maxLiveRegisterFile = live;
+			args->maxLiveInstructionIndex = i;
+		}
+	}
+	v3d_arena_restore(args->arena, marker);
+
+	args->maxThreads = v3d_qpu_max_threads_for_register_file(args->numRegisterFile);
+	args->maxThreadsIfRenumbered =
+	    v3d_qpu_max_threads_for_register_file(args->maxLiveRegisterFile);
+	return TRUE;
 }
 
-// >> qpu_validate.c
+// Peephole optimization
 
-struct v3d_qpu_validate_state {
-	const struct v3d_device_info *devinfo;
-	const struct v3d_qpu_instr *last;
-	int ip;
-	int last_sfu_write;
-	int last_branch_ip;
-	int last_thrsw_ip;
-	int first_tlb_z_write;
+// An ALU instruction as the builder takes it
+struct v3d_qpu_alu_parts
+{
+	enum v3d_qpu_add_op addOp;
+	enum v3d_qpu_mul_op mulOp;
+	struct v3d_qpu_operand addDst;
+	struct v3d_qpu_operand mulDst;
+	// addA, addB, mulA, mulB, with unused ones V3D_QPU_OPERAND_NONE
+	struct v3d_qpu_operand sources[4];
+	struct v3d_qpu_emit_modifiers modifiers;
+};
 
-	/* Set when we've found the last-THRSW signal, or if we were started
-	 * in single-segment mode.
-	 */
-	v3d_bool last_thrsw_found;
+struct v3d_qpu_peephole_context
+{
+	struct v3d_qpu_peephole_arguments* args;
+	// The program being rewritten, with the input's indices. Removed instructions are NOPs here.
+	struct v3d_qpu_instr* work;
+	struct v3d_qpu_liveness* liveIn;
+	v3d_bool* removed;
+	v3d_bool* inDelaySlots;
+	v3d_bool* isBranchTarget;
+	int* oldIndices;
+	int* newIndices;
+};
 
-	/* Set when we've found the THRSW after the last THRSW */
-	v3d_bool thrend_found;
+static v3d_bool v3d_qpu_peephole_fail(struct v3d_qpu_peephole_arguments* args,
+                                      const char* message, int instructionIndex)
+{
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
-	int thrsw_count;
+static void v3d_qpu_get_alu_parts(const struct v3d_qpu_instr* instr,
+                                  struct v3d_qpu_alu_parts* partsOut)
+{
+	struct v3d_qpu_alu_parts* parts = partsOut;
+	const struct v3d_qpu_alu_instr* alu = &instr->alu;
+	int numAddSrc = v3d_qpu_add_op_num_src(alu->add.op);
+	int numMulSrc = v3d_qpu_mul_op_num_src(alu->mul.op);
+	struct v3d_qpu_operand none = v3d_qpu_operand_none();
+	parts->addOp = alu->add.op;
+	parts->mulOp = alu->mul.op;
+	parts->addDst = v3d_qpu_waddr_operand(v3d_qpu_add_op_has_dst(alu->add.op), alu->add.waddr,
+	                                      alu->add.magic_write, alu->add.output_pack);
+	parts->mulDst = v3d_qpu_waddr_operand(v3d_qpu_mul_op_has_dst(alu->mul.op), alu->mul.waddr,
+	                                      alu->mul.magic_write, alu->mul.output_pack);
+	parts->sources[0] = numAddSrc > 0 ? v3d_qpu_input_operand(instr, &alu->add.a) : none;
+	parts->sources[1] = numAddSrc > 1 ? v3d_qpu_input_operand(instr, &alu->add.b) : none;
+	parts->sources[2] = numMulSrc > 0 ? v3d_qpu_input_operand(instr, &alu->mul.a) : none;
+	parts->sources[3] = numMulSrc > 1 ? v3d_qpu_input_operand(instr, &alu->mul.b) : none;
+	parts->modifiers = (struct v3d_qpu_emit_modifiers){0};
+	parts->modifiers.flags = instr->flags;
+	parts->modifiers.sig = instr->sig;
+	// Decided again by the build
+	parts->modifiers.sig.small_imm_b = FALSE;
+	parts->modifiers.sig_addr = instr->sig_addr;
+	parts->modifiers.sig_magic = instr->sig_magic;
+}
 
-	// Include message for ease of use as well as value if e.g. an editor wants to provide helpful
-	// fixups or suggestions.
-	const char* errorMessage;
-	enum v3d_qpu_validate_error error;
-};
+static void v3d_qpu_clear_add_part(struct v3d_qpu_alu_parts* parts)
+{
+	parts->addOp = V3D_QPU_A_NOP;
+	parts->addDst = v3d_qpu_operand_none();
+	parts->sources[0] = v3d_qpu_operand_none();
+	parts->sources[1] = v3d_qpu_operand_none();
+	parts->modifiers.flags.ac = V3D_QPU_COND_NONE;
+	parts->modifiers.flags.apf = V3D_QPU_PF_NONE;
+	parts->modifiers.flags.auf = V3D_QPU_UF_NONE;
+}
 
-static void fail_instr(struct v3d_qpu_validate_state* state, enum v3d_qpu_validate_error error,
-                       const char* msg)
+static void v3d_qpu_clear_mul_part(struct v3d_qpu_alu_parts* parts)
 {
-	state->errorMessage = msg;
-	state->error = error;
-	/* struct v3d_compile *c = state->c; */
+	parts->mulOp = V3D_QPU_M_NOP;
+	parts->mulDst = v3d_qpu_operand_none();
+	parts->sources[2] = v3d_qpu_operand_none();
+	parts->sources[3] = v3d_qpu_operand_none();
+	parts->modifiers.flags.mc = V3D_QPU_COND_NONE;
+	parts->modifiers.flags.mpf = V3D_QPU_PF_NONE;
+	parts->modifiers.flags.muf = V3D_QPU_UF_NONE;
+}
 
-	/* fprintf(stderr, "v3d_qpu_validate at ip %d: %s:\n", state->ip, msg); */
+// Goes through packing, so the result is exactly what the hardware would run. Fails rather than
+// let the encoding swap an op for its twin, e.g. fadd for faddnf.
+static v3d_bool v3d_qpu_build_alu_parts(const struct v3d_device_info* devinfo,
+                                        const struct v3d_qpu_alu_parts* parts,
+                                        struct v3d_qpu_instr* instrOut)
+{
+	struct v3d_qpu_instr built;
+	const char* error = NULL;
+	v3d_uint64 packed = 0;
+	return v3d_qpu_build_alu(devinfo, parts->addOp, parts->addDst, parts->sources[0],
+	                         parts->sources[1], parts->mulOp, parts->mulDst, parts->sources[2],
+	                         parts->sources[3], &parts->modifiers, &built, &error) &&
+	       v3d_qpu_instr_pack(devinfo, &built, &packed) &&
+	       v3d_qpu_instr_unpack(devinfo, packed, instrOut) &&
+	       instrOut->alu.add.op == parts->addOp && instrOut->alu.mul.op == parts->mulOp;
+}
 
-	/* int dump_ip = 0; */
-	/* vir_for_each_inst_inorder(inst, c) { */
-	/*         v3d_qpu_dump(c->devinfo, &inst->qpu); */
+// The register a destination writes, as a source operand. None for waddrs which aren't registers.
+static struct v3d_qpu_operand v3d_qpu_dst_register(struct v3d_qpu_operand dst)
+{
+	if (dst.kind == V3D_QPU_OPERAND_REGISTER_FILE)
+		return v3d_qpu_operand_rf(dst.index);
+	if (dst.kind == V3D_QPU_OPERAND_MAGIC && dst.index <= V3D_QPU_WADDR_R5)
+		return v3d_qpu_operand_acc(dst.index - V3D_QPU_WADDR_R0);
+	return v3d_qpu_operand_none();
+}
 
-	/*         if (dump_ip++ == state->ip) */
-	/*                 fprintf(stderr, " *** ERROR ***"); */
+static v3d_bool v3d_qpu_usage_has_register(const struct v3d_qpu_reg_usage* usage,
+                                           v3d_bool reads, struct v3d_qpu_operand reg)
+{
+	if (reg.kind == V3D_QPU_OPERAND_REGISTER_FILE)
+		return ((reads ? usage->rfReads : usage->rfWrites) >> reg.index) & 1;
+	if (reg.kind == V3D_QPU_OPERAND_ACCUMULATOR)
+		return ((reads ? usage->accReads : usage->accWrites) >> reg.index) & 1;
+	return FALSE;
+}
 
-	/*         fprintf(stderr, "\n"); */
-	/* } */
+static v3d_bool v3d_qpu_liveness_has_register(struct v3d_qpu_liveness liveness,
+                                              struct v3d_qpu_operand reg)
+{
+	if (reg.kind == V3D_QPU_OPERAND_REGISTER_FILE)
+		return (liveness.rf >> reg.index) & 1;
+	if (reg.kind == V3D_QPU_OPERAND_ACCUMULATOR)
+		return (liveness.acc >> reg.index) & 1;
+	return FALSE;
+}
 
-	/* fprintf(stderr, "\n"); */
+// Carry is the only flag which depends on the op rather than just the result
+static v3d_bool v3d_qpu_flags_use_carry(enum v3d_qpu_pf pf, enum v3d_qpu_uf uf)
+{
+	return pf == V3D_QPU_PF_PUSHC || uf == V3D_QPU_UF_ANDC || uf == V3D_QPU_UF_ANDNC ||
+	       uf == V3D_QPU_UF_NORNC || uf == V3D_QPU_UF_NORC;
 }
 
-static v3d_bool
-in_branch_delay_slots(struct v3d_qpu_validate_state *state)
+// Whether instruction i + 1 always runs straight after instruction i
+static v3d_bool v3d_qpu_peephole_falls_through(const struct v3d_qpu_peephole_context* context,
+                                               int i)
 {
-	return (state->ip - state->last_branch_ip) < 3;
+	return i + 1 < context->args->numInstructions &&
+	       !(i >= 3 && context->work[i - 3].type == V3D_QPU_INSTR_TYPE_BRANCH) &&
+	       context->work[i + 1].type == V3D_QPU_INSTR_TYPE_ALU;
+}
+
+// Copies the program without removed instructions into instructionsOut and validates it
+static v3d_bool v3d_qpu_peephole_build(struct v3d_qpu_peephole_context* context,
+                                       struct v3d_qpu_validate_result* resultOut)
+{
+	struct v3d_qpu_peephole_arguments* args = context->args;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		context->newIndices[i] = args->numInstructionsOut;
+		if (context->removed[i])
+			continue;
+		int outIndex = args->numInstructionsOut++;
+		args->instructionsOut[outIndex] = context->work[i];
+		context->oldIndices[outIndex] = i;
+	}
+	context->newIndices[numInstructions] = args->numInstructionsOut;
+	v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, context->oldIndices,
+	                       context->newIndices, numInstructions);
+
+	*resultOut = (struct v3d_qpu_validate_result){0};
+	return v3d_qpu_validate(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+	                        resultOut);
+}
+
+// Puts replacements for instructions first and second (or -1) in place, keeping them if the
+// program still validates. An instruction left doing nothing is removed if that validates too.
+static v3d_bool v3d_qpu_peephole_try(struct v3d_qpu_peephole_context* context, int first,
+                                     const struct v3d_qpu_instr* firstInstr, int second,
+                                     const struct v3d_qpu_instr* secondInstr)
+{
+	struct v3d_qpu_instr oldFirst = context->work[first];
+	struct v3d_qpu_instr oldSecond = second >= 0 ? context->work[second] : oldFirst;
+	context->work[first] = *firstInstr;
+	if (second >= 0)
+		context->work[second] = *secondInstr;
+
+	struct v3d_qpu_validate_result result;
+	if (!context->inDelaySlots[first] && v3d_qpu_instr_is_plain_nop(firstInstr))
+	{
+		context->removed[first] = TRUE;
+		if (v3d_qpu_peephole_build(context, &result))
+			return TRUE;
+		context->removed[first] = FALSE;
+	}
+	if (v3d_qpu_peephole_build(context, &result))
+		return TRUE;
+
+	context->work[first] = oldFirst;
+	if (second >= 0)
+		context->work[second] = oldSecond;
+	return FALSE;
+}
+
+// A mov or fmov in the add (isAdd) or mul ALU of instruction i, whose result i + 1 overwrites
+static v3d_bool v3d_qpu_peephole_remove_mov(struct v3d_qpu_peephole_context* context, int i,
+                                            v3d_bool isAdd)
+{
+	const struct v3d_device_info* devinfo = &context->args->devinfo;
+	struct v3d_qpu_alu_parts parts;
+	v3d_qpu_get_alu_parts(&context->work[i], &parts);
+	const struct v3d_qpu_flags* flags = &parts.modifiers.flags;
+	if (isAdd ? (parts.addOp != V3D_QPU_A_MOV && parts.addOp != V3D_QPU_A_FMOV) ||
+	                flags->apf != V3D_QPU_PF_NONE || flags->auf != V3D_QPU_UF_NONE
+	          : (parts.mulOp != V3D_QPU_M_MOV && parts.mulOp != V3D_QPU_M_FMOV) ||
+	                flags->mpf != V3D_QPU_PF_NONE || flags->muf != V3D_QPU_UF_NONE)
+		return FALSE;
+	struct v3d_qpu_operand reg = v3d_qpu_dst_register(isAdd ? parts.addDst : parts.mulDst);
+	if (reg.kind == V3D_QPU_OPERAND_NONE || !v3d_qpu_peephole_falls_through(context, i))
+		return FALSE;
+
+	struct v3d_qpu_reg_usage nextUsage;
+	struct v3d_qpu_reg_usage nextKills;
+	v3d_qpu_get_reg_usage(devinfo, &context->work[i + 1], &nextUsage);
+	v3d_qpu_get_kills(devinfo, &context->work[i + 1], &nextKills);
+	if (!v3d_qpu_usage_has_register(&nextKills, FALSE, reg) ||
+	    v3d_qpu_usage_has_register(&nextUsage, TRUE, reg))
+		return FALSE;
+
+	if (isAdd)
+		v3d_qpu_clear_add_part(&parts);
+	else
+		v3d_qpu_clear_mul_part(&parts);
+	struct v3d_qpu_instr instr;
+	return v3d_qpu_build_alu_parts(devinfo, &parts, &instr) &&
+	       v3d_qpu_peephole_try(context, i, &instr, -1, NULL);
 }
 
-static v3d_bool
-in_thrsw_delay_slots(struct v3d_qpu_validate_state *state)
-{
-	return (state->ip - state->last_thrsw_ip) < 3;
+// A mov in the add (isAdd) or mul ALU of instruction i, whose result only i + 1 reads
+static v3d_bool v3d_qpu_peephole_fold_mov(struct v3d_qpu_peephole_context* context, int i,
+                                          v3d_bool isAdd)
+{
+	const struct v3d_device_info* devinfo = &context->args->devinfo;
+	struct v3d_qpu_alu_parts parts;
+	v3d_qpu_get_alu_parts(&context->work[i], &parts);
+	const struct v3d_qpu_flags* flags = &parts.modifiers.flags;
+	if (isAdd ? parts.addOp != V3D_QPU_A_MOV || flags->ac != V3D_QPU_COND_NONE ||
+	                flags->apf != V3D_QPU_PF_NONE || flags->auf != V3D_QPU_UF_NONE
+	          : parts.mulOp != V3D_QPU_M_MOV || flags->mc != V3D_QPU_COND_NONE ||
+	                flags->mpf != V3D_QPU_PF_NONE || flags->muf != V3D_QPU_UF_NONE)
+		return FALSE;
+	struct v3d_qpu_operand dst = isAdd ? parts.addDst : parts.mulDst;
+	struct v3d_qpu_operand value = parts.sources[isAdd ? 0 : 2];
+	struct v3d_qpu_operand reg = v3d_qpu_dst_register(dst);
+	int consumer = i + 1;
+	if (reg.kind == V3D_QPU_OPERAND_NONE || dst.pack != V3D_QPU_PACK_NONE ||
+	    value.unpack != V3D_QPU_UNPACK_NONE || v3d_qpu_operand_same_source(value, reg) ||
+	    !v3d_qpu_peephole_falls_through(context, i) || context->isBranchTarget[consumer] ||
+	    context->removed[consumer])
+		return FALSE;
+
+	// The value must still be there when the consumer reads it. r3-r5 are written implicitly,
+	// some of them late.
+	struct v3d_qpu_reg_usage usage;
+	v3d_qpu_get_reg_usage(devinfo, &context->work[i], &usage);
+	if ((value.kind == V3D_QPU_OPERAND_ACCUMULATOR && value.index > 2) ||
+	    v3d_qpu_usage_has_register(&usage, FALSE, value))
+		return FALSE;
+	if (i > 0 && context->work[i - 1].type == V3D_QPU_INSTR_TYPE_ALU &&
+	    context->work[i - 1].sig.ldvary && !context->work[i - 1].sig_magic &&
+	    value.kind == V3D_QPU_OPERAND_REGISTER_FILE && context->work[i - 1].sig_addr == value.index)
+		return FALSE;
+
+	// Nothing after the consumer may read the mov's result
+	struct v3d_qpu_reg_usage consumerKills;
+	v3d_qpu_get_kills(devinfo, &context->work[consumer], &consumerKills);
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	struct v3d_qpu_liveness consumerLiveOut =
+	    v3d_qpu_liveness_out(context->work, context->args->numInstructions, context->liveIn,
+	                         unknownTarget, consumer);
+	if (!v3d_qpu_usage_has_register(&consumerKills, FALSE, reg) &&
+	    v3d_qpu_liveness_has_register(consumerLiveOut, reg))
+		return FALSE;
+
+	struct v3d_qpu_alu_parts consumerParts;
+	v3d_qpu_get_alu_parts(&context->work[consumer], &consumerParts);
+	int numReplaced = 0;
+	for (int source = 0; source < 4; ++source)
+	{
+		if (!v3d_qpu_operand_same_source(consumerParts.sources[source], reg))
+			continue;
+		consumerParts.sources[source] =
+		    v3d_qpu_operand_unpack(value, consumerParts.sources[source].unpack);
+		++numReplaced;
+	}
+	if (!numReplaced)
+		return FALSE;
+
+	if (isAdd)
+		v3d_qpu_clear_add_part(&parts);
+	else
+		v3d_qpu_clear_mul_part(&parts);
+	struct v3d_qpu_instr instr;
+	struct v3d_qpu_instr consumerInstr;
+	return v3d_qpu_build_alu_parts(devinfo, &parts, &instr) &&
+	       v3d_qpu_build_alu_parts(devinfo, &consumerParts, &consumerInstr) &&
+	       v3d_qpu_peephole_try(context, i, &instr, consumer, &consumerInstr);
 }
 
-/* static v3d_bool */
-/* qpu_magic_waddr_matches(const struct v3d_qpu_instr *inst, */
-/*                         v3d_bool (*predicate)(enum v3d_qpu_waddr waddr)) */
-/* { */
-/* 	if (inst->type == V3D_QPU_INSTR_TYPE_ALU) */
-/* 		return FALSE; */
-
-/* 	if (inst->alu.add.op != V3D_QPU_A_NOP && */
-/* 		inst->alu.add.magic_write && */
-/* 		predicate(inst->alu.add.waddr)) */
-/* 		return TRUE; */
+// fmul by 2.0 to fadd, or umul24 and smul24 by a small power of two to shl, on the add ALU
+static v3d_bool v3d_qpu_peephole_replace_multiply(struct v3d_qpu_peephole_context* context,
+                                                  int i)
+{
+	const struct v3d_device_info* devinfo = &context->args->devinfo;
+	struct v3d_qpu_alu_parts parts;
+	v3d_qpu_get_alu_parts(&context->work[i], &parts);
+	struct v3d_qpu_flags* flags = &parts.modifiers.flags;
+	v3d_bool isFloat = parts.mulOp == V3D_QPU_M_FMUL;
+	v3d_bool isMul24 = parts.mulOp == V3D_QPU_M_UMUL24 || parts.mulOp == V3D_QPU_M_SMUL24;
+	if (parts.addOp != V3D_QPU_A_NOP || !(isFloat || (isMul24 && context->args->allowMul24ToShift)) ||
+	    v3d_qpu_flags_use_carry(flags->mpf, flags->muf))
+		return FALSE;
 
-/* 	if (inst->alu.mul.op != V3D_QPU_M_NOP && */
-/* 		inst->alu.mul.magic_write && */
-/* 		predicate(inst->alu.mul.waddr)) */
-/* 		return TRUE; */
+	for (int factor = 2; factor < 4; ++factor)
+	{
+		struct v3d_qpu_operand immediate = parts.sources[factor];
+		if (immediate.kind != V3D_QPU_OPERAND_SMALL_IMMEDIATE ||
+		    immediate.unpack != V3D_QPU_UNPACK_NONE)
+			continue;
+		v3d_uint32 bits = small_immediates[immediate.index];
+		int shift = 0;
+		while (shift < 4 && bits != 1u << shift)
+			++shift;
+		if (isFloat ? bits != 0x40000000 /* 2.0 */ : shift == 4)
+			continue;
 
-/* 	return FALSE; */
-/* } */
+		struct v3d_qpu_alu_parts replaced = parts;
+		struct v3d_qpu_operand value = parts.sources[factor == 2 ? 3 : 2];
+		replaced.addOp = isFloat ? V3D_QPU_A_FADD : V3D_QPU_A_SHL;
+		replaced.addDst = parts.mulDst;
+		replaced.sources[0] = value;
+		// The small immediates 0-15 are packed as themselves
+		replaced.sources[1] = isFloat ? value : v3d_qpu_operand_small_imm(shift);
+		replaced.modifiers.flags.ac = flags->mc;
+		replaced.modifiers.flags.apf = flags->mpf;
+		replaced.modifiers.flags.auf = flags->muf;
+		v3d_qpu_clear_mul_part(&replaced);
+		struct v3d_qpu_instr instr;
+		if (v3d_qpu_build_alu_parts(devinfo, &replaced, &instr) &&
+		    v3d_qpu_peephole_try(context, i, &instr, -1, NULL))
+			return TRUE;
+	}
+	return FALSE;
+}
 
-// Returns whether the instruction is valid relative to the current state
-static v3d_bool
-qpu_validate_inst(struct v3d_qpu_validate_state *state, const struct v3d_qpu_instr* inst)
+static v3d_bool v3d_qpu_peephole_remove_flag_writes(struct v3d_qpu_peephole_context* context,
+                                                    int i)
 {
-	const struct v3d_device_info *devinfo = state->devinfo;
-
-	// (todo robustness) Find a way to check for tlb z writes using just the instruction rather
-	// than the qinst.
-	/* if (qinst->is_tlb_z_write && state->ip < state->first_tlb_z_write) */
-	/*         state->first_tlb_z_write = state->ip; */
+	struct v3d_qpu_instr instr = context->work[i];
+	struct v3d_qpu_flags* flags = &instr.flags;
+	if (flags->apf == V3D_QPU_PF_NONE && flags->mpf == V3D_QPU_PF_NONE &&
+	    flags->auf == V3D_QPU_UF_NONE && flags->muf == V3D_QPU_UF_NONE)
+		return FALSE;
 
-	if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH && state->first_tlb_z_write >= 0 &&
-	    state->ip > state->first_tlb_z_write && inst->branch.msfign != V3D_QPU_MSFIGN_NONE &&
-	    inst->branch.cond != V3D_QPU_BRANCH_COND_ALWAYS &&
-	    inst->branch.cond != V3D_QPU_BRANCH_COND_A0 && inst->branch.cond != V3D_QPU_BRANCH_COND_NA0)
-	{
-		fail_instr(state, V3D_QPU_VALIDATE_ERROR_IMPLICIT_BRANCH_MSF_READ_AFTER_TLB_Z_WRITE,
-		           "Implicit branch MSF read after TLB Z write");
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	struct v3d_qpu_liveness liveOut = v3d_qpu_liveness_out(
+	    context->work, context->args->numInstructions, context->liveIn, unknownTarget, i);
+	if (liveOut.flags)
 		return FALSE;
-	}
 
-	if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
-		return TRUE;
+	flags->apf = V3D_QPU_PF_NONE;
+	flags->mpf = V3D_QPU_PF_NONE;
+	flags->auf = V3D_QPU_UF_NONE;
+	flags->muf = V3D_QPU_UF_NONE;
+	v3d_uint64 packed = 0;
+	return v3d_qpu_instr_pack(&context->args->devinfo, &instr, &packed) &&
+	       v3d_qpu_peephole_try(context, i, &instr, -1, NULL);
+}
 
-	if (inst->alu.add.op == V3D_QPU_A_SETMSF && state->first_tlb_z_write >= 0 &&
-	    state->ip > state->first_tlb_z_write)
+v3d_bool v3d_qpu_peephole(struct v3d_qpu_peephole_arguments* args)
+{
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->numMovsRemoved = 0;
+	args->numMovsFolded = 0;
+	args->numMultipliesReplaced = 0;
+	args->numFlagWritesRemoved = 0;
+	args->numInstructionsRemoved = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_peephole_fail(args, "V3D 7.x peephole optimization not implemented", 0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	struct v3d_qpu_peephole_context context = {0};
+	context.args = args;
+	context.work = V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_instr, numInstructions + 1);
+	context.liveIn =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_liveness, numInstructions + 1);
+	context.removed = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	context.inDelaySlots = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	context.isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	context.oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	context.newIndices = args->newIndicesOut;
+	if (!context.newIndices)
+		context.newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	if (!context.work || !context.liveIn || !context.removed || !context.inDelaySlots ||
+	    !context.isBranchTarget || !context.oldIndices || !context.newIndices)
 	{
-		fail_instr(state, V3D_QPU_VALIDATE_ERROR_SETMSF_AFTER_TLB_Z_WRITE,
-		           "SETMSF after TLB Z write");
-		return FALSE;
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_peephole_fail(args, "Out of arena memory", 0);
 	}
-
-	if (state->first_tlb_z_write >= 0 && state->ip > state->first_tlb_z_write &&
-	    inst->alu.add.op == V3D_QPU_A_MSF)
+	v3d_qpu_find_branch_targets(args->instructions, numInstructions, context.isBranchTarget);
+	for (int i = 0; i <= numInstructions; ++i)
 	{
-		fail_instr(state, V3D_QPU_VALIDATE_ERROR_MSF_READ_AFTER_TLB_Z_WRITE,
-		           "MSF read after TLB Z write");
-		return FALSE;
+		context.removed[i] = FALSE;
+		context.inDelaySlots[i] = FALSE;
 	}
-
-	if (devinfo->ver < 71)
+	for (int i = 0; i < numInstructions; ++i)
 	{
-		if (inst->sig.small_imm_a || inst->sig.small_imm_c || inst->sig.small_imm_d)
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SMALL_IMM_A_C_D_ADDED_AFTER_V3D_7_1,
-			           "small imm a/c/d added after V3D 7.1");
-			return FALSE;
-		}
+		context.work[i] = args->instructions[i];
+		int numSlots = v3d_qpu_num_delay_slots(&args->instructions[i]);
+		for (int slot = i + 1; slot <= i + numSlots && slot < numInstructions; ++slot)
+			context.inDelaySlots[slot] = TRUE;
 	}
-	else
+
+	struct v3d_qpu_validate_result result;
+	v3d_bool succeeded = v3d_qpu_peephole_build(&context, &result);
+	if (!succeeded)
+		v3d_qpu_peephole_fail(args, result.errorMessage, result.errorInstructionIndex);
+
+	// Each rewrite leaves less to do, so this ends. Liveness is brought up to date after each.
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	for (v3d_bool changed = succeeded; changed;)
 	{
-		if ((inst->sig.small_imm_a || inst->sig.small_imm_b) &&
-		    !(inst->type == V3D_QPU_INSTR_TYPE_ALU && inst->alu.add.op != V3D_QPU_A_NOP))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SMALL_IMM_A_B_USED_BUT_NO_ADD_INST,
-			           "small imm a/b used but no ADD inst");
-			return FALSE;
-		}
-		if ((inst->sig.small_imm_c || inst->sig.small_imm_d) &&
-		    !(inst->type == V3D_QPU_INSTR_TYPE_ALU && inst->alu.mul.op != V3D_QPU_M_NOP))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SMALL_IMM_C_D_USED_BUT_NO_MUL_INST,
-			           "small imm c/d used but no MUL inst");
-			return FALSE;
-		}
-		if (inst->sig.small_imm_a + inst->sig.small_imm_b + inst->sig.small_imm_c +
-		        inst->sig.small_imm_d >
-		    1)
+		changed = FALSE;
+		v3d_qpu_compute_liveness(&args->devinfo, context.work, numInstructions, unknownTarget,
+		                         context.liveIn);
+		for (int i = 0; i < numInstructions && !changed; ++i)
 		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_MAX_ONE_SMALL_IMMEDIATE_PER_INSTRUCTION,
-			           "only one small immediate can be enabled per instruction");
-			return FALSE;
+			if (context.removed[i] || context.work[i].type != V3D_QPU_INSTR_TYPE_ALU)
+				continue;
+			if (v3d_qpu_peephole_remove_mov(&context, i, TRUE) ||
+			    v3d_qpu_peephole_remove_mov(&context, i, FALSE))
+				++args->numMovsRemoved;
+			else if (v3d_qpu_peephole_fold_mov(&context, i, TRUE) ||
+			         v3d_qpu_peephole_fold_mov(&context, i, FALSE))
+				++args->numMovsFolded;
+			else if (v3d_qpu_peephole_replace_multiply(&context, i))
+				++args->numMultipliesReplaced;
+			else if (v3d_qpu_peephole_remove_flag_writes(&context, i))
+				++args->numFlagWritesRemoved;
+			else
+				continue;
+			changed = TRUE;
 		}
 	}
 
-	/* LDVARY writes r5 two instructions later and LDUNIF writes
-	 * r5 one instruction later, which is illegal to have
-	 * together.
-	 */
-	if (state->last && state->last->sig.ldvary && (inst->sig.ldunif || inst->sig.ldunifa))
+	if (succeeded)
 	{
-		fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDUNIF_AFTER_A_LDVARY, "LDUNIF after a LDVARY");
+		// The last rewrite tried may have been rejected, so build from what was kept
+		succeeded = v3d_qpu_peephole_build(&context, &result);
+		if (!succeeded)
+			v3d_qpu_peephole_fail(args, result.errorMessage, result.errorInstructionIndex);
+		args->numInstructionsRemoved = numInstructions - args->numInstructionsOut;
+	}
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
+}
+
+// Dead code elimination
+
+static v3d_bool v3d_qpu_dead_code_fail(struct v3d_qpu_eliminate_dead_code_arguments* args,
+                                       const char* message, int instructionIndex)
+{
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
+
+// Drops what liveOut shows nothing reads from the add (isAdd) or mul op. Returns whether anything
+// changed.
+static v3d_bool v3d_qpu_remove_dead_op(struct v3d_qpu_alu_parts* parts, v3d_bool isAdd,
+                                       struct v3d_qpu_liveness liveOut,
+                                       struct v3d_qpu_eliminate_dead_code_arguments* counts)
+{
+	struct v3d_qpu_flags* flags = &parts->modifiers.flags;
+	enum v3d_qpu_pf* pf = isAdd ? &flags->apf : &flags->mpf;
+	enum v3d_qpu_uf* uf = isAdd ? &flags->auf : &flags->muf;
+	struct v3d_qpu_operand* dst = isAdd ? &parts->addDst : &parts->mulDst;
+	if (isAdd ? parts->addOp == V3D_QPU_A_NOP ||
+	                !v3d_qpu_add_op_has_dst(parts->addOp) ||
+	                v3d_qpu_add_op_has_side_effects(parts->addOp)
+	          : parts->mulOp == V3D_QPU_M_NOP || !v3d_qpu_mul_op_has_dst(parts->mulOp))
 		return FALSE;
+
+	v3d_bool changed = FALSE;
+	v3d_bool writesFlags = *pf != V3D_QPU_PF_NONE || *uf != V3D_QPU_UF_NONE;
+	if (writesFlags && !liveOut.flags)
+	{
+		*pf = V3D_QPU_PF_NONE;
+		*uf = V3D_QPU_UF_NONE;
+		writesFlags = FALSE;
+		++counts->numFlagWritesRemoved;
+		changed = TRUE;
+	}
+
+	// Other magic waddrs have side effects
+	struct v3d_qpu_operand reg = v3d_qpu_dst_register(*dst);
+	if (reg.kind == V3D_QPU_OPERAND_NONE || v3d_qpu_liveness_has_register(liveOut, reg))
+		return changed;
+	if (writesFlags)
+	{
+		*dst = v3d_qpu_operand_pack(v3d_qpu_operand_magic(V3D_QPU_WADDR_NOP), dst->pack);
+		++counts->numWritesRemoved;
+	}
+	else
+	{
+		if (isAdd)
+			v3d_qpu_clear_add_part(parts);
+		else
+			v3d_qpu_clear_mul_part(parts);
+		++counts->numOpsRemoved;
 	}
+	return TRUE;
+}
 
-	/* GFXH-1633 (fixed since V3D 4.2.14, which is Rpi4)
-	 *
-	 * FIXME: This would not check correctly for V3D 4.2 versions lower
-	 * than V3D 4.2.14, but that is not a real issue because the simulator
-	 * will still catch this, and we are not really targeting any such
-	 * versions anyway.
-	 */
-	if (devinfo->ver < 42)
+static v3d_bool v3d_qpu_dead_code_build(struct v3d_qpu_eliminate_dead_code_arguments* args,
+                                        const struct v3d_qpu_instr* work, const v3d_bool* removed,
+                                        int* oldIndices, int* newIndices,
+                                        struct v3d_qpu_validate_result* resultOut)
+{
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	for (int i = 0; i < numInstructions; ++i)
 	{
-		v3d_bool last_reads_ldunif =
-		    (state->last && (state->last->sig.ldunif || state->last->sig.ldunifrf));
-		v3d_bool last_reads_ldunifa =
-		    (state->last && (state->last->sig.ldunifa || state->last->sig.ldunifarf));
-		v3d_bool reads_ldunif = inst->sig.ldunif || inst->sig.ldunifrf;
-		v3d_bool reads_ldunifa = inst->sig.ldunifa || inst->sig.ldunifarf;
-		if ((last_reads_ldunif && reads_ldunifa) || (last_reads_ldunifa && reads_ldunif))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDUNIF_AND_LDUNIFA_CANT_BE_NEXT_TO_EACH_OTHER,
-			           "LDUNIF and LDUNIFA can't be next to each other");
-			return FALSE;
-		}
+		newIndices[i] = args->numInstructionsOut;
+		if (removed[i])
+			continue;
+		int outIndex = args->numInstructionsOut++;
+		args->instructionsOut[outIndex] = work[i];
+		oldIndices[outIndex] = i;
 	}
+	newIndices[numInstructions] = args->numInstructionsOut;
+	v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, oldIndices,
+	                       newIndices, numInstructions);
 
-	int tmu_writes = 0;
-	int sfu_writes = 0;
-	int vpm_writes = 0;
-	int tlb_writes = 0;
-	int tsy_writes = 0;
+	*resultOut = (struct v3d_qpu_validate_result){0};
+	return v3d_qpu_validate(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+	                        resultOut);
+}
 
-	if (inst->alu.add.op != V3D_QPU_A_NOP) {
-		if (inst->alu.add.magic_write) {
-			if (v3d_qpu_magic_waddr_is_tmu(devinfo,
-										   inst->alu.add.waddr)) {
-				tmu_writes++;
-			}
-			if (v3d_qpu_magic_waddr_is_sfu(inst->alu.add.waddr))
-				sfu_writes++;
-			if (v3d_qpu_magic_waddr_is_vpm(inst->alu.add.waddr))
-				vpm_writes++;
-			if (v3d_qpu_magic_waddr_is_tlb(inst->alu.add.waddr))
-				tlb_writes++;
-			if (v3d_qpu_magic_waddr_is_tsy(inst->alu.add.waddr))
-				tsy_writes++;
-		}
+v3d_bool v3d_qpu_eliminate_dead_code(struct v3d_qpu_eliminate_dead_code_arguments* args)
+{
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->numOpsRemoved = 0;
+	args->numWritesRemoved = 0;
+	args->numFlagWritesRemoved = 0;
+	args->numInstructionsRemoved = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_dead_code_fail(args, "V3D 7.x dead code elimination not implemented", 0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	struct v3d_qpu_instr* work =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_instr, numInstructions + 1);
+	struct v3d_qpu_liveness* liveIn =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_liveness, numInstructions + 1);
+	v3d_bool* removed = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* inDelaySlots = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	if (!work || !liveIn || !removed || !inDelaySlots || !oldIndices || !newIndices)
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_dead_code_fail(args, "Out of arena memory", 0);
 	}
-
-	if (inst->alu.mul.op != V3D_QPU_M_NOP) {
-		if (inst->alu.mul.magic_write) {
-			if (v3d_qpu_magic_waddr_is_tmu(devinfo,
-										   inst->alu.mul.waddr)) {
-				tmu_writes++;
-			}
-			if (v3d_qpu_magic_waddr_is_sfu(inst->alu.mul.waddr))
-				sfu_writes++;
-			if (v3d_qpu_magic_waddr_is_vpm(inst->alu.mul.waddr))
-				vpm_writes++;
-			if (v3d_qpu_magic_waddr_is_tlb(inst->alu.mul.waddr))
-				tlb_writes++;
-			if (v3d_qpu_magic_waddr_is_tsy(inst->alu.mul.waddr))
-				tsy_writes++;
-		}
+	for (int i = 0; i <= numInstructions; ++i)
+	{
+		removed[i] = FALSE;
+		inDelaySlots[i] = FALSE;
+	}
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		work[i] = instructions[i];
+		int numSlots = v3d_qpu_num_delay_slots(&instructions[i]);
+		for (int slot = i + 1; slot <= i + numSlots && slot < numInstructions; ++slot)
+			inDelaySlots[slot] = TRUE;
 	}
 
-	if (in_thrsw_delay_slots(state))
+	struct v3d_qpu_validate_result result;
+	if (!v3d_qpu_dead_code_build(args, work, removed, oldIndices, newIndices, &result))
 	{
-		/* There's no way you want to start SFU during the THRSW delay
-		 * slots, since the result would land in the other thread.
-		 */
-		if (sfu_writes)
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SFU_WRITE_STARTED_DURING_THRSW_DELAY_SLOTS,
-			           "SFU write started during THRSW delay slots ");
-			return FALSE;
-		}
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_dead_code_fail(args, result.errorMessage, result.errorInstructionIndex);
+	}
 
-		if (inst->sig.ldvary)
+	// Liveness from before a sweep only overstates what is live after it, so each sweep is safe
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	for (v3d_bool changed = TRUE; changed;)
+	{
+		changed = FALSE;
+		v3d_qpu_compute_liveness(&args->devinfo, work, numInstructions, unknownTarget, liveIn);
+		for (int i = 0; i < numInstructions; ++i)
 		{
-			if (devinfo->ver == 42)
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDVARY_DURING_THRSW_DELAY_SLOTS,
-				           "LDVARY during THRSW delay slots");
-				return FALSE;
-			}
-			if (devinfo->ver >= 71 && state->ip - state->last_thrsw_ip == 2)
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_LDVARY_IN_2ND_THRSW_DELAY_SLOT,
-				           "LDVARY in 2nd THRSW delay slot");
-				return FALSE;
-			}
+			if (work[i].type != V3D_QPU_INSTR_TYPE_ALU)
+				continue;
+			struct v3d_qpu_liveness liveOut =
+			    v3d_qpu_liveness_out(work, numInstructions, liveIn, unknownTarget, i);
+			struct v3d_qpu_alu_parts parts;
+			v3d_qpu_get_alu_parts(&work[i], &parts);
+			struct v3d_qpu_eliminate_dead_code_arguments counts = {0};
+			v3d_bool removedAdd = v3d_qpu_remove_dead_op(&parts, TRUE, liveOut, &counts);
+			v3d_bool removedMul = v3d_qpu_remove_dead_op(&parts, FALSE, liveOut, &counts);
+			struct v3d_qpu_instr instr;
+			if ((!removedAdd && !removedMul) ||
+			    !v3d_qpu_build_alu_parts(&args->devinfo, &parts, &instr))
+				continue;
+			work[i] = instr;
+			args->numOpsRemoved += counts.numOpsRemoved;
+			args->numWritesRemoved += counts.numWritesRemoved;
+			args->numFlagWritesRemoved += counts.numFlagWritesRemoved;
+			changed = TRUE;
 		}
 	}
 
-	/* (void)qpu_magic_waddr_matches; /\* XXX *\/ */
-
-	/* SFU r4 results come back two instructions later.  No doing
-	 * r4 read/writes or other SFU lookups until it's done.
-	 */
-	if (state->ip - state->last_sfu_write < 2)
+	// Instructions this emptied go one at a time, as e.g. an SFU result may need the time
+	v3d_bool succeeded = v3d_qpu_dead_code_build(args, work, removed, oldIndices, newIndices,
+	                                             &result);
+	for (int i = 0; i < numInstructions && succeeded; ++i)
 	{
-		if (v3d_qpu_uses_mux(inst, V3D_QPU_MUX_R4))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_R4_READ_TOO_SOON_AFTER_SFU,
-			           "R4 read too soon after SFU");
-			return FALSE;
-		}
+		if (inDelaySlots[i] || v3d_qpu_instr_is_plain_nop(&instructions[i]) ||
+		    !v3d_qpu_instr_is_plain_nop(&work[i]))
+			continue;
+		removed[i] = TRUE;
+		if (v3d_qpu_dead_code_build(args, work, removed, oldIndices, newIndices, &result))
+			continue;
+		removed[i] = FALSE;
+		succeeded = v3d_qpu_dead_code_build(args, work, removed, oldIndices, newIndices, &result);
+	}
+	if (!succeeded)
+		v3d_qpu_dead_code_fail(args, result.errorMessage, result.errorInstructionIndex);
+	args->numInstructionsRemoved = numInstructions - args->numInstructionsOut;
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
+}
 
-		if (v3d_qpu_writes_r4(devinfo, inst))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_R4_WRITE_TOO_SOON_AFTER_SFU,
-			           "R4 write too soon after SFU");
-			return FALSE;
-		}
+// NOP compaction
 
-		if (sfu_writes)
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_SFU_WRITE_TOO_SOON_AFTER_SFU,
-			           "SFU write too soon after SFU");
-			return FALSE;
-		}
-	}
+static v3d_bool v3d_qpu_compact_nops_fail(struct v3d_qpu_compact_nops_arguments* args,
+                                          const char* message, int instructionIndex)
+{
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
-	/* XXX: The docs say VPM can happen with the others, but the simulator
-	 * disagrees.
-	 */
-	if (tmu_writes + sfu_writes + vpm_writes + tlb_writes + tsy_writes +
-	        (devinfo->ver == 42 ? inst->sig.ldtmu : 0) + inst->sig.ldtlb + inst->sig.ldvpm +
-	        inst->sig.ldtlbu >
-	    1)
+// Whether the instructions after i still validate with i left out. No rule looks back further
+// than the last three instructions, so only those after i which come that close can notice.
+static v3d_bool v3d_qpu_compact_nops_can_skip(const struct v3d_qpu_validate_state* state,
+                                              const struct v3d_qpu_instr* instructions,
+                                              int numInstructions, int i)
+{
+	struct v3d_qpu_validate_state trial = *state;
+	for (int j = i + 1; j < numInstructions && j <= i + 3; ++j)
 	{
-		fail_instr(state, V3D_QPU_VALIDATE_ERROR_ONLY_ONE_OF_TMU_SFU_TSY_TLB_READ_VPM_ALLOWED,
-		           "Only one of [TMU, SFU, TSY, TLB read, VPM] allowed");
-		return FALSE;
+		if (!qpu_validate_inst(&trial, &instructions[j]))
+			return FALSE;
+		trial.last = &instructions[j];
+		trial.ip++;
 	}
+	return TRUE;
+}
 
-	if (sfu_writes)
-		state->last_sfu_write = state->ip;
+v3d_bool v3d_qpu_compact_nops(struct v3d_qpu_compact_nops_arguments* args)
+{
+	const struct v3d_qpu_instr* instructions = args->instructions;
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->numNopsRemoved = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	v3d_bool* isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* inDelaySlots = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	if (!isBranchTarget || !inDelaySlots || !oldIndices || !newIndices)
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_compact_nops_fail(args, "Out of arena memory", 0);
+	}
+	v3d_qpu_find_branch_targets(instructions, numInstructions, isBranchTarget);
+	for (int i = 0; i <= numInstructions; ++i)
+		inDelaySlots[i] = FALSE;
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		int numSlots = v3d_qpu_num_delay_slots(&instructions[i]);
+		for (int slot = i + 1; slot <= i + numSlots && slot < numInstructions; ++slot)
+			inDelaySlots[slot] = TRUE;
+	}
 
-	if (inst->sig.thrsw)
+	// Validates the output as it is written, which the input instructions still point into
+	struct v3d_qpu_validate_state state;
+	qpu_validate_begin(&state, &args->devinfo);
+	int sinceBranchTarget = 3;
+	for (int i = 0; i < numInstructions; ++i)
 	{
-		if (in_branch_delay_slots(state))
+		newIndices[i] = args->numInstructionsOut;
+		sinceBranchTarget = isBranchTarget[i] ? 0 : sinceBranchTarget + 1;
+		if (v3d_qpu_instr_is_plain_nop(&instructions[i]) && !inDelaySlots[i] &&
+		    sinceBranchTarget > 2 &&
+		    v3d_qpu_compact_nops_can_skip(&state, instructions, numInstructions, i))
+			continue;
+
+		if (!qpu_validate_inst(&state, &instructions[i]))
 		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_THRSW_IN_A_BRANCH_DELAY_SLOT,
-			           "THRSW in a branch delay slot.");
-			return FALSE;
+			v3d_arena_restore(args->arena, marker);
+			return v3d_qpu_compact_nops_fail(args, state.errorMessage, i);
 		}
+		state.last = &instructions[i];
+		state.ip++;
+		oldIndices[args->numInstructionsOut] = i;
+		args->instructionsOut[args->numInstructionsOut++] = instructions[i];
+	}
+	newIndices[numInstructions] = args->numInstructionsOut;
 
-		if (state->last_thrsw_found)
-			state->thrend_found = TRUE;
+	int numOut = args->numInstructionsOut;
+	if (!qpu_validate_finish(&state, numOut,
+	                         numOut >= 2 && args->instructionsOut[numOut - 2].sig.thrsw,
+	                         numOut >= 1 && args->instructionsOut[numOut - 1].sig.thrsw))
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_compact_nops_fail(args, state.errorMessage,
+		                                 numInstructions > 0 ? numInstructions - 1 : 0);
+	}
 
-		if (state->last_thrsw_ip == state->ip - 1)
-		{
-			/* If it's the second THRSW in a row, then it's just a
-			 * last-thrsw signal.
-			 */
-			if (state->last_thrsw_found)
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_TWO_LAST_THRSW_SIGNALS,
-				           "Two last-THRSW signals");
-				return FALSE;
-			}
-			state->last_thrsw_found = TRUE;
-		}
-		else
-		{
-			if (in_thrsw_delay_slots(state))
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_THRSW_TOO_CLOSE_TO_ANOTHER_THRSW,
-				           "THRSW too close to another THRSW.");
-				return FALSE;
-			}
-			state->thrsw_count++;
-			state->last_thrsw_ip = state->ip;
-		}
+	v3d_qpu_remap_branches(args->instructionsOut, numOut, oldIndices, newIndices, numInstructions);
+	for (int i = 0; i < args->numLabels; ++i)
+	{
+		if (args->labels[i] >= 0 && args->labels[i] <= numInstructions)
+			args->labels[i] = newIndices[args->labels[i]];
 	}
+	args->numNopsRemoved = numInstructions - numOut;
+	v3d_arena_restore(args->arena, marker);
+	return TRUE;
+}
 
-	if (state->thrend_found && state->last_thrsw_ip - state->ip <= 2 &&
-	    inst->type == V3D_QPU_INSTR_TYPE_ALU)
+// Accumulator promotion
+
+// r4 and r5 are written implicitly too often to be worth tracking
+#define V3D_QPU_PROMOTE_NUM_ACCUMULATORS 4
+
+struct v3d_qpu_promote_context
+{
+	struct v3d_qpu_promote_accumulators_arguments* args;
+	// The program as promoted so far, i.e. args->instructionsOut
+	struct v3d_qpu_instr* work;
+	struct v3d_qpu_instr* backup;
+	// From before any promotion. Register file liveness only shrinks as values are promoted.
+	struct v3d_qpu_liveness* liveIn;
+	// Accumulators which promoted values keep live out of each instruction
+	v3d_uint8* promotedLiveOut;
+	v3d_bool* isBranchTarget;
+};
+
+static v3d_bool v3d_qpu_promote_fail(struct v3d_qpu_promote_accumulators_arguments* args,
+                                     const char* message, int instructionIndex)
+{
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
+
+static struct v3d_qpu_liveness v3d_qpu_promote_live_out(const struct v3d_qpu_promote_context* context,
+                                                        int i)
+{
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	struct v3d_qpu_liveness liveOut = v3d_qpu_liveness_out(
+	    context->work, context->args->numInstructions, context->liveIn, unknownTarget, i);
+	liveOut.acc |= context->promotedLiveOut[i];
+	return liveOut;
+}
+
+// The last instruction which reads what instruction w writes to registerFile, or -1 if that isn't
+// one straight stretch of ALU instructions without thread switches.
+static int v3d_qpu_promote_last_read(const struct v3d_qpu_promote_context* context, int w,
+                                     int registerFile)
+{
+	const struct v3d_qpu_promote_accumulators_arguments* args = context->args;
+	const struct v3d_qpu_instr* work = context->work;
+	// A branch's delay slots and a thread switch's delay slots still run before them
+	for (int j = w - 3; j <= w; ++j)
 	{
-		if ((inst->alu.add.op != V3D_QPU_A_NOP && !inst->alu.add.magic_write))
+		if (j >= 0 && (work[j].type != V3D_QPU_INSTR_TYPE_ALU || (j >= w - 2 && work[j].sig.thrsw)))
+			return -1;
+	}
+	for (int j = w + 1; j < args->numInstructions; ++j)
+	{
+		if ((args->maxLifetime > 0 && j - w > args->maxLifetime) ||
+		    work[j].type != V3D_QPU_INSTR_TYPE_ALU || work[j].sig.thrsw ||
+		    context->isBranchTarget[j])
+			return -1;
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(&args->devinfo, &work[j], &usage);
+		// Reading the value and replacing it in one go, e.g. when counting up
+		if ((usage.rfWrites >> registerFile) & 1)
 		{
-			if (devinfo->ver == 42)
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF_WRITE_AFTER_THREND,
-				           "RF write after THREND");
-				return FALSE;
-			}
-			else if (devinfo->ver >= 71)
-			{
-				if (state->last_thrsw_ip - state->ip == 0)
-				{
-					fail_instr(state, V3D_QPU_VALIDATE_ERROR_ADD_RF_WRITE_AT_THREND,
-					           "ADD RF write at THREND");
-					return FALSE;
-				}
-				if (inst->alu.add.waddr == 2 || inst->alu.add.waddr == 3)
-				{
-					fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF2_3_WRITE_AFTER_THREND,
-					           "RF2-3 write after THREND");
-					return FALSE;
-				}
-			}
+			struct v3d_qpu_reg_usage kills;
+			v3d_qpu_get_kills(&args->devinfo, &work[j], &kills);
+			return ((usage.rfReads & kills.rfWrites) >> registerFile) & 1 ? j : -1;
 		}
+		if (!((v3d_qpu_promote_live_out(context, j).rf >> registerFile) & 1))
+			return j;
+	}
+	return -1;
+}
 
-		if ((inst->alu.mul.op != V3D_QPU_M_NOP && !inst->alu.mul.magic_write))
-		{
-			if (devinfo->ver == 42)
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF_WRITE_AFTER_THREND,
-				           "RF write after THREND");
-				return FALSE;
-			}
-			else if (devinfo->ver >= 71)
-			{
-				if (state->last_thrsw_ip - state->ip == 0)
-				{
-					fail_instr(state, V3D_QPU_VALIDATE_ERROR_MUL_RF_WRITE_AT_THREND,
-					           "MUL RF write at THREND");
-					return FALSE;
-				}
+// An accumulator which nothing else uses while instructions w to lastRead hold the value, or -1
+static int v3d_qpu_promote_find_accumulator(const struct v3d_qpu_promote_context* context, int w,
+                                            int lastRead)
+{
+	const struct v3d_device_info* devinfo = &context->args->devinfo;
+	v3d_uint8 used = 0;
+	for (int j = w; j <= lastRead; ++j)
+	{
+		struct v3d_qpu_reg_usage usage;
+		v3d_qpu_get_reg_usage(devinfo, &context->work[j], &usage);
+		used |= usage.accWrites | v3d_qpu_promote_live_out(context, j).acc;
+	}
+	if (w > 0 && v3d_qpu_writes_r3(devinfo, &context->work[w - 1]))
+		used |= 1 << 3;
+	for (int accumulator = 0; accumulator < V3D_QPU_PROMOTE_NUM_ACCUMULATORS; ++accumulator)
+	{
+		if (!((used >> accumulator) & 1))
+			return accumulator;
+	}
+	return -1;
+}
 
-				if (inst->alu.mul.waddr == 2 || inst->alu.mul.waddr == 3)
-				{
-					fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF2_3_WRITE_AFTER_THREND,
-					           "RF2-3 write after THREND");
-					return FALSE;
-				}
-			}
-		}
+// Moves what the add (isAdd) or mul op of instruction w writes into an accumulator
+static v3d_bool v3d_qpu_promote_value(struct v3d_qpu_promote_context* context, int w,
+                                      v3d_bool isAdd)
+{
+	struct v3d_qpu_promote_accumulators_arguments* args = context->args;
+	struct v3d_qpu_instr* work = context->work;
+	struct v3d_qpu_alu_parts parts;
+	v3d_qpu_get_alu_parts(&work[w], &parts);
+	struct v3d_qpu_operand* dst = isAdd ? &parts.addDst : &parts.mulDst;
+	enum v3d_qpu_cond cond = isAdd ? parts.modifiers.flags.ac : parts.modifiers.flags.mc;
+	if ((isAdd ? parts.addOp == V3D_QPU_A_NOP : parts.mulOp == V3D_QPU_M_NOP) ||
+	    dst->kind != V3D_QPU_OPERAND_REGISTER_FILE || dst->pack != V3D_QPU_PACK_NONE ||
+	    cond != V3D_QPU_COND_NONE)
+		return FALSE;
+	int registerFile = dst->index;
+	if (!((v3d_qpu_promote_live_out(context, w).rf >> registerFile) & 1))
+		return FALSE;
+	int lastRead = v3d_qpu_promote_last_read(context, w, registerFile);
+	if (lastRead < 0)
+		return FALSE;
+	int accumulator = v3d_qpu_promote_find_accumulator(context, w, lastRead);
+	if (accumulator < 0)
+		return FALSE;
 
-		if (v3d_qpu_sig_writes_address(devinfo, &inst->sig) && !inst->sig_magic)
+	for (int j = w; j <= lastRead; ++j)
+		context->backup[j] = work[j];
+	int numReads = 0;
+	*dst = v3d_qpu_operand_magic((enum v3d_qpu_waddr)(V3D_QPU_WADDR_R0 + accumulator));
+	v3d_bool succeeded = v3d_qpu_build_alu_parts(&args->devinfo, &parts, &work[w]);
+	for (int j = w + 1; j <= lastRead && succeeded; ++j)
+	{
+		v3d_qpu_get_alu_parts(&work[j], &parts);
+		for (int source = 0; source < 4; ++source)
 		{
-			if (devinfo->ver == 42)
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF_WRITE_AFTER_THREND,
-				           "RF write after THREND");
-				return FALSE;
-			}
-			else if (devinfo->ver >= 71 && (inst->sig_addr == 2 || inst->sig_addr == 3))
-			{
-				fail_instr(state, V3D_QPU_VALIDATE_ERROR_RF2_3_WRITE_AFTER_THREND,
-				           "RF2-3 write after THREND");
-				return FALSE;
-			}
+			if (parts.sources[source].kind != V3D_QPU_OPERAND_REGISTER_FILE ||
+			    parts.sources[source].index != registerFile)
+				continue;
+			parts.sources[source] = v3d_qpu_operand_unpack(v3d_qpu_operand_acc(accumulator),
+			                                               parts.sources[source].unpack);
+			++numReads;
 		}
+		succeeded = v3d_qpu_build_alu_parts(&args->devinfo, &parts, &work[j]);
+	}
 
-		/* GFXH-1625: No TMUWT in the last instruction */
-		if (state->last_thrsw_ip - state->ip == 2 && inst->alu.add.op == V3D_QPU_A_TMUWT)
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_TMUWT_IN_LAST_INSTRUCTION,
-			           "TMUWT in last instruction");
-			return FALSE;
-		}
+	struct v3d_qpu_validate_result result = {0};
+	if (!succeeded || !v3d_qpu_validate(&args->devinfo, work, args->numInstructions, &result))
+	{
+		for (int j = w; j <= lastRead; ++j)
+			work[j] = context->backup[j];
+		return FALSE;
 	}
+	for (int j = w; j < lastRead; ++j)
+		context->promotedLiveOut[j] |= 1 << accumulator;
+	++args->numValuesPromoted;
+	args->numReadsPromoted += numReads;
+	return TRUE;
+}
 
-	if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH)
+v3d_bool v3d_qpu_promote_accumulators(struct v3d_qpu_promote_accumulators_arguments* args)
+{
+	int numInstructions = args->numInstructions;
+	args->numValuesPromoted = 0;
+	args->numReadsPromoted = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70 || !args->devinfo.has_accumulators)
+		return v3d_qpu_promote_fail(args, "V3D 7.x has no accumulators", 0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	struct v3d_qpu_promote_context context = {0};
+	context.args = args;
+	context.work = args->instructionsOut;
+	context.backup = V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_instr, numInstructions + 1);
+	context.liveIn =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_liveness, numInstructions + 1);
+	context.promotedLiveOut = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_uint8, numInstructions + 1);
+	context.isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	if (!context.backup || !context.liveIn || !context.promotedLiveOut || !context.isBranchTarget)
 	{
-		if (in_branch_delay_slots(state))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_BRANCH_IN_A_BRANCH_DELAY_SLOT,
-			           "branch in a branch delay slot.");
-			return FALSE;
-		}
-		if (in_thrsw_delay_slots(state))
-		{
-			fail_instr(state, V3D_QPU_VALIDATE_ERROR_BRANCH_IN_A_THRSW_DELAY_SLOT,
-			           "branch in a THRSW delay slot.");
-			return FALSE;
-		}
-		state->last_branch_ip = state->ip;
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_promote_fail(args, "Out of arena memory", 0);
+	}
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		context.work[i] = args->instructions[i];
+		context.promotedLiveOut[i] = 0;
+	}
+	struct v3d_qpu_validate_result result = {0};
+	if (!v3d_qpu_validate(&args->devinfo, context.work, numInstructions, &result))
+	{
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_promote_fail(args, result.errorMessage, result.errorInstructionIndex);
+	}
+	v3d_qpu_find_branch_targets(context.work, numInstructions, context.isBranchTarget);
+
+	// One pass in program order, so promoted values only add to accumulator liveness from here on
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	v3d_qpu_compute_liveness(&args->devinfo, context.work, numInstructions, unknownTarget,
+	                         context.liveIn);
+	for (int i = 0; i < numInstructions; ++i)
+	{
+		if (context.work[i].type != V3D_QPU_INSTR_TYPE_ALU)
+			continue;
+		v3d_qpu_promote_value(&context, i, TRUE);
+		v3d_qpu_promote_value(&context, i, FALSE);
 	}
+	v3d_arena_restore(args->arena, marker);
 	return TRUE;
 }
 
-v3d_bool v3d_qpu_validate(const struct v3d_device_info* devinfo, struct v3d_qpu_instr* instructions,
-                          int numInstructions, struct v3d_qpu_validate_result* results)
+// If-conversion
+
+static v3d_bool v3d_qpu_if_convert_fail(struct v3d_qpu_if_convert_arguments* args,
+                                        const char* message, int instructionIndex)
 {
-	struct v3d_qpu_validate_state state = {
-	    .devinfo = devinfo,
-	    .last_sfu_write = -10,
-	    .last_thrsw_ip = -10,
-	    .last_branch_ip = -10,
-	    .first_tlb_z_write = numInstructions + 1 /*INT_MAX*/,
-	    .ip = 0,
+	args->errorMessage = message;
+	args->errorInstructionIndex = instructionIndex;
+	return FALSE;
+}
 
-	    // (todo) Not sure what to put here, since it relies on there having been a compile phase
-	    /* .last_thrsw_found = !c->last_thrsw, */
-		.last_thrsw_found = FALSE,
-	};
+// Whether the add (isAdd) or mul op of instr writes nothing that matters when flag A is as the
+// skipping branch saw it: either not in any lane, by blockCond, or nothing read after the block
+static v3d_bool v3d_qpu_if_convert_op_is_harmless(const struct v3d_qpu_instr* instr,
+                                                  v3d_bool isAdd, enum v3d_qpu_cond blockCond,
+                                                  struct v3d_qpu_liveness liveAfter)
+{
+	const struct v3d_qpu_alu_instr* alu = &instr->alu;
+	if (isAdd ? alu->add.op == V3D_QPU_A_NOP : alu->mul.op == V3D_QPU_M_NOP)
+		return TRUE;
+	if ((isAdd ? instr->flags.ac : instr->flags.mc) == blockCond)
+		return TRUE;
+	struct v3d_qpu_operand dst =
+	    isAdd ? v3d_qpu_waddr_operand(v3d_qpu_add_op_has_dst(alu->add.op), alu->add.waddr,
+	                                  alu->add.magic_write, alu->add.output_pack)
+	          : v3d_qpu_waddr_operand(v3d_qpu_mul_op_has_dst(alu->mul.op), alu->mul.waddr,
+	                                  alu->mul.magic_write, alu->mul.output_pack);
+	struct v3d_qpu_operand reg = v3d_qpu_dst_register(dst);
+	return reg.kind != V3D_QPU_OPERAND_NONE && !v3d_qpu_liveness_has_register(liveAfter, reg);
+}
 
-	/* // Find the last thrsw. I am not sure this is correct. */
-	/* for (int instructionIndex = numInstructions - 1; instructionIndex >= 0; --instructionIndex) */
-	/* { */
-	/* 	if (instructions[instructionIndex].sig.thrsw) */
-	/* 	{ */
-	/* 		state.last_thrsw_found = TRUE; */
-	/* 		break; */
-	/* 	} */
-	/* } */
+// Whether the branch at b only skips a block which can run anyway, without slowing the path which
+// skipped it by more than maxExtraCycles
+static v3d_bool v3d_qpu_if_convert_can_remove(const struct v3d_qpu_if_convert_arguments* args,
+                                              const struct v3d_qpu_liveness* liveIn,
+                                              const v3d_bool* isBranchTarget, int b)
+{
+	const struct v3d_qpu_instr* instructions = args->instructionsOut;
+	int numInstructions = args->numInstructionsOut;
+	const struct v3d_qpu_branch_instr* branch = &instructions[b].branch;
+	if (instructions[b].type != V3D_QPU_INSTR_TYPE_BRANCH ||
+	    branch->bdi != V3D_QPU_BRANCH_DEST_REL || branch->msfign != V3D_QPU_MSFIGN_NONE ||
+	    branch->ub || isBranchTarget[b])
+		return FALSE;
+	enum v3d_qpu_cond blockCond;
+	if (branch->cond == V3D_QPU_BRANCH_COND_ALLNA)
+		blockCond = V3D_QPU_COND_IFA;
+	else if (branch->cond == V3D_QPU_BRANCH_COND_ALLA)
+		blockCond = V3D_QPU_COND_IFNA;
+	else
+		return FALSE;
+	int blockStart = b + 4;
+	int target = v3d_qpu_branch_target(b, branch->offset);
+	if (blockStart > numInstructions || target < blockStart || target > numInstructions)
+		return FALSE;
 
-	v3d_bool hasError = FALSE;
-	for (int instructionIndex = 0; instructionIndex < numInstructions; ++instructionIndex)
+	// Nothing is live past the end
+	struct v3d_qpu_liveness liveAfter = {0};
+	if (target < numInstructions)
+		liveAfter = liveIn[target];
+
+	// Flag A has to stay as the branch saw it for the predicated writes
+	int numSlotNops = 0;
+	for (int j = b + 1; j < target; ++j)
 	{
-		if (!qpu_validate_inst(&state, &instructions[instructionIndex]))
+		const struct v3d_qpu_instr* instr = &instructions[j];
+		if (instr->type != V3D_QPU_INSTR_TYPE_ALU || v3d_qpu_writes_flags(instr))
+			return FALSE;
+		if (v3d_qpu_instr_is_plain_nop(instr))
 		{
-			results->errorInstructionIndex = instructionIndex;
-			hasError = TRUE;
-			break;
+			numSlotNops += j < blockStart;
+			continue;
 		}
-
-		state.last = &instructions[instructionIndex];
-		state.ip++;
+		if (j < blockStart)
+			continue;
+		if (!v3d_qpu_instr_is_movable(instr) ||
+		    !v3d_qpu_if_convert_op_is_harmless(instr, TRUE, blockCond, liveAfter) ||
+		    !v3d_qpu_if_convert_op_is_harmless(instr, FALSE, blockCond, liveAfter))
+			return FALSE;
 	}
+	return target - blockStart <= 1 + numSlotNops + args->maxExtraCycles;
+}
 
-	if (!hasError && (state.thrsw_count > 1 && !state.last_thrsw_found))
+static v3d_bool v3d_qpu_if_convert_build(struct v3d_qpu_if_convert_arguments* args,
+                                         const v3d_bool* removed, int* oldIndices,
+                                         int* newIndices,
+                                         struct v3d_qpu_validate_result* resultOut)
+{
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	for (int i = 0; i < numInstructions; ++i)
 	{
-		fail_instr(&state, V3D_QPU_VALIDATE_ERROR_THREAD_SWITCH_FOUND_WITHOUT_LAST_THRSW_IN_PROGRAM,
-		           "thread switch found without last-THRSW in program");
-		results->errorInstructionIndex = numInstructions - 1;
-		hasError = TRUE;
+		newIndices[i] = args->numInstructionsOut;
+		if (removed[i])
+			continue;
+		int outIndex = args->numInstructionsOut++;
+		args->instructionsOut[outIndex] = args->instructions[i];
+		oldIndices[outIndex] = i;
 	}
+	newIndices[numInstructions] = args->numInstructionsOut;
+	v3d_qpu_remap_branches(args->instructionsOut, args->numInstructionsOut, oldIndices,
+	                       newIndices, numInstructions);
 
-	// (todo) Figure out this thrsw business
-	/* if (!hasError && !state.thrend_found) */
-	/* { */
-	/* 	fail_instr(&state, V3D_QPU_VALIDATE_ERROR_NO_PROGRAM_END_THRSW_FOUND, */
-	/* 	           "No program-end THRSW found"); */
-	/* 	results->errorInstructionIndex = numInstructions - 1; */
-	/* 	hasError = TRUE; */
-	/* } */
+	*resultOut = (struct v3d_qpu_validate_result){0};
+	return v3d_qpu_validate(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+	                        resultOut);
+}
 
-	if (!hasError && (numInstructions < 3 || (instructions[numInstructions - 1].sig.thrsw ||
-	                                          instructions[numInstructions - 2].sig.thrsw)))
+v3d_bool v3d_qpu_if_convert(struct v3d_qpu_if_convert_arguments* args)
+{
+	int numInstructions = args->numInstructions;
+	args->numInstructionsOut = 0;
+	args->numBranchesRemoved = 0;
+	args->numInstructionsRemoved = 0;
+	args->errorMessage = NULL;
+	args->errorInstructionIndex = 0;
+	if (args->devinfo.ver >= 70)
+		return v3d_qpu_if_convert_fail(args, "V3D 7.x if-conversion not implemented", 0);
+
+	struct v3d_arena_marker marker = v3d_arena_mark(args->arena);
+	struct v3d_qpu_liveness* liveIn =
+	    V3D_ARENA_ALLOC_ARRAY(args->arena, struct v3d_qpu_liveness, numInstructions + 1);
+	v3d_bool* removed = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* rejected = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	v3d_bool* isBranchTarget = V3D_ARENA_ALLOC_ARRAY(args->arena, v3d_bool, numInstructions + 1);
+	int* oldIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	int* newIndices = args->newIndicesOut;
+	if (!newIndices)
+		newIndices = V3D_ARENA_ALLOC_ARRAY(args->arena, int, numInstructions + 1);
+	if (!liveIn || !removed || !rejected || !isBranchTarget || !oldIndices || !newIndices)
 	{
-		fail_instr(&state, V3D_QPU_VALIDATE_ERROR_NO_PROGRAM_END_THRSW_DELAY_SLOTS,
-		           "THRSW needs two delay slot instructions");
-		results->errorInstructionIndex = numInstructions - 1;
-		hasError = TRUE;
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_if_convert_fail(args, "Out of arena memory", 0);
+	}
+	for (int i = 0; i <= numInstructions; ++i)
+	{
+		removed[i] = FALSE;
+		rejected[i] = FALSE;
 	}
 
-	if (hasError)
+	struct v3d_qpu_validate_result result;
+	if (!v3d_qpu_if_convert_build(args, removed, oldIndices, newIndices, &result))
 	{
-		results->errorMessage = state.errorMessage;
-		results->error = state.error;
-		return FALSE;
+		v3d_arena_restore(args->arena, marker);
+		return v3d_qpu_if_convert_fail(args, result.errorMessage, result.errorInstructionIndex);
 	}
 
-	return TRUE;
+	// Last branch first, so the else branch of a diamond is gone by the time the if branch's block
+	// is looked at. Liveness and targets are worked out again after every removal.
+	struct v3d_qpu_liveness unknownTarget = {~0ull, 0xff, V3D_QPU_FLAG_A | V3D_QPU_FLAG_B};
+	v3d_bool succeeded = TRUE;
+	for (v3d_bool changed = TRUE; changed && succeeded;)
+	{
+		changed = FALSE;
+		v3d_qpu_compute_liveness(&args->devinfo, args->instructionsOut, args->numInstructionsOut,
+		                         unknownTarget, liveIn);
+		v3d_qpu_find_branch_targets(args->instructionsOut, args->numInstructionsOut,
+		                            isBranchTarget);
+		for (int b = args->numInstructionsOut - 1; b >= 0 && !changed; --b)
+		{
+			int branch = oldIndices[b];
+			if (rejected[branch] || !v3d_qpu_if_convert_can_remove(args, liveIn, isBranchTarget, b))
+				continue;
+			int slots[3];
+			for (int slot = 0; slot < 3; ++slot)
+				slots[slot] = oldIndices[b + 1 + slot];
+
+			// Either way the program changed, so look again
+			changed = TRUE;
+			removed[branch] = TRUE;
+			if (!v3d_qpu_if_convert_build(args, removed, oldIndices, newIndices, &result))
+			{
+				removed[branch] = FALSE;
+				rejected[branch] = TRUE;
+				succeeded =
+				    v3d_qpu_if_convert_build(args, removed, oldIndices, newIndices, &result);
+				break;
+			}
+			++args->numBranchesRemoved;
+
+			// The delay slot NOPs now only matter if something needs the time
+			for (int slot = 0; slot < 3; ++slot)
+			{
+				if (!v3d_qpu_instr_is_plain_nop(&args->instructions[slots[slot]]))
+					continue;
+				removed[slots[slot]] = TRUE;
+				if (v3d_qpu_if_convert_build(args, removed, oldIndices, newIndices, &result))
+					continue;
+				removed[slots[slot]] = FALSE;
+				succeeded =
+				    v3d_qpu_if_convert_build(args, removed, oldIndices, newIndices, &result);
+			}
+		}
+	}
+	if (!succeeded)
+		v3d_qpu_if_convert_fail(args, result.errorMessage, result.errorInstructionIndex);
+	args->numInstructionsRemoved = numInstructions - args->numInstructionsOut;
+	v3d_arena_restore(args->arena, marker);
+	return succeeded;
 }
 
 #endif // V3D_ASSEMBLER_IMPLEMENTATION
@@ -0,0 +1,381 @@
+// v3dAssembler.hpp
+// C++17 interface over v3dAssembler.h. Source is taken as std::string_view and code as a span, so
+// nothing is copied on the way in, and assembled programs are move-only objects which own their
+// packed code, line table, and uniform layout.
+//
+// Written by Macoy Madson. Shares the license of v3dAssembler.h.
+//
+//
+// Usage
+//
+// The implementation still comes from v3dAssembler.h, built as C in one source file (see
+// v3dAssembler.h). This header only needs its interface:
+//
+// #include "v3dAssembler.hpp"
+//
+// v3d::Program program;
+// v3d::Error error;
+// if (!v3d::assemble(devinfo, source, program, &error))
+//     printf("%d: %.*s\n", error.line, (int)error.message.size(), error.message.data());
+// upload(program.code().data(), program.code().size() * sizeof(v3d_uint64));
+//
+// v3d::span is std::span when the standard library has it, otherwise a minimal stand-in with the
+// same interface.
+#ifndef V3DASSEMBLER_HPP
+#define V3DASSEMBLER_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "v3dAssembler.h"
+
+namespace v3d
+{
+#ifdef __cpp_lib_span
+template <typename T>
+using span = std::span<T>;
+#else
+template <typename T>
+class span
+{
+public:
+	constexpr span() = default;
+	constexpr span(T* data, std::size_t size) : begin_(data), size_(size) {}
+	template <std::size_t N>
+	constexpr span(T (&array)[N]) : begin_(array), size_(N)
+	{
+	}
+	// Also takes std::vector, std::array, and spans of non-const T
+	template <typename Container,
+	          typename = decltype(static_cast<T*>(std::declval<Container&>().data()))>
+	constexpr span(Container& container) : begin_(container.data()), size_(container.size())
+	{
+	}
+
+	constexpr T* data() const { return begin_; }
+	constexpr std::size_t size() const { return size_; }
+	constexpr bool empty() const { return size_ == 0; }
+	constexpr T* begin() const { return begin_; }
+	constexpr T* end() const { return begin_ + size_; }
+	constexpr T& operator[](std::size_t index) const { return begin_[index]; }
+
+private:
+	T* begin_ = nullptr;
+	std::size_t size_ = 0;
+};
+#endif
+
+// Describes why assembling, loading, or validating failed. message points at a string owned by
+// v3dAssembler.h, so an Error can be kept around indefinitely.
+struct Error
+{
+	std::string_view message;
+	// Byte offset into the source and line number (starting at 1). Both are 0 when the code did
+	// not come from source.
+	int offset = 0;
+	int line = 0;
+	// The instruction at fault, or -1 if the error is not about a single instruction.
+	int instructionIndex = -1;
+	v3d_qpu_validate_error validateError = V3D_QPU_VALIDATE_ERROR_NONE;
+	// All valid words where the error happened, e.g. every add op, for "did you mean" suggestions
+	span<const char* const> hints;
+
+	explicit operator bool() const { return !message.empty(); }
+};
+
+// Where an instruction came from in the source
+struct LineInfo
+{
+	int offset;
+	int line;
+};
+
+enum class UniformLoad
+{
+	// ldunif signal, writing r5
+	Ldunif,
+	// ldunifrf signal, writing the register in sig_addr
+	Ldunifrf,
+	// Write to a magic waddr which also reads a uniform, e.g. tmuau or tlbu
+	MagicWrite,
+	// Branch which moves the uniform stream to a new address read from the stream
+	Branch,
+};
+
+// Each entry consumes the next value of the uniform stream, in order.
+struct Uniform
+{
+	int instructionIndex;
+	UniformLoad load;
+};
+
+// An instruction unpacked while iterating over a Program
+struct DecodedInstruction
+{
+	int index;
+	v3d_uint64 packed;
+	// FALSE if packed is not a valid instruction for the device, in which case instr is unset
+	v3d_bool valid;
+	v3d_qpu_instr instr;
+};
+
+// Unpacks each instruction as it is reached, so nothing is decoded up front.
+class DecodedRange
+{
+public:
+	class iterator
+	{
+	public:
+		iterator(const v3d_device_info* devinfo, const v3d_uint64* code, int index)
+		    : devinfo(devinfo), code(code), index(index)
+		{
+		}
+
+		DecodedInstruction operator*() const
+		{
+			DecodedInstruction decoded = {};
+			decoded.index = index;
+			decoded.packed = code[index];
+			decoded.valid = v3d_qpu_instr_unpack(devinfo, decoded.packed, &decoded.instr);
+			return decoded;
+		}
+		iterator& operator++()
+		{
+			++index;
+			return *this;
+		}
+		bool operator==(const iterator& other) const { return index == other.index; }
+		bool operator!=(const iterator& other) const { return index != other.index; }
+
+	private:
+		const v3d_device_info* devinfo;
+		const v3d_uint64* code;
+		int index;
+	};
+
+	DecodedRange(const v3d_device_info* devinfo, span<const v3d_uint64> code)
+	    : devinfo(devinfo), code(code)
+	{
+	}
+
+	iterator begin() const { return iterator(devinfo, code.data(), 0); }
+	iterator end() const { return iterator(devinfo, code.data(), (int)code.size()); }
+
+private:
+	const v3d_device_info* devinfo;
+	span<const v3d_uint64> code;
+};
+
+class Program
+{
+public:
+	Program() = default;
+	Program(Program&&) noexcept = default;
+	Program& operator=(Program&&) noexcept = default;
+	Program(const Program&) = delete;
+	Program& operator=(const Program&) = delete;
+
+	const v3d_device_info& devinfo() const { return deviceInfo; }
+	span<const v3d_uint64> code() const { return packedCode; }
+	int numInstructions() const { return (int)packedCode.size(); }
+	bool empty() const { return packedCode.empty(); }
+	// One entry per instruction. Empty if the program was not assembled from source.
+	span<const LineInfo> lines() const { return lineTable; }
+	span<const Uniform> uniforms() const { return uniformLayout; }
+	DecodedRange instructions() const { return DecodedRange(&deviceInfo, packedCode); }
+
+private:
+	friend bool assemble(const v3d_device_info& devinfo, std::string_view source,
+	                     Program& programOut, Error* errorOut);
+	friend bool load(const v3d_device_info& devinfo, span<const v3d_uint64> code,
+	                 Program& programOut, Error* errorOut);
+
+	v3d_device_info deviceInfo = {};
+	std::vector<v3d_uint64> packedCode;
+	std::vector<LineInfo> lineTable;
+	std::vector<Uniform> uniformLayout;
+};
+
+namespace detail
+{
+inline int countNewlines(const char* begin, const char* end)
+{
+	int numNewlines = 0;
+	for (const char* currentChar = begin; currentChar < end; ++currentChar)
+	{
+		if (*currentChar == '\n')
+			++numNewlines;
+	}
+	return numNewlines;
+}
+
+inline void setError(Error* errorOut, const char* message, int instructionIndex)
+{
+	if (!errorOut)
+		return;
+	*errorOut = Error();
+	errorOut->message = message;
+	errorOut->instructionIndex = instructionIndex;
+}
+
+inline void appendUniforms(const v3d_qpu_instr& instr, int instructionIndex,
+                           std::vector<Uniform>& uniforms)
+{
+	if (instr.type == V3D_QPU_INSTR_TYPE_BRANCH)
+	{
+		if (instr.branch.ub && (instr.branch.bdu == V3D_QPU_BRANCH_DEST_ABS ||
+		                        instr.branch.bdu == V3D_QPU_BRANCH_DEST_REL))
+			uniforms.push_back({instructionIndex, UniformLoad::Branch});
+		return;
+	}
+
+	if (instr.sig.ldunif)
+		uniforms.push_back({instructionIndex, UniformLoad::Ldunif});
+	if (instr.sig.ldunifrf)
+		uniforms.push_back({instructionIndex, UniformLoad::Ldunifrf});
+	if ((instr.alu.add.magic_write &&
+	     v3d_qpu_magic_waddr_loads_unif((v3d_qpu_waddr)instr.alu.add.waddr)) ||
+	    (instr.alu.mul.magic_write &&
+	     v3d_qpu_magic_waddr_loads_unif((v3d_qpu_waddr)instr.alu.mul.waddr)))
+		uniforms.push_back({instructionIndex, UniformLoad::MagicWrite});
+}
+
+// Validates instructions, filling errorOut from the validator's result
+inline bool validateInstructions(const v3d_device_info& devinfo,
+                                 std::vector<v3d_qpu_instr>& instructions, Error* errorOut)
+{
+	v3d_qpu_validate_result result = {};
+	if (v3d_qpu_validate(&devinfo, instructions.data(), (int)instructions.size(), &result))
+		return true;
+	setError(errorOut, result.errorMessage, result.errorInstructionIndex);
+	if (errorOut)
+		errorOut->validateError = result.error;
+	return false;
+}
+}  // namespace detail
+
+inline bool pack(const v3d_device_info& devinfo, const v3d_qpu_instr& instr, v3d_uint64& packedOut)
+{
+	return v3d_qpu_instr_pack(&devinfo, &instr, &packedOut);
+}
+
+inline bool unpack(const v3d_device_info& devinfo, v3d_uint64 packed, v3d_qpu_instr& instrOut)
+{
+	return v3d_qpu_instr_unpack(&devinfo, packed, &instrOut);
+}
+
+// Returns an empty string if packed is not a valid instruction
+inline std::string disassemble(const v3d_device_info& devinfo, v3d_uint64 packed)
+{
+	char buffer[256];
+	std::size_t length = v3d_qpu_disasm(&devinfo, packed, buffer, sizeof(buffer));
+	if (length >= sizeof(buffer))
+		length = sizeof(buffer) - 1;
+	return std::string(buffer, length);
+}
+
+// Unpacks and validates code. Returns false on the first instruction which doesn't unpack, or
+// whichever instruction the validator rejects.
+inline bool validate(const v3d_device_info& devinfo, span<const v3d_uint64> code,
+                     Error* errorOut = nullptr)
+{
+	std::vector<v3d_qpu_instr> instructions(code.size());
+	for (std::size_t i = 0; i < code.size(); ++i)
+	{
+		if (!v3d_qpu_instr_unpack(&devinfo, code[i], &instructions[i]))
+		{
+			detail::setError(errorOut, "Instruction is not valid on this device", (int)i);
+			return false;
+		}
+	}
+	return detail::validateInstructions(devinfo, instructions, errorOut);
+}
+
+// Assembles, packs, and validates source in a single pass with v3d_qpu_assemble_program(), so no
+// unpacked instructions are kept. programOut is only modified on success.
+inline bool assemble(const v3d_device_info& devinfo, std::string_view source, Program& programOut,
+                     Error* errorOut = nullptr)
+{
+	// There is at most one instruction per line
+	const int maxInstructions =
+	    detail::countNewlines(source.data(), source.data() + source.size()) + 1;
+	Program program;
+	program.deviceInfo = devinfo;
+	program.packedCode.resize(maxInstructions);
+	std::vector<int> offsets(maxInstructions);
+	std::vector<int> lines(maxInstructions);
+
+	v3d_qpu_assemble_program_arguments args = {};
+	args.devinfo = devinfo;
+	args.assembly = source.data();
+	args.assemblyLength = (int)source.size();
+	args.instructionsOut = program.packedCode.data();
+	args.maxInstructions = maxInstructions;
+	args.instructionOffsetsOut = offsets.data();
+	args.instructionLinesOut = lines.data();
+	if (!v3d_qpu_assemble_program(&args))
+	{
+		if (errorOut)
+		{
+			// Assembly errors are about the instruction which didn't make it into the program
+			const bool validationFailed = args.validateResult.errorMessage != nullptr;
+			detail::setError(errorOut, args.errorMessage,
+			                 validationFailed ? args.validateResult.errorInstructionIndex :
+			                                    args.numInstructions);
+			errorOut->offset = args.errorAtOffset;
+			errorOut->line = args.errorLine;
+			errorOut->validateError = args.validateResult.error;
+			errorOut->hints = span<const char* const>(args.hintAvailable, args.numHints);
+		}
+		return false;
+	}
+
+	program.packedCode.resize(args.numInstructions);
+	program.lineTable.reserve(args.numInstructions);
+	for (int i = 0; i < args.numInstructions; ++i)
+	{
+		program.lineTable.push_back({offsets[i], lines[i]});
+		v3d_qpu_instr instr;
+		if (v3d_qpu_instr_unpack(&devinfo, program.packedCode[i], &instr))
+			detail::appendUniforms(instr, i, program.uniformLayout);
+	}
+
+	programOut = std::move(program);
+	return true;
+}
+
+// Takes ownership of a copy of already packed code, e.g. loaded from disk, after validating it.
+// programOut is only modified on success.
+inline bool load(const v3d_device_info& devinfo, span<const v3d_uint64> code, Program& programOut,
+                 Error* errorOut = nullptr)
+{
+	Program program;
+	program.deviceInfo = devinfo;
+	program.packedCode.assign(code.begin(), code.end());
+
+	std::vector<v3d_qpu_instr> instructions(code.size());
+	for (std::size_t i = 0; i < code.size(); ++i)
+	{
+		if (!v3d_qpu_instr_unpack(&devinfo, code[i], &instructions[i]))
+		{
+			detail::setError(errorOut, "Instruction is not valid on this device", (int)i);
+			return false;
+		}
+		detail::appendUniforms(instructions[i], (int)i, program.uniformLayout);
+	}
+	if (!detail::validateInstructions(devinfo, instructions, errorOut))
+		return false;
+
+	programOut = std::move(program);
+	return true;
+}
+}  // namespace v3d
+
+#endif  // V3DASSEMBLER_HPP
@@ -0,0 +1,1214 @@
+// v3dAssemblerConstexpr.hpp
+// Compile-time assembler for V3D 4.1/4.2 shader code which never changes, e.g. clears, copies, and
+// blits. The program is assembled and packed while compiling, so there is no startup cost, and
+// assembly errors are compile errors instead of runtime failures.
+//
+// Written by Macoy Madson. Shares the license of v3dAssembler.h.
+//
+//
+// Usage
+//
+// Requires C++20. Only the interface of v3dAssembler.h is used, so V3D_ASSEMBLER_IMPLEMENTATION is
+// not needed for this.
+//
+// #include "v3dAssemblerConstexpr.hpp"
+//
+// constexpr auto clearKernel = v3d::assemble<v3d::V3D_42, R"(
+//     nop ; nop ; ldunifrf.rf0
+//     or tlbu, rf0, rf0 ; nop
+//     ...
+// )">();
+//
+// clearKernel is a std::array<v3d_uint64, N> holding one packed instruction per non-empty line.
+//
+// The syntax follows v3d_qpu_assemble(), one instruction per line, and a line which both accept
+// packs to the same word as running v3d_qpu_assemble() and v3d_qpu_instr_pack() on it. The parser
+// is a separate implementation though, and doesn't accept exactly the same text. It is more
+// lenient about rf32 through rf63, a ';' right after an operand, and a ';' ending the line, and
+// doesn't know the "tmu", "quad" and "rep" waddr aliases from V3D 3.x and 7.x, which
+// v3d_qpu_assemble() accepts for any version. Branches are not supported, matching
+// v3d_qpu_assemble().
+// Constant expressions (e.g. "(1 << 3)" or "rf(2 + 1)") are not supported either; they are a
+// compile error here.
+//
+// When the assembly is invalid, compilation fails with a note pointing at the
+// v3d::detail::assembly_error() call which describes the problem. The line number (starting at 1)
+// is reported as an out of bounds subscript of atLine.
+#ifndef V3DASSEMBLERCONSTEXPR_HPP
+#define V3DASSEMBLERCONSTEXPR_HPP
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+
+#include "v3dAssembler.h"
+
+namespace v3d
+{
+inline constexpr int V3D_41 = 41;
+inline constexpr int V3D_42 = 42;
+
+// Lets string literals be passed as template arguments
+template <std::size_t N>
+struct fixed_string
+{
+	char text[N] = {};
+
+	consteval fixed_string(const char (&string)[N])
+	{
+		for (std::size_t i = 0; i < N; ++i)
+			text[i] = string[i];
+	}
+
+	constexpr std::string_view view() const { return std::string_view(text, N - 1); }
+};
+
+namespace detail
+{
+// Reaching this during constant evaluation stops compilation. The compiler's constexpr backtrace
+// shows this call with the message, and the out of bounds subscript reports the line number.
+constexpr void assembly_error(const char* message, int line)
+{
+	if (std::is_constant_evaluated() && message)
+	{
+		const char atLine[1] = {0};
+		const char reached = atLine[line];
+		(void)reached;
+	}
+}
+
+enum : v3d_uint8
+{
+	ARG_D = 1,  // Destination
+	ARG_A = 2,  // Argument A
+	ARG_B = 4,  // Argument B
+};
+
+constexpr v3d_uint8 muxMask(int bit) { return (v3d_uint8)(1 << bit); }
+constexpr v3d_uint8 muxRange(int bottom, int top)
+{
+	return (v3d_uint8)(((1 << (top + 1)) - 1) & ~((1 << bottom) - 1));
+}
+inline constexpr v3d_uint8 anyMux = 0xff;
+
+// The V3D 3.3-4.2 rows of add_ops_v33[] and mul_ops_v33[] in v3dAssembler.h, with the names and
+// argument counts folded in. The first row matching an op and version is the one used to pack it.
+struct opcode_desc
+{
+	const char* name;
+	int op;
+	v3d_uint8 opcodeFirst;
+	v3d_uint8 bMask;
+	v3d_uint8 aMask;
+	v3d_uint8 args;
+	v3d_uint8 firstVer = 0;
+	v3d_uint8 lastVer = 0;
+};
+
+inline constexpr opcode_desc addOps[] = {
+    {"fadd", V3D_QPU_A_FADD, 0, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"faddnf", V3D_QPU_A_FADDNF, 0, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"vfpack", V3D_QPU_A_VFPACK, 53, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"add", V3D_QPU_A_ADD, 56, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"sub", V3D_QPU_A_SUB, 60, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"fsub", V3D_QPU_A_FSUB, 64, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"min", V3D_QPU_A_MIN, 120, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"max", V3D_QPU_A_MAX, 121, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"umin", V3D_QPU_A_UMIN, 122, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"umax", V3D_QPU_A_UMAX, 123, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"shl", V3D_QPU_A_SHL, 124, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"shr", V3D_QPU_A_SHR, 125, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"asr", V3D_QPU_A_ASR, 126, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"ror", V3D_QPU_A_ROR, 127, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"fmin", V3D_QPU_A_FMIN, 128, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"fmax", V3D_QPU_A_FMAX, 128, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"vfmin", V3D_QPU_A_VFMIN, 176, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"and", V3D_QPU_A_AND, 181, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"or", V3D_QPU_A_OR, 182, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"xor", V3D_QPU_A_XOR, 183, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"vadd", V3D_QPU_A_VADD, 184, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"vsub", V3D_QPU_A_VSUB, 185, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"not", V3D_QPU_A_NOT, 186, muxMask(0), anyMux, ARG_D | ARG_A},
+    {"neg", V3D_QPU_A_NEG, 186, muxMask(1), anyMux, ARG_D | ARG_A},
+    {"flapush", V3D_QPU_A_FLAPUSH, 186, muxMask(2), anyMux, ARG_D | ARG_A},
+    {"flbpush", V3D_QPU_A_FLBPUSH, 186, muxMask(3), anyMux, ARG_D | ARG_A},
+    {"flpop", V3D_QPU_A_FLPOP, 186, muxMask(4), anyMux, ARG_D | ARG_A},
+    {"recip", V3D_QPU_A_RECIP, 186, muxMask(5), anyMux, ARG_D | ARG_A},
+    {"setmsf", V3D_QPU_A_SETMSF, 186, muxMask(6), anyMux, ARG_D | ARG_A},
+    {"setrevf", V3D_QPU_A_SETREVF, 186, muxMask(7), anyMux, ARG_D | ARG_A},
+    {"nop", V3D_QPU_A_NOP, 187, muxMask(0), muxMask(0), 0},
+    {"tidx", V3D_QPU_A_TIDX, 187, muxMask(0), muxMask(1), ARG_D},
+    {"eidx", V3D_QPU_A_EIDX, 187, muxMask(0), muxMask(2), ARG_D},
+    {"lr", V3D_QPU_A_LR, 187, muxMask(0), muxMask(3), ARG_D},
+    {"vfla", V3D_QPU_A_VFLA, 187, muxMask(0), muxMask(4), ARG_D},
+    {"vflna", V3D_QPU_A_VFLNA, 187, muxMask(0), muxMask(5), ARG_D},
+    {"vflb", V3D_QPU_A_VFLB, 187, muxMask(0), muxMask(6), ARG_D},
+    {"vflnb", V3D_QPU_A_VFLNB, 187, muxMask(0), muxMask(7), ARG_D},
+    {"fxcd", V3D_QPU_A_FXCD, 187, muxMask(1), muxRange(0, 2), ARG_D},
+    {"xcd", V3D_QPU_A_XCD, 187, muxMask(1), muxMask(3), ARG_D},
+    {"fycd", V3D_QPU_A_FYCD, 187, muxMask(1), muxRange(4, 6), ARG_D},
+    {"ycd", V3D_QPU_A_YCD, 187, muxMask(1), muxMask(7), ARG_D},
+    {"msf", V3D_QPU_A_MSF, 187, muxMask(2), muxMask(0), ARG_D},
+    {"revf", V3D_QPU_A_REVF, 187, muxMask(2), muxMask(1), ARG_D},
+    {"vdwwt", V3D_QPU_A_VDWWT, 187, muxMask(2), muxMask(2), ARG_D, 33},
+    {"iid", V3D_QPU_A_IID, 187, muxMask(2), muxMask(2), ARG_D, 40},
+    {"sampid", V3D_QPU_A_SAMPID, 187, muxMask(2), muxMask(3), ARG_D, 40},
+    {"barrierid", V3D_QPU_A_BARRIERID, 187, muxMask(2), muxMask(4), ARG_D, 40},
+    {"tmuwt", V3D_QPU_A_TMUWT, 187, muxMask(2), muxMask(5), ARG_D},
+    {"vpmwt", V3D_QPU_A_VPMWT, 187, muxMask(2), muxMask(6), ARG_D},
+    {"flafirst", V3D_QPU_A_FLAFIRST, 187, muxMask(2), muxMask(7), ARG_D, 41},
+    {"flnafirst", V3D_QPU_A_FLNAFIRST, 187, muxMask(3), muxMask(0), ARG_D, 41},
+    {"vpmsetup", V3D_QPU_A_VPMSETUP, 187, muxMask(3), anyMux, ARG_D | ARG_A, 33},
+    {"ldvpmv_in", V3D_QPU_A_LDVPMV_IN, 188, muxMask(0), anyMux, ARG_D | ARG_A, 40},
+    {"ldvpmv_out", V3D_QPU_A_LDVPMV_OUT, 188, muxMask(0), anyMux, ARG_D | ARG_A, 40},
+    {"ldvpmd_in", V3D_QPU_A_LDVPMD_IN, 188, muxMask(1), anyMux, ARG_D | ARG_A, 40},
+    {"ldvpmd_out", V3D_QPU_A_LDVPMD_OUT, 188, muxMask(1), anyMux, ARG_D | ARG_A, 40},
+    {"ldvpmp", V3D_QPU_A_LDVPMP, 188, muxMask(2), anyMux, ARG_D | ARG_A, 40},
+    {"rsqrt", V3D_QPU_A_RSQRT, 188, muxMask(3), anyMux, ARG_D | ARG_A, 41},
+    {"exp", V3D_QPU_A_EXP, 188, muxMask(4), anyMux, ARG_D | ARG_A, 41},
+    {"log", V3D_QPU_A_LOG, 188, muxMask(5), anyMux, ARG_D | ARG_A, 41},
+    {"sin", V3D_QPU_A_SIN, 188, muxMask(6), anyMux, ARG_D | ARG_A, 41},
+    {"rsqrt2", V3D_QPU_A_RSQRT2, 188, muxMask(7), anyMux, ARG_D | ARG_A, 41},
+    {"ldvpmg_in", V3D_QPU_A_LDVPMG_IN, 189, anyMux, anyMux, ARG_D | ARG_A | ARG_B, 40},
+    {"ldvpmg_out", V3D_QPU_A_LDVPMG_OUT, 189, anyMux, anyMux, ARG_D | ARG_A | ARG_B, 40},
+    {"fcmp", V3D_QPU_A_FCMP, 192, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"vfmax", V3D_QPU_A_VFMAX, 240, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"fround", V3D_QPU_A_FROUND, 245, muxRange(0, 2), anyMux, ARG_D | ARG_A},
+    {"ftoin", V3D_QPU_A_FTOIN, 245, muxMask(3), anyMux, ARG_D | ARG_A},
+    {"ftrunc", V3D_QPU_A_FTRUNC, 245, muxRange(4, 6), anyMux, ARG_D | ARG_A},
+    {"ftoiz", V3D_QPU_A_FTOIZ, 245, muxMask(7), anyMux, ARG_D | ARG_A},
+    {"ffloor", V3D_QPU_A_FFLOOR, 246, muxRange(0, 2), anyMux, ARG_D | ARG_A},
+    {"ftouz", V3D_QPU_A_FTOUZ, 246, muxMask(3), anyMux, ARG_D | ARG_A},
+    {"fceil", V3D_QPU_A_FCEIL, 246, muxRange(4, 6), anyMux, ARG_D | ARG_A},
+    {"ftoc", V3D_QPU_A_FTOC, 246, muxMask(7), anyMux, ARG_D | ARG_A},
+    {"fdx", V3D_QPU_A_FDX, 247, muxRange(0, 2), anyMux, ARG_D | ARG_A},
+    {"fdy", V3D_QPU_A_FDY, 247, muxRange(4, 6), anyMux, ARG_D | ARG_A},
+    {"stvpmv", V3D_QPU_A_STVPMV, 248, anyMux, anyMux, ARG_A | ARG_B},
+    {"stvpmd", V3D_QPU_A_STVPMD, 248, anyMux, anyMux, ARG_A | ARG_B},
+    {"stvpmp", V3D_QPU_A_STVPMP, 248, anyMux, anyMux, ARG_A | ARG_B},
+    {"itof", V3D_QPU_A_ITOF, 252, muxRange(0, 2), anyMux, ARG_D | ARG_A},
+    {"clz", V3D_QPU_A_CLZ, 252, muxMask(3), anyMux, ARG_D | ARG_A},
+    {"utof", V3D_QPU_A_UTOF, 252, muxRange(4, 6), anyMux, ARG_D | ARG_A},
+};
+
+inline constexpr opcode_desc mulOps[] = {
+    {"add", V3D_QPU_M_ADD, 1, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"sub", V3D_QPU_M_SUB, 2, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"umul24", V3D_QPU_M_UMUL24, 3, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"vfmul", V3D_QPU_M_VFMUL, 4, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"smul24", V3D_QPU_M_SMUL24, 9, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"multop", V3D_QPU_M_MULTOP, 10, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+    {"fmov", V3D_QPU_M_FMOV, 14, anyMux, anyMux, ARG_D | ARG_A, 33, 42},
+    {"nop", V3D_QPU_M_NOP, 15, muxMask(4), muxMask(0), 0, 33, 42},
+    {"mov", V3D_QPU_M_MOV, 15, muxMask(7), anyMux, ARG_D | ARG_A, 33, 42},
+    {"fmul", V3D_QPU_M_FMUL, 16, anyMux, anyMux, ARG_D | ARG_A | ARG_B},
+};
+
+// Names are shared by conditions, pf, and uf, so they are told apart by which table matches
+struct named_value
+{
+	const char* name;
+	int value;
+};
+
+inline constexpr named_value condNames[] = {
+    {"ifa", V3D_QPU_COND_IFA},
+    {"ifb", V3D_QPU_COND_IFB},
+    {"ifna", V3D_QPU_COND_IFNA},
+    {"ifnb", V3D_QPU_COND_IFNB},
+};
+
+inline constexpr named_value pfNames[] = {
+    {"pushz", V3D_QPU_PF_PUSHZ},
+    {"pushn", V3D_QPU_PF_PUSHN},
+    {"pushc", V3D_QPU_PF_PUSHC},
+};
+
+inline constexpr named_value ufNames[] = {
+    {"andz", V3D_QPU_UF_ANDZ},   {"andnz", V3D_QPU_UF_ANDNZ}, {"norz", V3D_QPU_UF_NORZ},
+    {"nornz", V3D_QPU_UF_NORNZ}, {"andn", V3D_QPU_UF_ANDN},   {"andnn", V3D_QPU_UF_ANDNN},
+    {"norn", V3D_QPU_UF_NORN},   {"nornn", V3D_QPU_UF_NORNN}, {"andc", V3D_QPU_UF_ANDC},
+    {"andnc", V3D_QPU_UF_ANDNC}, {"norc", V3D_QPU_UF_NORC},   {"nornc", V3D_QPU_UF_NORNC},
+};
+
+inline constexpr named_value packNames[] = {
+    {"l", V3D_QPU_PACK_L},
+    {"h", V3D_QPU_PACK_H},
+};
+
+inline constexpr named_value unpackNames[] = {
+    {"l", V3D_QPU_UNPACK_L},
+    {"h", V3D_QPU_UNPACK_H},
+    {"abs", V3D_QPU_UNPACK_ABS},
+    {"ff", V3D_QPU_UNPACK_REPLICATE_32F_16},
+    {"ll", V3D_QPU_UNPACK_REPLICATE_L_16},
+    {"hh", V3D_QPU_UNPACK_REPLICATE_H_16},
+    {"swp", V3D_QPU_UNPACK_SWAP_16},
+};
+
+// V3D 4.x names only
+inline constexpr named_value waddrNames[] = {
+    {"r0", V3D_QPU_WADDR_R0},           {"r1", V3D_QPU_WADDR_R1},
+    {"r2", V3D_QPU_WADDR_R2},           {"r3", V3D_QPU_WADDR_R3},
+    {"r4", V3D_QPU_WADDR_R4},           {"r5", V3D_QPU_WADDR_R5},
+    {"-", V3D_QPU_WADDR_NOP},           {"tlb", V3D_QPU_WADDR_TLB},
+    {"tlbu", V3D_QPU_WADDR_TLBU},       {"unifa", V3D_QPU_WADDR_UNIFA},
+    {"tmul", V3D_QPU_WADDR_TMUL},       {"tmud", V3D_QPU_WADDR_TMUD},
+    {"tmua", V3D_QPU_WADDR_TMUA},       {"tmuau", V3D_QPU_WADDR_TMUAU},
+    {"vpm", V3D_QPU_WADDR_VPM},         {"vpmu", V3D_QPU_WADDR_VPMU},
+    {"sync", V3D_QPU_WADDR_SYNC},       {"syncu", V3D_QPU_WADDR_SYNCU},
+    {"syncb", V3D_QPU_WADDR_SYNCB},     {"recip", V3D_QPU_WADDR_RECIP},
+    {"rsqrt", V3D_QPU_WADDR_RSQRT},     {"exp", V3D_QPU_WADDR_EXP},
+    {"log", V3D_QPU_WADDR_LOG},         {"sin", V3D_QPU_WADDR_SIN},
+    {"rsqrt2", V3D_QPU_WADDR_RSQRT2},   {"tmuc", V3D_QPU_WADDR_TMUC},
+    {"tmus", V3D_QPU_WADDR_TMUS},       {"tmut", V3D_QPU_WADDR_TMUT},
+    {"tmur", V3D_QPU_WADDR_TMUR},       {"tmui", V3D_QPU_WADDR_TMUI},
+    {"tmub", V3D_QPU_WADDR_TMUB},       {"tmudref", V3D_QPU_WADDR_TMUDREF},
+    {"tmuoff", V3D_QPU_WADDR_TMUOFF},   {"tmuscm", V3D_QPU_WADDR_TMUSCM},
+    {"tmusf", V3D_QPU_WADDR_TMUSF},     {"tmuslod", V3D_QPU_WADDR_TMUSLOD},
+    {"tmuhs", V3D_QPU_WADDR_TMUHS},     {"tmuhscm", V3D_QPU_WADDR_TMUHSCM},
+    {"tmuhsf", V3D_QPU_WADDR_TMUHSF},   {"tmuhslod", V3D_QPU_WADDR_TMUHSLOD},
+    {"r5rep", V3D_QPU_WADDR_R5REP},
+};
+
+// Same spellings as small_immediates_names[], mapped to the packed small immediate
+inline constexpr named_value smallImmediateNames[] = {
+    {"0", 0},           {"1", 1},           {"2", 2},           {"3", 3},
+    {"4", 4},           {"5", 5},           {"6", 6},           {"7", 7},
+    {"8", 8},           {"9", 9},           {"10", 10},         {"11", 11},
+    {"12", 12},         {"13", 13},         {"14", 14},         {"15", 15},
+    {"-16", 16},        {"-15", 17},        {"-14", 18},        {"-13", 19},
+    {"-12", 20},        {"-11", 21},        {"-10", 22},        {"-9", 23},
+    {"-8", 24},         {"-7", 25},         {"-6", 26},         {"-5", 27},
+    {"-4", 28},         {"-3", 29},         {"-2", 30},         {"-1", 31},
+    {"16", 16},         {"17", 17},         {"18", 18},         {"19", 19},
+    {"20", 20},         {"21", 21},         {"22", 22},         {"23", 23},
+    {"24", 24},         {"25", 25},         {"26", 26},         {"27", 27},
+    {"28", 28},         {"29", 29},         {"30", 30},         {"31", 31},
+    {"2f^-8", 32},      {"2f^-7", 33},      {"2f^-6", 34},      {"2f^-5", 35},
+    {"2f^-4", 36},      {"2f^-3", 37},      {"2f^-2", 38},      {"2f^-1", 39},
+    {"2f^0", 40},       {"2f^1", 41},       {"2f^2", 42},       {"2f^3", 43},
+    {"2f^4", 44},       {"2f^5", 45},       {"2f^6", 46},       {"2f^7", 47},
+    {"0x3b800000", 32}, {"0x3c000000", 33}, {"0x3c800000", 34}, {"0x3d000000", 35},
+    {"0x3d800000", 36}, {"0x3e000000", 37}, {"0x3e800000", 38}, {"0x3f000000", 39},
+    {"0x3f800000", 40}, {"0x40000000", 41}, {"0x40800000", 42}, {"0x41000000", 43},
+    {"0x41800000", 44}, {"0x42000000", 45}, {"0x42800000", 46}, {"0x43000000", 47},
+};
+
+// Signal bits, in the same order as the fields of struct v3d_qpu_sig
+enum : v3d_uint32
+{
+	SIG_THRSW = 1 << 0,
+	SIG_LDUNIF = 1 << 1,
+	SIG_LDUNIFA = 1 << 2,
+	SIG_LDUNIFRF = 1 << 3,
+	SIG_LDUNIFARF = 1 << 4,
+	SIG_LDTMU = 1 << 5,
+	SIG_LDVARY = 1 << 6,
+	SIG_LDVPM = 1 << 7,
+	SIG_LDTLB = 1 << 8,
+	SIG_LDTLBU = 1 << 9,
+	SIG_UCB = 1 << 10,
+	SIG_ROTATE = 1 << 11,
+	SIG_WRTMUC = 1 << 12,
+	SIG_SMALL_IMM_B = 1 << 14,
+};
+
+// Signals which take an address on V3D 4.1+ (see v3d_qpu_sig_writes_address())
+inline constexpr v3d_uint32 sigWritesAddress =
+    SIG_LDUNIFRF | SIG_LDUNIFARF | SIG_LDVARY | SIG_LDTMU | SIG_LDTLB | SIG_LDTLBU;
+
+inline constexpr named_value sigNames[] = {
+    {"thrsw", SIG_THRSW},         {"ldvary", SIG_LDVARY},       {"ldvpm", SIG_LDVPM},
+    {"ldtmu", SIG_LDTMU},         {"ldtlb", SIG_LDTLB},         {"ldtlbu", SIG_LDTLBU},
+    {"ldunif", SIG_LDUNIF},       {"ldunifrf", SIG_LDUNIFRF},   {"ldunifa", SIG_LDUNIFA},
+    {"ldunifarf", SIG_LDUNIFARF}, {"wrtmuc", SIG_WRTMUC},
+};
+
+// v41_sig_map[], indexed by packed signal. Reserved encodings are 0.
+inline constexpr v3d_uint32 v41SigMap[32] = {
+    0,
+    SIG_THRSW,
+    SIG_LDUNIF,
+    SIG_THRSW | SIG_LDUNIF,
+    SIG_LDTMU,
+    SIG_THRSW | SIG_LDTMU,
+    SIG_LDTMU | SIG_LDUNIF,
+    SIG_THRSW | SIG_LDTMU | SIG_LDUNIF,
+    SIG_LDVARY,
+    SIG_THRSW | SIG_LDVARY,
+    SIG_LDVARY | SIG_LDUNIF,
+    SIG_THRSW | SIG_LDVARY | SIG_LDUNIF,
+    SIG_LDUNIFRF,
+    SIG_THRSW | SIG_LDUNIFRF,
+    SIG_SMALL_IMM_B | SIG_LDVARY,
+    SIG_SMALL_IMM_B,
+    SIG_LDTLB,
+    SIG_LDTLBU,
+    SIG_WRTMUC,
+    SIG_THRSW | SIG_WRTMUC,
+    SIG_LDVARY | SIG_WRTMUC,
+    SIG_THRSW | SIG_LDVARY | SIG_WRTMUC,
+    SIG_UCB,
+    SIG_ROTATE,
+    SIG_LDUNIFA,
+    SIG_LDUNIFARF,
+    0,
+    0,
+    0,
+    0,
+    0,
+    SIG_SMALL_IMM_B | SIG_LDTMU,
+};
+
+// Field positions from v3dAssembler.h (V3D_QPU_*_SHIFT)
+enum : int
+{
+	SHIFT_OP_MUL = 58,
+	SHIFT_SIG = 53,
+	SHIFT_COND = 46,
+	SHIFT_MM = 45,
+	SHIFT_MA = 44,
+	SHIFT_WADDR_M = 38,
+	SHIFT_WADDR_A = 32,
+	SHIFT_OP_ADD = 24,
+	SHIFT_MUL_B = 21,
+	SHIFT_MUL_A = 18,
+	SHIFT_ADD_B = 15,
+	SHIFT_ADD_A = 12,
+	SHIFT_RADDR_A = 6,
+	SHIFT_RADDR_B = 0,
+};
+
+struct alu_input
+{
+	v3d_uint32 mux = V3D_QPU_MUX_R0;
+	int unpack = V3D_QPU_UNPACK_NONE;
+};
+
+struct alu_op
+{
+	const opcode_desc* desc = nullptr;
+	alu_input a;
+	alu_input b;
+	v3d_uint32 waddr = 0;
+	bool magicWrite = false;
+	int outputPack = V3D_QPU_PACK_NONE;
+	int cond = V3D_QPU_COND_NONE;
+	int pf = V3D_QPU_PF_NONE;
+	int uf = V3D_QPU_UF_NONE;
+};
+
+struct alu_instr
+{
+	alu_op add;
+	alu_op mul;
+	v3d_uint32 raddrA = 0;
+	v3d_uint32 raddrB = 0;
+	v3d_uint32 sig = 0;
+	v3d_uint32 sigAddr = 0;
+	bool sigMagic = false;
+};
+
+constexpr int numSources(const opcode_desc* desc)
+{
+	return (desc->args & ARG_B) ? 2 : (desc->args & ARG_A) ? 1 : 0;
+}
+
+constexpr int lowestBit(v3d_uint32 mask)
+{
+	for (int bit = 0; bit < 32; ++bit)
+	{
+		if (mask & (1u << bit))
+			return bit;
+	}
+	return 0;
+}
+
+// See v3d_qpu_float32_unpack_pack()
+constexpr bool float32Unpack(int unpack, v3d_uint32& packed)
+{
+	switch (unpack)
+	{
+		case V3D_QPU_UNPACK_ABS: packed = 0; return true;
+		case V3D_QPU_UNPACK_NONE: packed = 1; return true;
+		case V3D_QPU_UNPACK_L: packed = 2; return true;
+		case V3D_QPU_UNPACK_H: packed = 3; return true;
+		default: return false;
+	}
+}
+
+// See v3d_qpu_float16_unpack_pack()
+constexpr bool float16Unpack(int unpack, v3d_uint32& packed)
+{
+	switch (unpack)
+	{
+		case V3D_QPU_UNPACK_NONE: packed = 0; return true;
+		case V3D_QPU_UNPACK_REPLICATE_32F_16: packed = 1; return true;
+		case V3D_QPU_UNPACK_REPLICATE_L_16: packed = 2; return true;
+		case V3D_QPU_UNPACK_REPLICATE_H_16: packed = 3; return true;
+		case V3D_QPU_UNPACK_SWAP_16: packed = 4; return true;
+		default: return false;
+	}
+}
+
+// See v3d_qpu_float32_pack_pack()
+constexpr bool float32Pack(int pack, v3d_uint32& packed)
+{
+	switch (pack)
+	{
+		case V3D_QPU_PACK_NONE: packed = 0; return true;
+		case V3D_QPU_PACK_L: packed = 1; return true;
+		case V3D_QPU_PACK_H: packed = 2; return true;
+		default: return false;
+	}
+}
+
+// See v3d33_qpu_add_pack()
+constexpr bool packAdd(const alu_op& add, v3d_uint64& packed)
+{
+	const opcode_desc* desc = add.desc;
+	const int op = desc->op;
+	v3d_uint32 waddr = add.waddr;
+	v3d_uint32 muxA = add.a.mux;
+	v3d_uint32 muxB = add.b.mux;
+	v3d_uint32 opcode = desc->opcodeFirst;
+	const int nsrc = numSources(desc);
+	if (nsrc < 2)
+		muxB = lowestBit(desc->bMask);
+	if (nsrc < 1)
+		muxA = lowestBit(desc->aMask);
+
+	bool noMagicWrite = false;
+	switch (op)
+	{
+		case V3D_QPU_A_STVPMV: waddr = 0; noMagicWrite = true; break;
+		case V3D_QPU_A_STVPMD: waddr = 1; noMagicWrite = true; break;
+		case V3D_QPU_A_STVPMP: waddr = 2; noMagicWrite = true; break;
+		case V3D_QPU_A_LDVPMV_IN:
+		case V3D_QPU_A_LDVPMD_IN:
+		case V3D_QPU_A_LDVPMP:
+		case V3D_QPU_A_LDVPMG_IN:
+			if (add.magicWrite)
+				return false;
+			break;
+		case V3D_QPU_A_LDVPMV_OUT:
+		case V3D_QPU_A_LDVPMD_OUT:
+		case V3D_QPU_A_LDVPMG_OUT:
+			if (add.magicWrite)
+				return false;
+			packed |= 1ull << SHIFT_MA;
+			break;
+		default: break;
+	}
+
+	v3d_uint32 aUnpack = 0;
+	v3d_uint32 bUnpack = 0;
+	v3d_uint32 outputPack = 0;
+	switch (op)
+	{
+		case V3D_QPU_A_FADD:
+		case V3D_QPU_A_FADDNF:
+		case V3D_QPU_A_FSUB:
+		case V3D_QPU_A_FMIN:
+		case V3D_QPU_A_FMAX:
+		case V3D_QPU_A_FCMP:
+		{
+			if (!float32Pack(add.outputPack, outputPack) || !float32Unpack(add.a.unpack, aUnpack) ||
+			    !float32Unpack(add.b.unpack, bUnpack))
+				return false;
+			opcode |= outputPack << 4;
+
+			// These operations with commutative operands are distinguished by which order their
+			// operands come in.
+			const bool ordering = aUnpack * 8 + muxA > bUnpack * 8 + muxB;
+			if (((op == V3D_QPU_A_FMIN || op == V3D_QPU_A_FADD) && ordering) ||
+			    ((op == V3D_QPU_A_FMAX || op == V3D_QPU_A_FADDNF) && !ordering))
+			{
+				v3d_uint32 temp = aUnpack;
+				aUnpack = bUnpack;
+				bUnpack = temp;
+				temp = muxA;
+				muxA = muxB;
+				muxB = temp;
+			}
+			opcode |= aUnpack << 2;
+			opcode |= bUnpack << 0;
+			break;
+		}
+		case V3D_QPU_A_VFPACK:
+			if (add.a.unpack == V3D_QPU_UNPACK_ABS || add.b.unpack == V3D_QPU_UNPACK_ABS ||
+			    !float32Unpack(add.a.unpack, aUnpack) || !float32Unpack(add.b.unpack, bUnpack))
+				return false;
+			opcode = (opcode & ~(0x3u << 2)) | (aUnpack << 2);
+			opcode = (opcode & ~(0x3u << 0)) | (bUnpack << 0);
+			break;
+		case V3D_QPU_A_FFLOOR:
+		case V3D_QPU_A_FROUND:
+		case V3D_QPU_A_FTRUNC:
+		case V3D_QPU_A_FCEIL:
+		case V3D_QPU_A_FDX:
+		case V3D_QPU_A_FDY:
+			if (!float32Pack(add.outputPack, outputPack))
+				return false;
+			muxB |= outputPack;
+			if (!float32Unpack(add.a.unpack, aUnpack) || aUnpack == 0)
+				return false;
+			opcode = (opcode & ~(0x3u << 2)) | aUnpack << 2;
+			break;
+		case V3D_QPU_A_FTOIN:
+		case V3D_QPU_A_FTOIZ:
+		case V3D_QPU_A_FTOUZ:
+		case V3D_QPU_A_FTOC:
+			if (add.outputPack != V3D_QPU_PACK_NONE || !float32Unpack(add.a.unpack, aUnpack) ||
+			    aUnpack == 0)
+				return false;
+			opcode |= aUnpack << 2;
+			break;
+		case V3D_QPU_A_VFMIN:
+		case V3D_QPU_A_VFMAX:
+			if (add.outputPack != V3D_QPU_PACK_NONE || add.b.unpack != V3D_QPU_UNPACK_NONE ||
+			    !float16Unpack(add.a.unpack, aUnpack))
+				return false;
+			opcode |= aUnpack;
+			break;
+		default:
+			if (op != V3D_QPU_A_NOP &&
+			    (add.outputPack != V3D_QPU_PACK_NONE || add.a.unpack != V3D_QPU_UNPACK_NONE ||
+			     add.b.unpack != V3D_QPU_UNPACK_NONE))
+				return false;
+			break;
+	}
+
+	packed |= (v3d_uint64)(muxA & 0x7) << SHIFT_ADD_A;
+	packed |= (v3d_uint64)(muxB & 0x7) << SHIFT_ADD_B;
+	packed |= (v3d_uint64)(opcode & 0xff) << SHIFT_OP_ADD;
+	packed |= (v3d_uint64)(waddr & 0x3f) << SHIFT_WADDR_A;
+	if (add.magicWrite && !noMagicWrite)
+		packed |= 1ull << SHIFT_MA;
+	return true;
+}
+
+// See v3d33_qpu_mul_pack()
+constexpr bool packMul(const alu_op& mul, v3d_uint64& packed)
+{
+	const opcode_desc* desc = mul.desc;
+	const int op = desc->op;
+	v3d_uint32 muxA = mul.a.mux;
+	v3d_uint32 muxB = mul.b.mux;
+	v3d_uint32 opcode = desc->opcodeFirst;
+	const int nsrc = numSources(desc);
+	if (nsrc < 2)
+		muxB = lowestBit(desc->bMask);
+	if (nsrc < 1)
+		muxA = lowestBit(desc->aMask);
+
+	v3d_uint32 unpacked = 0;
+	switch (op)
+	{
+		case V3D_QPU_M_FMUL:
+			if (!float32Pack(mul.outputPack, unpacked))
+				return false;
+			// No need for a +1 because opcodeFirst has a 1 in this field
+			opcode += unpacked << 4;
+			if (!float32Unpack(mul.a.unpack, unpacked))
+				return false;
+			opcode |= unpacked << 2;
+			if (!float32Unpack(mul.b.unpack, unpacked))
+				return false;
+			opcode |= unpacked << 0;
+			break;
+		case V3D_QPU_M_FMOV:
+			if (!float32Pack(mul.outputPack, unpacked))
+				return false;
+			opcode |= (unpacked >> 1) & 1;
+			muxB = (unpacked & 1) << 2;
+			if (!float32Unpack(mul.a.unpack, unpacked))
+				return false;
+			muxB |= unpacked;
+			break;
+		case V3D_QPU_M_VFMUL:
+			if (mul.outputPack != V3D_QPU_PACK_NONE || !float16Unpack(mul.a.unpack, unpacked) ||
+			    mul.b.unpack != V3D_QPU_UNPACK_NONE)
+				return false;
+			if (mul.a.unpack == V3D_QPU_UNPACK_SWAP_16)
+				opcode = 8;
+			else
+				opcode |= (unpacked + 4) & 7;
+			break;
+		default:
+			if (op != V3D_QPU_M_NOP &&
+			    (mul.outputPack != V3D_QPU_PACK_NONE || mul.a.unpack != V3D_QPU_UNPACK_NONE ||
+			     mul.b.unpack != V3D_QPU_UNPACK_NONE))
+				return false;
+			break;
+	}
+
+	packed |= (v3d_uint64)(muxA & 0x7) << SHIFT_MUL_A;
+	packed |= (v3d_uint64)(muxB & 0x7) << SHIFT_MUL_B;
+	packed |= (v3d_uint64)(opcode & 0x3f) << SHIFT_OP_MUL;
+	packed |= (v3d_uint64)(mul.waddr & 0x3f) << SHIFT_WADDR_M;
+	if (mul.magicWrite)
+		packed |= 1ull << SHIFT_MM;
+	return true;
+}
+
+// See v3d_qpu_flags_pack()
+constexpr bool packFlags(const alu_instr& instr, v3d_uint32& packedCond)
+{
+	enum : v3d_uint8
+	{
+		AC = 1 << 0,
+		MC = 1 << 1,
+		APF = 1 << 2,
+		MPF = 1 << 3,
+		AUF = 1 << 4,
+		MUF = 1 << 5,
+	};
+	struct flags_row
+	{
+		v3d_uint8 flagsPresent;
+		v3d_uint8 bits;
+	};
+	constexpr flags_row flagsTable[] = {
+	    {0, 0},
+	    {APF, 0},
+	    {AUF, 0},
+	    {MPF, (1 << 4)},
+	    {MUF, (1 << 4)},
+	    {AC, (1 << 5)},
+	    {AC | MPF, (1 << 5)},
+	    {MC, (1 << 5) | (1 << 4)},
+	    {MC | APF, (1 << 5) | (1 << 4)},
+	    {MC | AC, (1 << 6)},
+	    {MC | AUF, (1 << 6)},
+	};
+
+	v3d_uint8 flagsPresent = 0;
+	if (instr.add.cond != V3D_QPU_COND_NONE)
+		flagsPresent |= AC;
+	if (instr.mul.cond != V3D_QPU_COND_NONE)
+		flagsPresent |= MC;
+	if (instr.add.pf != V3D_QPU_PF_NONE)
+		flagsPresent |= APF;
+	if (instr.mul.pf != V3D_QPU_PF_NONE)
+		flagsPresent |= MPF;
+	if (instr.add.uf != V3D_QPU_UF_NONE)
+		flagsPresent |= AUF;
+	if (instr.mul.uf != V3D_QPU_UF_NONE)
+		flagsPresent |= MUF;
+
+	for (const flags_row& row : flagsTable)
+	{
+		if (row.flagsPresent != flagsPresent)
+			continue;
+
+		packedCond = row.bits;
+		packedCond |= instr.add.pf;
+		packedCond |= instr.mul.pf;
+		if (flagsPresent & AUF)
+			packedCond |= instr.add.uf - V3D_QPU_UF_ANDZ + 4;
+		if (flagsPresent & MUF)
+			packedCond |= instr.mul.uf - V3D_QPU_UF_ANDZ + 4;
+		if (flagsPresent & AC)
+		{
+			if (packedCond & (1 << 6))
+				packedCond |= instr.add.cond - V3D_QPU_COND_IFA;
+			else
+				packedCond |= (instr.add.cond - V3D_QPU_COND_IFA) << 2;
+		}
+		if (flagsPresent & MC)
+		{
+			if (packedCond & (1 << 6))
+				packedCond |= (instr.mul.cond - V3D_QPU_COND_IFA) << 4;
+			else
+				packedCond |= (instr.mul.cond - V3D_QPU_COND_IFA) << 2;
+		}
+		return true;
+	}
+	return false;
+}
+
+// See v3d_qpu_instr_pack_alu()
+constexpr bool packInstruction(const alu_instr& instr, v3d_uint64& packed)
+{
+	packed = 0;
+	v3d_uint32 packedSig = 32;
+	for (v3d_uint32 i = 0; i < 32; ++i)
+	{
+		if (v41SigMap[i] == instr.sig && (i == 0 || v41SigMap[i] != 0))
+		{
+			packedSig = i;
+			break;
+		}
+	}
+	if (packedSig == 32)
+		return false;
+	packed |= (v3d_uint64)packedSig << SHIFT_SIG;
+	packed |= (v3d_uint64)(instr.raddrA & 0x3f) << SHIFT_RADDR_A;
+	packed |= (v3d_uint64)(instr.raddrB & 0x3f) << SHIFT_RADDR_B;
+
+	if (!packAdd(instr.add, packed) || !packMul(instr.mul, packed))
+		return false;
+
+	v3d_uint32 cond = 0;
+	if (instr.sig & sigWritesAddress)
+	{
+		if (instr.add.cond || instr.mul.cond || instr.add.pf || instr.mul.pf || instr.add.uf ||
+		    instr.mul.uf)
+			return false;
+		cond = instr.sigAddr | (instr.sigMagic ? (1u << 6) : 0u);
+	}
+	else if (!packFlags(instr, cond))
+		return false;
+	packed |= (v3d_uint64)(cond & 0x7f) << SHIFT_COND;
+	return true;
+}
+
+// Parsing. Mirrors v3d_qpu_assemble(), which is the reference for the syntax.
+
+struct parser
+{
+	std::string_view text;
+	std::size_t position = 0;
+	int line = 1;
+
+	constexpr char peek(std::size_t offset = 0) const
+	{
+		return position + offset < text.size() ? text[position + offset] : 0;
+	}
+
+	// See v3d_symbol_equals()
+	static constexpr bool isDelimiter(char c)
+	{
+		return c == 0 || c == '\n' || c == '\r' || c == '\t' || c == '.' || c == ' ' || c == ',' ||
+		       c == ';';
+	}
+
+	constexpr std::string_view symbol() const
+	{
+		std::size_t length = 0;
+		while (!isDelimiter(peek(length)))
+			++length;
+		return text.substr(position, length);
+	}
+
+	// Skips whitespace and comments without leaving the line, unless a /* */ comment spans lines.
+	// Returns false at the end of the line or input.
+	constexpr bool skipWhitespaceComments()
+	{
+		for (;;)
+		{
+			const char c = peek();
+			if (c == ' ' || c == '\t' || c == '\r')
+				++position;
+			else if (c == '/' && peek(1) == '/')
+			{
+				while (peek() && peek() != '\n')
+					++position;
+			}
+			else if (c == '/' && peek(1) == '*')
+			{
+				position += 2;
+				while (peek() && !(peek() == '*' && peek(1) == '/'))
+				{
+					if (peek() == '\n')
+						++line;
+					++position;
+				}
+				if (!peek())
+				{
+					assembly_error("Unterminated /* comment", line);
+					return false;
+				}
+				position += 2;
+			}
+			else
+				return c != 0 && c != '\n';
+		}
+	}
+
+	template <std::size_t N>
+	constexpr bool matchName(const named_value (&names)[N], int& valueOut)
+	{
+		const std::string_view name = symbol();
+		for (const named_value& entry : names)
+		{
+			if (name == entry.name)
+			{
+				valueOut = entry.value;
+				position += name.size();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template <std::size_t N>
+	constexpr const opcode_desc* matchOp(const opcode_desc (&ops)[N], int version)
+	{
+		const std::string_view name = symbol();
+		for (const opcode_desc& desc : ops)
+		{
+			if (name != desc.name || (desc.firstVer && version < desc.firstVer) ||
+			    (desc.lastVer && version > desc.lastVer))
+				continue;
+			position += name.size();
+			return &desc;
+		}
+		return nullptr;
+	}
+
+	// rf0 through rf63, the range of the raddr and waddr fields
+	constexpr bool matchRegisterFile(v3d_uint32& registerFileOut)
+	{
+		const std::string_view name = symbol();
+		if (name.size() < 3 || name.size() > 4 || name[0] != 'r' || name[1] != 'f')
+			return false;
+		v3d_uint32 value = 0;
+		for (std::size_t i = 2; i < name.size(); ++i)
+		{
+			if (name[i] < '0' || name[i] > '9')
+				return false;
+			value = value * 10 + (name[i] - '0');
+		}
+		if (value > 63)
+			return false;
+		registerFileOut = value;
+		position += name.size();
+		return true;
+	}
+
+	constexpr bool expect(char c)
+	{
+		if (!skipWhitespaceComments() || peek() != c)
+			return false;
+		++position;
+		return true;
+	}
+};
+
+// See v3d33_qpu_allocate_raddr()
+constexpr bool muxInUse(const alu_instr& instr, v3d_uint32 mux)
+{
+	return instr.add.a.mux == mux || instr.add.b.mux == mux || instr.mul.a.mux == mux ||
+	       instr.mul.b.mux == mux;
+}
+
+constexpr bool allocateRaddr(alu_instr& instr, alu_input& input, v3d_uint32 registerFile)
+{
+	if (!muxInUse(instr, V3D_QPU_MUX_A))
+	{
+		input.mux = V3D_QPU_MUX_A;
+		instr.raddrA = registerFile;
+		return true;
+	}
+	if (instr.raddrA == registerFile)
+	{
+		input.mux = V3D_QPU_MUX_A;
+		return true;
+	}
+	if (muxInUse(instr, V3D_QPU_MUX_B) &&
+	    ((instr.sig & SIG_SMALL_IMM_B) || instr.raddrB != registerFile))
+		return false;
+	input.mux = V3D_QPU_MUX_B;
+	instr.raddrB = registerFile;
+	return true;
+}
+
+// See v3d33_qpu_allocate_small_imm()
+constexpr bool allocateSmallImmediate(alu_instr& instr, alu_input& input, v3d_uint32 packed)
+{
+	if (muxInUse(instr, V3D_QPU_MUX_B) &&
+	    !((instr.sig & SIG_SMALL_IMM_B) && instr.raddrB == packed))
+		return false;
+	input.mux = V3D_QPU_MUX_B;
+	instr.raddrB = packed;
+	instr.sig |= SIG_SMALL_IMM_B;
+	return true;
+}
+
+constexpr bool parseOp(parser& p, alu_instr& instr, alu_op& output, bool isMul, int version)
+{
+	output.desc = isMul ? p.matchOp(mulOps, version) : p.matchOp(addOps, version);
+	if (!output.desc)
+	{
+		assembly_error(isMul ? "Expected ALU mul instruction or nop" :
+		                       "Expected ALU add instruction or nop",
+		               p.line);
+		return false;
+	}
+
+	// From vir_to_qpu.c, v3d_qpu_nop() sets magic for NOP
+	if (output.desc->op == (isMul ? (int)V3D_QPU_M_NOP : (int)V3D_QPU_A_NOP))
+	{
+		output.waddr = V3D_QPU_WADDR_NOP;
+		output.magicWrite = true;
+	}
+
+	// Condition and flags
+	while (p.peek() == '.')
+	{
+		++p.position;
+		if (!p.matchName(condNames, output.cond) && !p.matchName(pfNames, output.pf) &&
+		    !p.matchName(ufNames, output.uf))
+		{
+			assembly_error("Condition, pack flags, or uf unrecognized", p.line);
+			return false;
+		}
+	}
+
+	const bool hasDst = output.desc->args & ARG_D;
+	if (hasDst)
+	{
+		int waddr = 0;
+		if (!p.skipWhitespaceComments())
+		{
+			assembly_error("Expected destination operand rf0 through rf63 or waddr", p.line);
+			return false;
+		}
+		if (p.matchRegisterFile(output.waddr))
+			output.magicWrite = false;
+		else if (p.matchName(waddrNames, waddr))
+		{
+			output.waddr = (v3d_uint32)waddr;
+			output.magicWrite = true;
+		}
+		else
+		{
+			assembly_error("Expected rf0 through rf63 or waddr", p.line);
+			return false;
+		}
+
+		if (p.peek() == '.')
+		{
+			++p.position;
+			if (!p.matchName(packNames, output.outputPack))
+			{
+				assembly_error("Invalid pack operation", p.line);
+				return false;
+			}
+		}
+	}
+
+	const int nsrc = numSources(output.desc);
+	for (int src = 0; src < nsrc; ++src)
+	{
+		alu_input& input = src == 0 ? output.a : output.b;
+		if (hasDst || src > 0)
+		{
+			if (!p.expect(','))
+			{
+				assembly_error("Expected , before source operand", p.line);
+				return false;
+			}
+		}
+		if (!p.skipWhitespaceComments())
+		{
+			assembly_error(
+			    "Expected source operand rf0 through rf63, accumulator register r0-r5, or small "
+			    "immediate",
+			    p.line);
+			return false;
+		}
+
+		v3d_uint32 registerFile = 0;
+		int smallImmediate = 0;
+		const std::string_view name = p.symbol();
+		if (p.matchRegisterFile(registerFile))
+		{
+			if (!allocateRaddr(instr, input, registerFile))
+			{
+				assembly_error(
+				    "Too many unique register files (plus small immediate) specified. Only two "
+				    "unique raddrs may be specified per instruction",
+				    p.line);
+				return false;
+			}
+		}
+		else if (name.size() == 2 && name[0] == 'r' && name[1] >= '0' && name[1] <= '5')
+		{
+			input.mux = V3D_QPU_MUX_R0 + (name[1] - '0');
+			p.position += 2;
+		}
+		else if (p.matchName(smallImmediateNames, smallImmediate))
+		{
+			if (!allocateSmallImmediate(instr, input, (v3d_uint32)smallImmediate))
+			{
+				assembly_error(
+				    "No raddr space for small immediate. Only one small immediate may be specified "
+				    "per instruction, and it uses raddr_b",
+				    p.line);
+				return false;
+			}
+		}
+		else
+		{
+			assembly_error("Unrecognized register file, accumulator, or small immediate", p.line);
+			return false;
+		}
+
+		if (p.peek() == '.')
+		{
+			++p.position;
+			if (!p.matchName(unpackNames, input.unpack))
+			{
+				assembly_error("Invalid unpack operation", p.line);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Parses the instruction starting at the parser's position, if there is one on this line. Leaves
+// the position at the end of the line.
+constexpr bool parseLine(parser& p, int version, bool& isEmptyLineOut, alu_instr& instr)
+{
+	instr = alu_instr{};
+	isEmptyLineOut = !p.skipWhitespaceComments();
+	if (isEmptyLineOut)
+		return true;
+
+	if (p.peek() == 'b' && p.peek(1) != 'a')
+	{
+		assembly_error("Branch instructions unimplemented", p.line);
+		return false;
+	}
+
+	if (!parseOp(p, instr, instr.add, /*isMul=*/false, version))
+		return false;
+	if (!p.expect(';'))
+	{
+		assembly_error("Expected ';' between add and mul instructions", p.line);
+		return false;
+	}
+	if (!p.skipWhitespaceComments())
+	{
+		assembly_error("Expected ALU mul instruction or nop", p.line);
+		return false;
+	}
+	if (!parseOp(p, instr, instr.mul, /*isMul=*/true, version))
+		return false;
+
+	// Finally, parse (optional) signals
+	bool sigWithAddressSpecified = false;
+	while (p.skipWhitespaceComments())
+	{
+		if (p.peek() != ';')
+		{
+			assembly_error("Expected ';' before start of signal", p.line);
+			return false;
+		}
+		++p.position;
+		// Dangling ; after mul is allowed
+		if (!p.skipWhitespaceComments())
+			break;
+
+		int sig = 0;
+		if (!p.matchName(sigNames, sig))
+		{
+			assembly_error("Unrecognized signal name", p.line);
+			return false;
+		}
+		instr.sig |= (v3d_uint32)sig;
+
+		const bool sigTakesAddress = sig & sigWritesAddress;
+		if (sigTakesAddress)
+		{
+			if (sigWithAddressSpecified)
+			{
+				assembly_error(
+				    "Too many signals with addresses specified. Only one signal with address may "
+				    "be specified per instruction",
+				    p.line);
+				return false;
+			}
+			sigWithAddressSpecified = true;
+		}
+
+		if (p.peek() == '.')
+		{
+			if (!sigTakesAddress)
+			{
+				assembly_error("Signal does not support an address", p.line);
+				return false;
+			}
+			++p.position;
+			int waddr = 0;
+			if (p.matchRegisterFile(instr.sigAddr))
+				instr.sigMagic = false;
+			else if (p.matchName(waddrNames, waddr))
+			{
+				instr.sigAddr = (v3d_uint32)waddr;
+				instr.sigMagic = true;
+			}
+			else
+			{
+				assembly_error("Expected rf0 through rf63 or waddr", p.line);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Assembles source, writing up to maxInstructions packed words to instructionsOut (which may be
+// null to only count them). Returns the number of instructions, or -1 on error.
+constexpr int assembleInto(std::string_view source, int version, v3d_uint64* instructionsOut,
+                           int maxInstructions)
+{
+	if (version < V3D_41 || version > V3D_42)
+	{
+		assembly_error("Only V3D 4.1 and 4.2 are supported", 0);
+		return -1;
+	}
+
+	parser p{source};
+	int numInstructions = 0;
+	for (;;)
+	{
+		bool isEmptyLine = false;
+		alu_instr instr{};
+		if (!parseLine(p, version, isEmptyLine, instr))
+			return -1;
+		if (!isEmptyLine)
+		{
+			v3d_uint64 packed = 0;
+			if (!packInstruction(instr, packed))
+			{
+				assembly_error("Instruction is not encodable on this device", p.line);
+				return -1;
+			}
+			if (instructionsOut && numInstructions < maxInstructions)
+				instructionsOut[numInstructions] = packed;
+			++numInstructions;
+		}
+
+		if (p.peek() != '\n')
+		{
+			if (p.peek() == 0)
+				break;
+			assembly_error("Unexpected text at end of instruction", p.line);
+			return -1;
+		}
+		++p.position;
+		++p.line;
+	}
+	return numInstructions;
+}
+}  // namespace detail
+
+template <int Version, fixed_string Source>
+consteval auto assemble()
+{
+	constexpr int numInstructions = detail::assembleInto(Source.view(), Version, nullptr, 0);
+	static_assert(numInstructions >= 0, "Invalid V3D assembly");
+	std::array<v3d_uint64, numInstructions> instructions{};
+	detail::assembleInto(Source.view(), Version, instructions.data(), numInstructions);
+	return instructions;
+}
+}  // namespace v3d
+
+#endif  // V3DASSEMBLERCONSTEXPR_HPP